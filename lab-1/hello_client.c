@@ -1,67 +1,470 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <netdb.h>
 
+#include "dnscache.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
 #define BUFLEN 1500
+#define MAX_ADDRS 64
+#define MAX_HOSTS 8
 
-int main(int argc, char *argv[]) {
-  int i; 
-  ssize_t wlen;
+// Without -t, connect and send "Hello, world!" once. With -t, act as a
+// bulk sender: open -P parallel connections, one thread each, and send
+// -l byte payloads on all of them for -t seconds, then report each
+// stream's throughput and how fairly the streams shared the path.
+//
+// Connections are made "happy eyeballs" style (RFC 8305): rather than
+// waiting for each address to time out before trying the next, a new
+// attempt starts every -D milliseconds, alternating between IPv6 and IPv4,
+// and the first to connect wins. The hostname may be a comma-separated
+// list, whose addresses are raced together; "10.255.255.1,localhost" is a
+// handy way to test against an unreachable address.
+//
+// Lookups go through the resolver cache in lab-3 (dnscache.c); with -c it
+// is kept in a file, so that repeated runs don't wait for the DNS.
+
+struct options {
+  const char *host;
+  const char *port;
+  const char *cache_file;
+  int streams;
+  double duration;
+  size_t payload;
+  int sndbuf;
+  int zerocopy;
+  int delay_ms;
+  int timeout_ms;
+  int verbose;
+};
+
+// The addresses to try, in the order to try them
+struct addrs {
+  struct addrinfo *lists[MAX_HOSTS];
+  int nlists;
+  struct addrinfo *ai[MAX_ADDRS];
+  int n;
+};
+
+struct stream {
+  pthread_t thread;
+  int id;
   int fd;
-  char *buf = malloc(BUFLEN);
-  struct addrinfo hints, *ai, *ai0;
-  int flags = MSG_NOSIGNAL;
+  const struct options *opts;
+  unsigned long long bytes;
+  double secs;
+  int failed;
+};
 
-  if (argc != 2) {
-    printf("Usage: %s <hostname>\n", argv[0]);
-    return 1;
-  }
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void format_addr(const struct addrinfo *ai, char *name, size_t len) {
+  const void *a = ai->ai_family == AF_INET6
+    ? (const void *) &((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr
+    : (const void *) &((struct sockaddr_in *) ai->ai_addr)->sin_addr;
+  inet_ntop(ai->ai_family, a, name, len);
+}
+
+// Look up each comma-separated hostname, and order the addresses found as
+// RFC 8305 section 4 suggests: start with the family of the first address
+// returned, then alternate between families, so that a broken IPv6 (or
+// IPv4) path can't hold up every attempt.
+static int resolve(const char *hosts, const char *port, const char *cache_file,
+                   struct addrs *out) {
+  struct dns_cache *cache = dns_cache_open(cache_file);
+  struct addrinfo hints, *ai;
+  struct addrinfo *v6[MAX_ADDRS], *v4[MAX_ADDRS];
+  int n6 = 0, n4 = 0, i6 = 0, i4 = 0, i, first_v6 = -1;
+  char *copy = strdup(hosts), *host, *save = NULL;
 
-  // Look up the IP address of the hostname specified on the command line
   memset(&hints, 0, sizeof(hints));
   hints.ai_family = PF_UNSPEC;
   hints.ai_socktype = SOCK_STREAM;
-  if ((i = getaddrinfo(argv[1], "5000", &hints, &ai0)) != 0) {
-    printf("Unable to look up IP address: %s", gai_strerror(i));
-    return 2;
+
+  out->nlists = out->n = 0;
+  for (host = strtok_r(copy, ",", &save); host != NULL && out->nlists < MAX_HOSTS;
+       host = strtok_r(NULL, ",", &save)) {
+    if ((i = dns_cache_getaddrinfo(cache, host, port, &hints, &out->lists[out->nlists])) != 0) {
+      printf("Unable to look up IP address of %s: %s\n", host, gai_strerror(i));
+      continue;
+    }
+    for (ai = out->lists[out->nlists]; ai != NULL; ai = ai->ai_next) {
+      if (ai->ai_family == AF_INET6 && n6 < MAX_ADDRS) {
+        v6[n6++] = ai;
+      } else if (ai->ai_family == AF_INET && n4 < MAX_ADDRS) {
+        v4[n4++] = ai;
+      } else {
+        continue;
+      }
+      if (first_v6 == -1) {
+        first_v6 = (ai->ai_family == AF_INET6);
+      }
+    }
+    out->nlists++;
   }
+  free(copy);
+  dns_cache_close(cache);
+
+  for (i = 0; (i6 < n6 || i4 < n4) && out->n < MAX_ADDRS; i++) {
+    int want_v6 = (i % 2 == 0) == first_v6;
 
-  // Try to connect to each address in turn
-  for (ai = ai0; ai != NULL; ai = ai->ai_next) {
-    // Create a TCP/IP socket
-    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-    if (fd == -1) {
-      continue;       // Try the next address
+    if ((want_v6 && i6 < n6) || i4 == n4) {
+      out->ai[out->n++] = v6[i6++];
+    } else {
+      out->ai[out->n++] = v4[i4++];
     }
+  }
+  return out->n;
+}
+
+static void free_addrs(struct addrs *a) {
+  int i;
+  for (i = 0; i < a->nlists; i++) {
+    dns_cache_freeaddrinfo(a->lists[i]);
+  }
+}
+
+static double elapsed_ms(double since) {
+  return (now() - since) * 1000;
+}
+
+// Race connection attempts to the addresses, starting a new one every
+// delay_ms, or as soon as an earlier attempt fails. The first to complete
+// wins and the rest are abandoned. Returns a connected, blocking socket,
+// or -1.
+static int connect_to(const struct addrs *a, const struct options *o) {
+  struct pollfd pfds[MAX_ADDRS];
+  int which[MAX_ADDRS];
+  int active = 0, next = 0, winner = -1, i;
+  double start = now(), next_start = start;
+  char name[INET6_ADDRSTRLEN];
+
+  while (winner == -1) {
+    double t = now();
+    int timeout;
+
+    // Start the next attempt if it is due
+    if (next < a->n && (t >= next_start || active == 0)) {
+      const struct addrinfo *ai = a->ai[next];
+      int fd;
+
+      if (o->verbose) {
+        format_addr(ai, name, sizeof(name));
+        fprintf(stderr, "%7.1f ms: trying %s\n", elapsed_ms(start), name);
+      }
+      next++;
+
+      // Create a non-blocking TCP/IP socket, and start to connect
+      fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (fd == -1) {
+        continue;       // Try the next address
+      }
+      fcntl(fd, F_SETFL, O_NONBLOCK);
+      if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+        pfds[active].fd = fd;
+        which[active] = next - 1;
+        winner = active++;
+        break;
+      } else if (errno != EINPROGRESS) {
+        if (o->verbose) {
+          fprintf(stderr, "%7.1f ms: %s failed: %s\n", elapsed_ms(start), name, strerror(errno));
+        }
+        close(fd);
+        continue;       // Try the next address straight away
+      }
+      pfds[active].fd = fd;
+      pfds[active].events = POLLOUT;
+      which[active] = next - 1;
+      active++;
+      next_start = now() + o->delay_ms / 1000.0;
+    }
+
+    if (active == 0 && next == a->n) {
+      break;            // Every attempt has failed
+    }
+    if (elapsed_ms(start) >= o->timeout_ms) {
+      if (o->verbose) {
+        fprintf(stderr, "%7.1f ms: timed out\n", elapsed_ms(start));
+      }
+      break;
+    }
+
+    // Wait until an attempt completes, or it is time to start another
+    timeout = (int) (o->timeout_ms - elapsed_ms(start));
+    if (next < a->n) {
+      int until_next = (int) ((next_start - now()) * 1000);
+      if (until_next < timeout) {
+        timeout = until_next > 0 ? until_next : 0;
+      }
+    }
+    if (poll(pfds, active, timeout) <= 0) {
+      continue;
+    }
+
+    for (i = 0; i < active; i++) {
+      int err = 0;
+      socklen_t len = sizeof(err);
+
+      if (pfds[i].revents == 0) {
+        continue;
+      }
+      getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      if (err == 0) {
+        winner = i;
+        break;
+      }
+      if (o->verbose) {
+        format_addr(a->ai[which[i]], name, sizeof(name));
+        fprintf(stderr, "%7.1f ms: %s failed: %s\n", elapsed_ms(start), name, strerror(err));
+      }
+      // Drop the failed attempt, and bring the next one forward
+      close(pfds[i].fd);
+      pfds[i] = pfds[active - 1];
+      which[i] = which[active - 1];
+      active--;
+      i--;
+      next_start = now();
+    }
+  }
+
+  // Abandon the attempts that lost
+  for (i = 0; i < active; i++) {
+    if (i != winner) {
+      close(pfds[i].fd);
+    }
+  }
+  if (winner == -1) {
+    return -1;
+  }
+
+  if (o->verbose) {
+    format_addr(a->ai[which[winner]], name, sizeof(name));
+    fprintf(stderr, "%7.1f ms: connected to %s\n", elapsed_ms(start), name);
+  }
+  fcntl(pfds[winner].fd, F_SETFL, 0);
+  return pfds[winner].fd;
+}
+
+// Release zero-copy completion notifications from the socket's error
+// queue. The payload is never modified, so there is nothing to do with
+// them other than make room for more.
+static void drain_completions(int fd) {
+  char control[128];
+  struct msghdr msg;
+
+  do {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+  } while (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) != -1);
+}
+
+static void *send_stream(void *arg) {
+  struct stream *s = arg;
+  const struct options *o = s->opts;
+  char *buf = malloc(o->payload);
+  int flags = MSG_NOSIGNAL;
+  double start, end;
+  unsigned long sends = 0;
+
+  memset(buf, 'x', o->payload);
 
-    // Connect to the server
-    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
-      close(fd);
-      continue;       // Try the next address
+  if (o->sndbuf > 0 &&
+      setsockopt(s->fd, SOL_SOCKET, SO_SNDBUF, &o->sndbuf, sizeof(o->sndbuf)) == -1) {
+    perror("Unable to set SO_SNDBUF");
+  }
+  if (o->zerocopy) {
+    int one = 1;
+    if (setsockopt(s->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1) {
+      perror("Unable to enable SO_ZEROCOPY, copying instead");
+    } else {
+      flags |= MSG_ZEROCOPY;
     }
+  }
+
+  start = now();
+  end = start + o->duration;
+  while (now() < end) {
+    ssize_t wlen = send(s->fd, buf, o->payload, flags);
 
-    // Send "Hello, world!"
-    sprintf(buf, "Hello, world!");
-    wlen = send(fd, buf, strlen(buf), flags);
     if (wlen == -1) {
-      perror("Unable to send request");
-      close(fd);
-      return 2;
+      if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+        // Too many zero-copy sends are awaiting completion
+        drain_completions(s->fd);
+        continue;
+      }
+      perror("Unable to send data");
+      s->failed = 1;
+      break;
     }
+    s->bytes += (unsigned long long) wlen;
+    if ((flags & MSG_ZEROCOPY) && ++sends % 64 == 0) {
+      drain_completions(s->fd);
+    }
+  }
+  s->secs = now() - start;
 
-    // Close the connection and exit
-    freeaddrinfo(ai0);
-    close(fd);
+  close(s->fd);
+  free(buf);
+  return NULL;
+}
+
+static int run_bulk(const struct options *o, const struct addrs *a) {
+  struct stream *streams = calloc(o->streams, sizeof(struct stream));
+  double sum = 0, sum_sq = 0, total_secs = 0;
+  unsigned long long total = 0;
+  int i, started = 0;
+
+  // Connect all the streams before any starts sending, so they compete
+  // on equal terms.
+  for (i = 0; i < o->streams; i++) {
+    streams[i].id = i;
+    streams[i].opts = o;
+    if ((streams[i].fd = connect_to(a, o)) == -1) {
+      printf("Unable to connect stream %d\n", i);
+      break;
+    }
+  }
+  for (started = 0; started < i; started++) {
+    pthread_create(&streams[started].thread, NULL, send_stream, &streams[started]);
+  }
+
+  for (i = 0; i < started; i++) {
+    pthread_join(streams[i].thread, NULL);
+  }
+
+  for (i = 0; i < started; i++) {
+    double gbps = streams[i].secs > 0 ? streams[i].bytes * 8 / streams[i].secs / 1e9 : 0;
+
+    printf("stream %2d: %llu bytes in %.2f s, %.3f Gb/s%s\n", i,
+           streams[i].bytes, streams[i].secs, gbps,
+           streams[i].failed ? " (failed)" : "");
+    total += streams[i].bytes;
+    sum += gbps;
+    sum_sq += gbps * gbps;
+    if (streams[i].secs > total_secs) {
+      total_secs = streams[i].secs;
+    }
+  }
+
+  if (started > 0 && total_secs > 0) {
+    // Jain's fairness index: 1.0 when every stream got the same rate,
+    // falling towards 1/n as one stream takes everything.
+    printf("total: %llu bytes, %.3f Gb/s over %d streams, fairness %.3f\n",
+           total, total * 8 / total_secs / 1e9, started,
+           sum_sq > 0 ? (sum * sum) / (started * sum_sq) : 1.0);
+  }
+
+  free(streams);
+  return started == o->streams ? 0 : 1;
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s [-p port] [-c cache-file] [-D ms] [-T ms] [-v]\n"
+         "          [-t seconds [-P streams] [-l bytes] [-w sndbuf] [-z]] <hostname>[,hostname...]\n"
+         "  -p port     server port (default: 5000)\n"
+         "  -c file     keep resolved addresses in this file between runs\n"
+         "  -D ms       delay between connection attempts (default: 250)\n"
+         "  -T ms       give up connecting after this long (default: 30000)\n"
+         "  -v          report each connection attempt\n"
+         "  -t seconds  bulk mode: send for this long\n"
+         "  -P streams  parallel connections, one thread each (default: 1)\n"
+         "  -l bytes    payload per send() (default: 131072)\n"
+         "  -w bytes    SO_SNDBUF size (default: system)\n"
+         "  -z          use MSG_ZEROCOPY\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+  int i, opt;
+  ssize_t wlen;
+  int fd;
+  char *buf = malloc(BUFLEN);
+  int flags = MSG_NOSIGNAL;
+  struct options o;
+  struct addrs a;
+
+  memset(&o, 0, sizeof(o));
+  o.port = "5000";
+  o.streams = 1;
+  o.payload = 128 * 1024;
+  o.delay_ms = 250;
+  o.timeout_ms = 30000;
+
+  while ((opt = getopt(argc, argv, "p:c:D:T:vt:P:l:w:z")) != -1) {
+    switch (opt) {
+      case 'p': o.port = optarg; break;
+      case 'c': o.cache_file = optarg; break;
+      case 'D': o.delay_ms = atoi(optarg); break;
+      case 'T': o.timeout_ms = atoi(optarg); break;
+      case 'v': o.verbose = 1; break;
+      case 't': o.duration = atof(optarg); break;
+      case 'P': o.streams = atoi(optarg); break;
+      case 'l': o.payload = (size_t) atol(optarg); break;
+      case 'w': o.sndbuf = atoi(optarg); break;
+      case 'z': o.zerocopy = 1; break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (optind != argc - 1 || o.streams < 1 || o.payload < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+  o.host = argv[optind];
+
+  // Look up the IP address of the hostname specified on the command line
+  if (resolve(o.host, o.port, o.cache_file, &a) == 0) {
+    printf("Unable to look up IP address\n");
+    return 2;
+  }
+
+  if (o.duration > 0) {
+    i = run_bulk(&o, &a);
+    free_addrs(&a);
     free(buf);
-    return 0;
+    return i;
+  }
+
+  if ((fd = connect_to(&a, &o)) == -1) {
+    // Couldn't connect
+    printf("Unable to connect\n");
+    return 1;
+  }
+
+  // Send "Hello, world!"
+  sprintf(buf, "Hello, world!");
+  wlen = send(fd, buf, strlen(buf), flags);
+  if (wlen == -1) {
+    perror("Unable to send request");
+    close(fd);
+    return 2;
   }
 
-  // Couldn't connect
-  printf("Unable to connect\n");
-  return 1;
+  // Close the connection and exit
+  free_addrs(&a);
+  close(fd);
+  free(buf);
+  return 0;
 }
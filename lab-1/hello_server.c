@@ -1,61 +1,230 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-#define BUFLEN 1500
+#define BUFLEN      65536
+#define MAX_EVENTS  256
 
-int main(void) {
-  int fd, conn_fd; 
-  ssize_t rlen;
-  struct sockaddr_in addr, conn_addr;
-  socklen_t conn_addr_len;
-  char buf[BUFLEN];
-  int flags = 0;
+// A TCP ingest sink: accepts any number of clients, writes whatever they
+// send to stdout (unless run with -q), and reports per-connection and
+// aggregate throughput on stderr. A single thread multiplexes all of the
+// connections with epoll.
 
-  // Create a TCP/IP socket
-  fd = socket(AF_INET, SOCK_STREAM, 0);
+struct conn {
+  int                      fd;
+  char                     name[INET6_ADDRSTRLEN + 8];
+  unsigned long long       bytes;
+  double                   start;
+};
+
+static volatile sig_atomic_t stop = 0;
+
+static void signal_handler(int sig) {
+  (void) sig;
+  stop = 1;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void set_nonblocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static void format_peer(struct sockaddr_storage *sa, char *name, size_t len) {
+  char host[INET6_ADDRSTRLEN];
+
+  if (sa->ss_family == AF_INET6) {
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) sa;
+    inet_ntop(AF_INET6, &sin6->sin6_addr, host, sizeof(host));
+    snprintf(name, len, "[%s]:%d", host, ntohs(sin6->sin6_port));
+  } else {
+    struct sockaddr_in *sin = (struct sockaddr_in *) sa;
+    inet_ntop(AF_INET, &sin->sin_addr, host, sizeof(host));
+    snprintf(name, len, "%s:%d", host, ntohs(sin->sin_port));
+  }
+}
+
+static void close_conn(int epfd, struct conn *c) {
+  double secs = now() - c->start;
+
+  fprintf(stderr, "%s: closed, %llu bytes in %.3f s (%.2f MB/s)\n",
+          c->name, c->bytes, secs, secs > 0 ? c->bytes / secs / 1e6 : 0.0);
+  epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  free(c);
+}
+
+int main(int argc, char *argv[]) {
+  int fd, epfd, opt, n, i;
+  int port = 5000;
+  int quiet = 0;
+  int nconns = 0;
+  int off = 0, on = 1;
+  struct sockaddr_in6 addr;
+  struct epoll_event ev, events[MAX_EVENTS];
+  char *buf = malloc(BUFLEN);
+  unsigned long long total = 0, interval_bytes = 0;
+  double start, last_report;
+
+  while ((opt = getopt(argc, argv, "p:q")) != -1) {
+    switch (opt) {
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'q':
+        quiet = 1;
+        break;
+      default:
+        printf("Usage: %s [-p port] [-q]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  signal(SIGINT, signal_handler);
+  signal(SIGTERM, signal_handler);
+
+  // Create a TCP/IP socket. An IPv6 socket with IPV6_V6ONLY cleared
+  // accepts IPv4 clients too.
+  fd = socket(AF_INET6, SOCK_STREAM, 0);
   if (fd == -1) {
     perror("Unable to create socket");
     return 1;
   }
+  setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
 
   // Bind to port 5000
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(5000);
-  addr.sin_addr.s_addr = INADDR_ANY;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_port = htons(port);
+  addr.sin6_addr = in6addr_any;
 
   if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
     perror("Unable to bind to port");
     return 1;
   }
 
-  // Listen for a connection
-  if (listen(fd, 1) == -1) {
+  // Listen for connections
+  if (listen(fd, SOMAXCONN) == -1) {
     perror("Unable to listen for connection");
     return 1;
   }
+  set_nonblocking(fd);
 
-  // Accept the first connection
-  conn_addr_len= sizeof(struct sockaddr);
-  if ((conn_fd = accept(fd, (struct sockaddr *) &conn_addr, &conn_addr_len)) == -1){
-    perror("Unable to accept connection");
+  if ((epfd = epoll_create1(0)) == -1) {
+    perror("Unable to create epoll instance");
     return 1;
   }
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;  // NULL marks the listening socket
+  epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+
+  start = last_report = now();
+
+  while (!stop) {
+    double t;
+
+    n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+    if (n == -1 && errno != EINTR) {
+      perror("epoll_wait");
+      break;
+    }
+
+    for (i = 0; i < n; i++) {
+      struct conn *c = events[i].data.ptr;
+
+      if (c == NULL) {
+        // Accept every connection that is waiting
+        struct sockaddr_storage conn_addr;
+        socklen_t conn_addr_len;
+        int conn_fd;
+
+        while (1) {
+          conn_addr_len = sizeof(conn_addr);
+          conn_fd = accept(fd, (struct sockaddr *) &conn_addr, &conn_addr_len);
+          if (conn_fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+              perror("Unable to accept connection");
+            }
+            break;
+          }
+          set_nonblocking(conn_fd);
+
+          c = malloc(sizeof(struct conn));
+          c->fd = conn_fd;
+          c->bytes = 0;
+          c->start = now();
+          format_peer(&conn_addr, c->name, sizeof(c->name));
+
+          ev.events = EPOLLIN | EPOLLRDHUP;
+          ev.data.ptr = c;
+          epoll_ctl(epfd, EPOLL_CTL_ADD, conn_fd, &ev);
+          nconns++;
+          fprintf(stderr, "%s: connected (%d open)\n", c->name, nconns);
+        }
+        continue;
+      }
+
+      // Retrieve the data. Drain the socket, writing each buffer to stdout
+      // with a single fwrite().
+      while (1) {
+        ssize_t rlen = recv(c->fd, buf, BUFLEN, 0);
+
+        if (rlen > 0) {
+          if (!quiet) {
+            fwrite(buf, 1, (size_t) rlen, stdout);
+          }
+          c->bytes += (unsigned long long) rlen;
+          interval_bytes += (unsigned long long) rlen;
+          total += (unsigned long long) rlen;
+        } else if (rlen == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          break;
+        } else if (rlen == -1 && errno == EINTR) {
+          continue;
+        } else {
+          // Client closed the connection, or an error
+          close_conn(epfd, c);
+          nconns--;
+          break;
+        }
+      }
+    }
 
-  // Retrieve the data
-  while ((rlen = recv(conn_fd, buf, BUFLEN, flags)) > 0) {
-    int i;
-    for (i = 0; i < rlen; i++) {
-      printf("%c", buf[i]);
+    // Report the aggregate ingest rate once a second while data is flowing
+    t = now();
+    if (t - last_report >= 1.0) {
+      if (interval_bytes > 0) {
+        if (!quiet) {
+          fflush(stdout);
+        }
+        fprintf(stderr, "aggregate: %.2f MB/s over %d connections\n",
+                interval_bytes / (t - last_report) / 1e6, nconns);
+      }
+      interval_bytes = 0;
+      last_report = t;
     }
-    printf("\n");
   }
 
-  // Close the connection, and the underlying listening socket
-  close(conn_fd);
+  // Close the listening socket, and report the totals
   close(fd);
+  close(epfd);
+  fflush(stdout);
+  fprintf(stderr, "total: %llu bytes in %.3f s\n", total, now() - start);
+  free(buf);
 
   return 0;
 }
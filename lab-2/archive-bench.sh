@@ -0,0 +1,77 @@
+#!/bin/sh
+#
+# archive-bench.sh -- loopback benchmark of wserver serving the website
+# directory against serving it packed into one archive
+#
+# Packs ./website with ./wpack, then runs the same load against three
+# servers:
+#   - the directory tree, without the static file cache (-N)
+#   - the directory tree, with the cache pre-loaded at startup
+#   - the archive (-R)
+# Each client is one curl process fetching every file in the site over a
+# keep-alive connection, round after round; the clients run in parallel.
+# On loopback the clients are usually the bottleneck, so the server's CPU
+# time per request (from /proc) is the figure to compare.
+#
+# Usage: ./archive-bench.sh [clients] [rounds]
+
+CLIENTS=${1:-8}
+ROUNDS=${2:-200}
+PORT=8080
+HOST=$(hostname)
+TMP=$(mktemp -d)
+HZ=$(getconf CLK_TCK)
+
+cleanup() {
+  [ -n "$PID" ] && kill -INT "$PID" 2>/dev/null
+  rm -rf "$TMP"
+}
+trap cleanup EXIT INT TERM
+
+./wpack -z -o "$TMP/site.wpk" website || exit 1
+
+# One curl config per client: every file, ROUNDS times
+FILES=$(cd website && find . -type f | sed 's|^\.||')
+i=0
+while [ $i -lt "$ROUNDS" ]; do
+  for f in $FILES; do
+    echo "url = \"http://127.0.0.1:$PORT$f\""
+    echo "output = /dev/null"
+  done
+  i=$((i + 1))
+done > "$TMP/urls"
+REQUESTS=$((CLIENTS * ROUNDS * $(echo "$FILES" | wc -w)))
+
+run() {
+  name=$1
+  shift
+  ./wserver -l 127.0.0.1 -p $PORT "$@" > "$TMP/wserver.log" 2>&1 &
+  PID=$!
+  sleep 1
+
+  start=$(date +%s%N)
+  c=0
+  clients=
+  while [ $c -lt "$CLIENTS" ]; do
+    curl -s -H "Host: $HOST" --compressed -K "$TMP/urls" &
+    clients="$clients $!"
+    c=$((c + 1))
+  done
+  wait $clients
+  end=$(date +%s%N)
+  # utime and stime, in clock ticks
+  ticks=$(awk '{ print $14 + $15 }' /proc/$PID/stat 2>/dev/null || echo 0)
+
+  kill -INT $PID
+  wait $PID 2>/dev/null
+  PID=
+  ms=$(( (end - start) / 1000000 ))
+  echo "$name: $((REQUESTS * 1000 / (ms + 1))) requests/sec," \
+       "$((ticks * 1000000 / HZ / REQUESTS)) us CPU per request," \
+       "$(grep -o 'ready in .*' "$TMP/wserver.log")"
+}
+
+echo "== $CLIENTS clients x $ROUNDS rounds of $(echo "$FILES" | wc -w) files"
+run "directory, no cache" -N
+run "directory, cached  "
+run "archive            " -R "$TMP/site.wpk"
@@ -0,0 +1,897 @@
+//
+// h2.c -- HTTP/2 framing, streams and flow control for wserver
+//
+// An HTTP/2 connection carries many requests at once, as independent
+// streams, so a browser fetching a page and its images needs one
+// connection (and so one responder) rather than six. Clients reach it in
+// one of three ways: by ALPN during the TLS handshake, by an HTTP/1.1
+// "Upgrade: h2c" request, or by sending the HTTP/2 connection preface
+// straight away ("prior knowledge").
+//
+// The responder that owns the connection multiplexes the streams itself.
+// Whenever it has response data that flow control allows it to send, it
+// sends one DATA frame from the most urgent stream, then checks, without
+// blocking, for frames from the client; only when nothing can be sent
+// does it block reading. A large image therefore no longer holds up the
+// stylesheet requested after it, as it would on an HTTP/1.1 connection.
+//
+// Stream priority follows RFC 9218: the "priority" request header gives an
+// urgency from 0 to 7, and says whether the response is useful piece by
+// piece (incremental). Among streams of equal urgency, non-incremental
+// responses are sent one after another, in the order they were requested,
+// and incremental ones share the connection round-robin. Clients that
+// only send RFC 7540 weights get an urgency derived from the weight.
+//
+// Header compression is HPACK (RFC 7541), in hpack.c.
+//
+// Only the static file path is served this way. Requests for proxied
+// paths are answered 421, telling the client to retry them on a new
+// connection, and the h2c upgrade isn't offered for them.
+//
+
+#include <sys/types.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "h2.h"
+
+#define H2_FRAME_MAX       16384   // The default SETTINGS_MAX_FRAME_SIZE
+#define H2_HB_MAX          16384   // Largest header block we accept
+#define H2_MAX_STREAMS     100
+
+#define H2_DATA            0x0
+#define H2_HEADERS         0x1
+#define H2_PRIORITY        0x2
+#define H2_RST_STREAM      0x3
+#define H2_SETTINGS        0x4
+#define H2_PUSH_PROMISE    0x5
+#define H2_PING            0x6
+#define H2_GOAWAY          0x7
+#define H2_WINDOW_UPDATE   0x8
+#define H2_CONTINUATION    0x9
+#define H2_PRIORITY_UPDATE 0x10    // RFC 9218
+
+#define H2_END_STREAM      0x1
+#define H2_ACK             0x1
+#define H2_END_HEADERS     0x4
+#define H2_PADDED          0x8
+#define H2_PRIORITY_FLAG   0x20
+
+#define H2_NO_ERROR           0x0
+#define H2_PROTOCOL_ERROR     0x1
+#define H2_INTERNAL_ERROR     0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_FRAME_SIZE_ERROR   0x6
+#define H2_REFUSED_STREAM     0x7
+#define H2_COMPRESSION_ERROR  0x9
+#define H2_ENHANCE_YOUR_CALM  0xb
+
+#define H2_WINDOW_MAX      0x7fffffff
+#define H2_DEFAULT_WINDOW  65535
+
+struct h2_session {
+  struct connection  *c;
+  int                 id;            // The responder's, for logging
+  struct h2_stream    streams[H2_MAX_STREAMS];
+  int                 nstreams;
+  uint32_t            last_sid;      // Highest stream the client opened
+  int64_t             send_window;   // Connection flow-control window
+  int64_t             initial_window;
+  int                 goaway;        // The client has sent GOAWAY
+  int                 rfc9218;       // The client has sent RFC 9218 priorities
+  uint64_t            sequence;
+
+  // A header block being assembled from HEADERS and CONTINUATION frames
+  uint32_t            hb_sid;        // 0 = none in progress
+  int                 hb_end_stream;
+  int                 hb_urgency;    // From an RFC 7540 weight, or -1
+  size_t              hb_len;
+
+  struct hpack        hpack;
+  size_t              in_len;
+  uint8_t             in[2 * (H2_FRAME_MAX + 9)];
+  uint8_t             hb[H2_HB_MAX];
+  char                scratch[2 * H2_HB_MAX];
+  uint8_t             out[H2_FRAME_MAX + 9];
+};
+
+
+static void
+h2_copy_field(char *dst, size_t dstlen, const char *value, size_t vlen,
+              int *bad)
+{
+  if (vlen >= dstlen) {
+    *bad = 1;
+    vlen = dstlen - 1;
+  }
+  memcpy(dst, value, vlen);
+  dst[vlen] = '\0';
+}
+
+// Parse an RFC 9218 priority field value, such as "u=1, i"
+static void
+h2_parse_priority(const char *value, size_t vlen, int *urgency,
+                  int *incremental)
+{
+  const char *p = value, *end = value + vlen;
+
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == ',')) {
+      p++;
+    }
+    if (end - p >= 3 && p[0] == 'u' && p[1] == '=' && p[2] >= '0' &&
+        p[2] <= '7') {
+      *urgency = p[2] - '0';
+    } else if (p < end && *p == 'i') {
+      *incremental = !(end - p >= 4 && strncmp(p, "i=?0", 4) == 0);
+    }
+    while (p < end && *p != ',') {
+      p++;
+    }
+  }
+}
+
+// Take in a request header field, as hpack_decode() passes it
+static void
+h2_request_field(void *arg, const char *name, size_t nlen,
+                 const char *value, size_t vlen)
+{
+  struct h2_request *req = arg;
+
+#define FIELD_IS(s)  (nlen == sizeof(s) - 1 && memcmp(name, s, nlen) == 0)
+  if (FIELD_IS(":method")) {
+    h2_copy_field(req->method, sizeof(req->method), value, vlen, &req->bad);
+  } else if (FIELD_IS(":path")) {
+    h2_copy_field(req->path, sizeof(req->path), value, vlen, &req->bad);
+  } else if (FIELD_IS(":authority") ||
+             (FIELD_IS("host") && req->authority[0] == '\0')) {
+    h2_copy_field(req->authority, sizeof(req->authority), value, vlen,
+                  &req->bad);
+  } else if (FIELD_IS("priority")) {
+    if (req->urgency == -1) {
+      req->urgency = 3;
+    }
+    h2_parse_priority(value, vlen, &req->urgency, &req->incremental);
+  } else if (FIELD_IS("accept-encoding")) {
+    char  buf[256];
+    int   too_long = 0;
+
+    h2_copy_field(buf, sizeof(buf), value, vlen, &too_long);
+    req->gzip = h2_accepts_gzip(buf);
+  }
+#undef FIELD_IS
+}
+
+static int
+h2_frame(struct h2_session *s, int type, int flags, uint32_t sid,
+         const void *payload, size_t len)
+{
+  uint8_t *f = s->out;
+
+  f[0] = (uint8_t) (len >> 16);
+  f[1] = (uint8_t) (len >> 8);
+  f[2] = (uint8_t) len;
+  f[3] = (uint8_t) type;
+  f[4] = (uint8_t) flags;
+  f[5] = (uint8_t) ((sid >> 24) & 0x7f);
+  f[6] = (uint8_t) (sid >> 16);
+  f[7] = (uint8_t) (sid >> 8);
+  f[8] = (uint8_t) sid;
+  if (payload != NULL && len > 0) {
+    memcpy(f + 9, payload, len);
+  }
+  return h2_conn_send(s->c, f, len + 9);
+}
+
+static void
+put32(uint8_t *p, uint32_t v)
+{
+  p[0] = (uint8_t) (v >> 24);
+  p[1] = (uint8_t) (v >> 16);
+  p[2] = (uint8_t) (v >> 8);
+  p[3] = (uint8_t) v;
+}
+
+static uint32_t
+get32(const uint8_t *p)
+{
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+         ((uint32_t) p[2] << 8) | p[3];
+}
+
+static int
+h2_goaway(struct h2_session *s, uint32_t error)
+{
+  uint8_t payload[8];
+
+  put32(payload, s->last_sid);
+  put32(payload + 4, error);
+  if (error != H2_NO_ERROR) {
+    printf("responder %d: h2 connection error %u\n", s->id, error);
+  }
+  h2_frame(s, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+  return -1;
+}
+
+static int
+h2_rst_stream(struct h2_session *s, uint32_t sid, uint32_t error)
+{
+  uint8_t payload[4];
+
+  put32(payload, error);
+  return h2_frame(s, H2_RST_STREAM, 0, sid, payload, sizeof(payload));
+}
+
+static int
+h2_window_update(struct h2_session *s, uint32_t sid, uint32_t increment)
+{
+  uint8_t payload[4];
+
+  put32(payload, increment);
+  return h2_frame(s, H2_WINDOW_UPDATE, 0, sid, payload, sizeof(payload));
+}
+
+static struct h2_stream *
+h2_find_stream(struct h2_session *s, uint32_t sid)
+{
+  int i;
+
+  for (i = 0; i < H2_MAX_STREAMS; i++) {
+    if (s->streams[i].id == sid) {
+      return &s->streams[i];
+    }
+  }
+  return NULL;
+}
+
+static void
+h2_stream_free(struct h2_session *s, struct h2_stream *st)
+{
+  if (st->fd != -1) {
+    close(st->fd);
+  }
+  free(st->body);
+  memset(st, 0, sizeof(*st));
+  s->nstreams--;
+}
+
+// The response on a stream has been sent. A client still sending a request
+// body is told to stop, since nothing will read it.
+static int
+h2_stream_done(struct h2_session *s, struct h2_stream *st)
+{
+  int rc = 0;
+
+  if (!st->remote_closed) {
+    rc = h2_rst_stream(s, st->id, H2_NO_ERROR);
+  }
+  h2_stream_free(s, st);
+  return rc;
+}
+
+void
+h2_printf(struct h2_stream *st, const char *fmt, ...)
+{
+  va_list  ap;
+  size_t   room = st->body_cap - (size_t) st->length;
+  size_t   cap;
+  char    *body;
+  int      n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(st->body + st->length, room, fmt, ap);
+  va_end(ap);
+  if (n < 0) {
+    return;
+  }
+  if ((size_t) n >= room) {
+    for (cap = st->body_cap; cap - (size_t) st->length <= (size_t) n; ) {
+      cap = cap > 0 ? cap * 2 : 4096;
+    }
+    if ((body = realloc(st->body, cap)) == NULL) {
+      return;    // The body is left as it was
+    }
+    st->body     = body;
+    st->body_cap = cap;
+    va_start(ap, fmt);
+    vsnprintf(st->body + st->length, (size_t) n + 1, fmt, ap);
+    va_end(ap);
+  }
+  st->length += n;
+}
+
+void
+h2_error_body(struct h2_stream *st, const char *status, const char *message)
+{
+  h2_printf(st, "<html>\r\n"
+                "<head>\r\n"
+                "<title> %s </title>\r\n"
+                "</head>\r\n"
+                "<body>\r\n"
+                "<p> %s </p>\r\n"
+                "</body>\r\n"
+                "</html>\r\n", status, message);
+}
+
+// Start the response to a complete request: send its headers now, and
+// leave its body to be scheduled.
+static int
+h2_respond(struct h2_session *s, struct h2_stream *st, struct h2_request *req)
+{
+  uint8_t      block[2048];
+  char         extra[1100];
+  char         num[32];
+  const char  *type;
+  size_t       n = 0;
+  int          status, extra_index, head, coding = 0;
+
+  head   = strcmp(req->method, "HEAD") == 0;
+  status = h2_prepare_response(st, req, s->id, &type, &extra_index, extra,
+                               sizeof(extra), &coding);
+
+  if (status == 200) {
+    block[n++] = 0x80 | HPACK_STATIC_STATUS;
+  } else {
+    sprintf(num, "%d", status);
+    n += hpack_literal(block + n, HPACK_STATIC_STATUS, num);
+  }
+  n += hpack_literal(block + n, HPACK_STATIC_CONTENT_TYPE, type);
+  if (coding == H2_CODING_GZIP) {
+    n += hpack_literal(block + n, HPACK_STATIC_CONTENT_ENCODING, "gzip");
+  }
+  if (coding != 0) {
+    n += hpack_literal(block + n, HPACK_STATIC_VARY, "accept-encoding");
+  }
+  sprintf(num, "%lld", (long long) st->length);
+  n += hpack_literal(block + n, HPACK_STATIC_CONTENT_LENGTH, num);
+  if (extra_index != 0) {
+    n += hpack_literal(block + n, extra_index, extra);
+  }
+
+  printf("responder %d: h2 stream %u: %d %s (%lld bytes)\n", s->id, st->id,
+         status, req->path, (long long) st->length);
+
+  if (head || st->length == 0) {
+    if (h2_frame(s, H2_HEADERS, H2_END_HEADERS | H2_END_STREAM, st->id,
+                 block, n) == -1) {
+      return -1;
+    }
+    return h2_stream_done(s, st);
+  }
+  return h2_frame(s, H2_HEADERS, H2_END_HEADERS, st->id, block, n);
+}
+
+// A stream's header block is complete: decode it, and either start a new
+// request or, on a stream already open, take it as the request trailers.
+static int
+h2_headers_done(struct h2_session *s)
+{
+  struct h2_request   req;
+  struct h2_stream   *st;
+  uint32_t            sid = s->hb_sid;
+  int                 i, rc;
+
+  memset(&req, 0, sizeof(req));
+  req.urgency = -1;
+  s->hb_sid   = 0;
+  if ((rc = hpack_decode(&s->hpack, s->hb, s->hb_len, s->scratch,
+                         sizeof(s->scratch), h2_request_field, &req)) < 0) {
+    return h2_goaway(s, rc == -2 ? H2_INTERNAL_ERROR : H2_COMPRESSION_ERROR);
+  }
+
+  if ((st = h2_find_stream(s, sid)) != NULL) {
+    if (st->remote_closed || !s->hb_end_stream) {
+      return h2_goaway(s, H2_PROTOCOL_ERROR);
+    }
+    st->remote_closed = 1;
+    return 0;
+  }
+  if (sid <= s->last_sid) {
+    return 0;     // Trailers on a stream we have already finished
+  }
+  s->last_sid = sid;
+
+  if (s->nstreams == H2_MAX_STREAMS || h2_stopping()) {
+    return h2_rst_stream(s, sid, H2_REFUSED_STREAM);
+  }
+  for (i = 0; s->streams[i].id != 0; i++)
+    ;
+  st = &s->streams[i];
+  s->nstreams++;
+
+  st->id            = sid;
+  st->fd            = -1;
+  st->remote_closed = s->hb_end_stream;
+  st->window        = s->initial_window;
+  s->rfc9218       |= req.urgency != -1;
+  st->urgency       = req.urgency != -1 ? req.urgency :
+                      s->hb_urgency != -1 ? s->hb_urgency : 3;
+  st->incremental   = req.urgency != -1 ? req.incremental :
+                      s->hb_urgency != -1;
+  return h2_respond(s, st, &req);
+}
+
+// RFC 7540 weights run from 1 to 256, default 16. Map each doubling of
+// weight to one step of RFC 9218 urgency, with the default weight at the
+// default urgency of 3.
+static int
+h2_weight_urgency(int weight)
+{
+  int urgency = 7;
+
+  while (weight > 1 && urgency > 0) {
+    weight >>= 1;
+    urgency--;
+  }
+  return urgency;
+}
+
+static int
+h2_settings(struct h2_session *s, const uint8_t *p, size_t len)
+{
+  size_t i;
+
+  if (len % 6 != 0) {
+    return h2_goaway(s, H2_FRAME_SIZE_ERROR);
+  }
+  for (i = 0; i < len; i += 6) {
+    uint16_t  id    = (uint16_t) ((p[i] << 8) | p[i + 1]);
+    uint32_t  value = get32(p + i + 2);
+    int       j;
+
+    switch (id) {
+      case 0x2:     // SETTINGS_ENABLE_PUSH; we never push anyway
+        if (value > 1) {
+          return h2_goaway(s, H2_PROTOCOL_ERROR);
+        }
+        break;
+      case 0x4:     // SETTINGS_INITIAL_WINDOW_SIZE
+        if (value > H2_WINDOW_MAX) {
+          return h2_goaway(s, H2_FLOW_CONTROL_ERROR);
+        }
+        // Applies to streams already open, as a change to their windows,
+        // none of which may grow past the maximum (RFC 9113, 6.9.2)
+        for (j = 0; j < H2_MAX_STREAMS; j++) {
+          if (s->streams[j].id != 0) {
+            s->streams[j].window += (int64_t) value - s->initial_window;
+            if (s->streams[j].window > H2_WINDOW_MAX) {
+              return h2_goaway(s, H2_FLOW_CONTROL_ERROR);
+            }
+          }
+        }
+        s->initial_window = value;
+        break;
+      case 0x5:     // SETTINGS_MAX_FRAME_SIZE; we send smaller ones anyway
+        if (value < 16384 || value > 16777215) {
+          return h2_goaway(s, H2_PROTOCOL_ERROR);
+        }
+        break;
+    }
+  }
+  return 0;
+}
+
+// Handle the frame at the start of the input buffer
+static int
+h2_process(struct h2_session *s)
+{
+  uint8_t           *f     = s->in;
+  uint32_t           len   = ((uint32_t) f[0] << 16) | (f[1] << 8) | f[2];
+  uint8_t            type  = f[3];
+  uint8_t            flags = f[4];
+  uint32_t           sid   = get32(f + 5) & 0x7fffffff;
+  uint8_t           *p     = f + 9;
+  struct h2_stream  *st;
+  uint32_t           pad = 0;
+
+  // A header block must arrive without other frames in between
+  if (s->hb_sid != 0 && (type != H2_CONTINUATION || sid != s->hb_sid)) {
+    return h2_goaway(s, H2_PROTOCOL_ERROR);
+  }
+
+  switch (type) {
+    case H2_DATA:
+      if (sid == 0) {
+        return h2_goaway(s, H2_PROTOCOL_ERROR);
+      }
+      // Request bodies aren't used, but still count against the windows,
+      // which are reopened straight away.
+      if (len > 0 && h2_window_update(s, 0, len) == -1) {
+        return -1;
+      }
+      st = h2_find_stream(s, sid);
+      if (st != NULL && !st->remote_closed) {
+        if (flags & H2_END_STREAM) {
+          st->remote_closed = 1;
+        } else if (len > 0 && h2_window_update(s, sid, len) == -1) {
+          return -1;
+        }
+      }
+      return 0;
+
+    case H2_HEADERS:
+      if (sid == 0 || (sid & 1) == 0) {
+        return h2_goaway(s, H2_PROTOCOL_ERROR);
+      }
+      if (flags & H2_PADDED) {
+        if (len < 1 || (pad = p[0]) >= len) {
+          return h2_goaway(s, H2_PROTOCOL_ERROR);
+        }
+        p++;
+        len -= 1 + pad;
+      }
+      s->hb_urgency = -1;
+      if (flags & H2_PRIORITY_FLAG) {
+        if (len < 5) {
+          return h2_goaway(s, H2_FRAME_SIZE_ERROR);
+        }
+        s->hb_urgency = h2_weight_urgency(p[4] + 1);
+        p   += 5;
+        len -= 5;
+      }
+      s->hb_sid        = sid;
+      s->hb_end_stream = flags & H2_END_STREAM;
+      s->hb_len        = 0;
+      /* Fall through */
+    case H2_CONTINUATION:
+      if (s->hb_sid == 0) {
+        return h2_goaway(s, H2_PROTOCOL_ERROR);
+      }
+      if (s->hb_len + len > H2_HB_MAX) {
+        return h2_goaway(s, H2_ENHANCE_YOUR_CALM);
+      }
+      memcpy(s->hb + s->hb_len, p, len);
+      s->hb_len += len;
+      return (flags & H2_END_HEADERS) ? h2_headers_done(s) : 0;
+
+    case H2_PRIORITY:
+      if (len != 5) {
+        return h2_goaway(s, H2_FRAME_SIZE_ERROR);
+      }
+      // Superseded once the client has used the priority header
+      if ((st = h2_find_stream(s, sid)) != NULL && !s->rfc9218) {
+        st->urgency     = h2_weight_urgency(p[4] + 1);
+        st->incremental = 1;
+      }
+      return 0;
+
+    case H2_PRIORITY_UPDATE:
+      if (sid != 0 || len < 4) {
+        return h2_goaway(s, H2_PROTOCOL_ERROR);
+      }
+      s->rfc9218 = 1;
+      if ((st = h2_find_stream(s, get32(p) & 0x7fffffff)) != NULL) {
+        h2_parse_priority((char *) p + 4, len - 4, &st->urgency,
+                          &st->incremental);
+      }
+      return 0;
+
+    case H2_RST_STREAM:
+      if (len != 4) {
+        return h2_goaway(s, H2_FRAME_SIZE_ERROR);
+      }
+      if (sid == 0) {
+        return h2_goaway(s, H2_PROTOCOL_ERROR);
+      }
+      if ((st = h2_find_stream(s, sid)) != NULL) {
+        h2_stream_free(s, st);
+      }
+      return 0;
+
+    case H2_SETTINGS:
+      if (sid != 0) {
+        return h2_goaway(s, H2_PROTOCOL_ERROR);
+      }
+      if (flags & H2_ACK) {
+        return len == 0 ? 0 : h2_goaway(s, H2_FRAME_SIZE_ERROR);
+      }
+      if (h2_settings(s, p, len) == -1) {
+        return -1;
+      }
+      return h2_frame(s, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+
+    case H2_PING:
+      if (len != 8) {
+        return h2_goaway(s, H2_FRAME_SIZE_ERROR);
+      }
+      if (flags & H2_ACK) {
+        return 0;
+      }
+      return h2_frame(s, H2_PING, H2_ACK, 0, p, 8);
+
+    case H2_GOAWAY:
+      // Finish the streams already open, then close
+      s->goaway = 1;
+      return 0;
+
+    case H2_WINDOW_UPDATE:
+      if (len != 4) {
+        return h2_goaway(s, H2_FRAME_SIZE_ERROR);
+      }
+      if ((get32(p) & 0x7fffffff) == 0) {
+        return h2_goaway(s, H2_PROTOCOL_ERROR);
+      }
+      if (sid == 0) {
+        s->send_window += get32(p) & 0x7fffffff;
+        if (s->send_window > H2_WINDOW_MAX) {
+          return h2_goaway(s, H2_FLOW_CONTROL_ERROR);
+        }
+      } else if ((st = h2_find_stream(s, sid)) != NULL) {
+        st->window += get32(p) & 0x7fffffff;
+        if (st->window > H2_WINDOW_MAX) {
+          h2_stream_free(s, st);
+          return h2_rst_stream(s, sid, H2_FLOW_CONTROL_ERROR);
+        }
+      }
+      return 0;
+
+    case H2_PUSH_PROMISE:
+      return h2_goaway(s, H2_PROTOCOL_ERROR);
+
+    default:
+      return 0;   // Unknown frame types are ignored
+  }
+}
+
+// The stream whose response should go next, or NULL if flow control
+// allows nothing to be sent.
+static struct h2_stream *
+h2_next_stream(struct h2_session *s)
+{
+  struct h2_stream  *best = NULL;
+  int                i;
+
+  if (s->send_window <= 0) {
+    return NULL;
+  }
+  for (i = 0; i < H2_MAX_STREAMS; i++) {
+    struct h2_stream *st = &s->streams[i];
+
+    if (st->id == 0 || st->offset == st->length || st->window <= 0) {
+      continue;
+    }
+    if (best == NULL || st->urgency < best->urgency) {
+      best = st;
+    } else if (st->urgency == best->urgency) {
+      // Sequential responses first, in request order; then incremental
+      // ones, each in turn.
+      if (st->incremental != best->incremental) {
+        if (!st->incremental) {
+          best = st;
+        }
+      } else if (st->incremental ? st->served < best->served
+                                 : st->id < best->id) {
+        best = st;
+      }
+    }
+  }
+  return best;
+}
+
+static int
+h2_send_data(struct h2_session *s, struct h2_stream *st)
+{
+  size_t   n = H2_FRAME_MAX;
+  int      flags = 0;
+
+  if ((int64_t) n > st->window) {
+    n = (size_t) st->window;
+  }
+  if ((int64_t) n > s->send_window) {
+    n = (size_t) s->send_window;
+  }
+  if ((off_t) n > st->length - st->offset) {
+    n = (size_t) (st->length - st->offset);
+  }
+
+  if (st->fd != -1) {
+    ssize_t rlen = pread(st->fd, s->out + 9, n, st->base + st->offset);
+
+    if (rlen <= 0) {
+      // The file shrank, or can't be read: the response can't be finished
+      uint32_t sid = st->id;
+
+      h2_stream_free(s, st);
+      return h2_rst_stream(s, sid, H2_INTERNAL_ERROR);
+    }
+    n = (size_t) rlen;
+  } else {
+    memcpy(s->out + 9, st->body + st->offset, n);
+  }
+
+  st->offset     += (off_t) n;
+  st->window     -= (int64_t) n;
+  s->send_window -= (int64_t) n;
+  st->served      = ++s->sequence;
+  if (st->offset == st->length) {
+    flags = H2_END_STREAM;
+  }
+  if (h2_frame(s, H2_DATA, flags, st->id, NULL, n) == -1) {
+    return -1;
+  }
+  return flags ? h2_stream_done(s, st) : 0;
+}
+
+// Make sure a whole frame is at the start of the input buffer, reading
+// more if necessary. Returns 1 when there is, 0 if the client closed the
+// connection, and -1 on error.
+static int
+h2_fill(struct h2_session *s)
+{
+  ssize_t rlen;
+
+  while (1) {
+    if (s->in_len >= 9) {
+      uint32_t len = ((uint32_t) s->in[0] << 16) | (s->in[1] << 8) | s->in[2];
+
+      if (len > H2_FRAME_MAX) {
+        return h2_goaway(s, H2_FRAME_SIZE_ERROR);
+      }
+      if (s->in_len >= 9 + len) {
+        return 1;
+      }
+    }
+    rlen = h2_conn_recv(s->c, s->in + s->in_len, sizeof(s->in) - s->in_len);
+    if (rlen <= 0) {
+      return rlen == 0 ? 0 : -1;
+    }
+    s->in_len += (size_t) rlen;
+  }
+}
+
+static void
+h2_consume(struct h2_session *s, size_t n)
+{
+  memmove(s->in, s->in + n, s->in_len - n);
+  s->in_len -= n;
+}
+
+// Whether the client has sent anything, without waiting for it
+static int
+h2_input_pending(struct h2_session *s)
+{
+  if (s->in_len >= 9 &&
+      s->in_len >= 9 + (((size_t) s->in[0] << 16) | (s->in[1] << 8) |
+                        s->in[2])) {
+    return 1;
+  }
+  return h2_conn_readable(s->c);
+}
+
+// Decode the base64url of an HTTP2-Settings header (RFC 7540, 3.2.1)
+static ssize_t
+base64url_decode(const char *in, uint8_t *out, size_t outlen)
+{
+  uint32_t  acc = 0;
+  size_t    n = 0;
+  int       bits = 0;
+
+  for (; *in != '\0' && *in != '='; in++) {
+    const char *alphabet =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    const char *c = strchr(alphabet, *in);
+
+    if (c == NULL) {
+      return -1;
+    }
+    acc   = (acc << 6) | (uint32_t) (c - alphabet);
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      if (n == outlen) {
+        return -1;
+      }
+      out[n++] = (uint8_t) (acc >> bits);
+    }
+  }
+  return (ssize_t) n;
+}
+
+void
+h2_serve(struct connection *c, const char *in, size_t in_len,
+         const struct h2_request *upgrade, const char *http2_settings, int id)
+{
+  struct h2_session  *s = calloc(1, sizeof(struct h2_session));
+  static const uint8_t settings[] = {
+    0x00, 0x03, 0x00, 0x00, 0x00, H2_MAX_STREAMS,  // MAX_CONCURRENT_STREAMS
+    0x00, 0x06, 0x00, 0x00, 0x40, 0x00,            // MAX_HEADER_LIST_SIZE
+  };
+  int                 rc, i;
+
+  if (s == NULL || in_len > sizeof(s->in)) {
+    free(s);
+    return;
+  }
+  printf("responder %d: HTTP/2%s\n", id, upgrade != NULL ? " (upgrade)" : "");
+  s->c              = c;
+  s->id             = id;
+  s->send_window    = H2_DEFAULT_WINDOW;
+  s->initial_window = H2_DEFAULT_WINDOW;
+  s->hpack.max_size = HPACK_TABLE_SIZE;
+  memcpy(s->in, in, in_len);
+  s->in_len = in_len;
+
+  if (h2_frame(s, H2_SETTINGS, 0, 0, settings, sizeof(settings)) == -1) {
+    goto done;
+  }
+
+  if (upgrade != NULL) {
+    // The upgrade request's HTTP2-Settings stand in for the client's first
+    // SETTINGS frame, and it becomes stream 1, already half-closed.
+    struct h2_request   req = *upgrade;
+    struct h2_stream   *st = &s->streams[0];
+    uint8_t             buf[128];
+    ssize_t             n = base64url_decode(http2_settings, buf,
+                                             sizeof(buf));
+
+    if (n == -1 || h2_settings(s, buf, (size_t) n) == -1) {
+      goto done;
+    }
+    s->last_sid       = 1;
+    s->nstreams       = 1;
+    st->id            = 1;
+    st->fd            = -1;
+    st->remote_closed = 1;
+    st->window        = s->initial_window;
+    st->urgency       = 3;
+    if (h2_respond(s, st, &req) == -1) {
+      goto done;
+    }
+  }
+
+  // The client's connection preface
+  while (s->in_len < H2_PREFACE_LEN) {
+    ssize_t rlen = h2_conn_recv(c, s->in + s->in_len,
+                                sizeof(s->in) - s->in_len);
+    if (rlen <= 0) {
+      goto done;
+    }
+    s->in_len += (size_t) rlen;
+  }
+  if (memcmp(s->in, H2_PREFACE, H2_PREFACE_LEN) != 0) {
+    h2_goaway(s, H2_PROTOCOL_ERROR);
+    goto done;
+  }
+  h2_consume(s, H2_PREFACE_LEN);
+
+  while (!h2_stopping()) {
+    struct h2_stream *st = h2_next_stream(s);
+
+    if (st == NULL && s->goaway && s->nstreams == 0) {
+      break;
+    }
+    // Take in whatever the client has sent, waiting for it only if there
+    // is nothing to send meanwhile
+    if (st == NULL || h2_input_pending(s)) {
+      if ((rc = h2_fill(s)) <= 0) {
+        break;
+      }
+      rc = h2_process(s);
+      h2_consume(s, 9 + (((size_t) s->in[0] << 16) | (s->in[1] << 8) |
+                         s->in[2]));
+      if (rc == -1) {
+        break;
+      }
+      continue;
+    }
+    if (h2_send_data(s, st) == -1) {
+      break;
+    }
+  }
+  if (h2_stopping()) {
+    h2_goaway(s, H2_NO_ERROR);
+  }
+
+done:
+  for (i = 0; i < H2_MAX_STREAMS; i++) {
+    if (s->streams[i].id != 0) {
+      h2_stream_free(s, &s->streams[i]);
+    }
+  }
+  hpack_free(&s->hpack);
+  free(s);
+}
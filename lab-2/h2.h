@@ -0,0 +1,95 @@
+//
+// h2.h -- HTTP/2 framing, streams and flow control for wserver
+//
+// h2.c runs an HTTP/2 connection: it reads and answers frames, decodes
+// request headers, and schedules the response bodies. What a request is
+// answered with is the server's business, as is moving bytes over the
+// connection; h2.c reaches both through the functions the server
+// supplies, declared at the end.
+//
+
+#ifndef H2_H
+#define H2_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hpack.h"
+
+#define H2_PREFACE         "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN     24
+
+#define H2_CODING_VARY  1     // The body has a gzip variant
+#define H2_CODING_GZIP  2     // The body is the gzip variant
+
+struct connection;            // The server's
+
+// What we need to know about a request on a stream
+struct h2_request {
+  char  method[16];
+  char  path[1024];
+  char  authority[256];
+  int   urgency;          // -1 if the client didn't say
+  int   incremental;
+  int   gzip;             // Accepts gzip content coding
+  int   bad;              // Malformed, or a field too long to keep
+};
+
+struct h2_stream {
+  uint32_t   id;             // 0 = free slot
+  int        remote_closed;  // Client has finished its side of the stream
+  int        fd;             // File being sent, or -1
+  off_t      base;           // Where the body starts in it
+  char      *body;           // Generated body, or NULL
+  size_t     body_cap;
+  off_t      offset;         // Next byte of the body to send
+  off_t      length;
+  int64_t    window;         // Flow-control window for sending
+  int        urgency;        // 0 (most urgent) to 7
+  int        incremental;
+  uint64_t   served;         // When a frame from it was last sent
+};
+
+// Serve an HTTP/2 connection until it closes. in holds any bytes already
+// read from the client, which start the HTTP/2 input. For an h2c upgrade,
+// upgrade is the HTTP/1.1 request, whose response goes on stream 1, and
+// http2_settings its HTTP2-Settings header; otherwise both are NULL. id is
+// the responder's, for logging.
+void h2_serve(struct connection *c, const char *in, size_t in_len,
+              const struct h2_request *upgrade, const char *http2_settings,
+              int id);
+
+// Append to a stream's generated body
+void h2_printf(struct h2_stream *st, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+void h2_error_body(struct h2_stream *st, const char *status,
+                   const char *message);
+
+// Supplied by the server:
+
+// Send all of data, returning 0, or -1 if the connection failed
+int h2_conn_send(struct connection *c, const void *data, size_t len);
+
+// Read what the client has sent, waiting for it if need be. Returns the
+// length read, 0 if the client closed the connection, or -1 on error.
+ssize_t h2_conn_recv(struct connection *c, void *buf, size_t len);
+
+// Whether the client has sent anything, without waiting for it
+int h2_conn_readable(struct connection *c);
+
+// Whether the server is shutting down, and should take no new streams
+int h2_stopping(void);
+
+// Whether an Accept-Encoding value lets us send gzip
+int h2_accepts_gzip(const char *value);
+
+// Work out the response to a request, leaving its body on st ready to send
+// from a file or from memory. Returns the status, and fills in the content
+// type, any extra header (by its HPACK static table index, or 0 for none)
+// and the content coding.
+int h2_prepare_response(struct h2_stream *st, struct h2_request *req, int id,
+                        const char **type, int *extra_index, char *extra,
+                        size_t extra_len, int *coding);
+
+#endif
@@ -0,0 +1,360 @@
+//
+// hpack.c -- HPACK header compression for HTTP/2 (RFC 7541)
+//
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hpack.h"
+
+// HPACK Huffman code (RFC 7541, Appendix B). The code is canonical, so it
+// is determined by the length of each symbol's code: codes are assigned
+// in order of length, and within a length in order of symbol.
+static const uint8_t huffman_lengths[257] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+   6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+   5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+  13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+   7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+  15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+   6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+  30
+};
+
+#define HUFFMAN_EOS  256
+
+static struct {
+  uint32_t  first[31];     // Code of the first symbol of each length
+  uint16_t  count[31];     // Number of symbols of each length
+  uint16_t  offset[31];    // Index in symbols[] of the first of each length
+  uint16_t  symbols[257];  // Symbols in code order
+} huffman;
+
+void
+hpack_init(void)
+{
+  uint32_t  code = 0;
+  int       len, sym, n = 0;
+
+  for (sym = 0; sym < 257; sym++) {
+    huffman.count[huffman_lengths[sym]]++;
+  }
+  for (len = 1; len <= 30; len++) {
+    huffman.first[len]  = code;
+    huffman.offset[len] = (uint16_t) n;
+    for (sym = 0; sym < 257; sym++) {
+      if (huffman_lengths[sym] == len) {
+        huffman.symbols[n++] = (uint16_t) sym;
+      }
+    }
+    code = (code + huffman.count[len]) << 1;
+  }
+}
+
+static ssize_t
+huffman_decode(const uint8_t *in, size_t len, char *out, size_t outlen)
+{
+  uint32_t  code = 0;
+  size_t    i, n = 0;
+  int       bits = 0, b;
+
+  for (i = 0; i < len; i++) {
+    for (b = 7; b >= 0; b--) {
+      uint32_t k;
+
+      code = (code << 1) | ((in[i] >> b) & 1);
+      if (++bits > 30) {
+        return -1;
+      }
+      // A code of this length is valid if it falls within the range of
+      // codes assigned to this length; otherwise it's the prefix of a
+      // longer one.
+      k = code - huffman.first[bits];
+      if (k < huffman.count[bits]) {
+        uint16_t sym = huffman.symbols[huffman.offset[bits] + k];
+
+        if (sym == HUFFMAN_EOS || n == outlen) {
+          return -1;
+        }
+        out[n++] = (char) sym;
+        code = 0;
+        bits = 0;
+      }
+    }
+  }
+  // The string is padded to a byte boundary with the start of the EOS
+  // code, which is all ones.
+  if (bits > 7 || code != (1u << bits) - 1) {
+    return -1;
+  }
+  return (ssize_t) n;
+}
+
+// HPACK static table (RFC 7541, Appendix A)
+static const char *hpack_static[61][2] = {
+  { ":authority", "" }, { ":method", "GET" }, { ":method", "POST" },
+  { ":path", "/" }, { ":path", "/index.html" }, { ":scheme", "http" },
+  { ":scheme", "https" }, { ":status", "200" }, { ":status", "204" },
+  { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+  { ":status", "404" }, { ":status", "500" }, { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" }, { "accept-language", "" },
+  { "accept-ranges", "" }, { "accept", "" },
+  { "access-control-allow-origin", "" }, { "age", "" }, { "allow", "" },
+  { "authorization", "" }, { "cache-control", "" },
+  { "content-disposition", "" }, { "content-encoding", "" },
+  { "content-language", "" }, { "content-length", "" },
+  { "content-location", "" }, { "content-range", "" },
+  { "content-type", "" }, { "cookie", "" }, { "date", "" }, { "etag", "" },
+  { "expect", "" }, { "expires", "" }, { "from", "" }, { "host", "" },
+  { "if-match", "" }, { "if-modified-since", "" }, { "if-none-match", "" },
+  { "if-range", "" }, { "if-unmodified-since", "" },
+  { "last-modified", "" }, { "link", "" }, { "location", "" },
+  { "max-forwards", "" }, { "proxy-authenticate", "" },
+  { "proxy-authorization", "" }, { "range", "" }, { "referer", "" },
+  { "refresh", "" }, { "retry-after", "" }, { "server", "" },
+  { "set-cookie", "" }, { "strict-transport-security", "" },
+  { "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" },
+  { "via", "" }, { "www-authenticate", "" }
+};
+
+static void
+hpack_evict(struct hpack *hp, size_t room)
+{
+  while (hp->count > 0 && hp->size + room > hp->max_size) {
+    struct hpack_entry *e = &hp->entries[(hp->head + hp->count - 1) %
+                                         HPACK_MAX_ENTRIES];
+
+    hp->size -= e->nlen + e->vlen + 32;
+    free(e->name);
+    hp->count--;
+  }
+}
+
+// Add an entry to the table, evicting old ones to make room. Returns -1
+// if there's no memory for it, leaving the table as it was.
+static int
+hpack_insert(struct hpack *hp, const char *name, size_t nlen,
+             const char *value, size_t vlen)
+{
+  struct hpack_entry  *e;
+  size_t               size = nlen + vlen + 32;
+  char                *copy;
+
+  // Copy first: the name may belong to an entry about to be evicted
+  if (size > hp->max_size) {
+    hpack_evict(hp, hp->max_size + 1);   // Empties the table
+    return 0;
+  }
+  if ((copy = malloc(nlen + vlen + 1)) == NULL) {
+    return -1;
+  }
+  memcpy(copy, name, nlen);
+  memcpy(copy + nlen, value, vlen);
+  hpack_evict(hp, size);
+
+  hp->head = (hp->head + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+  e = &hp->entries[hp->head];
+  e->name  = copy;
+  e->value = copy + nlen;
+  e->nlen  = nlen;
+  e->vlen  = vlen;
+  hp->count++;
+  hp->size += size;
+  return 0;
+}
+
+static int
+hpack_lookup(const struct hpack *hp, uint32_t index, const char **name,
+             size_t *nlen, const char **value, size_t *vlen)
+{
+  if (index == 0) {
+    return -1;
+  }
+  if (index <= 61) {
+    *name  = hpack_static[index - 1][0];
+    *value = hpack_static[index - 1][1];
+    *nlen  = strlen(*name);
+    *vlen  = strlen(*value);
+    return 0;
+  }
+  if (index - 62 >= (uint32_t) hp->count) {
+    return -1;
+  }
+  {
+    const struct hpack_entry *e = &hp->entries[(hp->head + (int) index - 62) %
+                                               HPACK_MAX_ENTRIES];
+
+    *name  = e->name;
+    *value = e->value;
+    *nlen  = e->nlen;
+    *vlen  = e->vlen;
+  }
+  return 0;
+}
+
+void
+hpack_free(struct hpack *hp)
+{
+  hp->max_size = 0;
+  hpack_evict(hp, 1);
+}
+
+// Decode an integer with an n-bit prefix (RFC 7541, section 5.1)
+static int
+hpack_integer(const uint8_t **p, const uint8_t *end, int prefix,
+              uint32_t *value)
+{
+  uint32_t  max = (1u << prefix) - 1;
+  uint32_t  v   = **p & max;
+  int       shift = 0;
+
+  (*p)++;
+  if (v == max) {
+    uint8_t b;
+
+    do {
+      if (*p == end || shift > 21) {
+        return -1;    // Truncated, or too large to be sensible
+      }
+      b      = *(*p)++;
+      v     += (uint32_t) (b & 0x7f) << shift;
+      shift += 7;
+    } while (b & 0x80);
+  }
+  *value = v;
+  return 0;
+}
+
+static size_t
+hpack_put_integer(uint8_t *out, uint8_t flags, int prefix, size_t value)
+{
+  size_t  max = (1u << prefix) - 1;
+  size_t  n   = 0;
+
+  if (value < max) {
+    out[n++] = (uint8_t) (flags | value);
+    return n;
+  }
+  out[n++] = (uint8_t) (flags | max);
+  for (value -= max; value >= 128; value >>= 7) {
+    out[n++] = (uint8_t) (0x80 | (value & 0x7f));
+  }
+  out[n++] = (uint8_t) value;
+  return n;
+}
+
+static int
+hpack_string(const uint8_t **p, const uint8_t *end, char *out, size_t outlen,
+             size_t *len)
+{
+  uint32_t  n;
+  int       huffman_coded;
+
+  if (*p == end) {
+    return -1;
+  }
+  huffman_coded = **p & 0x80;
+  if (hpack_integer(p, end, 7, &n) == -1 || n > (size_t) (end - *p)) {
+    return -1;
+  }
+  if (huffman_coded) {
+    ssize_t dlen = huffman_decode(*p, n, out, outlen);
+
+    if (dlen == -1) {
+      return -1;
+    }
+    *len = (size_t) dlen;
+  } else {
+    if (n > outlen) {
+      return -1;
+    }
+    memcpy(out, *p, n);
+    *len = n;
+  }
+  *p += n;
+  return 0;
+}
+
+size_t
+hpack_literal(uint8_t *out, int index, const char *value)
+{
+  size_t len = strlen(value);
+  size_t n   = hpack_put_integer(out, 0x00, 4, (size_t) index);
+
+  n += hpack_put_integer(out + n, 0x00, 7, len);
+  memcpy(out + n, value, len);
+  return n + len;
+}
+
+int
+hpack_decode(struct hpack *hp, const uint8_t *p, size_t len, char *scratch,
+             size_t scratch_len,
+             void (*field)(void *arg, const char *name, size_t nlen,
+                           const char *value, size_t vlen),
+             void *arg)
+{
+  const uint8_t *end = p + len;
+
+  while (p < end) {
+    const char  *name, *value;
+    size_t       nlen, vlen;
+    uint32_t     index;
+    uint8_t      b = *p;
+
+    if (b & 0x80) {
+      // Indexed header field
+      if (hpack_integer(&p, end, 7, &index) == -1 ||
+          hpack_lookup(hp, index, &name, &nlen, &value, &vlen) == -1) {
+        return -1;
+      }
+      field(arg, name, nlen, value, vlen);
+    } else if ((b & 0xe0) == 0x20) {
+      // Dynamic table size update
+      if (hpack_integer(&p, end, 5, &index) == -1 ||
+          index > HPACK_TABLE_SIZE) {
+        return -1;
+      }
+      hp->max_size = index;
+      hpack_evict(hp, 0);
+    } else {
+      // Literal, with incremental indexing (01), without (0000), or never
+      // indexed (0001). The name is either indexed or a literal string.
+      int indexing = (b & 0xc0) == 0x40;
+
+      if (hpack_integer(&p, end, indexing ? 6 : 4, &index) == -1) {
+        return -1;
+      }
+      if (index == 0) {
+        if (hpack_string(&p, end, scratch, scratch_len, &nlen) == -1) {
+          return -1;
+        }
+        name = scratch;
+      } else if (hpack_lookup(hp, index, &name, &nlen, &value,
+                              &vlen) == -1) {
+        return -1;
+      }
+      if (hpack_string(&p, end, scratch + nlen, scratch_len - nlen,
+                       &vlen) == -1) {
+        return -1;
+      }
+      value = scratch + nlen;
+
+      field(arg, name, nlen, value, vlen);
+      if (indexing && hpack_insert(hp, name, nlen, value, vlen) == -1) {
+        return -2;
+      }
+    }
+  }
+  return 0;
+}
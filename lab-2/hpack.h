@@ -0,0 +1,65 @@
+//
+// hpack.h -- HPACK header compression for HTTP/2 (RFC 7541)
+//
+// The decoder implements all of it, since clients use the dynamic table
+// and Huffman coding freely; the encoder sends literals without indexing,
+// which any decoder accepts.
+//
+
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Static table entries (RFC 7541, Appendix A) that name response headers
+#define HPACK_STATIC_ALLOW             22
+#define HPACK_STATIC_CONTENT_ENCODING  26
+#define HPACK_STATIC_CONTENT_LENGTH    28
+#define HPACK_STATIC_CONTENT_TYPE      31
+#define HPACK_STATIC_LOCATION          46
+#define HPACK_STATIC_STATUS            8     // :status 200
+#define HPACK_STATIC_VARY              59
+#define HPACK_TABLE_SIZE             4096  // SETTINGS_HEADER_TABLE_SIZE
+#define HPACK_MAX_ENTRIES            (HPACK_TABLE_SIZE / 32)
+
+struct hpack_entry {
+  char    *name;
+  char    *value;
+  size_t   nlen;
+  size_t   vlen;
+};
+
+// The decoder's dynamic table: a ring of entries, newest first. Zeroed,
+// with max_size set, it is an empty table.
+struct hpack {
+  struct hpack_entry  entries[HPACK_MAX_ENTRIES];
+  int                 head;       // Index of the newest entry
+  int                 count;
+  size_t              size;       // As RFC 7541 counts it: 32 + lengths
+  size_t              max_size;
+};
+
+// Build the Huffman decoding tables. Called once, before any decoding.
+void hpack_init(void);
+
+// Decode a complete header block, passing each field to field() and
+// updating the dynamic table. scratch holds literal names and values.
+// Returns -1 on a compression error, or -2 if the table couldn't grow;
+// either way the table is out of step with the encoder's, and the
+// connection is lost.
+int hpack_decode(struct hpack *hp, const uint8_t *p, size_t len,
+                 char *scratch, size_t scratch_len,
+                 void (*field)(void *arg, const char *name, size_t nlen,
+                               const char *value, size_t vlen),
+                 void *arg);
+
+// Free the dynamic table's entries
+void hpack_free(struct hpack *hp);
+
+// Encode a response header into out as a literal not added to the
+// decoder's dynamic table, named by its static table index (RFC 7541,
+// section 6.2.2). Returns its length.
+size_t hpack_literal(uint8_t *out, int index, const char *value);
+
+#endif
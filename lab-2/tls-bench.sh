@@ -0,0 +1,56 @@
+#!/bin/sh
+#
+# tls-bench.sh -- loopback benchmark of wserver's TLS listener
+#
+# Generates a throwaway self-signed certificate, starts ./wserver with a TLS
+# listener, and measures:
+#   - full handshakes per second       (openssl s_time -new)
+#   - resumed handshakes per second    (openssl s_time -reuse)
+#   - bulk throughput of a large file  (curl, plaintext and TLS)
+#
+# Usage: ./tls-bench.sh [seconds] [file-size-MB]
+
+SECS=${1:-5}
+SIZE_MB=${2:-256}
+PORT=8080
+TLS_PORT=8443
+HOST=$(hostname)
+TMP=$(mktemp -d)
+BULK=website/tls-bench.bin
+
+cleanup() {
+  [ -n "$PID" ] && kill -INT "$PID" 2>/dev/null
+  rm -rf "$TMP" "$BULK"
+}
+trap cleanup EXIT INT TERM
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj "/CN=$HOST" \
+  -keyout "$TMP/key.pem" -out "$TMP/cert.pem" 2>/dev/null || exit 1
+dd if=/dev/urandom of="$BULK" bs=1M count="$SIZE_MB" 2>/dev/null
+
+./wserver -l 127.0.0.1 -p $PORT -s $TLS_PORT \
+  -c "$TMP/cert.pem" -k "$TMP/key.pem" > "$TMP/wserver.log" 2>&1 &
+PID=$!
+sleep 1
+
+echo "== Full handshakes (${SECS}s)"
+openssl s_time -connect 127.0.0.1:$TLS_PORT -new -time "$SECS" 2>/dev/null \
+  | grep 'connections/user sec'
+
+# s_time picks up its session before TLS 1.3 tickets arrive, so measure
+# resumption with TLS 1.2 sessions.
+echo "== Resumed handshakes (${SECS}s, TLS 1.2)"
+openssl s_time -connect 127.0.0.1:$TLS_PORT -reuse -tls1_2 -time "$SECS" \
+  2>/dev/null | grep 'connections/user sec'
+
+echo "== Bulk transfer, ${SIZE_MB} MB"
+for url in http://127.0.0.1:$PORT https://127.0.0.1:$TLS_PORT; do
+  curl -sk -o /dev/null -H "Host: $HOST" \
+    -w "$url: %{speed_download} bytes/sec\n" "$url/tls-bench.bin"
+done
+
+if grep -q kTLS "$TMP/wserver.log"; then
+  echo "kTLS offload: active"
+else
+  echo "kTLS offload: not available (is the tls kernel module loaded?)"
+fi
@@ -0,0 +1,431 @@
+//
+// wpack.c -- pack a docroot into a single archive, for wserver -R
+//
+// Usage: wpack [-z] [-o archive] docroot
+//
+// The archive format is described in wpack.h. With -z, text files also get
+// a gzip-compressed variant, where that saves at least a tenth of them.
+//
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+
+#include "wpack.h"
+
+#define PATH_MAX_LEN  4096
+
+struct item {
+  char    *path;        // As requested
+  char    *file;        // Where the body comes from, or NULL if in body
+  char    *body;
+  size_t   size;
+  char    *gz;
+  size_t   gz_size;
+  char    *headers;
+  char    *gz_headers;
+  int      kind;
+};
+
+static struct item  *items;
+static int           num_items, cap_items;
+#ifdef WITH_ZLIB
+static int           compress_text;
+#endif
+
+// The string area, which starts at strings_base in the archive
+static char         *strings;
+static size_t        strings_len, strings_cap;
+static uint64_t      strings_base;
+
+static struct item *
+add_item(const char *path, int kind)
+{
+  struct item *it;
+
+  if (num_items == cap_items) {
+    cap_items = cap_items ? cap_items * 2 : 64;
+    items     = realloc(items, sizeof(*items) * (size_t) cap_items);
+  }
+  it = &items[num_items++];
+  memset(it, 0, sizeof(*it));
+  it->path = strdup(path);
+  it->kind = kind;
+  return it;
+}
+
+// Append to a growing string
+static void
+append(char **buf, size_t *len, size_t *cap, const char *s)
+{
+  size_t n = strlen(s);
+
+  while (*len + n + 1 > *cap) {
+    *cap  = *cap ? *cap * 2 : 4096;
+    *buf  = realloc(*buf, *cap);
+  }
+  memcpy(*buf + *len, s, n + 1);
+  *len += n;
+}
+
+// Add a string to the string area, returning its offset in the archive
+static uint64_t
+add_string(const char *s)
+{
+  uint64_t off = strings_base + strings_len;
+
+  append(&strings, &strings_len, &strings_cap, s);
+  strings_len++;  // Keep the NUL
+  return off;
+}
+
+// Read a whole file; returns NULL if it can't be read, or changes size
+static char *
+read_file(const char *file, size_t size)
+{
+  char     *buf = malloc(size + 1);
+  size_t    got = 0;
+  ssize_t   n   = 0;
+  int       fd;
+
+  if ((fd = open(file, O_RDONLY)) == -1) {
+    free(buf);
+    return NULL;
+  }
+  while (got < size && (n = read(fd, buf + got, size - got)) > 0) {
+    got += (size_t) n;
+  }
+  close(fd);
+  if (got != size) {
+    free(buf);
+    return NULL;
+  }
+  return buf;
+}
+
+#ifdef WITH_ZLIB
+static void
+compress_item(struct item *it)
+{
+  z_stream  zs;
+  char     *data = it->body ? it->body : read_file(it->file, it->size);
+  uLong     bound;
+
+  if (data == NULL) {
+    return;
+  }
+  memset(&zs, 0, sizeof(zs));
+  deflateInit2(&zs, 9, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY); // gzip
+  bound        = deflateBound(&zs, (uLong) it->size);
+  it->gz       = malloc(bound);
+  zs.next_in   = (Bytef *) data;
+  zs.avail_in  = (uInt) it->size;
+  zs.next_out  = (Bytef *) it->gz;
+  zs.avail_out = (uInt) bound;
+  if (deflate(&zs, Z_FINISH) == Z_STREAM_END &&
+      zs.total_out < it->size - it->size / 10) {
+    it->gz_size = zs.total_out;
+  } else {
+    free(it->gz);
+    it->gz = NULL;
+  }
+  deflateEnd(&zs);
+  if (data != it->body) {
+    free(data);
+  }
+}
+#endif
+
+static void
+render_headers(struct item *it, const char *type)
+{
+  char buf[WPACK_HEADERS_MAX];
+
+  // As send_response_200() would have it, up to the Connection header
+  snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\n"
+                             "Content-Type: %s\r\n"
+                             "Content-Length: %zu\r\n"
+                             "%s",
+           type, it->size, it->gz ? "Vary: Accept-Encoding\r\n" : "");
+  it->headers = strdup(buf);
+  if (it->gz != NULL) {
+    snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\n"
+                               "Content-Type: %s\r\n"
+                               "Content-Encoding: gzip\r\n"
+                               "Content-Length: %zu\r\n"
+                               "Vary: Accept-Encoding\r\n",
+             type, it->gz_size);
+    it->gz_headers = strdup(buf);
+  }
+}
+
+static int
+not_dots(const struct dirent *ent)
+{
+  return strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0;
+}
+
+// Add a directory and everything under it. path is the directory as
+// requested, without a trailing slash, so "" for the docroot.
+static int
+walk(const char *dir, const char *path)
+{
+  struct dirent  *ent;
+  struct stat     st;
+  char            child[PATH_MAX_LEN], child_path[PATH_MAX_LEN];
+  DIR            *d;
+  struct item    *it;
+
+  if ((d = opendir(dir)) == NULL) {
+    perror(dir);
+    return -1;
+  }
+
+  // A directory with an index.html redirects to it, and any other is
+  // listed, as wserver would list it
+  snprintf(child, sizeof(child), "%s/index.html", dir);
+  if (stat(child, &st) == 0) {
+    snprintf(child_path, sizeof(child_path), "%s/index.html", path);
+    it          = add_item(path[0] ? path : "/", WPACK_REDIRECT);
+    it->headers = strdup(child_path);
+  } else {
+    struct dirent  **names;
+    size_t           len = 0, cap = 0;
+    char            *body = NULL;
+    char             line[3 * PATH_MAX_LEN], when[32];
+    int              i, n;
+
+    // alphasort() in the C locale is the byte order wserver sorts by
+    if ((n = scandir(dir, &names, not_dots, alphasort)) == -1) {
+      perror(dir);
+      closedir(d);
+      return -1;
+    }
+    append(&body, &len, &cap, LISTING_HEAD);
+    for (i = 0; i < n; i++) {
+      snprintf(child, sizeof(child), "%s/%s", dir, names[i]->d_name);
+      if (stat(child, &st) == -1 && lstat(child, &st) == -1) {
+        memset(&st, 0, sizeof(st));
+      }
+      listing_mtime(when, sizeof(when), st.st_mtime);
+      snprintf(line, sizeof(line), LISTING_ENTRY, path, names[i]->d_name,
+               names[i]->d_name, (long long) st.st_size, when);
+      append(&body, &len, &cap, line);
+      free(names[i]);
+    }
+    free(names);
+    append(&body, &len, &cap, LISTING_END LISTING_TAIL);
+
+    it       = add_item(path[0] ? path : "/", WPACK_LISTING);
+    it->body = body;
+    it->size = len;
+#ifdef WITH_ZLIB
+    if (compress_text) {
+      compress_item(it);
+    }
+#endif
+    render_headers(it, "text/html");
+  }
+
+  while ((ent = readdir(d)) != NULL) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+    snprintf(child, sizeof(child), "%s/%s", dir, ent->d_name);
+    snprintf(child_path, sizeof(child_path), "%s/%s", path, ent->d_name);
+    if (stat(child, &st) == -1) {
+      perror(child);
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      if (walk(child, child_path) == -1) {
+        closedir(d);
+        return -1;
+      }
+    } else if (S_ISREG(st.st_mode)) {
+      const char *type = content_type(child_path);
+
+      it       = add_item(child_path, WPACK_FILE);
+      it->file = strdup(child);
+      it->size = (size_t) st.st_size;
+#ifdef WITH_ZLIB
+      if (compress_text && strncmp(type, "text/", 5) == 0) {
+        compress_item(it);
+      }
+#endif
+      render_headers(it, type);
+    }
+  }
+  closedir(d);
+  return 0;
+}
+
+static int
+item_cmp(const void *a, const void *b)
+{
+  return strcmp(((const struct item *) a)->path,
+                ((const struct item *) b)->path);
+}
+
+static uint64_t
+page_align(uint64_t off)
+{
+  return (off + WPACK_PAGE - 1) & ~(uint64_t) (WPACK_PAGE - 1);
+}
+
+// Write len bytes at offset off, zero-filling any gap since *pos
+static int
+write_at(FILE *f, uint64_t *pos, uint64_t off, const char *data, size_t len)
+{
+  static const char zeros[WPACK_PAGE];
+
+  while (*pos < off) {
+    size_t n = off - *pos < sizeof(zeros) ? off - *pos : sizeof(zeros);
+
+    if (fwrite(zeros, 1, n, f) != n) {
+      return -1;
+    }
+    *pos += n;
+  }
+  if (len > 0 && fwrite(data, 1, len, f) != len) {
+    return -1;
+  }
+  *pos += len;
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct wpack_header  hdr;
+  struct wpack_entry  *entries;
+  const char          *out = "site.wpk";
+  char                 tmp[PATH_MAX_LEN];
+  uint64_t             off, pos = 0, total = 0, gz_total = 0;
+  FILE                *f;
+  int                  opt, i, ok = 1;
+
+  while ((opt = getopt(argc, argv, "o:z")) != -1) {
+    switch (opt) {
+      case 'o':
+        out = optarg;
+        break;
+      case 'z':
+#ifdef WITH_ZLIB
+        compress_text = 1;
+        break;
+#else
+        fprintf(stderr, "wpack: built without zlib, can't compress\n");
+        return 1;
+#endif
+      default:
+        fprintf(stderr, "Usage: %s [-z] [-o archive] docroot\n", argv[0]);
+        return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "Usage: %s [-z] [-o archive] docroot\n", argv[0]);
+    return 1;
+  }
+  if (walk(argv[optind], "") == -1) {
+    return 1;
+  }
+  qsort(items, (size_t) num_items, sizeof(*items), item_cmp);
+
+  // Lay out the strings, after the index...
+  entries      = calloc((size_t) num_items, sizeof(*entries));
+  strings_base = sizeof(hdr) + sizeof(*entries) * (size_t) num_items;
+  for (i = 0; i < num_items; i++) {
+    struct item         *it = &items[i];
+    struct wpack_entry  *e  = &entries[i];
+
+    e->kind        = (uint32_t) it->kind;
+    e->path        = add_string(it->path);
+    e->headers     = add_string(it->headers);
+    e->headers_len = (uint32_t) strlen(it->headers);
+    if (it->kind != WPACK_REDIRECT) {
+      e->type = add_string(it->kind == WPACK_LISTING ? "text/html"
+                                                     : content_type(it->path));
+    }
+    if (it->gz != NULL) {
+      e->gz_headers     = add_string(it->gz_headers);
+      e->gz_headers_len = (uint32_t) strlen(it->gz_headers);
+    }
+  }
+
+  // ...and then the bodies, each on a page of its own
+  off = strings_base + strings_len;
+  for (i = 0; i < num_items; i++) {
+    if (items[i].kind != WPACK_REDIRECT) {
+      entries[i].body = off = page_align(off);
+      entries[i].size = items[i].size;
+      off += items[i].size;
+      total += items[i].size;
+    }
+    if (items[i].gz != NULL) {
+      entries[i].gz_body = off = page_align(off);
+      entries[i].gz_size = items[i].gz_size;
+      off += items[i].gz_size;
+      gz_total += items[i].size - items[i].gz_size;
+    }
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, WPACK_MAGIC, sizeof(hdr.magic));
+  hdr.size        = off;
+  hdr.num_entries = (uint32_t) num_items;
+  hdr.index       = sizeof(hdr);
+
+  // Written aside and renamed into place, so that a server with the old
+  // archive mapped keeps a consistent copy
+  snprintf(tmp, sizeof(tmp), "%s.tmp", out);
+  if ((f = fopen(tmp, "wb")) == NULL) {
+    perror(tmp);
+    return 1;
+  }
+  ok = write_at(f, &pos, 0, (const char *) &hdr, sizeof(hdr)) == 0 &&
+       write_at(f, &pos, pos, (const char *) entries,
+                sizeof(*entries) * (size_t) num_items) == 0 &&
+       write_at(f, &pos, pos, strings, strings_len) == 0;
+  for (i = 0; ok && i < num_items; i++) {
+    struct item *it = &items[i];
+
+    if (it->kind == WPACK_FILE && it->body == NULL &&
+        (it->body = read_file(it->file, it->size)) == NULL) {
+      fprintf(stderr, "wpack: %s: unreadable, or changed while packing\n",
+              it->file);
+      ok = 0;
+      break;
+    }
+    if (it->kind != WPACK_REDIRECT) {
+      ok = write_at(f, &pos, entries[i].body, it->body, it->size) == 0;
+      free(it->body);
+      it->body = NULL;
+    }
+    if (ok && it->gz != NULL) {
+      ok = write_at(f, &pos, entries[i].gz_body, it->gz, it->gz_size) == 0;
+    }
+  }
+  if (fclose(f) != 0 || !ok || rename(tmp, out) == -1) {
+    if (ok) {
+      perror(out);
+    }
+    unlink(tmp);
+    return 1;
+  }
+
+  printf("wpack: %s: %d entries, %llu bytes of files, %llu saved by "
+         "compression, %llu bytes in all\n", out, num_items,
+         (unsigned long long) total, (unsigned long long) gz_total,
+         (unsigned long long) off);
+  return 0;
+}
@@ -0,0 +1,110 @@
+//
+// wpack.h -- the packed site archive written by wpack and served by
+// wserver -R
+//
+// An archive holds a whole docroot in one file: a header, an index of
+// entries sorted by path, a string area holding the paths, content types
+// and pre-rendered response headers, and then the bodies, each starting
+// on a page boundary so it can be sent with sendfile() or mapped on its
+// own. All offsets are from the start of the file, in the byte order of
+// the machine that packed it.
+//
+// Entries are named as requested, relative to the docroot: "/style.css",
+// "/subdir". A directory with an index.html is a redirect to it; any other
+// directory carries its listing, rendered when the archive was packed.
+// Text files may also carry a gzip-compressed variant, sent to clients
+// that accept it.
+//
+
+#ifndef WPACK_H
+#define WPACK_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define WPACK_MAGIC        "WPACK001"
+#define WPACK_PAGE         4096
+#define WPACK_HEADERS_MAX  256
+
+#define WPACK_FILE         0
+#define WPACK_REDIRECT     1    // headers is the Location
+#define WPACK_LISTING      2    // A directory, listed
+
+struct wpack_header {
+  char      magic[8];
+  uint64_t  size;            // Of the whole archive
+  uint32_t  num_entries;
+  uint32_t  reserved;
+  uint64_t  index;           // Offset of the entries, sorted by path
+};
+
+struct wpack_entry {
+  uint64_t  path;            // Offsets of NUL-terminated strings
+  uint64_t  type;
+  uint64_t  headers;         // Up to, not including, any Connection header
+  uint64_t  gz_headers;
+  uint64_t  body;            // Page aligned
+  uint64_t  size;
+  uint64_t  gz_body;         // Page aligned
+  uint64_t  gz_size;         // 0 if there is no compressed variant
+  uint32_t  headers_len;
+  uint32_t  gz_headers_len;
+  uint32_t  kind;
+  uint32_t  reserved;
+};
+
+// A directory listing, as wserver renders it and wpack packs it: the
+// entries sorted by name, one LISTING_ENTRY each with its link, name, size
+// and modification time, between LISTING_HEAD and LISTING_END. wserver
+// serves long listings a page at a time, with links to the other pages
+// between LISTING_END and LISTING_TAIL; wpack packs each listing whole.
+#define LISTING_HEAD   "<html>\r\n" \
+                       "<head>\r\n" \
+                       "<title>Directory Listings</title>\r\n" \
+                       "</head>\r\n" \
+                       "<body>\r\n" \
+                       "<ul>"
+#define LISTING_ENTRY  "<li><a href=\"%s/%s\">%s</a> %lld %s</li>\r\n"
+#define LISTING_END    "</ul>\r\n"
+#define LISTING_TAIL   "</body>\r\n" \
+                       "</html>\r\n"
+
+// Format a listed entry's modification time, in UTC
+static inline void
+listing_mtime(char *buf, size_t len, time_t mtime)
+{
+  struct tm tm;
+
+  gmtime_r(&mtime, &tm);
+  strftime(buf, len, "%Y-%m-%d %H:%M", &tm);
+}
+
+// Generate Content-Type: based on the extension
+static inline const char *
+content_type(const char *filename)
+{
+  const char *extn = strrchr(filename, '.');
+
+  if (extn == NULL) {
+    // No extension on the requested filename
+    return "application/octet-stream";
+  } else if (strcmp(extn, ".html") == 0) {
+    return "text/html";
+  } else if (strcmp(extn, ".htm") == 0) {
+    return "text/html";
+  } else if (strcmp(extn, ".css") == 0) {
+    return "text/css";
+  } else if (strcmp(extn, ".txt") == 0) {
+    return "text/plain";
+  } else if (strcmp(extn, ".jpg") == 0) {
+    return "image/jpeg";
+  } else if (strcmp(extn, ".jpeg") == 0) {
+    return "image/jpeg";
+  } else {
+    // Unknown extension
+    return "application/octet-stream";
+  }
+}
+
+#endif
@@ -4,52 +4,237 @@
 // Copyright (c) 2007-2016 University of Glasgow
 // All rights reserved.
 
+#ifdef __linux__
+#define _GNU_SOURCE   // For splice()
+#endif
+
 #include <arpa/inet.h>
 #include <sys/errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/mman.h>   // For mmap()
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>    // For open()
 #include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>   // For malloc()
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <signal.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <poll.h>
+#include <strings.h>  // For strncasecmp()
+#include <time.h>
+#ifdef __linux__
+#include <sched.h>    // For sched_getaffinity()
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h> // For getdents64()
+#endif
+#ifdef WITH_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+#ifdef WITH_SDT
+#include <sys/sdt.h>  // USDT probes
+#endif
+
+#include "wpack.h"    // Packed site archives, and content_type()
+#include "h2.h"       // HTTP/2, run by h2.c
+
+#ifdef __APPLE__
+#define st_mtim  st_mtimespec
+#endif
 
 #define BUFLEN      1500
-#define NUM_THREADS   10
+#define NUM_THREADS   10      // Responders, unless the config file says
+
+static int     num_threads = NUM_THREADS;
+static size_t  file_buflen = BUFLEN;   // Chunk size when copying files
 
 // There are strong restrictions on what a signal handler is allowed to do. 
 // See the C11 standard, section 7.14.1.1 paragraph 5 for details (the full
 // standard is available for purchase from ISO, but the final working draft
 // is online at http://www.open-std.org/jtc1/sc22/WG14/www/docs/n1570.pdf).
 static volatile sig_atomic_t shutdown_requested = 0;
+static volatile sig_atomic_t timing_requested   = 0;
+static volatile sig_atomic_t reload_requested   = 0;
 
 static void
 signal_handler(int sig)
 {
-  if (sig == SIGINT) {
+  if (sig == SIGINT || sig == SIGTERM) {
     shutdown_requested = 1;
+  } else if (sig == SIGUSR1) {
+    timing_requested = 1;
+  } else if (sig == SIGHUP) {
+    reload_requested = 1;
   }
 }
 
-// Work queue implementation:
+// Connection pool:
+//
+// Each accepted connection gets a struct connection straight away, which
+// carries it through the work queue to a responder, and goes back to the
+// pool when the connection closes. The structs are carved from slabs of
+// CONN_SLAB, each one cache-line aligned so that no two connections share
+// a line, and kept on per-thread free lists: listeners allocate from their
+// own lists and responders free to theirs, and the lists trade batches of
+// CONN_BATCH through a shared depot when one runs dry or grows long. So
+// once the slabs are in place, tens of thousands of connections cost no
+// malloc(), and the depot's lock is taken once per batch. Slabs are kept
+// until the server exits.
+//
+// The request buffer is the responder's, lent to the connection it is
+// serving, so a connection waiting in the queue is only its struct. Each
+// struct has a generation, bumped whenever it is freed, so a reference
+// kept as a pointer and a generation can tell that its connection has
+// gone even though the struct has been reused for another.
 
-struct work_queue_elem {
-  int                      fd;
-  struct work_queue_elem  *next;
-};
+#define CONN_SLAB   512       // Structs per slab
+#define CONN_BATCH  64        // Moved to or from the depot at once
+#define CACHE_LINE  64
+
+struct connection {
+  struct connection  *next;       // In the work queue, or a free list
+#ifdef WITH_TLS
+  SSL                *ssl;        // NULL for plaintext connections
+#endif
+
+  // When set, a copy of everything sent is kept here (see head_cache)
+  char               *capture;
+
+  // Bytes received but not yet consumed, in a buffer of REQ_BUFLEN + 1.
+  // Requests are parsed in place, and anything after the current request
+  // (a body, or a pipelined request) stays here for the next read.
+  char               *in;
+
+  // What is still to be sent of the current response, or NULL
+  struct out_queue   *out;
+
+  uint32_t            capture_len;
+  uint32_t            in_len;
+  uint32_t            gen;
+  int                 fd;
+  uint8_t             tls;        // Accepted on a TLS listener
+  uint8_t             ktls_send;  // Kernel TLS offload is active for transmit
+  uint8_t             may_queue;  // Sends may go to an output queue
+  uint8_t             nonblock;   // The socket is in non-blocking mode
+
+  // How the response to the current request must be framed
+  uint8_t             head;       // HEAD request: send the headers only
+  uint8_t             http10;     // HTTP/1.0 client: no chunked encoding
+  uint8_t             close;      // Close the connection after this response
+  uint8_t             h2;         // HTTP/2 was negotiated during the TLS
+                                  // handshake
+} __attribute__((aligned(CACHE_LINE)));
+
+static struct {
+  pthread_mutex_t     lock;
+  struct connection  *free;
+  size_t              num_free;
+  size_t              num_slabs;
+} conn_pool = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+
+static __thread struct connection  *conn_free_list;
+static __thread int                 conn_free_count;
+
+// Take a batch from the depot, carving a new slab into it if it is empty
+static void
+conn_pool_refill(void)
+{
+  struct connection  *slab;
+  int                 i;
+
+  pthread_mutex_lock(&conn_pool.lock);
+  if (conn_pool.free == NULL) {
+    slab = mmap(NULL, sizeof(*slab) * CONN_SLAB, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab != MAP_FAILED) {
+      for (i = 0; i < CONN_SLAB; i++) {
+        slab[i].next = i + 1 < CONN_SLAB ? &slab[i + 1] : NULL;
+      }
+      conn_pool.free      = slab;
+      conn_pool.num_free += CONN_SLAB;
+      conn_pool.num_slabs++;
+    }
+  }
+  for (i = 0; i < CONN_BATCH && conn_pool.free != NULL; i++) {
+    struct connection *c = conn_pool.free;
+
+    conn_pool.free  = c->next;
+    c->next         = conn_free_list;
+    conn_free_list  = c;
+    conn_free_count++;
+    conn_pool.num_free--;
+  }
+  pthread_mutex_unlock(&conn_pool.lock);
+}
+
+// Returns NULL if there is no memory for another slab
+static struct connection *
+conn_alloc(void)
+{
+  struct connection *c;
+
+  if (conn_free_list == NULL) {
+    conn_pool_refill();
+    if (conn_free_list == NULL) {
+      return NULL;
+    }
+  }
+  c              = conn_free_list;
+  conn_free_list = c->next;
+  conn_free_count--;
+  c->next        = NULL;
+  return c;
+}
+
+static void
+conn_free(struct connection *c)
+{
+  int i;
+
+  c->gen++;
+  c->next        = conn_free_list;
+  conn_free_list = c;
+  if (++conn_free_count < 2 * CONN_BATCH) {
+    return;
+  }
+
+  // Hand a batch back, for the threads that allocate
+  pthread_mutex_lock(&conn_pool.lock);
+  for (i = 0; i < CONN_BATCH; i++) {
+    c              = conn_free_list;
+    conn_free_list = c->next;
+    c->next        = conn_pool.free;
+    conn_pool.free = c;
+    conn_free_count--;
+    conn_pool.num_free++;
+  }
+  pthread_mutex_unlock(&conn_pool.lock);
+}
+
+// Work queue implementation:
+//
+// The queue holds accepted connections, linked through their own structs,
+// so queueing one allocates nothing.
 
 struct work_queue {
-  pthread_mutex_t          lock;
-  struct work_queue_elem  *head;
-  int                      should_exit;
-  int                      worker_waiting;
-  pthread_cond_t           worker_cv;
+  pthread_mutex_t     lock;
+  struct connection  *head;
+  int                 depth;
+  int                 max_depth;   // Shed load beyond this; 0 = no limit
+  int                 should_exit;
+  int                 worker_waiting;
+  pthread_cond_t      worker_cv;
 };
 
 static struct work_queue *
@@ -58,6 +243,8 @@ wq_init(void)
   struct work_queue *wq = malloc(sizeof(struct work_queue));
 
   wq->head           = NULL;
+  wq->depth          = 0;
+  wq->max_depth      = 0;
   wq->should_exit    = 0;
   wq->worker_waiting = 0;
 
@@ -67,53 +254,56 @@ wq_init(void)
   return wq;
 }
 
-static void
-wq_add(struct work_queue* wq, int connection_fd)
+// Returns -1 if the connection was not queued, either because the server
+// is shutting down or because the queue is already too deep for it to be
+// served in reasonable time.
+static int
+wq_add(struct work_queue* wq, struct connection *c)
 {
-  pthread_mutex_lock(&wq->lock);
-  if (!wq->should_exit) {
-    struct work_queue_elem  *wqe = malloc(sizeof(struct work_queue_elem));
+  int rc = -1;
 
-    wqe->fd   = connection_fd;
-    wqe->next = wq->head;
-
-    wq->head = wqe;
+  pthread_mutex_lock(&wq->lock);
+  if (!wq->should_exit &&
+      (wq->max_depth == 0 || wq->depth < wq->max_depth)) {
+    c->next  = wq->head;
+    wq->head = c;
+    wq->depth++;
+    rc = 0;
 
     if (wq->worker_waiting) {
       pthread_cond_signal(&wq->worker_cv);
     }
   }
   pthread_mutex_unlock(&wq->lock);
+  return rc;
 }
 
-static int
+// Returns NULL once the server is shutting down
+static struct connection *
 wq_get(struct work_queue *wq)
 {
-  int                      fd;
-  struct work_queue_elem  *wqe;
+  struct connection *c;
 
   pthread_mutex_lock(&wq->lock);
 
   while (wq->head == NULL) {
     if (wq->should_exit) {
       pthread_mutex_unlock(&wq->lock);
-      return -1;
+      return NULL;
     }
 
     wq->worker_waiting++;
     pthread_cond_wait(&wq->worker_cv, &wq->lock);
     wq->worker_waiting--;
   }
-  wqe      = wq->head;
-  wq->head = wqe->next;
+  c        = wq->head;
+  wq->head = c->next;
+  wq->depth--;
 
   pthread_mutex_unlock(&wq->lock);
 
-  fd = wqe->fd;
-
-  free(wqe);
-
-  return fd;
+  c->next = NULL;
+  return c;
 }
 
 static int
@@ -136,468 +326,6116 @@ wq_shutdown(struct work_queue *wq)
   pthread_mutex_unlock(&wq->lock);
 }
 
-static int
-create_socket(void)
-{
-  int                 fd;
-  struct sockaddr_in  addr;
+// Admission control:
+//
+// The listeners decide whether to serve a connection as soon as it is
+// accepted, before it reaches the work queue. A connection is refused if
+// the server already has max_conns connections open, if its client has
+// exceeded its connection rate, or (in wq_add) if the queue is too deep.
+// Refusal is a single non-blocking write of a canned response, so the
+// listeners keep up even under a connection flood.
+//
+// Per-client rates are enforced with token buckets kept in a hash table
+// keyed on the client's address. The table is split into shards, each with
+// its own lock, so listeners rarely contend. Each shard is a fixed-size
+// open-addressed table: when a new client finds no free slot nearby, it
+// takes over the slot that has been idle longest, whose bucket would have
+// refilled anyway. That ages out old clients without a sweeper thread.
 
-  fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (fd == -1) {
-    perror("Unable to create socket");
-    return -1;
-  }
+#define RL_SHARDS       64
+#define RL_SLOTS        1024    // Per shard
+#define RL_PROBE        8
 
-  addr.sin_family      = AF_INET;
-  addr.sin_port        = htons(8080);
-  addr.sin_addr.s_addr = INADDR_ANY;
+struct rl_entry {
+  uint64_t  key[2];
+  int64_t   last_ms;            // Time of last refill; 0 = unused
+  int64_t   tokens;             // In thousandths of a connection
+};
 
-  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
-    perror("Unable to bind to port");
-    return -1;
-  }
+struct rl_shard {
+  pthread_mutex_t  lock;
+  struct rl_entry  slots[RL_SLOTS];
+};
 
-  if (listen(fd, 4) == -1) {
-    perror("Unable to listen for connections");
-    return -1;
-  }
+struct admission {
+  int               rate;       // Connections/second per client; 0 = off
+  int               burst;
+  int               max_conns;  // 0 = no limit
+  atomic_int        active;
+  atomic_ulong      rejected_rate;
+  atomic_ulong      rejected_conns;
+  atomic_ulong      rejected_queue;
+  struct rl_shard  *shards;
+};
 
-  return fd;
-}
+static struct admission admission;
 
-static int
-send_response(int fd, const char *data, size_t datalen)
+static const char response_429[] =
+  "HTTP/1.1 429 Too Many Requests\r\n"
+  "Retry-After: 1\r\n"
+  "Content-Length: 0\r\n"
+  "Connection: close\r\n"
+  "\r\n";
+
+static const char response_503[] =
+  "HTTP/1.1 503 Service Unavailable\r\n"
+  "Retry-After: 1\r\n"
+  "Content-Length: 0\r\n"
+  "Connection: close\r\n"
+  "\r\n";
+
+static int64_t
+coarse_now_ms(void)
 {
-  size_t  offset = 0;
-  ssize_t wrote  = 0;
-#ifdef __APPLE__
-  int flags = 0;  // macOS doesn't support MSG_NOSIGNAL
+  struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
 #else
-  int flags = MSG_NOSIGNAL;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
 #endif
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-  do {
-    if ((wrote = send(fd, data + offset, datalen - offset, flags)) == -1) {
-      return -1;
-    } else {
-      offset += (size_t) wrote;
+static void
+admission_init(struct admission *adm)
+{
+  int i;
+
+  atomic_init(&adm->active, 0);
+  atomic_init(&adm->rejected_rate, 0);
+  atomic_init(&adm->rejected_conns, 0);
+  atomic_init(&adm->rejected_queue, 0);
+  adm->shards = NULL;
+
+  if (adm->rate > 0) {
+    if (adm->burst < 1) {
+      adm->burst = adm->rate;
     }
-  } while (offset < datalen);
+    adm->shards = calloc(RL_SHARDS, sizeof(struct rl_shard));
+    for (i = 0; i < RL_SHARDS; i++) {
+      pthread_mutex_init(&adm->shards[i].lock, NULL);
+    }
+  }
+}
 
-  return 0;
+// Key clients by IPv4 address, or by IPv6 /64 prefix, since a single IPv6
+// host can easily use many addresses within its subnet. IPv4-mapped
+// addresses from a dual-stack socket are keyed as IPv4.
+static void
+rl_key(const struct sockaddr_storage *sa, uint64_t key[2])
+{
+  key[0] = key[1] = 0;
+  if (sa->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) sa;
+
+    if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+      memcpy(&key[1], &sin6->sin6_addr.s6_addr[12], 4);
+    } else {
+      memcpy(&key[0], &sin6->sin6_addr.s6_addr[0], 8);
+      key[1] = 1;
+    }
+  } else {
+    memcpy(&key[1], &((const struct sockaddr_in *) sa)->sin_addr, 4);
+  }
 }
 
 static int
-send_response_200(int fd, char *filename, int inf, int id)
+rl_allow(struct admission *adm, const struct sockaddr_storage *sa)
 {
-  // File exists, send OK response:
-  struct stat  fs;
-  char        *extn;
-  char         headers[BUFLEN];
-  char         buf[BUFLEN];
-  ssize_t      rlen;
+  uint64_t          key[2];
+  uint64_t          h;
+  int64_t           now = coarse_now_ms();
+  int64_t           max_tokens = (int64_t) adm->burst * 1000;
+  struct rl_shard  *shard;
+  struct rl_entry  *e = NULL, *victim = NULL;
+  unsigned int      i, slot;
+  int               allow;
 
-  // Find file size, and generate Content-Length:
-  fstat(inf, &fs);
-  sprintf(buf, "Content-Length: %d\r\n", (int) fs.st_size);
-
-  // Generate and send Content-Type: based on the extension
-  extn = strrchr(filename, '.');
-  if (extn == NULL) {
-    // No extension on the requested filename
-    sprintf(headers, "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n%s\r\n", buf);
-  } else if (strcmp(extn, ".html") == 0) {
-    sprintf(headers, "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n%s\r\n", buf);
-  } else if (strcmp(extn, ".htm") == 0) {
-    sprintf(headers, "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n%s\r\n", buf);
-  } else if (strcmp(extn, ".css") == 0) {
-    sprintf(headers, "HTTP/1.1 200 OK\r\nContent-Type: text/css\r\n%s\r\n", buf);
-  } else if (strcmp(extn, ".txt") == 0) {
-    sprintf(headers, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n%s\r\n", buf);
-  } else if (strcmp(extn, ".jpg") == 0) {
-    sprintf(headers, "HTTP/1.1 200 OK\r\nContent-Type: image/jpeg\r\n%s\r\n", buf);
-  } else if (strcmp(extn, ".jpeg") == 0) {
-    sprintf(headers, "HTTP/1.1 200 OK\r\nContent-Type: image/jpeg\r\n%s\r\n", buf);
-  } else {
-    // Unknown extension
-    sprintf(headers, "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n%s\r\n", buf);
+  rl_key(sa, key);
+  h  = (key[0] ^ (key[1] * 0x9e3779b97f4a7c15ull)) * 0xff51afd7ed558ccdull;
+  h ^= h >> 32;
+
+  shard = &adm->shards[h % RL_SHARDS];
+  slot  = (unsigned int) (h / RL_SHARDS);
+
+  pthread_mutex_lock(&shard->lock);
+  for (i = 0; i < RL_PROBE; i++) {
+    struct rl_entry *cand = &shard->slots[(slot + i) % RL_SLOTS];
+
+    if (cand->last_ms != 0 && cand->key[0] == key[0] &&
+        cand->key[1] == key[1]) {
+      e = cand;
+      break;
+    }
+    if (victim == NULL || cand->last_ms < victim->last_ms) {
+      victim = cand;
+    }
+  }
+  if (e == NULL) {
+    e = victim;
+    e->key[0]  = key[0];
+    e->key[1]  = key[1];
+    e->tokens  = max_tokens;
+    e->last_ms = now;
   }
 
-  if (send_response(fd, headers, strlen(headers)) == -1) {
-    return -1;
+  // Refill at rate tokens per second, which is rate thousandths per ms
+  e->tokens += (now - e->last_ms) * adm->rate;
+  if (e->tokens > max_tokens) {
+    e->tokens = max_tokens;
   }
+  e->last_ms = now > 0 ? now : 1;
 
-  // Send the requested file
-  while ((rlen = read(inf, buf, BUFLEN)) > 0) {
-    // The cast from ssize_t to size_t is safe, since the previous line
-    // demonstrates that the value is non-negative.
-    // MINOR FIX: Use the var rlen
-    if (send_response(fd, buf, rlen) == -1) {
-      return -1;
-    }
+  if ((allow = (e->tokens >= 1000))) {
+    e->tokens -= 1000;
   }
+  pthread_mutex_unlock(&shard->lock);
 
-  printf("responder %d: 200 %s (%d bytes)\n", id, filename, (int) fs.st_size);
-  return 0;
+  return allow;
 }
 
-// EXTENSION
-static int
-send_response_200_listing(int fd, DIR *dir, char *filename, int id)
-{
-
-  // Print listing of the contents of the directory
-  char *buffer = NULL;
-  char *content = NULL;
-  int filename_size = strlen(filename);
-  int d_entry_size = 0;
-  int line_size = 0;
-  int total_size = 1;
-  struct dirent *entry;
-
-  // Read dir entry by entry
-  while ((entry = readdir(dir)) != NULL) {
-    d_entry_size = strlen(entry->d_name);
-    // Calculate the size of each list element
-    line_size = 27 + filename_size + d_entry_size*2;
-    // Increase the total size of the content
-    total_size += line_size;
-    if ((content = realloc(content, total_size)) == NULL) {
-      return -1;
-    }
-    // Add the new list element to the content
-    sprintf(content + total_size - line_size - 1,
-            "<li><a href=\"%s/%s\">%s</a></li>\r\n",
-            filename, entry->d_name, entry->d_name);
-  }
+static void
+reject_connection(int fd, int tls, const char *response, size_t len)
+{
+  // Best effort: a client that isn't reading simply loses the response.
+  // TLS clients can't read a plaintext response, so they just see a close.
+#ifdef __APPLE__
+  int flags = MSG_DONTWAIT;  // macOS doesn't support MSG_NOSIGNAL
+#else
+  int flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+#endif
 
-  if ((buffer = (char*)malloc(total_size + 96 + 62 + 5)) == NULL) {
-    return -1;
+  if (!tls) {
+    (void) send(fd, response, len, flags);
   }
+  close(fd);
+}
 
-  printf("responder %d: 200 %s\n", id, filename);
-
-  // Add content to buffer
-  sprintf(buffer, "HTTP/1.1 200 OK\r\n"
-                  "Content-Length: %d\r\n"
-                  "Content-Type: text/html\r\n"
-                  "\r\n"
-                  "<html>\r\n"                                     //   8
-                  "<head>\r\n"                                     //   8
-                  "<title>Directory Listings</title>\r\n"          //   35
-                  "</head>\r\n"                                    //   9
-                  "<body>\r\n"                                     //   8
-                  "<ul>%s</ul>\r\n"                                //   11 + total_size - 1
-                  "</body>\r\n"                                    //   9
-                  "</html>\r\n",                                   //   9
-          96 + total_size, content);                               // total: 96 + total_size
-  
-  free(content);
+// Decide whether to serve a newly accepted connection, and queue it if so.
+static void
+admit_connection(struct work_queue *wq, int fd, int tls,
+                 const struct sockaddr_storage *caddr)
+{
+  struct admission   *adm = &admission;
+  struct connection  *c;
 
-  // Send the generated response
-  if (send_response(fd, buffer, strlen(buffer)) == -1) {
-    free(buffer);
-    return -1;
+  if (adm->max_conns > 0 && atomic_load(&adm->active) >= adm->max_conns) {
+    atomic_fetch_add(&adm->rejected_conns, 1);
+    reject_connection(fd, tls, response_503, sizeof(response_503) - 1);
+    return;
+  }
+  if (adm->rate > 0 && !rl_allow(adm, caddr)) {
+    atomic_fetch_add(&adm->rejected_rate, 1);
+    reject_connection(fd, tls, response_429, sizeof(response_429) - 1);
+    return;
   }
 
-  free(buffer);
+  if ((c = conn_alloc()) == NULL) {
+    atomic_fetch_add(&adm->rejected_conns, 1);
+    reject_connection(fd, tls, response_503, sizeof(response_503) - 1);
+    return;
+  }
+  c->fd  = fd;
+  c->tls = tls;
 
-  return 0;
+  atomic_fetch_add(&adm->active, 1);
+  if (wq_add(wq, c) == -1) {
+    conn_free(c);
+    atomic_fetch_sub(&adm->active, 1);
+    atomic_fetch_add(&adm->rejected_queue, 1);
+    reject_connection(fd, tls, response_503, sizeof(response_503) - 1);
+  }
 }
 
-// EXTENSION
+// CPU placement:
+//
+// By default every thread floats, and all listeners feed one work queue.
+// On a machine with several NUMA nodes, a connection is then often
+// accepted on one node and served on another, and every access to its
+// buffers crosses the interconnect. With -A, the server is laid out to
+// match the machine instead: each node gets its own work queue and its
+// own listening socket on every address (bound with SO_REUSEPORT, so the
+// kernel shares out connections between them), and its listener and
+// responders are pinned to its CPUs, one core per responder. A connection
+// accepted on a node is served on that node.
+//
+// Memory follows without libnuma, because Linux places a page on the node
+// of the CPU that first touches it. Responders pin themselves before
+// allocating their connection buffers, and each node's work queue and
+// threads are created while main runs on that node, so the thread stacks
+// and the per-thread caches in them start out local too.
+//
+// The topology comes from /sys/devices/system/node, restricted to the
+// CPUs we are allowed to run on. Without it (or without -A) the server
+// runs as a single node.
+
+#define MAX_NODES      8
+#define MAX_NODE_CPUS  256
+
+struct numa_node {
+  int                 id;                  // The kernel's node number
+  int                 ncpus;
+  int                 cpus[MAX_NODE_CPUS];
+  int                 first_responder;     // Responders are numbered
+  int                 num_responders;      // contiguously by node
+  struct work_queue  *wq;
+};
+
+struct placement {
+  int               pin;
+  int               num_nodes;
+  struct numa_node  nodes[MAX_NODES];
+};
+
+static struct placement placement;
+
+#ifdef __linux__
+// Parse a kernel CPU list, such as "0-3,8-11", keeping only CPUs in allowed
 static int
-send_response_307(int fd, char *filename, int id)
+parse_cpulist(const char *list, const cpu_set_t *allowed, int *cpus,
+              int maxcpus)
 {
-  
-  // Redirect to index.html
-  char buffer[65535];
-  
-  printf("responder %d: 307 %s\n", id, filename);
+  int n = 0;
 
-  sprintf(buffer, "HTTP/1.1 307 Temporary Redirect\r\n"
-                  "Location: %s\r\n"
-                  "Content-Length: 143\r\n"
-                  "Content-Type: text/html\r\n"
-                  "\r\n"
-                  "<html>\r\n"                                     //   8
-                  "<head>\r\n"                                     //   8
-                  "<title>Redirected</title>\r\n"                  //  27
-                  "</head>\r\n"                                    //   9
-                  "<body>\r\n"                                     //   8
-                  "<p>Redirecting ...</p>\r\n"                     //  24
-                  "</body>\r\n"                                    //   9
-                  "</html>\r\n",                                   //   9
-         filename);                                                // total: 102
+  while (*list != '\0' && *list != '\n') {
+    char *end;
+    long  lo = strtol(list, &end, 10), hi = lo, cpu;
 
-  return send_response(fd, buffer, strlen(buffer));
+    if (end == list) {
+      break;
+    }
+    if (*end == '-') {
+      list = end + 1;
+      hi   = strtol(list, &end, 10);
+    }
+    for (cpu = lo; cpu <= hi && n < maxcpus; cpu++) {
+      if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, allowed)) {
+        cpus[n++] = (int) cpu;
+      }
+    }
+    list = *end == ',' ? end + 1 : end;
+  }
+  return n;
 }
 
-static int
-send_response_404(int fd, char *filename, int id)
+static void
+pin_thread(const int *cpus, int ncpus)
 {
-  // Requested file doesn't exist, send an error
-  char buffer[65535];
-  
-  printf("responder %d: 404 %s\n", id, filename);
+  cpu_set_t  set;
+  int        i;
 
-  sprintf(buffer, "HTTP/1.1 404 File Not Found\r\n"
-                  "Content-Type: text/html\r\n"
-                  "Content-Length: 113\r\n"
-                  "\r\n"
-                  "<html>\r\n"                              //  8
-                  "<head>\r\n"                              //  8
-                  "<title> 404 File Not Found </title>\r\n" // 37
-                  "</head>\r\n"                             //  9
-                  "<body>\r\n"                              //  8
-                  "<p> File not found </p>\r\n"             // 25
-                  "</body>\r\n"                             //  9
-                  "</html>\r\n"                             //  9
-         );                                                 // 113 total
- 
-  return send_response(fd, buffer, strlen(buffer));
+  CPU_ZERO(&set);
+  for (i = 0; i < ncpus; i++) {
+    CPU_SET(cpus[i], &set);
+  }
+  if ((errno = pthread_setaffinity_np(pthread_self(), sizeof(set),
+                                      &set)) != 0) {
+    perror("Unable to set CPU affinity");
+  }
 }
+#endif
 
-static int
-send_response_500(int fd, char *filename, int id)
+static void
+placement_init(struct placement *pl)
 {
-  // Internal server error, sent whenever something unexpected is received.
-  char buffer[65535];
+  struct numa_node  *node = &pl->nodes[0];
+  int                i;
 
-  printf("responder %d: 500 %s\n", id, filename);
+  pl->num_nodes = 1;
+  node->id      = 0;
+  node->ncpus   = 0;
+#ifdef __linux__
+  if (pl->pin) {
+    cpu_set_t  allowed;
+    char       path[64], list[1024];
+    FILE      *f;
 
-  sprintf(buffer, "HTTP/1.1 500 Internal Server Error\r\n"
-                  "Content-Type: text/html\r\n"
-                  "Content-Length: 120\r\n"
-                  "Connection: close\r\n"
-                  "\r\n"
-                  "<html>\r\n"                                     //   8
-                  "<head>\r\n"                                     //   8
-                  "<title> 500 Internal Server Error </title>\r\n" //  44
-                  "</head>\r\n"                                    //   9
-                  "<body>\r\n"                                     //   8
-                  "<p> Internal Error </p>\r\n"                    //  25
-                  "</body>\r\n"                                    //   9
-                  "</html>\r\n"                                    //   9
-         );                                                        // total: 120 
-
-  return send_response(fd, buffer, strlen(buffer));
-}
-
-static int
-hostname_matches(char *headers)
-{
-  char  *host; 
-  char  *colonpos;
-  char   hostname[256];
-  char   myhostname[256];
-  char   domainname[256];
-
-  // Parse the HTTP headers, to find and validate the "Host:" header.
-  // Note that we search for a newline followed by "Host:", to avoid
-  // matching other headers that end in "Host:".
-  host = strstr(headers, "\nHost:");
-  if ((host == NULL) || (sscanf(host, "\nHost: %255s\n", hostname) != 1)) {
-    printf("Cannot parse HTTP Host: Header\n");
-    return 0;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    pl->num_nodes = 0;
+    for (i = 0; i < 1024 && pl->num_nodes < MAX_NODES; i++) {
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+               i);
+      if ((f = fopen(path, "r")) == NULL) {
+        continue;
+      }
+      node = &pl->nodes[pl->num_nodes];
+      if (fgets(list, sizeof(list), f) != NULL &&
+          (node->ncpus = parse_cpulist(list, &allowed, node->cpus,
+                                       MAX_NODE_CPUS)) > 0) {
+        node->id = i;
+        pl->num_nodes++;     // Nodes with memory but no CPUs are left out
+      }
+      fclose(f);
+    }
+    if (pl->num_nodes == 0) {
+      // No NUMA information: one node with every CPU we may use
+      node        = &pl->nodes[0];
+      node->id    = 0;
+      node->ncpus = 0;
+      for (i = 0; i < CPU_SETSIZE && node->ncpus < MAX_NODE_CPUS; i++) {
+        if (CPU_ISSET(i, &allowed)) {
+          node->cpus[node->ncpus++] = i;
+        }
+      }
+      pl->num_nodes = 1;
+    }
   }
+#else
+  if (pl->pin) {
+    printf("CPU affinity isn't supported on this platform; ignoring -A\n");
+    pl->pin = 0;
+  }
+#endif
 
-  // When running on a non-standard port, browsers include a colon 
-  // and the port number in the "Host:" header. Strip this out.
-  if ((colonpos = strchr(hostname, ':')) != NULL) {
-    *colonpos = '\0';
-  }
-
-  gethostname(myhostname, 256);
-  if (strcmp(hostname, myhostname) != 0) {
-    // The hostname in the request didn't match the return from gethostname().
-    // There are three possible reasons for this:
-    // 1) The hostname in the request doesn't match our hostname
-    // 2) The hostname in the request doesn't include the domain name, but
-    //    gethostname() on this machine does (gethostname() works this way
-    //    on MacOS X)
-    // 3) The hostname in the request might include the full domain name, 
-    //    while gethostname() on this machine returns only the host part
-    //    (this is how gethostname() works on Linux)
-    // Cases (2) and (3) are okay, and should be accepted, so we check for
-    // these now.
-    char  myNameDom[512];
-    char  reNameDom[512];
-
-    getdomainname(domainname, 256);
-    sprintf(myNameDom, "%s.%s", myhostname, domainname);
-    sprintf(reNameDom, "%s.%s", hostname, domainname);
-
-    if ((strcmp(hostname, myNameDom) != 0) && 
-       (strcmp(reNameDom, myhostname) == 0))
-    {
-      return 0;
-    }
+  // Share the responders out between the nodes
+  for (i = 0; i < pl->num_nodes; i++) {
+    pl->nodes[i].first_responder = i * num_threads / pl->num_nodes;
+    pl->nodes[i].num_responders  = (i + 1) * num_threads / pl->num_nodes -
+                                   pl->nodes[i].first_responder;
   }
-  return 1;
 }
 
-static char *
-read_headers(int fd)
+// Run the calling thread on a node's CPUs, if we are pinning at all
+static void
+placement_enter(const struct placement *pl, const struct numa_node *node)
 {
-  char     buf[BUFLEN];
-  char    *headers   = malloc(1);
-  size_t   headerLen = 0;
-  ssize_t  rlen;
+#ifdef __linux__
+  if (pl->pin) {
+    pin_thread(node->cpus, node->ncpus);
+  }
+#else
+  (void) pl;
+  (void) node;
+#endif
+}
 
-  headers[0] = '\0';
-  while (strstr(headers, "\r\n\r\n") == NULL) {
-    rlen = recv(fd, buf, BUFLEN, 0);
-    if (rlen ==  0) { 
-      // Connection closed by client
-      free(headers);
-      return NULL;
-    } else if (rlen < 0)  {
-      free(headers);
-      perror("Cannot read HTTP request");
-      return NULL;
-    } else {
-      // The cast is safe, since we've checked rlen is non-negative
-      headerLen += (size_t) rlen;
-      headers = realloc(headers, headerLen + 1);
-      strncat(headers, buf, (size_t) rlen);
-    }
+// The CPU a responder should be pinned to, or -1 to let it float
+static int
+placement_cpu(const struct placement *pl, const struct numa_node *node,
+              int id)
+{
+  if (!pl->pin) {
+    return -1;
+  }
+  return node->cpus[(id - node->first_responder) % node->ncpus];
+}
 
-    if (shutdown_requested) {
-      printf("shutdown requested\n");
-      return NULL;
-    }
+static void
+placement_print(const struct placement *pl)
+{
+  int i, j;
+
+  if (!pl->pin) {
+    printf("placement: %d responders, not pinned\n", num_threads);
+    return;
   }
+  for (i = 0; i < pl->num_nodes; i++) {
+    const struct numa_node *node = &pl->nodes[i];
 
-  return headers;
+    printf("placement: node %d: responders %d-%d on CPUs", node->id,
+           node->first_responder,
+           node->first_responder + node->num_responders - 1);
+    for (j = 0; j < node->num_responders; j++) {
+      printf(" %d", placement_cpu(pl, node, node->first_responder + j));
+    }
+    printf(" (of %d)\n", node->ncpus);
+  }
 }
 
-struct response_params {
-  struct work_queue *wq;
-  int                id;
+// Listening socket setup:
+
+#define MAX_LISTENERS  16
+
+struct listen_config {
+  const char  *hosts[MAX_LISTENERS];  // Addresses to bind; NULL = wildcard
+  int          num_hosts;
+  const char  *port;
+  const char  *tls_port;              // Port for TLS listeners, or NULL
+  int          family;                // AF_UNSPEC, AF_INET or AF_INET6
+  int          dual_stack;            // Serve IPv4 via a single :: socket
+  int          backlog;
+  int          num_nodes;             // Sockets per address, one per node
 };
 
-static void *
-response_thread(void *arg)
+struct listener {
+  int                 fd;
+  int                 tls;
+  int                 node;           // Index into placement.nodes
+  char                name[INET6_ADDRSTRLEN + 8];
+  struct work_queue  *wq;
+  pthread_t           thread;
+};
+
+static void
+format_sockaddr(const struct sockaddr *sa, char *name, size_t namelen)
 {
-  struct response_params *params = (struct response_params *) arg;
-  struct work_queue      *wq = params->wq;
-  int                     id = params->id;
-  int                     fd;
+  char  host[INET6_ADDRSTRLEN];
 
-  printf("responder %d: created\n", id);
+  if (sa->sa_family == AF_INET6) {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) sa;
+    inet_ntop(AF_INET6, &sin6->sin6_addr, host, sizeof(host));
+    snprintf(name, namelen, "[%s]:%d", host, ntohs(sin6->sin6_port));
+  } else {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *) sa;
+    inet_ntop(AF_INET, &sin->sin_addr, host, sizeof(host));
+    snprintf(name, namelen, "%s:%d", host, ntohs(sin->sin_port));
+  }
+}
 
-  while ((fd = wq_get(wq)) != -1) {
-    printf("responder %d: connection opened\n", id);
-    while (1) {
-      char    *headers = NULL;
-      char     basename[1024];
-      char     filename[1024+8];
-      int      inf;
-      DIR     *dir;
+static int
+create_socket(const struct addrinfo *ai, const struct listen_config *cfg)
+{
+  int  fd;
+  int  opt = 1;
 
-      // Retrieve the request
-      if ((headers = read_headers(fd)) == NULL) {
-        break;
-      }
+  fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+  if (fd == -1) {
+    perror("Unable to create socket");
+    return -1;
+  }
+
+  // Allow a restarted server to rebind while old connections sit in
+  // TIME_WAIT.
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
+    perror("Unable to set SO_REUSEADDR");
+  }
+
+  // Each node has its own socket on the address, which the kernel
+  // balances connections across.
+  if (cfg->num_nodes > 1 &&
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
+    perror("Unable to set SO_REUSEPORT");
+  }
+
+  // An IPv6 socket accepts IPv4-mapped connections unless IPV6_V6ONLY is
+  // set. Leave it clear when asked for dual-stack operation, so that one
+  // [::] socket serves both families; otherwise set it, so that a separate
+  // IPv4 socket can bind the same port.
+  if (ai->ai_family == AF_INET6) {
+    opt = !cfg->dual_stack;
+    if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt)) == -1) {
+      perror("Unable to set IPV6_V6ONLY");
+    }
+  }
+
+  if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+    perror("Unable to bind to port");
+    close(fd);
+    return -1;
+  }
+
+  if (listen(fd, cfg->backlog) == -1) {
+    perror("Unable to listen for connections");
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+// Resolve each configured host with getaddrinfo(), and create a listening
+// socket on the given port for every address returned. A NULL host with
+// AI_PASSIVE yields the wildcard addresses, usually both [::] and 0.0.0.0.
+// With more than one NUMA node, each address gets a socket per node.
+// Returns the number of listeners created.
+static int
+create_listeners(const struct listen_config *cfg, const char *port, int tls,
+                 struct listener *ls, int maxls)
+{
+  struct addrinfo  hints, *ai, *ai0;
+  int              h, n = 0;
+  int              num_hosts = cfg->num_hosts > 0 ? cfg->num_hosts : 1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family   = cfg->dual_stack ? AF_INET6 : cfg->family;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags    = AI_PASSIVE | AI_NUMERICSERV;
+
+  for (h = 0; h < num_hosts; h++) {
+    const char *host = cfg->num_hosts > 0 ? cfg->hosts[h] : NULL;
+    int         err;
+
+    if ((err = getaddrinfo(host, port, &hints, &ai0)) != 0) {
+      printf("listener: cannot resolve %s: %s\n", host ? host : "*",
+             gai_strerror(err));
+      continue;
+    }
+
+    for (ai = ai0; ai != NULL && n < maxls; ai = ai->ai_next) {
+      int fd, node;
+
+      // In dual-stack mode the single [::] socket also covers 0.0.0.0
+      if (cfg->dual_stack && ai->ai_family != AF_INET6) {
+        continue;
+      }
+      for (node = 0; node < cfg->num_nodes && n < maxls; node++) {
+        if ((fd = create_socket(ai, cfg)) == -1) {
+          break;
+        }
+        ls[n].fd   = fd;
+        ls[n].tls  = tls;
+        ls[n].node = node;
+        format_sockaddr(ai->ai_addr, ls[n].name, sizeof(ls[n].name));
+        n++;
+      }
+    }
+
+    freeaddrinfo(ai0);
+  }
+
+  return n;
+}
+
+// Connection I/O. A connection is either a plain TCP socket, or a TLS
+// session layered over one when the server is built with WITH_TLS.
+
+#define REQ_BUFLEN       8192
+#define HEAD_CACHE_RESP  512
+#define IDLE_TIMEOUT_MS  5000   // Close connections that go quiet this long
+
+#ifdef WITH_TLS
+static SSL_CTX *tls_ctx = NULL;
+
+// ALPN: offer HTTP/2 to clients that support it, and HTTP/1.1 otherwise
+static int
+tls_alpn_select(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                const unsigned char *in, unsigned int inlen, void *arg)
+{
+  static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+
+  (void) ssl;
+  (void) arg;
+  if (SSL_select_next_proto((unsigned char **) out, outlen, protocols,
+                            sizeof(protocols) - 1, in, inlen) !=
+      OPENSSL_NPN_NEGOTIATED) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  return SSL_TLSEXT_ERR_OK;
+}
+
+static int
+tls_init(const char *cert_file, const char *key_file)
+{
+  SSL_CTX *ctx;
+
+  if ((ctx = SSL_CTX_new(TLS_server_method())) == NULL) {
+    ERR_print_errors_fp(stderr);
+    return -1;
+  }
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+  if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+      SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(ctx) != 1) {
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(ctx);
+    return -1;
+  }
+
+  // Ask OpenSSL to hand the record layer to the kernel once the handshake
+  // completes. If the kernel supports it, sendfile() then works on the TLS
+  // socket and file data never passes through userspace.
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+
+  // Returning clients should resume rather than repeat the full handshake.
+  // Stateless session tickets cover TLS 1.2 and 1.3 clients; the server-side
+  // cache covers TLS 1.2 clients that resume by session ID instead.
+  SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+  SSL_CTX_set_num_tickets(ctx, 2);
+  SSL_CTX_set_session_id_context(ctx, (const unsigned char *) "wserver", 7);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(ctx, 20480);
+  SSL_CTX_set_timeout(ctx, 3600);
+
+  SSL_CTX_set_alpn_select_cb(ctx, tls_alpn_select, NULL);
+
+  tls_ctx = ctx;
+  return 0;
+}
+
+static int
+tls_accept(struct connection *c, int id)
+{
+  if ((c->ssl = SSL_new(tls_ctx)) == NULL) {
+    return -1;
+  }
+  SSL_set_fd(c->ssl, c->fd);
+
+  if (SSL_accept(c->ssl) != 1) {
+    printf("responder %d: TLS handshake failed\n", id);
+    ERR_clear_error();
+    return -1;
+  }
+
+  c->ktls_send = BIO_get_ktls_send(SSL_get_wbio(c->ssl));
+  {
+    const unsigned char  *alpn;
+    unsigned int          alpn_len;
+
+    SSL_get0_alpn_selected(c->ssl, &alpn, &alpn_len);
+    c->h2 = (alpn_len == 2 && memcmp(alpn, "h2", 2) == 0);
+  }
+  printf("responder %d: %s %s%s%s\n", id, SSL_get_version(c->ssl),
+         SSL_get_cipher_name(c->ssl),
+         SSL_session_reused(c->ssl) ? ", resumed" : "",
+         c->ktls_send ? ", kTLS" : "");
+  return 0;
+}
+#endif
+
+static int
+conn_open(struct connection *c, char *in, int id)
+{
+  c->head      = 0;
+  c->http10    = 0;
+  c->close     = 0;
+  c->h2        = 0;
+  c->capture   = NULL;
+  c->in        = in;
+  c->in_len    = 0;
+  c->out       = NULL;
+  c->may_queue = 0;
+  c->nonblock  = 0;
+#ifdef WITH_TLS
+  c->ssl       = NULL;
+  c->ktls_send = 0;
+  if (c->tls) {
+    return tls_accept(c, id);
+  }
+#else
+  (void) id;
+#endif
+  return 0;
+}
+
+static void
+conn_close(struct connection *c)
+{
+#ifdef WITH_TLS
+  if (c->ssl != NULL) {
+    SSL_shutdown(c->ssl);
+    SSL_free(c->ssl);
+    c->ssl = NULL;
+  }
+#endif
+  close(c->fd);
+}
+
+static int
+conn_tls(const struct connection *c)
+{
+#ifdef WITH_TLS
+  return c->ssl != NULL;
+#else
+  (void) c;
+  return 0;
+#endif
+}
+
+static ssize_t
+conn_recv(struct connection *c, char *buf, size_t len)
+{
+#ifdef WITH_TLS
+  if (c->ssl != NULL) {
+    int rlen = SSL_read(c->ssl, buf, (int) len);
+
+    if (rlen <= 0) {
+      int err = SSL_get_error(c->ssl, rlen);
+      ERR_clear_error();
+      return err == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+    }
+    return rlen;
+  }
+#endif
+  return recv(c->fd, buf, len, 0);
+}
+
+// Output queues:
+//
+// Responses used to be written with blocking sends, so a slow client held
+// its responder, and any file being sent to it, for as long as it took to
+// read the response, with no limit. Now responses to HTTP/1.x requests on
+// plain TCP are written without blocking, and once the socket's buffer is
+// full the rest goes onto an output queue for the connection: chunks of
+// OUT_CHUNK copied bytes, and references to ranges of files, resumed by
+// offset, which cost a descriptor but no memory. When the request is done
+// the connection is parked with the drainer thread, which waits with epoll
+// for the socket to take more, and the responder moves on to the next
+// connection. Once its queue is empty, the connection goes back on the work
+// queue for its next request, or is closed.
+//
+// The chunks queued across all connections are limited to OUT_BUDGET bytes.
+// Beyond that, and for a connection that can't be parked (one with more
+// input waiting, or anywhere but Linux), the responder writes the queue out
+// itself, as before. A parked connection that reads less than min_rate
+// bytes a second (-w) over OUT_WINDOW_MS is evicted, and so is one that a
+// responder waits on that long without progress. TLS connections and
+// HTTP/2 still use blocking writes.
+
+#define OUT_CHUNK      16384
+#define OUT_BUDGET     (64 << 20)     // Bytes in chunks, in total
+#define OUT_WINDOW_MS  10000
+#define OUT_MIN_RATE   1024           // Bytes a second, unless -w says
+#define OUT_EVENTS     64
+
+struct out_item {
+  struct out_item  *next;
+  int               fd;        // A range of this file, or -1 for a chunk
+  off_t             off;       // Next byte to send
+  off_t             end;
+  char              data[];    // OUT_CHUNK bytes, for a chunk
+};
+
+struct out_queue {
+  struct out_item    *head;
+  struct out_item    *tail;
+  struct connection  *c;
+  struct work_queue  *wq;            // To go back to once drained
+  struct out_queue   *prev;          // Among the parked
+  struct out_queue   *next;
+  int64_t             window_start;  // ms
+  off_t               window_sent;
+};
+
+static struct {
+  pthread_mutex_t     lock;
+  struct out_queue   *parked;
+  int                 epfd;
+  atomic_size_t       queued;        // Bytes in chunks, all connections
+  atomic_ulong        num_parked;
+  atomic_ulong        num_evicted;
+} drainer = { PTHREAD_MUTEX_INITIALIZER, NULL, -1, 0, 0, 0 };
+
+static int min_rate = OUT_MIN_RATE;   // -w; 0 never evicts
+
+static void
+conn_set_blocking(struct connection *c, int blocking)
+{
+  int flags = fcntl(c->fd, F_GETFL, 0);
+
+  fcntl(c->fd, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+  c->nonblock = !blocking;
+}
+
+// The connection's queue, made if need be, or NULL if memory ran out
+static struct out_queue *
+out_begin(struct connection *c)
+{
+  if (c->out == NULL) {
+    if ((c->out = calloc(1, sizeof(struct out_queue))) == NULL) {
+      return NULL;
+    }
+    c->out->c            = c;
+    c->out->window_start = coarse_now_ms();
+  }
+  if (!c->nonblock) {
+    conn_set_blocking(c, 0);
+  }
+  return c->out;
+}
+
+static void
+out_item_free(struct out_item *it)
+{
+  if (it->fd != -1) {
+    close(it->fd);
+  } else {
+    atomic_fetch_sub(&drainer.queued, OUT_CHUNK);
+  }
+  free(it);
+}
+
+// Drop whatever is still queued, and go back to blocking writes
+static void
+out_free(struct connection *c)
+{
+  struct out_item *it;
+
+  if (c->out != NULL) {
+    while ((it = c->out->head) != NULL) {
+      c->out->head = it->next;
+      out_item_free(it);
+    }
+    free(c->out);
+    c->out = NULL;
+  }
+  if (c->nonblock) {
+    conn_set_blocking(c, 1);
+  }
+}
+
+static void
+out_push_item(struct out_queue *q, struct out_item *it)
+{
+  it->next = NULL;
+  if (q->tail != NULL) {
+    q->tail->next = it;
+  } else {
+    q->head = it;
+  }
+  q->tail = it;
+}
+
+// Queue a copy of data. Returns 1, having queued nothing, if the chunks it
+// needs would take the queues over budget, or -1 if memory ran out.
+static int
+out_append(struct connection *c, const char *data, size_t len)
+{
+  struct out_queue  *q = out_begin(c);
+  struct out_item   *it;
+  size_t             n, room, need;
+
+  if (q == NULL) {
+    return -1;
+  }
+  it   = q->tail;
+  room = it != NULL && it->fd == -1 ? OUT_CHUNK - (size_t) it->end : 0;
+  need = len > room ? (len - room + OUT_CHUNK - 1) / OUT_CHUNK : 0;
+  if (atomic_fetch_add(&drainer.queued, need * OUT_CHUNK) + need * OUT_CHUNK >
+      OUT_BUDGET) {
+    atomic_fetch_sub(&drainer.queued, need * OUT_CHUNK);
+    return 1;
+  }
+
+  while (len > 0) {
+    if (it == NULL || it->fd != -1 || it->end == OUT_CHUNK) {
+      if ((it = malloc(sizeof(*it) + OUT_CHUNK)) == NULL) {
+        // The chunks already queued give back their share when freed
+        atomic_fetch_sub(&drainer.queued, need * OUT_CHUNK);
+        return -1;
+      }
+      need--;
+      it->fd  = -1;
+      it->off = it->end = 0;
+      out_push_item(q, it);
+    }
+    n = OUT_CHUNK - (size_t) it->end < len ? OUT_CHUNK - (size_t) it->end : len;
+    memcpy(it->data + it->end, data, n);
+    it->end += (off_t) n;
+    data    += n;
+    len     -= n;
+  }
+  return 0;
+}
+
+// Queue a range of a file, which may be closed once this returns
+static int
+out_append_file(struct connection *c, int inf, off_t offset, off_t end)
+{
+  struct out_queue  *q = out_begin(c);
+  struct out_item   *it;
+
+  if (q == NULL || (it = malloc(sizeof(*it))) == NULL) {
+    return -1;
+  }
+  if ((it->fd = dup(inf)) == -1) {
+    free(it);
+    return -1;
+  }
+  it->off = offset;
+  it->end = end;
+  out_push_item(q, it);
+  return 0;
+}
+
+// Send as much of the queue as the socket will take. Returns 1 once it is
+// all sent, 0 if the socket is full, and -1 on error.
+static int
+out_push(struct connection *c)
+{
+  struct out_queue  *q = c->out;
+  struct out_item   *it;
+  ssize_t            sent;
+#ifdef __APPLE__
+  int flags = 0;
+#else
+  int flags = MSG_NOSIGNAL;
+#endif
+
+  while ((it = q->head) != NULL) {
+    if (it->fd == -1) {
+      sent = send(c->fd, it->data + it->off, (size_t) (it->end - it->off),
+                  flags | MSG_DONTWAIT);
+      if (sent > 0) {
+        it->off += sent;
+      }
+    } else {
+#ifdef __linux__
+      sent = sendfile(c->fd, it->fd, &it->off, (size_t) (it->end - it->off));
+      if (sent == 0) {
+        it->off = it->end;  // File was truncated underneath us
+      }
+#else
+      char     buf[OUT_CHUNK];
+      ssize_t  rlen = pread(it->fd, buf, (size_t) (it->end - it->off) <
+                                         sizeof(buf) ?
+                                         (size_t) (it->end - it->off) :
+                                         sizeof(buf), it->off);
+
+      if (rlen <= 0) {
+        it->off = it->end;
+        continue;
+      }
+      sent = send(c->fd, buf, (size_t) rlen, flags | MSG_DONTWAIT);
+      if (sent > 0) {
+        it->off += sent;
+      }
+#endif
+    }
+    if (sent == -1) {
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    q->window_sent += sent;
+    if (it->off < it->end) {
+      continue;
+    }
+    q->head = it->next;
+    if (q->head == NULL) {
+      q->tail = NULL;
+    }
+    out_item_free(it);
+  }
+  return 1;
+}
+
+// Write the queue out here and now, waiting for the socket as long as it
+// keeps taking data
+static int
+out_flush(struct connection *c)
+{
+  struct pollfd  pfd = { c->fd, POLLOUT, 0 };
+  int            rc  = 0;
+
+  while (c->out != NULL && (rc = out_push(c)) == 0) {
+    if (poll(&pfd, 1, OUT_WINDOW_MS) <= 0) {
+      rc = -1;
+      break;
+    }
+  }
+  out_free(c);
+  return rc == -1 ? -1 : 0;
+}
+
+// Send what the socket will take now, and queue the rest. Returns 1 if the
+// queues are over budget, leaving data and len as what is still to send,
+// blocking.
+static int
+out_send(struct connection *c, const char **data, size_t *len)
+{
+  ssize_t sent;
+  int     rc;
+#ifdef __APPLE__
+  int flags = 0;
+#else
+  int flags = MSG_NOSIGNAL;
+#endif
+
+  if (c->out == NULL) {
+    sent = send(c->fd, *data, *len, flags | MSG_DONTWAIT);
+    if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      return -1;
+    }
+    if (sent > 0) {
+      *data += sent;
+      *len  -= (size_t) sent;
+    }
+    if (*len == 0) {
+      return 0;
+    }
+  }
+  if ((rc = out_append(c, *data, *len)) != 1) {
+    return rc;   // Queued, or out of memory and the connection is closed
+  }
+  return out_flush(c) == -1 ? -1 : 1;
+}
+
+// Send what the socket will take of a file now, and queue the rest
+static int
+out_send_file(struct connection *c, int inf, off_t offset, off_t end)
+{
+#ifdef __linux__
+  ssize_t sent;
+
+  if (c->out == NULL) {
+    if (!c->nonblock) {
+      conn_set_blocking(c, 0);
+    }
+    while (offset < end) {
+      sent = sendfile(c->fd, inf, &offset, (size_t) (end - offset));
+      if (sent == 0) {
+        return 0;   // File was truncated underneath us
+      } else if (sent == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          return -1;
+        }
+        break;
+      }
+    }
+    if (offset == end) {
+      return 0;
+    }
+  }
+#endif
+  return out_append_file(c, inf, offset, end);
+}
+
+#ifdef __linux__
+// Take a queue off the parked list
+static void
+out_unlink(struct out_queue *q)
+{
+  pthread_mutex_lock(&drainer.lock);
+  if (q->prev != NULL) {
+    q->prev->next = q->next;
+  } else {
+    drainer.parked = q->next;
+  }
+  if (q->next != NULL) {
+    q->next->prev = q->prev;
+  }
+  pthread_mutex_unlock(&drainer.lock);
+}
+#endif
+
+// Hand a connection with a queue to the drainer. Returns -1 if it can't
+// take it, and the caller must flush the queue itself.
+static int
+out_park(struct connection *c, struct work_queue *wq)
+{
+  struct out_queue   *q = c->out;
+#ifdef __linux__
+  struct epoll_event  ev;
+  int                 rc;
+
+  if (drainer.epfd == -1 || shutdown_requested) {
+    return -1;
+  }
+  q->wq           = wq;
+  q->window_start = coarse_now_ms();
+  q->window_sent  = 0;
+
+  // Level triggered: the drainer is woken whenever the socket has room. It
+  // can't see the queue until the lock is released, by which time the
+  // queue is both listed and watched, or neither.
+  ev.events   = EPOLLOUT;
+  ev.data.ptr = q;
+  pthread_mutex_lock(&drainer.lock);
+  if ((rc = epoll_ctl(drainer.epfd, EPOLL_CTL_ADD, c->fd, &ev)) == 0) {
+    q->prev = NULL;
+    q->next = drainer.parked;
+    if (q->next != NULL) {
+      q->next->prev = q;
+    }
+    drainer.parked = q;
+  }
+  pthread_mutex_unlock(&drainer.lock);
+  if (rc == -1) {
+    return -1;
+  }
+  atomic_fetch_add(&drainer.num_parked, 1);
+  return 0;
+#else
+  (void) q;
+  (void) wq;
+  return -1;
+#endif
+}
+
+#ifdef __linux__
+static void
+out_unpark(struct out_queue *q, int keep)
+{
+  struct connection  *c  = q->c;
+  struct work_queue  *wq = q->wq;
+
+  epoll_ctl(drainer.epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  out_unlink(q);
+  out_free(c);
+  if (!keep || c->close || wq_add(wq, c) == -1) {
+    conn_close(c);
+    conn_free(c);
+    atomic_fetch_sub(&admission.active, 1);
+  }
+}
+
+// Evict the parked connections that read too slowly over the last window
+static void
+out_evict_slow(int64_t now)
+{
+  struct out_queue  *q, *next;
+
+  pthread_mutex_lock(&drainer.lock);
+  q = drainer.parked;
+  pthread_mutex_unlock(&drainer.lock);
+
+  // Only this thread takes connections off the list, so the ones it walks
+  // stay there; new ones are added at the head, ahead of it
+  for (; q != NULL; q = next) {
+    int64_t elapsed = now - q->window_start;
+
+    pthread_mutex_lock(&drainer.lock);
+    next = q->next;
+    pthread_mutex_unlock(&drainer.lock);
+    if (elapsed < OUT_WINDOW_MS) {
+      continue;
+    }
+    if (min_rate > 0 && q->window_sent * 1000 < (off_t) min_rate * elapsed) {
+      printf("drainer: evicted a reader at %lld bytes/sec\n",
+             (long long) (q->window_sent * 1000 / elapsed));
+      atomic_fetch_add(&drainer.num_evicted, 1);
+      out_unpark(q, 0);
+      continue;
+    }
+    q->window_start = now;
+    q->window_sent  = 0;
+  }
+}
+
+static void *
+drainer_thread(void *arg)
+{
+  struct epoll_event  events[OUT_EVENTS];
+  int64_t             last_check = coarse_now_ms(), now;
+  int                 i, n, rc;
+
+  (void) arg;
+  printf("drainer: start\n");
+  while (!shutdown_requested) {
+    n = epoll_wait(drainer.epfd, events, OUT_EVENTS, 1000);
+    for (i = 0; i < n; i++) {
+      struct out_queue *q = events[i].data.ptr;
+
+      if ((rc = out_push(q->c)) != 0) {
+        out_unpark(q, rc == 1);
+      }
+    }
+    if ((now = coarse_now_ms()) - last_check >= 1000) {
+      out_evict_slow(now);
+      last_check = now;
+    }
+  }
+
+  while (drainer.parked != NULL) {
+    out_unpark(drainer.parked, 0);
+  }
+  printf("drainer: done\n");
+  return NULL;
+}
+#endif
+
+static int
+send_response(struct connection *c, const char *data, size_t datalen)
+{
+  size_t  offset = 0;
+  ssize_t wrote  = 0;
+#ifdef __APPLE__
+  int flags = 0;  // macOS doesn't support MSG_NOSIGNAL
+#else
+  int flags = MSG_NOSIGNAL;
+#endif
+
+  if (c->capture != NULL) {
+    if (c->capture_len + datalen <= HEAD_CACHE_RESP) {
+      memcpy(c->capture + c->capture_len, data, datalen);
+      c->capture_len += datalen;
+    } else {
+      c->capture = NULL;  // Too big to cache
+    }
+  }
+
+  if (c->may_queue) {
+    int rc = out_send(c, &data, &datalen);
+
+    if (rc != 1) {
+      return rc;
+    }
+  }
+
+#ifdef WITH_TLS
+  if (c->ssl != NULL) {
+    // SSL_write() only returns once the whole buffer has been written
+    if (SSL_write(c->ssl, data, (int) datalen) <= 0) {
+      ERR_clear_error();
+      return -1;
+    }
+    return 0;
+  }
+#endif
+
+  do {
+    if ((wrote = send(c->fd, data + offset, datalen - offset, flags)) == -1) {
+      return -1;
+    } else {
+      offset += (size_t) wrote;
+    }
+  } while (offset < datalen);
+
+  return 0;
+}
+
+// Hold back partial packets while a response is assembled from headers,
+// framing and a body sent separately, so they go out together. Otherwise
+// the tail of a small body waits behind the unacknowledged headers until
+// the client's delayed ACK.
+static void
+conn_cork(struct connection *c, int on)
+{
+#if defined(TCP_CORK)
+  setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#elif defined(TCP_NOPUSH)
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NOPUSH, &on, sizeof(on));
+#else
+  (void) c;
+  (void) on;
+#endif
+}
+
+// Send size bytes of an open file, from offset. Where possible this uses
+// sendfile(), so the data goes from the page cache to the socket without a
+// copy; over TLS that needs kernel TLS offload, and otherwise the file is
+// read into a buffer and encrypted in userspace.
+static int
+send_file(struct connection *c, int inf, off_t offset, off_t size)
+{
+  char    *buf;
+  ssize_t  rlen;
+  off_t    end = offset + size;
+
+  if (c->may_queue) {
+    return out_send_file(c, inf, offset, end);
+  }
+#ifdef WITH_TLS
+  if (c->ssl != NULL && c->ktls_send) {
+    while (offset < end) {
+      ossl_ssize_t sent = SSL_sendfile(c->ssl, inf, offset,
+                                       (size_t) (end - offset), 0);
+      if (sent <= 0) {
+        ERR_clear_error();
+        return -1;
+      }
+      offset += sent;
+    }
+    return 0;
+  }
+#endif
+#ifdef __linux__
+#ifdef WITH_TLS
+  if (c->ssl == NULL)
+#endif
+  {
+    while (offset < end) {
+      ssize_t sent = sendfile(c->fd, inf, &offset, (size_t) (end - offset));
+      if (sent == -1) {
+        return -1;
+      } else if (sent == 0) {
+        break;  // File was truncated underneath us
+      }
+    }
+    return 0;
+  }
+#endif
+
+  buf = malloc(file_buflen);
+  while (offset < end &&
+         (rlen = pread(inf, buf, (size_t) (end - offset) < file_buflen ?
+                                 (size_t) (end - offset) : file_buflen,
+                       offset)) > 0) {
+    // The cast from ssize_t to size_t is safe, since the previous line
+    // demonstrates that the value is non-negative.
+    if (send_response(c, buf, (size_t) rlen) == -1) {
+      free(buf);
+      return -1;
+    }
+    offset += rlen;
+  }
+  free(buf);
+  return 0;
+}
+
+// Send a file. For a HEAD request, inf is -1 and only the headers are sent.
+static int
+send_response_200(struct connection *c, char *filename, int inf,
+                  const struct stat *fs, int id)
+{
+  // File exists, send OK response:
+  char  headers[BUFLEN];
+  int   len;
+
+  len = snprintf(headers, BUFLEN, "HTTP/1.1 200 OK\r\n"
+                                  "Content-Type: %s\r\n"
+                                  "Content-Length: %lld\r\n"
+                                  "%s"
+                                  "\r\n",
+                 content_type(filename), (long long) fs->st_size,
+                 c->close ? "Connection: close\r\n" : "");
+
+  conn_cork(c, 1);
+  if (send_response(c, headers, (size_t) len) == -1) {
+    return -1;
+  }
+
+  // Send the requested file
+  if (!c->head && send_file(c, inf, 0, fs->st_size) == -1) {
+    return -1;
+  }
+  conn_cork(c, 0);
+
+  printf("responder %d: 200 %s (%lld bytes)\n", id, filename,
+         (long long) fs->st_size);
+  return 0;
+}
+
+// Directory index:
+//
+// A listing used to be printed in raw readdir() order, all of it, so a
+// directory of 100k entries cost a scan of the directory and a
+// multi-megabyte page on every hit. Instead each listed directory gets an
+// index, read once with getdents64() in large batches and kept as a compact
+// array of entries (name, size and mtime) sorted by name, with its orders
+// by size and by mtime alongside. Listings are served from the index a page
+// at a time, in the order asked for:
+//
+//   /dir/?page=3              entries 2001 to 3000, by name
+//   /dir/?sort=-mtime         sort is name, size or mtime; a leading '-'
+//                             reverses it, so this is newest first
+//
+// The DIR_CACHE_SIZE most recently listed directories keep their indexes.
+// Each is watched with inotify, and any change to the directory or to one
+// of its entries drops the index, to be rebuilt by the next listing. The
+// events are drained by whichever responder next asks for an index, so no
+// thread is needed for them. Where there is no inotify, or the watch can't
+// be added, the directory's mtime is checked instead, which misses changes
+// to the files' sizes. The first request to miss a directory claims its
+// slot and reads it without the cache lock held; a burst of requests for
+// the same directory waits for that read rather than repeating it, and
+// listings of other directories go ahead meanwhile.
+
+#define DIR_CACHE_SIZE   64
+#define DIR_PAGE_SIZE    1000
+#define DIR_BATCH        (256 * 1024)    // Bytes per getdents64()
+#define DIR_WATCH_MASK   (IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                          IN_MOVED_TO | IN_ATTRIB | IN_CLOSE_WRITE | \
+                          IN_DELETE_SELF | IN_MOVE_SELF)
+
+#define DIR_SORT_NAME    0
+#define DIR_SORT_SIZE    1
+#define DIR_SORT_MTIME   2
+#define DIR_SORTS        3
+
+static const char *dir_sort_names[DIR_SORTS] = { "name", "size", "mtime" };
+
+struct dir_entry {
+  int64_t   size;
+  int64_t   mtime;
+  uint32_t  name;          // Offset in names
+};
+
+struct dir_index {
+  char              *path;
+  int                wd;                // inotify watch, or -1
+  int                refs;              // The cache's, and each user's
+  uint64_t           used;              // For evicting the oldest
+  struct timespec    mtime;             // Of the directory, if no watch
+  int                building;          // Being read; wait on dir_cache.built
+  int                failed;            // Couldn't be read
+  uint32_t           count;
+  struct dir_entry  *entries;           // Sorted by name
+  uint32_t          *order[DIR_SORTS];  // Entries in each other order
+  char              *names;
+  size_t             names_len;
+};
+
+// A page of a listing: what was asked for, and where it falls
+struct listing_page {
+  int       page;          // From 1
+  int       pages;
+  int       sort;
+  int       reverse;
+  uint32_t  first;
+  uint32_t  count;
+};
+
+static struct {
+  pthread_mutex_t    lock;
+  pthread_cond_t     built;
+  struct dir_index  *slots[DIR_CACHE_SIZE];
+  uint64_t           clock;
+  int                inotify;
+} dir_cache = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                { NULL }, 0, -1 };
+
+#ifdef __linux__
+struct linux_dirent64 {
+  uint64_t        d_ino;
+  int64_t         d_off;
+  unsigned short  d_reclen;
+  unsigned char   d_type;
+  char            d_name[];
+};
+#endif
+
+static void
+dir_cache_init(void)
+{
+#ifdef __linux__
+  if ((dir_cache.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+    perror("inotify_init1");
+  }
+#endif
+}
+
+static void
+dir_index_unref(struct dir_index *ix)
+{
+  if (--ix->refs > 0) {
+    return;
+  }
+  free(ix->path);
+  free(ix->entries);
+  free(ix->order[DIR_SORT_SIZE]);
+  free(ix->order[DIR_SORT_MTIME]);
+  free(ix->names);
+  free(ix);
+}
+
+// Done with an index from dir_index_get()
+static void
+dir_index_release(struct dir_index *ix)
+{
+  pthread_mutex_lock(&dir_cache.lock);
+  dir_index_unref(ix);
+  pthread_mutex_unlock(&dir_cache.lock);
+}
+
+// Drop the index in a slot, and its watch unless another index shares it
+static void
+dir_cache_drop(int slot)
+{
+  struct dir_index  *ix = dir_cache.slots[slot];
+  int                i;
+
+  dir_cache.slots[slot] = NULL;
+#ifdef __linux__
+  if (ix->wd != -1) {
+    for (i = 0; i < DIR_CACHE_SIZE; i++) {
+      if (dir_cache.slots[i] != NULL && dir_cache.slots[i]->wd == ix->wd) {
+        break;
+      }
+    }
+    if (i == DIR_CACHE_SIZE) {
+      inotify_rm_watch(dir_cache.inotify, ix->wd);
+    }
+  }
+#else
+  (void) i;
+#endif
+  dir_index_unref(ix);
+}
+
+// Drop the indexes of directories that have changed
+static void
+dir_cache_drain(void)
+{
+#ifdef __linux__
+  char                         buf[4096]
+    __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event  *ev;
+  ssize_t                      n;
+  char                        *p;
+  int                          i;
+
+  if (dir_cache.inotify == -1) {
+    return;
+  }
+  while ((n = read(dir_cache.inotify, buf, sizeof(buf))) > 0) {
+    for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+      ev = (const struct inotify_event *) p;
+      for (i = 0; i < DIR_CACHE_SIZE; i++) {
+        // On overflow, which directories changed is lost
+        if (dir_cache.slots[i] != NULL &&
+            (dir_cache.slots[i]->wd == ev->wd ||
+             (ev->mask & IN_Q_OVERFLOW))) {
+          dir_cache_drop(i);
+        }
+      }
+    }
+  }
+#endif
+}
+
+static int
+dir_index_fresh(const struct dir_index *ix)
+{
+  struct stat st;
+
+  if (ix->wd != -1) {
+    // It would have been dropped
+    return 1;
+  }
+  return stat(ix->path, &st) == 0 &&
+         st.st_mtim.tv_sec == ix->mtime.tv_sec &&
+         st.st_mtim.tv_nsec == ix->mtime.tv_nsec;
+}
+
+// The comparisons are passed the index being sorted
+static int
+dir_cmp_name(const void *a, const void *b, void *arg)
+{
+  const struct dir_index  *ix = arg;
+  const struct dir_entry  *x = a, *y = b;
+
+  return strcmp(ix->names + x->name, ix->names + y->name);
+}
+
+// By size or mtime, and then by name
+static int
+dir_cmp_size(const void *a, const void *b, void *arg)
+{
+  const struct dir_index  *ix = arg;
+  const struct dir_entry  *x = &ix->entries[*(const uint32_t *) a];
+  const struct dir_entry  *y = &ix->entries[*(const uint32_t *) b];
+
+  if (x->size != y->size) {
+    return x->size < y->size ? -1 : 1;
+  }
+  return x < y ? -1 : x > y;
+}
+
+static int
+dir_cmp_mtime(const void *a, const void *b, void *arg)
+{
+  const struct dir_index  *ix = arg;
+  const struct dir_entry  *x = &ix->entries[*(const uint32_t *) a];
+  const struct dir_entry  *y = &ix->entries[*(const uint32_t *) b];
+
+  if (x->mtime != y->mtime) {
+    return x->mtime < y->mtime ? -1 : 1;
+  }
+  return x < y ? -1 : x > y;
+}
+
+#ifdef __APPLE__
+// macOS's qsort_r() takes its context before the comparison, and passes it
+// first
+struct dir_sort_thunk {
+  int   (*cmp)(const void *, const void *, void *);
+  void   *arg;
+};
+
+static int
+dir_sort_thunk(void *thunk, const void *a, const void *b)
+{
+  const struct dir_sort_thunk *t = thunk;
+
+  return t->cmp(a, b, t->arg);
+}
+#endif
+
+static void
+dir_sort(void *base, size_t n, size_t size,
+         int (*cmp)(const void *, const void *, void *), void *arg)
+{
+#ifdef __APPLE__
+  struct dir_sort_thunk t = { cmp, arg };
+
+  qsort_r(base, n, size, &t, dir_sort_thunk);
+#else
+  qsort_r(base, n, size, cmp, arg);
+#endif
+}
+
+// Add an entry of the directory open as fd, growing the arrays by doubling.
+// Returns -1 if they can't grow.
+static int
+dir_index_add(struct dir_index *ix, int fd, const char *name,
+              uint32_t *cap, size_t *names_cap)
+{
+  struct dir_entry  *e;
+  struct stat        st;
+  size_t             len = strlen(name) + 1;
+  void              *p;
+
+  if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+    return 0;
+  }
+  // A dangling symlink is listed as itself; an entry already gone, not at
+  // all
+  if (fstatat(fd, name, &st, 0) == -1 &&
+      fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+    return 0;
+  }
+  if (ix->count == *cap) {
+    if ((p = realloc(ix->entries, sizeof(*ix->entries) *
+                                  (*cap ? *cap * 2 : 256))) == NULL) {
+      return -1;
+    }
+    ix->entries = p;
+    *cap        = *cap ? *cap * 2 : 256;
+  }
+  while (ix->names_len + len > *names_cap) {
+    if ((p = realloc(ix->names, *names_cap ? *names_cap * 2 : 4096)) == NULL) {
+      return -1;
+    }
+    ix->names  = p;
+    *names_cap = *names_cap ? *names_cap * 2 : 4096;
+  }
+  e        = &ix->entries[ix->count++];
+  e->size  = (int64_t) st.st_size;
+  e->mtime = (int64_t) st.st_mtim.tv_sec;
+  e->name  = (uint32_t) ix->names_len;
+  memcpy(ix->names + ix->names_len, name, len);
+  ix->names_len += len;
+  return 0;
+}
+
+// Read a directory into an index claimed by dir_index_get(). Called
+// without dir_cache.lock, so listings of other directories aren't held up.
+// Returns -1 if it can't be read.
+static int
+dir_index_read(struct dir_index *ix)
+{
+  struct stat  st;
+  uint32_t     cap = 0, i;
+  size_t       names_cap = 0;
+  int          fd, s, rc = 0;
+
+  if ((fd = open(ix->path, O_RDONLY | O_DIRECTORY)) == -1) {
+    return -1;
+  }
+  fstat(fd, &st);
+  ix->mtime = st.st_mtim;
+
+#ifdef __linux__
+  {
+    char     *buf = malloc(DIR_BATCH);
+    long      n, off;
+
+    while (buf != NULL && rc == 0 &&
+           (n = syscall(SYS_getdents64, fd, buf, DIR_BATCH)) > 0) {
+      for (off = 0; off < n && rc == 0;
+           off += ((struct linux_dirent64 *) (buf + off))->d_reclen) {
+        rc = dir_index_add(ix, fd,
+                           ((struct linux_dirent64 *) (buf + off))->d_name,
+                           &cap, &names_cap);
+      }
+    }
+    if (buf == NULL) {
+      rc = -1;
+    }
+    free(buf);
+  }
+#else
+  {
+    DIR            *dir = fdopendir(dup(fd));
+    struct dirent  *ent;
+
+    while (dir != NULL && rc == 0 && (ent = readdir(dir)) != NULL) {
+      rc = dir_index_add(ix, fd, ent->d_name, &cap, &names_cap);
+    }
+    if (dir != NULL) {
+      closedir(dir);
+    }
+  }
+#endif
+  close(fd);
+  if (rc == -1) {
+    return -1;
+  }
+
+  dir_sort(ix->entries, ix->count, sizeof(*ix->entries), dir_cmp_name, ix);
+  for (s = DIR_SORT_SIZE; s < DIR_SORTS; s++) {
+    ix->order[s] = malloc(sizeof(uint32_t) * (ix->count ? ix->count : 1));
+    if (ix->order[s] == NULL) {
+      return -1;
+    }
+    for (i = 0; i < ix->count; i++) {
+      ix->order[s][i] = i;
+    }
+    dir_sort(ix->order[s], ix->count, sizeof(uint32_t),
+             s == DIR_SORT_SIZE ? dir_cmp_size : dir_cmp_mtime, ix);
+  }
+  return 0;
+}
+
+// The index of a directory, from the cache or newly built, or NULL if it
+// can't be read. Release it with dir_index_release().
+static struct dir_index *
+dir_index_get(const char *path)
+{
+  struct dir_index  *ix = NULL;
+  int                i, victim = 0, rc;
+
+  pthread_mutex_lock(&dir_cache.lock);
+  dir_cache_drain();
+  for (i = 0; i < DIR_CACHE_SIZE; i++) {
+    if (dir_cache.slots[i] != NULL &&
+        strcmp(dir_cache.slots[i]->path, path) == 0) {
+      if (dir_cache.slots[i]->building ||
+          dir_index_fresh(dir_cache.slots[i])) {
+        ix = dir_cache.slots[i];
+      } else {
+        dir_cache_drop(i);
+      }
+      break;
+    }
+  }
+
+  if (ix != NULL) {
+    // Another responder may still be reading it
+    ix->refs++;
+    ix->used = ++dir_cache.clock;
+    while (ix->building) {
+      pthread_cond_wait(&dir_cache.built, &dir_cache.lock);
+    }
+    if (ix->failed) {
+      dir_index_unref(ix);
+      ix = NULL;
+    }
+    pthread_mutex_unlock(&dir_cache.lock);
+    return ix;
+  }
+
+  // Claim a slot, an empty one or else the least recently used, then read
+  // the directory with the lock released
+  if ((ix = calloc(1, sizeof(*ix))) == NULL ||
+      (ix->path = strdup(path)) == NULL) {
+    free(ix);
+    pthread_mutex_unlock(&dir_cache.lock);
+    return NULL;
+  }
+  ix->wd       = -1;
+  ix->building = 1;
+  ix->refs     = 2;  // The cache's and ours
+  ix->used     = ++dir_cache.clock;
+  // Watched before it is read, so no change can slip in between
+#ifdef __linux__
+  if (dir_cache.inotify != -1) {
+    ix->wd = inotify_add_watch(dir_cache.inotify, path, DIR_WATCH_MASK);
+  }
+#endif
+  for (i = 0; i < DIR_CACHE_SIZE; i++) {
+    if (dir_cache.slots[i] == NULL) {
+      victim = i;
+      break;
+    }
+    if (dir_cache.slots[i]->used < dir_cache.slots[victim]->used) {
+      victim = i;
+    }
+  }
+  if (dir_cache.slots[victim] != NULL) {
+    dir_cache_drop(victim);
+  }
+  dir_cache.slots[victim] = ix;
+  pthread_mutex_unlock(&dir_cache.lock);
+
+  rc = dir_index_read(ix);
+
+  // A change seen meanwhile has already dropped the index from its slot;
+  // the listing it was read for is served from it regardless
+  pthread_mutex_lock(&dir_cache.lock);
+  ix->building = 0;
+  if (rc == -1) {
+    ix->failed = 1;
+    for (i = 0; i < DIR_CACHE_SIZE; i++) {
+      if (dir_cache.slots[i] == ix) {
+        dir_cache_drop(i);
+      }
+    }
+    dir_index_unref(ix);
+    ix = NULL;
+  }
+  pthread_cond_broadcast(&dir_cache.built);
+  pthread_mutex_unlock(&dir_cache.lock);
+  return ix;
+}
+
+// Read page= and sort= from a listing's query string, if it has one
+static void
+listing_parse_query(const char *query, struct listing_page *lp)
+{
+  const char  *p;
+  int          s;
+
+  memset(lp, 0, sizeof(*lp));
+  lp->page = 1;
+  p = query;
+  while (p != NULL && *p != '\0') {
+    if (strncmp(p, "page=", 5) == 0) {
+      lp->page = atoi(p + 5) > 0 ? atoi(p + 5) : 1;
+    } else if (strncmp(p, "sort=", 5) == 0) {
+      p += 5;
+      if ((lp->reverse = *p == '-')) {
+        p++;
+      }
+      for (s = 0; s < DIR_SORTS; s++) {
+        size_t len = strlen(dir_sort_names[s]);
+
+        if (strncmp(p, dir_sort_names[s], len) == 0 &&
+            (p[len] == '\0' || p[len] == '&')) {
+          lp->sort = s;
+        }
+      }
+    }
+    if ((p = strchr(p, '&')) != NULL) {
+      p++;
+    }
+  }
+}
+
+// Work out which entries are on the page, the last one if it asked for a
+// page past the end
+static void
+listing_paginate(const struct dir_index *ix, struct listing_page *lp)
+{
+  lp->pages = ix->count ? (int) ((ix->count - 1) / DIR_PAGE_SIZE) + 1 : 1;
+  if (lp->page > lp->pages) {
+    lp->page = lp->pages;
+  }
+  lp->first = (uint32_t) (lp->page - 1) * DIR_PAGE_SIZE;
+  lp->count = ix->count - lp->first < DIR_PAGE_SIZE ?
+              ix->count - lp->first : DIR_PAGE_SIZE;
+}
+
+// The i'th entry of the listing, in its order
+static const struct dir_entry *
+listing_entry(const struct dir_index *ix, const struct listing_page *lp,
+              uint32_t i)
+{
+  if (lp->reverse) {
+    i = ix->count - 1 - i;
+  }
+  return &ix->entries[lp->sort == DIR_SORT_NAME ? i : ix->order[lp->sort][i]];
+}
+
+// Links to the neighbouring pages, keeping the order; empty if the listing
+// fits on one page
+static void
+listing_nav(char *buf, size_t len, const struct listing_page *lp)
+{
+  int n = 0;
+
+  buf[0] = '\0';
+  if (lp->pages == 1) {
+    return;
+  }
+  n += snprintf(buf + n, len - (size_t) n, "<p>Page %d of %d", lp->page,
+                lp->pages);
+  if (lp->page > 1) {
+    n += snprintf(buf + n, len - (size_t) n,
+                  " <a href=\"?page=%d&amp;sort=%s%s\">previous</a>",
+                  lp->page - 1, lp->reverse ? "-" : "",
+                  dir_sort_names[lp->sort]);
+  }
+  if (lp->page < lp->pages) {
+    n += snprintf(buf + n, len - (size_t) n,
+                  " <a href=\"?page=%d&amp;sort=%s%s\">next</a>",
+                  lp->page + 1, lp->reverse ? "-" : "",
+                  dir_sort_names[lp->sort]);
+  }
+  snprintf(buf + n, len - (size_t) n, "</p>\r\n");
+}
+
+// Streaming response writer:
+//
+// Generated responses are written through a response_writer, which holds
+// at most RW_BUFLEN bytes of body per connection. If the whole body fits,
+// it is sent with a Content-Length header once finished. Otherwise, the
+// buffer is sent as an HTTP/1.1 chunk each time it fills, so the client
+// starts receiving a large body immediately while memory use stays
+// constant. Each flush blocks until the client has accepted the data, which
+// throttles the generator to the speed of the connection.
+//
+// HTTP/1.0 clients don't understand chunks, so a large body to one of them
+// is sent raw and delimited by closing the connection. For HEAD requests
+// the body is generated (to find its length) but never sent.
+//
+// The headers always leave room for the Content-Length and the blank line
+// that end them. A response whose headers don't fit isn't sent at all; the
+// client gets a 500 in its place.
+
+#define RW_BUFLEN       16384
+#define RW_HEADERS_MAX  1024
+#define RW_HEADERS_END  48                      // Content-Length + CRLFCRLF
+#define RW_HEADROOM     (RW_HEADERS_MAX + 64)   // Headers + framing
+
+struct response_writer {
+  struct connection *c;
+  char               headers[RW_HEADERS_MAX];
+  size_t             hdr_len;   // Header bytes not yet sent
+  size_t             len;       // Body bytes buffered in data[]
+  int                chunked;   // Headers sent, body is being chunked
+  int                failed;
+  int                overflow;  // A header didn't fit
+  char               buf[RW_HEADROOM + RW_BUFLEN + 8];
+};
+
+#define RW_DATA(rw)  ((rw)->buf + RW_HEADROOM)
+
+static void rw_header(struct response_writer *rw, const char *fmt, ...);
+
+static void
+rw_begin(struct response_writer *rw, struct connection *c, const char *status)
+{
+  int n;
+
+  rw->c       = c;
+  rw->len     = 0;
+  rw->chunked  = 0;
+  rw->failed   = 0;
+  rw->overflow = 0;
+
+  n = snprintf(rw->headers, RW_HEADERS_MAX - RW_HEADERS_END,
+               "HTTP/1.1 %s\r\n", status);
+  if (n < 0 || (size_t) n >= RW_HEADERS_MAX - RW_HEADERS_END) {
+    n            = 0;
+    rw->overflow = 1;
+  }
+  rw->hdr_len = (size_t) n;
+
+  if (c->close) {
+    rw_header(rw, "Connection: close");
+  }
+}
+
+static void
+rw_header(struct response_writer *rw, const char *fmt, ...)
+{
+  va_list  ap;
+  size_t   room = RW_HEADERS_MAX - RW_HEADERS_END - rw->hdr_len;
+  int      n;
+
+  if (rw->overflow) {
+    return;
+  }
+  va_start(ap, fmt);
+  n = vsnprintf(rw->headers + rw->hdr_len, room, fmt, ap);
+  va_end(ap);
+
+  if (n < 0 || (size_t) n + 2 > room) {
+    // Never send half a header, nor the response without it
+    rw->overflow = 1;
+    return;
+  }
+  rw->hdr_len += (size_t) n;
+  memcpy(rw->headers + rw->hdr_len, "\r\n", 2);
+  rw->hdr_len += 2;
+}
+
+static int send_response_error(struct connection *c, const char *status,
+                               const char *message);
+
+// Replace a response whose headers overflowed with a 500. The generator may
+// still be writing the body, so the connection is closed after it.
+static int
+rw_overflowed(struct response_writer *rw)
+{
+  rw->failed   = 1;
+  rw->c->close = 1;
+  return send_response_error(rw->c, "500 Internal Server Error",
+                             "Internal server error");
+}
+
+// Send the buffered body as one chunk, preceded by the response headers if
+// they haven't gone out yet, and followed by the last-chunk marker if this
+// is the end of the body. Everything is assembled in front of and behind
+// the data in buf[], so each flush is a single send.
+static int
+rw_flush(struct response_writer *rw, int last)
+{
+  char    prefix[64];
+  char   *out;
+  size_t  total;
+  int     n;
+
+  if (rw->failed) {
+    return -1;
+  }
+  if (rw->overflow) {
+    rw_overflowed(rw);
+    return -1;
+  }
+
+  n = 0;
+  if (!rw->chunked) {
+    if (!rw->c->http10) {
+      n = sprintf(prefix, "Transfer-Encoding: chunked\r\n\r\n");
+    } else if (!rw->c->close) {
+      n = sprintf(prefix, "Connection: close\r\n\r\n");
+      rw->c->close = 1;
+    } else {
+      n = sprintf(prefix, "\r\n");
+    }
+    rw->chunked = 1;
+  } else if (rw->c->head) {
+    rw->len = 0;  // Headers have gone; discard the rest of the body
+    return 0;
+  }
+  if (rw->c->head) {
+    rw->len = 0;
+    last    = 0;
+  }
+  if (rw->c->http10) {
+    last = 0;
+  } else if (rw->len > 0) {
+    n += sprintf(prefix + n, "%zx\r\n", rw->len);
+  }
+
+  out   = RW_DATA(rw) - n - rw->hdr_len;
+  memcpy(out, rw->headers, rw->hdr_len);
+  memcpy(out + rw->hdr_len, prefix, (size_t) n);
+  total = rw->hdr_len + (size_t) n + rw->len;
+
+  if (rw->len > 0 && !rw->c->http10) {
+    memcpy(out + total, "\r\n", 2);
+    total += 2;
+  }
+  if (last) {
+    memcpy(out + total, "0\r\n\r\n", 5);
+    total += 5;
+  }
+
+  rw->hdr_len = 0;
+  rw->len     = 0;
+
+  if (send_response(rw->c, out, total) == -1) {
+    rw->failed = 1;
+    return -1;
+  }
+  return 0;
+}
+
+static int
+rw_write(struct response_writer *rw, const char *data, size_t len)
+{
+  while (len > 0) {
+    size_t n = RW_BUFLEN - rw->len;
+
+    if (n > len) {
+      n = len;
+    }
+    memcpy(RW_DATA(rw) + rw->len, data, n);
+    rw->len += n;
+    data    += n;
+    len     -= n;
+
+    if (rw->len == RW_BUFLEN && rw_flush(rw, 0) == -1) {
+      return -1;
+    }
+  }
+  return rw->failed ? -1 : 0;
+}
+
+static int
+rw_printf(struct response_writer *rw, const char *fmt, ...)
+{
+  va_list  ap;
+  size_t   room = RW_BUFLEN - rw->len;
+  int      n;
+
+  // Format straight into the buffer when the output fits, otherwise flush
+  // and try again. Output longer than the whole buffer goes via the heap.
+  va_start(ap, fmt);
+  n = vsnprintf(RW_DATA(rw) + rw->len, room + 1, fmt, ap);
+  va_end(ap);
+  if (n < 0) {
+    return -1;
+  }
+  if ((size_t) n <= room) {
+    rw->len += (size_t) n;
+    if (rw->len == RW_BUFLEN) {
+      return rw_flush(rw, 0);
+    }
+    return rw->failed ? -1 : 0;
+  }
+
+  if ((size_t) n <= RW_BUFLEN) {
+    if (rw_flush(rw, 0) == -1) {
+      return -1;
+    }
+    va_start(ap, fmt);
+    vsnprintf(RW_DATA(rw), RW_BUFLEN + 1, fmt, ap);
+    va_end(ap);
+    rw->len = (size_t) n;
+    return 0;
+  } else {
+    char *tmp = malloc((size_t) n + 1);
+    int   rc;
+
+    if (tmp == NULL) {
+      return -1;
+    }
+    va_start(ap, fmt);
+    vsnprintf(tmp, (size_t) n + 1, fmt, ap);
+    va_end(ap);
+    rc = rw_write(rw, tmp, (size_t) n);
+    free(tmp);
+    return rc;
+  }
+}
+
+// Complete the response. A body that never filled the buffer is sent in
+// one piece with its Content-Length; a streamed body gets its final chunk.
+static int
+rw_finish(struct response_writer *rw)
+{
+  char   *out;
+  size_t  total;
+  int     n;
+
+  if (rw->failed) {
+    return -1;
+  }
+  if (rw->chunked) {
+    return rw_flush(rw, 1);
+  }
+  if (rw->overflow) {
+    return rw_overflowed(rw);
+  }
+
+  n = snprintf(rw->headers + rw->hdr_len, RW_HEADERS_MAX - rw->hdr_len,
+               "Content-Length: %zu\r\n\r\n", rw->len);
+  if (n < 0 || (size_t) n >= RW_HEADERS_MAX - rw->hdr_len) {
+    return rw_overflowed(rw);
+  }
+  rw->hdr_len += (size_t) n;
+
+  out   = RW_DATA(rw) - rw->hdr_len;
+  memcpy(out, rw->headers, rw->hdr_len);
+  total = rw->hdr_len + (rw->c->head ? 0 : rw->len);
+
+  return send_response(rw->c, out, total);
+}
+
+// EXTENSION
+static int
+send_response_200_listing(struct connection *c, const struct dir_index *ix,
+                          char *filename, const char *query, int id)
+{
+  struct response_writer   rw;
+  struct listing_page      lp;
+  const struct dir_entry  *e;
+  char                     when[32], nav[256];
+  uint32_t                 i;
+
+  listing_parse_query(query, &lp);
+  listing_paginate(ix, &lp);
+  printf("responder %d: 200 %s (page %d of %d)\n", id, filename, lp.page,
+         lp.pages);
+
+  rw_begin(&rw, c, "200 OK");
+  rw_header(&rw, "Content-Type: text/html");
+  rw_printf(&rw, LISTING_HEAD);
+
+  // One page of the directory's index, in the order asked for, entry by
+  // entry straight into the writer
+  for (i = lp.first; i < lp.first + lp.count; i++) {
+    e = listing_entry(ix, &lp, i);
+    listing_mtime(when, sizeof(when), (time_t) e->mtime);
+    if (rw_printf(&rw, LISTING_ENTRY, filename, ix->names + e->name,
+                  ix->names + e->name, (long long) e->size, when) == -1) {
+      return -1;
+    }
+  }
+
+  listing_nav(nav, sizeof(nav), &lp);
+  rw_printf(&rw, LISTING_END "%s" LISTING_TAIL, nav);
+
+  return rw_finish(&rw);
+}
+
+// EXTENSION
+static int
+send_response_307(struct connection *c, const char *filename, int id)
+{
+  struct response_writer rw;
+  
+  // Redirect to index.html
+  printf("responder %d: 307 %s\n", id, filename);
+
+  rw_begin(&rw, c, "307 Temporary Redirect");
+  rw_header(&rw, "Location: %s", filename);
+  rw_header(&rw, "Content-Type: text/html");
+  rw_printf(&rw, "<html>\r\n"
+                 "<head>\r\n"
+                 "<title>Redirected</title>\r\n"
+                 "</head>\r\n"
+                 "<body>\r\n"
+                 "<p>Redirecting ...</p>\r\n"
+                 "</body>\r\n"
+                 "</html>\r\n");
+
+  return rw_finish(&rw);
+}
+
+static int
+send_response_error(struct connection *c, const char *status,
+                    const char *message)
+{
+  struct response_writer rw;
+
+  rw_begin(&rw, c, status);
+  rw_header(&rw, "Content-Type: text/html");
+  rw_printf(&rw, "<html>\r\n"
+                 "<head>\r\n"
+                 "<title> %s </title>\r\n"
+                 "</head>\r\n"
+                 "<body>\r\n"
+                 "<p> %s </p>\r\n"
+                 "</body>\r\n"
+                 "</html>\r\n", status, message);
+
+  return rw_finish(&rw);
+}
+
+static int
+send_response_400(struct connection *c, int id)
+{
+  // The request couldn't be parsed. We can't tell where the next request
+  // would start, so the connection is closed after this.
+  printf("responder %d: 400\n", id);
+  c->close = 1;
+  return send_response_error(c, "400 Bad Request", "Bad request");
+}
+
+static int
+send_response_404(struct connection *c, char *filename, int id)
+{
+  // Requested file doesn't exist, send an error
+  printf("responder %d: 404 %s\n", id, filename);
+  return send_response_error(c, "404 File Not Found", "File not found");
+}
+
+static int
+send_response_405(struct connection *c, char *method, int id)
+{
+  // A method we recognise, but which makes no sense for static files
+  struct response_writer rw;
+
+  printf("responder %d: 405 %s\n", id, method);
+
+  rw_begin(&rw, c, "405 Method Not Allowed");
+  rw_header(&rw, "Allow: GET, HEAD");
+  rw_header(&rw, "Content-Type: text/html");
+  rw_printf(&rw, "<html>\r\n"
+                 "<head>\r\n"
+                 "<title> 405 Method Not Allowed </title>\r\n"
+                 "</head>\r\n"
+                 "<body>\r\n"
+                 "<p> Method not allowed </p>\r\n"
+                 "</body>\r\n"
+                 "</html>\r\n");
+
+  return rw_finish(&rw);
+}
+
+static int
+send_response_431(struct connection *c, int id)
+{
+  // The request headers don't fit in the connection's input buffer
+  printf("responder %d: 431\n", id);
+  c->close = 1;
+  return send_response_error(c, "431 Request Header Fields Too Large",
+                             "Request headers too large");
+}
+
+static int
+send_response_500(struct connection *c, char *filename, int id)
+{
+  // Internal server error, sent whenever something unexpected happens.
+  printf("responder %d: 500 %s\n", id, filename);
+  c->close = 1;
+  return send_response_error(c, "500 Internal Server Error",
+                             "Internal Error");
+}
+
+static int
+send_response_501(struct connection *c, char *method, int id)
+{
+  // A method we don't know at all
+  printf("responder %d: 501 %s\n", id, method);
+  return send_response_error(c, "501 Not Implemented", "Not implemented");
+}
+
+static int
+send_response_502(struct connection *c, char *target, int id)
+{
+  // No upstream server could be reached for a proxied request
+  printf("responder %d: 502 %s\n", id, target);
+  return send_response_error(c, "502 Bad Gateway", "Bad gateway");
+}
+
+static int
+send_response_504(struct connection *c, char *target, int id)
+{
+  // The upstream server accepted a proxied request, but didn't answer it
+  printf("responder %d: 504 %s\n", id, target);
+  return send_response_error(c, "504 Gateway Timeout", "Gateway timeout");
+}
+
+// Static file cache:
+//
+// Just after a restart, the first request for each file pays for a cold
+// open() and fstat(), and usually a page cache miss as well. So before
+// accepting connections the server walks its docroots, with a few threads
+// working through the directories in parallel, and records each file's
+// metadata and response headers, the bodies of small files, and which
+// directories redirect to their index.html. Larger files are only read
+// ahead into the page cache.
+//
+// Everything goes into one packed block of offsets rather than pointers,
+// keyed by path, so the same block can be written out as a snapshot (-S)
+// and mapped straight back in by a later start with the same docroots,
+// skipping the walk. A snapshot is checked throughout before it is used,
+// and one that is damaged is ignored in favour of a fresh walk. Each entry
+// is checked against the file with a stat() at most once a second, and a
+// file that has changed since is served the slow way from then on; new
+// files are always served the slow way. The cache belongs to a
+// configuration, and is rebuilt when it is reloaded.
+
+#define CACHE_MAGIC        "WSCACHE1"
+#define CACHE_BODY_MAX     65536                // Larger files stay on disk
+#define CACHE_BODIES_MAX   (64 << 20)           // In memory, in total
+#define CACHE_READAHEAD    (256LL << 20)        // Read ahead, in total
+#define CACHE_ENTRIES_MAX  (1 << 20)
+#define CACHE_DEPTH_MAX    32
+#define CACHE_CHECK_MS     1000
+#define CACHE_PATH_MAX     4096
+#define CACHE_HEADERS_MAX  160
+
+#define CACHE_FILE         0
+#define CACHE_REDIRECT     1    // A directory with an index.html
+
+struct cache_entry {
+  uint64_t  path;          // Offset of the file name, as requested
+  uint64_t  check;         // Offset of the file to stat() to validate
+  uint64_t  data;          // Offset of the headers, or redirect location
+  uint64_t  body;          // Offset of the body, if it is cached
+  uint64_t  size;
+  uint64_t  ino;
+  int64_t   mtime_sec;
+  int64_t   mtime_nsec;
+  uint32_t  hash;
+  uint32_t  data_len;
+  uint32_t  kind;
+  uint32_t  has_body;
+};
+
+struct cache_header {
+  char      magic[8];
+  uint64_t  size;          // Of the whole block
+  uint32_t  num_entries;
+  uint32_t  mask;          // Of the slot table
+  uint32_t  num_roots;
+  uint32_t  roots_len;
+  uint64_t  roots;         // Offset of the docroots, NUL separated
+  uint64_t  slots;         // Offset of the slots: entry index + 1, or 0
+  uint64_t  entries;
+};
+
+struct file_cache {
+  const struct cache_header  *hdr;
+  size_t                      len;
+  int                         mapped;
+  _Atomic int64_t            *checked;  // Per entry: when last validated
+                                        // (ms), or -1 once stale
+};
+
+#define CACHE_AT(fc, off)  ((const char *) (fc)->hdr + (off))
+
+static const char *cache_snapshot;    // -S
+static int         cache_enabled = 1; // -N turns it off
+
+// A file or redirect found by the walk, before packing
+struct cache_item {
+  char        *path;
+  char        *check;
+  char        *data;
+  char        *body;
+  size_t       data_len;
+  int          kind;
+  struct stat  st;
+};
+
+struct cache_dir {
+  char  *path;
+  int    root_len;    // Of the docroot at the start of path
+  int    depth;
+};
+
+struct cache_walk {
+  pthread_mutex_t     lock;
+  pthread_cond_t      cond;
+  struct cache_dir   *dirs;       // Directories still to read
+  int                 num_dirs, cap_dirs;
+  int                 busy;       // Threads reading a directory
+  struct cache_item  *items;
+  int                 num_items, cap_items;
+  _Atomic int64_t     body_bytes;
+  _Atomic int64_t     readahead;
+};
+
+static uint32_t
+cache_hash(const char *path, size_t len)
+{
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  size_t   i;
+
+  for (i = 0; i < len; i++) {
+    h = (h ^ (unsigned char) path[i]) * 16777619u;
+  }
+  return h;
+}
+
+// Called with the walk locked
+static void
+cache_walk_push(struct cache_walk *w, char *path, int root_len, int depth)
+{
+  if (w->num_dirs == w->cap_dirs) {
+    w->cap_dirs = w->cap_dirs ? w->cap_dirs * 2 : 64;
+    w->dirs     = realloc(w->dirs, sizeof(*w->dirs) * (size_t) w->cap_dirs);
+  }
+  w->dirs[w->num_dirs].path     = path;
+  w->dirs[w->num_dirs].root_len = root_len;
+  w->dirs[w->num_dirs++].depth  = depth;
+  pthread_cond_signal(&w->cond);
+}
+
+static void
+cache_walk_add(struct cache_walk *w, struct cache_item *items, int n)
+{
+  pthread_mutex_lock(&w->lock);
+  while (w->num_items + n > CACHE_ENTRIES_MAX) {
+    struct cache_item *it = &items[--n];  // Served the slow way
+
+    free(it->path);
+    free(it->check);
+    free(it->data);
+    free(it->body);
+  }
+  if (w->num_items + n > w->cap_items) {
+    while (w->num_items + n > w->cap_items) {
+      w->cap_items = w->cap_items ? w->cap_items * 2 : 256;
+    }
+    w->items = realloc(w->items, sizeof(*items) * (size_t) w->cap_items);
+  }
+  memcpy(w->items + w->num_items, items, sizeof(*items) * (size_t) n);
+  w->num_items += n;
+  pthread_mutex_unlock(&w->lock);
+}
+
+// Record a regular file: its headers, and its body if there is room
+static int
+cache_walk_file(struct cache_walk *w, char *path, const struct stat *st,
+                struct cache_item *item)
+{
+  char  headers[CACHE_HEADERS_MAX];
+  int   fd, len;
+
+  if ((fd = open(path, O_RDONLY, 0)) == -1) {
+    return -1;  // Served the slow way, which will say why
+  }
+  memset(item, 0, sizeof(*item));
+  item->kind = CACHE_FILE;
+  item->path = path;
+  item->st   = *st;
+
+  // As send_response_200() would have it, up to the Connection header
+  len = snprintf(headers, sizeof(headers), "HTTP/1.1 200 OK\r\n"
+                                           "Content-Type: %s\r\n"
+                                           "Content-Length: %lld\r\n",
+                 content_type(path), (long long) st->st_size);
+  item->data     = strdup(headers);
+  item->data_len = (size_t) len;
+
+  if (st->st_size <= CACHE_BODY_MAX &&
+      atomic_fetch_add(&w->body_bytes, st->st_size) + st->st_size <=
+      CACHE_BODIES_MAX) {
+    size_t   got = 0;
+    ssize_t  n;
+
+    item->body = malloc((size_t) st->st_size + 1);
+    while (got < (size_t) st->st_size &&
+           (n = read(fd, item->body + got, (size_t) st->st_size - got)) > 0) {
+      got += (size_t) n;
+    }
+    if (got < (size_t) st->st_size) {
+      free(item->body);  // Truncated underneath us
+      item->body = NULL;
+    }
+  } else if (atomic_fetch_add(&w->readahead, st->st_size) + st->st_size <=
+             CACHE_READAHEAD) {
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, 0, st->st_size, POSIX_FADV_WILLNEED);
+#endif
+  }
+  close(fd);
+  return 0;
+}
+
+// Read one directory, queueing its subdirectories
+static void
+cache_walk_dir(struct cache_walk *w, struct cache_dir *d)
+{
+  char               *path = d->path;
+  struct cache_item   batch[64];
+  struct dirent      *ent;
+  struct stat         st;
+  char                child[CACHE_PATH_MAX];
+  int                 n = 0;
+  DIR                *dir;
+
+  // A directory with an index.html redirects to it, however it's named
+  snprintf(child, sizeof(child), "%s/index.html", path);
+  if (stat(child, &st) == 0 && S_ISREG(st.st_mode)) {
+    int i;
+
+    for (i = 0; i < 2; i++) {
+      char name[CACHE_PATH_MAX];
+      char location[CACHE_PATH_MAX];
+
+      snprintf(name, sizeof(name), "%s%s", path, i ? "/" : "");
+      snprintf(location, sizeof(location), "%s/index.html",
+               path + d->root_len);
+      memset(&batch[n], 0, sizeof(batch[n]));
+      batch[n].kind     = CACHE_REDIRECT;
+      batch[n].path     = strdup(name);
+      batch[n].check    = strdup(child);
+      batch[n].data     = strdup(location);
+      batch[n].data_len = strlen(location);
+      batch[n].st       = st;
+      n++;
+    }
+  }
+
+  if ((dir = opendir(path)) == NULL) {
+    cache_walk_add(w, batch, n);
+    free(path);
+    return;
+  }
+  while ((ent = readdir(dir)) != NULL) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+    if ((size_t) snprintf(child, sizeof(child), "%s/%s", path,
+                          ent->d_name) >= sizeof(child) ||
+        fstatat(dirfd(dir), ent->d_name, &st, 0) == -1) {
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      if (d->depth < CACHE_DEPTH_MAX) {
+        pthread_mutex_lock(&w->lock);
+        cache_walk_push(w, strdup(child), d->root_len, d->depth + 1);
+        pthread_mutex_unlock(&w->lock);
+      }
+    } else if (S_ISREG(st.st_mode)) {
+      char *name = strdup(child);
+
+      if (cache_walk_file(w, name, &st, &batch[n]) == -1) {
+        free(name);
+      } else if (++n == (int) (sizeof(batch) / sizeof(batch[0]))) {
+        cache_walk_add(w, batch, n);
+        n = 0;
+      }
+    }
+  }
+  closedir(dir);
+  cache_walk_add(w, batch, n);
+  free(path);
+}
+
+static void *
+cache_walk_thread(void *arg)
+{
+  struct cache_walk *w = arg;
+
+  pthread_mutex_lock(&w->lock);
+  while (1) {
+    struct cache_dir dir;
+
+    while (w->num_dirs == 0 && w->busy > 0) {
+      pthread_cond_wait(&w->cond, &w->lock);
+    }
+    if (w->num_dirs == 0) {
+      break;  // Nothing queued, and nobody reading a directory
+    }
+    dir = w->dirs[--w->num_dirs];
+    w->busy++;
+    pthread_mutex_unlock(&w->lock);
+
+    cache_walk_dir(w, &dir);
+
+    pthread_mutex_lock(&w->lock);
+    if (--w->busy == 0 && w->num_dirs == 0) {
+      pthread_cond_broadcast(&w->cond);
+    }
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+// Copy a string into the block being packed, returning its offset
+static uint64_t
+cache_put(const struct cache_header *hdr, char **p, const char *str,
+          size_t len)
+{
+  uint64_t off = (uint64_t) (*p - (const char *) hdr);
+
+  memcpy(*p, str, len);
+  (*p)[len] = '\0';
+  *p += len + 1;
+  return off;
+}
+
+// Pack the items into one block
+static struct cache_header *
+cache_pack(const char **roots, int num_roots, struct cache_item *items,
+           int num_items)
+{
+  struct cache_header  *hdr;
+  struct cache_entry   *entries;
+  uint32_t             *slots;
+  uint32_t              mask = 1;
+  size_t                size;
+  char                 *p;
+  int                   i;
+
+  while (mask + 1 < (uint32_t) num_items * 2) {
+    mask = mask * 2 + 1;
+  }
+  size = sizeof(*hdr) + sizeof(*entries) * (size_t) num_items +
+         sizeof(uint32_t) * (mask + 1);
+  for (i = 0; i < num_roots; i++) {
+    size += strlen(roots[i]) + 1;
+  }
+  for (i = 0; i < num_items; i++) {
+    size += strlen(items[i].path) + 1 + items[i].data_len + 1;
+    size += items[i].check ? strlen(items[i].check) + 1 : 0;
+    size += items[i].body ? (size_t) items[i].st.st_size : 0;
+  }
+
+  hdr = calloc(1, size);
+  memcpy(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic));
+  hdr->size        = size;
+  hdr->num_entries = (uint32_t) num_items;
+  hdr->mask        = mask;
+  hdr->num_roots   = (uint32_t) num_roots;
+  hdr->entries     = sizeof(*hdr);
+  hdr->slots       = hdr->entries + sizeof(*entries) * (size_t) num_items;
+  hdr->roots       = hdr->slots + sizeof(uint32_t) * (mask + 1);
+  entries          = (struct cache_entry *) ((char *) hdr + hdr->entries);
+  slots            = (uint32_t *) ((char *) hdr + hdr->slots);
+
+  p = (char *) hdr + hdr->roots;
+  for (i = 0; i < num_roots; i++) {
+    p = stpcpy(p, roots[i]) + 1;
+  }
+  hdr->roots_len = (uint32_t) (p - ((char *) hdr + hdr->roots));
+
+  for (i = 0; i < num_items; i++) {
+    struct cache_item   *it  = &items[i];
+    struct cache_entry  *e   = &entries[i];
+    size_t               len = strlen(it->path);
+    uint32_t             s;
+
+    e->kind       = (uint32_t) it->kind;
+    e->hash       = cache_hash(it->path, len);
+    e->path       = cache_put(hdr, &p, it->path, len);
+    e->check      = it->check ? cache_put(hdr, &p, it->check,
+                                          strlen(it->check)) : e->path;
+    e->data       = cache_put(hdr, &p, it->data, it->data_len);
+    e->data_len   = (uint32_t) it->data_len;
+    e->size       = (uint64_t) it->st.st_size;
+    e->ino        = (uint64_t) it->st.st_ino;
+    e->mtime_sec  = (int64_t) it->st.st_mtim.tv_sec;
+    e->mtime_nsec = (int64_t) it->st.st_mtim.tv_nsec;
+    if (it->body != NULL) {
+      e->has_body = 1;
+      e->body     = (size_t) (p - (char *) hdr);
+      memcpy(p, it->body, (size_t) it->st.st_size);
+      p += it->st.st_size;
+    }
+
+    for (s = e->hash & mask; slots[s] != 0; s = (s + 1) & mask) {
+    }
+    slots[s] = (uint32_t) i + 1;
+  }
+
+  return hdr;
+}
+
+static struct file_cache *
+cache_wrap(const struct cache_header *hdr, size_t len, int mapped)
+{
+  struct file_cache *fc = calloc(1, sizeof(*fc));
+
+  fc->hdr     = hdr;
+  fc->len     = len;
+  fc->mapped  = mapped;
+  fc->checked = calloc(hdr->num_entries ? hdr->num_entries : 1,
+                       sizeof(*fc->checked));
+  return fc;
+}
+
+// Whether a NUL-terminated string starts at off, and ends within the block
+static int
+cache_string_ok(const struct cache_header *hdr, uint64_t off)
+{
+  return off < hdr->size &&
+         memchr((const char *) hdr + off, '\0', hdr->size - off) != NULL;
+}
+
+// Check that an entry's strings and body lie within a mapped snapshot, and
+// fit the buffers send_cached() copies them into
+static int
+cache_entry_ok(const struct cache_header *hdr, const struct cache_entry *e)
+{
+  if (!cache_string_ok(hdr, e->path) || !cache_string_ok(hdr, e->check) ||
+      e->data >= hdr->size || e->data_len >= hdr->size - e->data ||
+      ((const char *) hdr)[e->data + e->data_len] != '\0') {
+    return 0;
+  }
+  if (e->kind == CACHE_REDIRECT) {
+    return 1;
+  }
+  return e->kind == CACHE_FILE && e->data_len <= CACHE_HEADERS_MAX &&
+         (!e->has_body || (e->size <= CACHE_BODY_MAX &&
+                           e->body <= hdr->size &&
+                           e->size <= hdr->size - e->body));
+}
+
+// Check the layout of a mapped snapshot: the tables lie within it, and
+// every slot names an entry, with at least one free to end a probe
+static int
+cache_header_ok(const struct cache_header *hdr)
+{
+  const struct cache_entry  *entries;
+  const uint32_t            *slots;
+  uint64_t                   nslots = (uint64_t) hdr->mask + 1;
+  uint32_t                   i, num_free = 0;
+
+  if ((nslots & hdr->mask) != 0 || nslots > 2 * (uint64_t) CACHE_ENTRIES_MAX ||
+      hdr->num_entries > CACHE_ENTRIES_MAX ||
+      hdr->entries % sizeof(uint64_t) != 0 ||
+      hdr->slots % sizeof(uint32_t) != 0 ||
+      hdr->entries > hdr->size || hdr->slots > hdr->size ||
+      hdr->roots > hdr->size || hdr->roots_len > hdr->size - hdr->roots ||
+      hdr->num_entries > (hdr->size - hdr->entries) / sizeof(*entries) ||
+      nslots > (hdr->size - hdr->slots) / sizeof(*slots)) {
+    return 0;
+  }
+  entries = (const struct cache_entry *) ((const char *) hdr + hdr->entries);
+  slots   = (const uint32_t *) ((const char *) hdr + hdr->slots);
+  for (i = 0; i < nslots; i++) {
+    if (slots[i] > hdr->num_entries) {
+      return 0;
+    }
+    num_free += slots[i] == 0;
+  }
+  if (num_free == 0) {
+    return 0;
+  }
+  for (i = 0; i < hdr->num_entries; i++) {
+    if (!cache_entry_ok(hdr, &entries[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Map a snapshot, if there is one and it was taken of these docroots
+static struct file_cache *
+cache_map(const char *path, const char **roots, int num_roots)
+{
+  const struct cache_header  *hdr;
+  const char                 *p, *end;
+  struct stat                 st;
+  void                       *map;
+  int                         fd, i;
+
+  if ((fd = open(path, O_RDONLY, 0)) == -1) {
+    return NULL;
+  }
+  if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(*hdr) ||
+      (map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd,
+                  0)) == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+  close(fd);
+
+  hdr = map;
+  if (memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->size != (uint64_t) st.st_size || !cache_header_ok(hdr)) {
+    printf("cache: %s is damaged or truncated, ignoring it\n", path);
+    munmap(map, (size_t) st.st_size);
+    return NULL;
+  }
+  p   = (const char *) map + hdr->roots;
+  end = p + hdr->roots_len;
+  if ((int) hdr->num_roots != num_roots) {
+    goto stale;
+  }
+  for (i = 0; i < num_roots; i++) {
+    size_t len = strlen(roots[i]);
+
+    if ((size_t) (end - p) <= len || memcmp(p, roots[i], len + 1) != 0) {
+      goto stale;
+    }
+    p += len + 1;
+  }
+#ifdef MADV_WILLNEED
+  madvise(map, (size_t) st.st_size, MADV_WILLNEED);
+#endif
+  return cache_wrap(hdr, (size_t) st.st_size, 1);
+
+stale:
+  printf("cache: %s is not a snapshot of these docroots, ignoring it\n",
+         path);
+  munmap(map, (size_t) st.st_size);
+  return NULL;
+}
+
+static void
+cache_save(const char *path, const struct cache_header *hdr)
+{
+  char     tmp[CACHE_PATH_MAX];
+  size_t   done = 0;
+  ssize_t  n;
+  int      fd;
+
+  // Written aside and renamed into place, so a server mapping the old
+  // snapshot keeps a consistent copy
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+    perror(tmp);
+    return;
+  }
+  while (done < hdr->size &&
+         (n = write(fd, (const char *) hdr + done, hdr->size - done)) > 0) {
+    done += (size_t) n;
+  }
+  if (close(fd) == -1 || done < hdr->size || rename(tmp, path) == -1) {
+    perror(path);
+    unlink(tmp);
+    return;
+  }
+  printf("cache: saved snapshot %s (%zu bytes)\n", path, done);
+}
+
+// Build the cache for a set of docroots: from the snapshot if there is
+// one that fits, and otherwise by walking them (and saving a snapshot).
+static struct file_cache *
+file_cache_build(const char **roots, int num_roots, int num_walkers)
+{
+  struct cache_walk     w;
+  struct cache_header  *hdr;
+  struct file_cache    *fc;
+  pthread_t            *walkers;
+  int                   i;
+
+  if (cache_snapshot != NULL &&
+      (fc = cache_map(cache_snapshot, roots, num_roots)) != NULL) {
+    printf("cache: mapped snapshot %s, %u entries\n", cache_snapshot,
+           fc->hdr->num_entries);
+    return fc;
+  }
+
+  memset(&w, 0, sizeof(w));
+  pthread_mutex_init(&w.lock, NULL);
+  pthread_cond_init(&w.cond, NULL);
+  for (i = 0; i < num_roots; i++) {
+    cache_walk_push(&w, strdup(roots[i]), (int) strlen(roots[i]), 0);
+  }
+  walkers = malloc(sizeof(pthread_t) * (size_t) num_walkers);
+  for (i = 0; i < num_walkers; i++) {
+    pthread_create(&walkers[i], NULL, cache_walk_thread, &w);
+  }
+  for (i = 0; i < num_walkers; i++) {
+    pthread_join(walkers[i], NULL);
+  }
+  free(walkers);
+  free(w.dirs);
+  pthread_mutex_destroy(&w.lock);
+  pthread_cond_destroy(&w.cond);
+
+  hdr = cache_pack(roots, num_roots, w.items, w.num_items);
+  for (i = 0; i < w.num_items; i++) {
+    free(w.items[i].path);
+    free(w.items[i].check);
+    free(w.items[i].data);
+    free(w.items[i].body);
+  }
+  free(w.items);
+
+  printf("cache: %u entries from %d docroots, %lld bytes in memory\n",
+         hdr->num_entries, num_roots,
+         (long long) (hdr->size - hdr->roots - hdr->roots_len));
+  if (cache_snapshot != NULL) {
+    cache_save(cache_snapshot, hdr);
+  }
+  return cache_wrap(hdr, hdr->size, 0);
+}
+
+static void
+file_cache_free(struct file_cache *fc)
+{
+  if (fc == NULL) {
+    return;
+  }
+  if (fc->mapped) {
+    munmap((void *) fc->hdr, fc->len);
+  } else {
+    free((void *) fc->hdr);
+  }
+  free(fc->checked);
+  free(fc);
+}
+
+// Find a file in the cache, checking that it hasn't changed if it's been
+// a while. Returns NULL if it must be served the slow way.
+static const struct cache_entry *
+file_cache_find(struct file_cache *fc, const char *path)
+{
+  const struct cache_entry  *entries;
+  const uint32_t            *slots;
+  const struct cache_entry  *e;
+  struct stat                st;
+  size_t                     len;
+  uint32_t                   h, s, i;
+  int64_t                    now, checked;
+
+  if (fc == NULL) {
+    return NULL;
+  }
+  len     = strlen(path);
+  h       = cache_hash(path, len);
+  entries = (const struct cache_entry *) CACHE_AT(fc, fc->hdr->entries);
+  slots   = (const uint32_t *) CACHE_AT(fc, fc->hdr->slots);
+  for (s = h & fc->hdr->mask; ; s = (s + 1) & fc->hdr->mask) {
+    if (slots[s] == 0) {
+      return NULL;
+    }
+    i = slots[s] - 1;
+    e = &entries[i];
+    if (e->hash == h && strcmp(CACHE_AT(fc, e->path), path) == 0) {
+      break;
+    }
+  }
+
+  if ((checked = atomic_load(&fc->checked[i])) == -1) {
+    return NULL;
+  }
+  now = coarse_now_ms();
+  if (checked == 0 || now - checked >= CACHE_CHECK_MS) {
+    if (stat(CACHE_AT(fc, e->check), &st) == -1 ||
+        (uint64_t) st.st_size != e->size ||
+        (uint64_t) st.st_ino != e->ino ||
+        (int64_t) st.st_mtim.tv_sec != e->mtime_sec ||
+        (int64_t) st.st_mtim.tv_nsec != e->mtime_nsec) {
+      atomic_store(&fc->checked[i], -1);
+      return NULL;
+    }
+    atomic_store(&fc->checked[i], now);
+  }
+  return e;
+}
+
+// Packed site archives:
+//
+// A vhost can be served from an archive made by wpack (see wpack.h) rather
+// than from a directory tree: with -R for the default vhost, or a "root"
+// naming an archive file. The archive is mapped and kept open, so that a
+// request costs a binary search of the index and a sendfile() from the
+// one file, with nothing to open or close; the whole site sits together
+// in the page cache. Text goes out gzip-compressed to clients that accept
+// it, if the archive was packed with -z. The archive is a snapshot, and
+// doesn't see later changes to the directory it was packed from.
+
+struct site_archive {
+  const struct wpack_header  *hdr;
+  const struct wpack_entry   *entries;
+  size_t                      len;
+  int                         fd;        // For sendfile()
+  char                       *path;
+  struct site_archive        *next;      // In the configuration's list
+};
+
+#define ARCHIVE_AT(ar, off)  ((const char *) (ar)->hdr + (off))
+
+// Whether a NUL-terminated string starts at off, and ends within the archive
+static int
+archive_string_ok(const struct wpack_header *hdr, uint64_t off)
+{
+  return off < hdr->size &&
+         memchr((const char *) hdr + off, '\0', hdr->size - off) != NULL;
+}
+
+// Check that an entry's strings, headers and bodies lie within the archive
+static int
+archive_entry_ok(const struct wpack_header *hdr, const struct wpack_entry *e)
+{
+  return archive_string_ok(hdr, e->path) && archive_string_ok(hdr, e->type) &&
+         e->headers_len < WPACK_HEADERS_MAX &&
+         e->gz_headers_len < WPACK_HEADERS_MAX &&
+         e->headers < hdr->size &&
+         e->headers_len <= hdr->size - e->headers &&
+         e->gz_headers < hdr->size &&
+         e->gz_headers_len <= hdr->size - e->gz_headers &&
+         e->body <= hdr->size && e->size <= hdr->size - e->body &&
+         e->gz_body <= hdr->size && e->gz_size <= hdr->size - e->gz_body;
+}
+
+static struct site_archive *
+archive_open(const char *path)
+{
+  struct site_archive  *ar;
+  struct wpack_header  *hdr;
+  struct stat           st;
+  void                 *map;
+  uint32_t              i;
+  int                   fd;
+
+  if ((fd = open(path, O_RDONLY, 0)) == -1 || fstat(fd, &st) == -1) {
+    perror(path);
+    if (fd != -1) {
+      close(fd);
+    }
+    return NULL;
+  }
+  if ((size_t) st.st_size < sizeof(*hdr) ||
+      (map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd,
+                  0)) == MAP_FAILED) {
+    printf("archive: %s: not an archive\n", path);
+    close(fd);
+    return NULL;
+  }
+  hdr = map;
+  if (memcmp(hdr->magic, WPACK_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->size != (uint64_t) st.st_size || hdr->index > hdr->size ||
+      hdr->num_entries > (hdr->size - hdr->index) /
+                         sizeof(struct wpack_entry)) {
+    printf("archive: %s: not an archive, or truncated\n", path);
+    goto fail;
+  }
+  for (i = 0; i < hdr->num_entries; i++) {
+    const struct wpack_entry *e =
+      (const struct wpack_entry *) ((char *) map + hdr->index) + i;
+
+    if (!archive_entry_ok(hdr, e)) {
+      printf("archive: %s: entry %u is damaged\n", path, i);
+      goto fail;
+    }
+  }
+
+  ar          = calloc(1, sizeof(*ar));
+  ar->hdr     = hdr;
+  ar->entries = (const struct wpack_entry *) ((char *) map + hdr->index);
+  ar->len     = (size_t) st.st_size;
+  ar->fd      = fd;
+  ar->path    = strdup(path);
+  printf("archive: %s, %u entries\n", path, hdr->num_entries);
+  return ar;
+
+fail:
+  munmap(map, (size_t) st.st_size);
+  close(fd);
+  return NULL;
+}
+
+static void
+archive_close(struct site_archive *ar)
+{
+  munmap((void *) ar->hdr, ar->len);
+  close(ar->fd);
+  free(ar->path);
+  free(ar);
+}
+
+// Find the entry for a request target, by binary search of the index. With
+// a trailing slash, the target can only name a directory.
+static const struct wpack_entry *
+archive_find(const struct site_archive *ar, const char *target)
+{
+  size_t    len = strlen(target);
+  uint32_t  lo = 0, hi = ar->hdr->num_entries;
+  int       dir = 0;
+
+  if (len > 1 && target[len - 1] == '/') {
+    len--;
+    dir = 1;
+  }
+  while (lo < hi) {
+    uint32_t     mid  = lo + (hi - lo) / 2;
+    const char  *path = ARCHIVE_AT(ar, ar->entries[mid].path);
+    int          cmp  = strncmp(target, path, len);
+
+    if (cmp == 0 && path[len] != '\0') {
+      cmp = -1;  // path continues beyond the target
+    }
+    if (cmp == 0) {
+      const struct wpack_entry *e = &ar->entries[mid];
+
+      return dir && e->kind == WPACK_FILE ? NULL : e;
+    }
+    if (cmp < 0) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return NULL;
+}
+
+// Our host and domain names, looked up once at startup rather than on
+// every request.
+static char myhostname[256];
+static char mydomainname[256];
+
+// Configuration:
+//
+// Virtual hosts and tuning knobs can be read from a file (-f) like this:
+//
+//   port 8080
+//   threads 16
+//
+//   vhost example.org
+//     alias www.example.org
+//     root /srv/example
+//     default
+//   vhost static.example.org
+//     root /srv/static
+//     head_cache off
+//
+// The knobs come before the first vhost, and are named after the command
+// line options they stand for; options after -f override them. Each vhost
+// has a docroot (a directory, or an archive made by wpack), any number of
+// aliases, and its own HEAD cache entries. A request whose Host matches no
+// vhost goes to the default one, or gets a 404 if there isn't one. Without
+// a file there is a single default vhost serving ./website, or the archive
+// given with -R.
+//
+// The file is parsed into one immutable block holding the vhosts, their
+// names, and a hash table of the names whose size and seed are chosen, when
+// it is built, so that no two names share a slot. Finding the vhost for a
+// request is then one hash of its Host and one probe.
+//
+// SIGHUP rereads the file and swaps the new block in atomically; the knobs
+// that shape listeners and threads only take effect on restart. Each
+// responder publishes the block it is using in a slot of its own (a hazard
+// pointer), and the old block is freed once no slot refers to it, so a
+// request sees one configuration from start to finish.
+
+#define DOCROOT_MAX      256
+#define DEFAULT_ROOT     "website"
+#define VHOST_NAME_MAX   255
+#define CONFIG_LINE_MAX  1024
+
+struct vhost {
+  const char           *docroot;
+  uint64_t              id;       // Unique across reloads; keys cache entries
+  int                   head_cache;
+  struct file_cache    *files;    // The configuration's, shared
+  struct site_archive  *archive;  // If the docroot is an archive
+};
+
+struct vhost_slot {
+  uint32_t             hash;
+  uint32_t             len;
+  const char          *name;
+  const struct vhost  *vhost;  // NULL if the slot is empty
+};
+
+struct config {
+  struct file_cache        *files;
+  struct site_archive      *archives;
+  const struct vhost       *default_vhost;
+  const struct vhost_slot  *slots;
+  uint32_t                  mask;
+  uint32_t                  seed;
+  int                       num_vhosts;
+  struct vhost              vhosts[];   // Then the slots, then the strings
+};
+
+// Settings that only apply at startup. Unset ones are NULL or -1.
+struct config_knobs {
+  const char  *hosts[MAX_LISTENERS];
+  int          num_hosts;
+  const char  *port;
+  const char  *tls_port;
+  const char  *cert;
+  const char  *key;
+  int          backlog;
+  int          threads;
+  int          buffer_size;
+  int          max_conns;
+  int          max_queue;
+  int          rate;
+  int          burst;
+  int          min_rate;
+};
+
+struct config_hazard {
+  _Atomic(const struct config *)  config;
+  char                            pad[64 - sizeof(void *)];
+};
+
+static const char                     *default_root = DEFAULT_ROOT;  // -R
+static _Atomic(const struct config *)  current_config;
+static struct config_hazard           *config_hazards;
+static uint64_t                        vhost_next_id = 1;
+
+// A vhost as parsed, before it is frozen into a struct config
+struct vhost_spec {
+  char   *docroot;
+  char   *names[64];
+  int     num_names;
+  int     head_cache;
+  int     is_default;
+};
+
+static uint32_t
+vhost_hash(uint32_t seed, const char *name, size_t len)
+{
+  // FNV-1a over the lowercased name, then a final mix so that the low bits
+  // used for the slot depend on every byte
+  uint32_t  h = 2166136261u ^ seed;
+  size_t    i;
+
+  for (i = 0; i < len; i++) {
+    unsigned char ch = (unsigned char) name[i];
+
+    if (ch >= 'A' && ch <= 'Z') {
+      ch |= 0x20;
+    }
+    h = (h ^ ch) * 16777619u;
+  }
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  return h;
+}
+
+// The part of a Host header that names the host: without the port, and
+// without the trailing dot of a fully qualified name
+static size_t
+host_slice(const char *host)
+{
+  const char *end;
+
+  if (host[0] == '[') {
+    end = strchr(host, ']');
+    end = end != NULL ? end + 1 : host + strlen(host);
+  } else if ((end = strchr(host, ':')) == NULL) {
+    end = host + strlen(host);
+  }
+  if (end > host && end[-1] == '.') {
+    end--;
+  }
+  return (size_t) (end - host);
+}
+
+// The vhost serving a Host header, or NULL for a 404
+static const struct vhost *
+vhost_lookup(const struct config *cfg, const char *host)
+{
+  const struct vhost_slot  *slot;
+  size_t                    len;
+  uint32_t                  h;
+
+  if (host[0] == '\0') {
+    printf("Cannot parse HTTP Host: Header\n");
+    return NULL;
+  }
+  len  = host_slice(host);
+  h    = vhost_hash(cfg->seed, host, len);
+  slot = &cfg->slots[h & cfg->mask];
+  if (slot->vhost != NULL && slot->hash == h && slot->len == len &&
+      strncasecmp(slot->name, host, len) == 0) {
+    return slot->vhost;
+  }
+  return cfg->default_vhost;
+}
+
+// Build the immutable configuration from parsed vhosts, in a single
+// allocation. Returns NULL if no collision-free table could be found.
+static struct config *
+config_freeze(const struct vhost_spec *specs, int num_specs)
+{
+  struct config      *cfg;
+  struct vhost_slot  *slots;
+  char               *strings;
+  size_t              size, nstrings = 0;
+  uint32_t            nslots, nnames = 0, seed;
+  int                 i, j;
+
+  for (i = 0; i < num_specs; i++) {
+    nstrings += strlen(specs[i].docroot) + 1;
+    for (j = 0; j < specs[i].num_names; j++) {
+      nstrings += strlen(specs[i].names[j]) + 1;
+      nnames++;
+    }
+  }
+
+  for (nslots = 4; nslots < 2 * nnames; nslots *= 2)
+    ;
+  for (; nslots <= 65536; nslots *= 2) {
+    for (seed = 0; seed < 32; seed++) {
+      size = sizeof(struct config) +
+             (size_t) num_specs * sizeof(struct vhost) +
+             nslots * sizeof(struct vhost_slot) + nstrings;
+      cfg = calloc(1, size);
+      slots   = (struct vhost_slot *) (cfg->vhosts + num_specs);
+      strings = (char *) (slots + nslots);
+
+      cfg->slots      = slots;
+      cfg->mask       = nslots - 1;
+      cfg->seed       = seed * 0x9e3779b9u;
+      cfg->num_vhosts = num_specs;
+      for (i = 0; i < num_specs; i++) {
+        struct vhost *vh = &cfg->vhosts[i];
+
+        vh->docroot    = strcpy(strings, specs[i].docroot);
+        strings       += strlen(strings) + 1;
+        vh->id         = vhost_next_id + (uint64_t) i;
+        vh->head_cache = specs[i].head_cache;
+        if (specs[i].is_default) {
+          cfg->default_vhost = vh;
+        }
+        for (j = 0; j < specs[i].num_names; j++) {
+          size_t              len = strlen(specs[i].names[j]);
+          uint32_t            h   = vhost_hash(cfg->seed, specs[i].names[j],
+                                               len);
+          struct vhost_slot  *slot = &slots[h & cfg->mask];
+
+          if (slot->vhost != NULL) {
+            goto collision;
+          }
+          slot->hash  = h;
+          slot->len   = (uint32_t) len;
+          slot->name  = strcpy(strings, specs[i].names[j]);
+          slot->vhost = vh;
+          strings    += len + 1;
+        }
+      }
+      vhost_next_id += (uint64_t) num_specs;
+      return cfg;
+
+collision:
+      free(cfg);
+    }
+  }
+  return NULL;
+}
+
+static void
+vhost_specs_free(struct vhost_spec *specs, int num_specs)
+{
+  int i, j;
+
+  for (i = 0; i < num_specs; i++) {
+    free(specs[i].docroot);
+    for (j = 0; j < specs[i].num_names; j++) {
+      free(specs[i].names[j]);
+    }
+  }
+  free(specs);
+}
+
+static int
+config_number(const char *path, int line, const char *value, int *out)
+{
+  char *end;
+  long  n = value != NULL ? strtol(value, &end, 10) : -1;
+
+  if (value == NULL || *end != '\0' || n < 0 || n > 1000000000) {
+    printf("config: %s:%d: expected a number\n", path, line);
+    return -1;
+  }
+  *out = (int) n;
+  return 0;
+}
+
+// Read a configuration file. The knobs are stored in knobs, unless it is
+// NULL (on reload). Returns NULL, having said why, if the file is invalid.
+static struct config *
+config_load(const char *path, struct config_knobs *knobs)
+{
+  struct vhost_spec  *specs = NULL, *vh = NULL;
+  struct config      *cfg = NULL;
+  struct stat         st;
+  char                buf[CONFIG_LINE_MAX];
+  int                 num_specs = 0, lineno = 0, i, j, defaults = 0;
+  FILE               *f;
+
+  if ((f = fopen(path, "r")) == NULL) {
+    perror(path);
+    return NULL;
+  }
+  while (fgets(buf, sizeof(buf), f) != NULL) {
+    char  *save, *key, *value, *extra;
+    int   *num = NULL;
+
+    lineno++;
+    if ((key = strchr(buf, '#')) != NULL) {
+      *key = '\0';
+    }
+    if ((key = strtok_r(buf, " \t\r\n", &save)) == NULL) {
+      continue;
+    }
+    value = strtok_r(NULL, " \t\r\n", &save);
+    extra = strtok_r(NULL, " \t\r\n", &save);
+    if (extra != NULL) {
+      printf("config: %s:%d: unexpected \"%s\"\n", path, lineno, extra);
+      goto fail;
+    }
+
+    if (strcmp(key, "vhost") == 0 || (vh != NULL && strcmp(key, "alias") == 0)) {
+      if (value == NULL || strlen(value) > VHOST_NAME_MAX) {
+        printf("config: %s:%d: expected a host name\n", path, lineno);
+        goto fail;
+      }
+      // A name given twice would collide in every table config_freeze()
+      // tried, so catch it here where the line is known
+      value[host_slice(value)] = '\0';
+      for (i = 0; i < num_specs; i++) {
+        for (j = 0; j < specs[i].num_names; j++) {
+          if (strcasecmp(specs[i].names[j], value) == 0) {
+            printf("config: %s:%d: %s is already the name of a vhost\n",
+                   path, lineno, value);
+            goto fail;
+          }
+        }
+      }
+      if (key[0] == 'v') {
+        specs = realloc(specs, sizeof(*specs) * (size_t) (num_specs + 1));
+        vh    = &specs[num_specs++];
+        memset(vh, 0, sizeof(*vh));
+        vh->head_cache = 1;
+      }
+      if (vh->num_names == (int) (sizeof(vh->names) / sizeof(vh->names[0]))) {
+        printf("config: %s:%d: too many aliases\n", path, lineno);
+        goto fail;
+      }
+      vh->names[vh->num_names++] = strdup(value);
+      continue;
+    }
+    if (vh != NULL) {
+      if (strcmp(key, "root") == 0 && value != NULL) {
+        size_t len = strlen(value);
+
+        while (len > 1 && value[len - 1] == '/') {
+          value[--len] = '\0';
+        }
+        if (len >= DOCROOT_MAX || stat(value, &st) == -1 ||
+            (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))) {
+          printf("config: %s:%d: %s is not a directory or archive\n", path,
+                 lineno, value);
+          goto fail;
+        }
+        free(vh->docroot);
+        vh->docroot = strdup(value);
+      } else if (strcmp(key, "head_cache") == 0 && value != NULL &&
+                 (strcmp(value, "on") == 0 || strcmp(value, "off") == 0)) {
+        vh->head_cache = strcmp(value, "on") == 0;
+      } else if (strcmp(key, "default") == 0 && value == NULL) {
+        vh->is_default = 1;
+        defaults++;
+      } else {
+        printf("config: %s:%d: unknown vhost setting \"%s\"\n", path,
+               lineno, key);
+        goto fail;
+      }
+      continue;
+    }
+
+    // A knob
+    if (knobs == NULL) {
+      continue;
+    }
+    if (value == NULL) {
+      printf("config: %s:%d: %s needs a value\n", path, lineno, key);
+      goto fail;
+    }
+    if (strcmp(key, "listen") == 0) {
+      if (knobs->num_hosts < MAX_LISTENERS) {
+        knobs->hosts[knobs->num_hosts++] = strdup(value);
+      }
+    } else if (strcmp(key, "port") == 0) {
+      knobs->port = strdup(value);
+    } else if (strcmp(key, "tls_port") == 0) {
+      knobs->tls_port = strdup(value);
+    } else if (strcmp(key, "cert") == 0) {
+      knobs->cert = strdup(value);
+    } else if (strcmp(key, "key") == 0) {
+      knobs->key = strdup(value);
+    } else if (strcmp(key, "backlog") == 0) {
+      num = &knobs->backlog;
+    } else if (strcmp(key, "threads") == 0) {
+      num = &knobs->threads;
+    } else if (strcmp(key, "buffer_size") == 0) {
+      num = &knobs->buffer_size;
+    } else if (strcmp(key, "max_conns") == 0) {
+      num = &knobs->max_conns;
+    } else if (strcmp(key, "max_queue") == 0) {
+      num = &knobs->max_queue;
+    } else if (strcmp(key, "rate") == 0) {
+      num = &knobs->rate;
+    } else if (strcmp(key, "burst") == 0) {
+      num = &knobs->burst;
+    } else if (strcmp(key, "min_rate") == 0) {
+      num = &knobs->min_rate;
+    } else {
+      printf("config: %s:%d: unknown setting \"%s\"\n", path, lineno, key);
+      goto fail;
+    }
+    if (num != NULL && config_number(path, lineno, value, num) == -1) {
+      goto fail;
+    }
+  }
+
+  if (num_specs == 0) {
+    printf("config: %s: no vhosts\n", path);
+    goto fail;
+  }
+  if (defaults > 1) {
+    printf("config: %s: more than one default vhost\n", path);
+    goto fail;
+  }
+  for (i = 0; i < num_specs; i++) {
+    if (specs[i].docroot == NULL) {
+      printf("config: %s: vhost %s has no root\n", path, specs[i].names[0]);
+      goto fail;
+    }
+  }
+  if ((cfg = config_freeze(specs, num_specs)) == NULL) {
+    printf("config: %s: too many vhost names\n", path);
+    goto fail;
+  }
+  for (i = 0; i < num_specs; i++) {
+    printf("config: vhost %s -> %s%s%s", specs[i].names[0],
+           specs[i].docroot, specs[i].is_default ? " (default)" : "",
+           specs[i].num_names > 1 ? ", aliases" : "");
+    for (j = 1; j < specs[i].num_names; j++) {
+      printf(" %s", specs[i].names[j]);
+    }
+    printf("\n");
+  }
+
+fail:
+  fclose(f);
+  vhost_specs_free(specs, num_specs);
+  return cfg;
+}
+
+// Without a configuration file: one default vhost, serving ./website (or
+// the -R archive) under our host name.
+static struct config *
+config_default(void)
+{
+  struct vhost_spec  *spec = calloc(1, sizeof(struct vhost_spec));
+  struct config      *cfg;
+
+  spec->docroot    = strdup(default_root);
+  spec->head_cache = 1;
+  spec->is_default = 1;
+  spec->names[spec->num_names++] = strdup(myhostname);
+  if (mydomainname[0] != '\0' && strcmp(mydomainname, "(none)") != 0) {
+    char name[512];
+
+    snprintf(name, sizeof(name), "%s.%s", myhostname, mydomainname);
+    spec->names[spec->num_names++] = strdup(name);
+  }
+  cfg = config_freeze(spec, 1);
+  vhost_specs_free(spec, 1);
+  return cfg;
+}
+
+// Open the configuration's archives, and build the static file cache for
+// its other docroots. Returns -1, having said why, if an archive won't
+// open.
+static int
+config_warm(struct config *cfg)
+{
+  const char  **roots = malloc(sizeof(char *) * (size_t) cfg->num_vhosts);
+  struct stat   st;
+  int           num_roots = 0, i, j;
+
+  for (i = 0; i < cfg->num_vhosts; i++) {
+    struct vhost         *vh = &cfg->vhosts[i];
+    struct site_archive  *ar;
+
+    if (stat(vh->docroot, &st) == 0 && S_ISREG(st.st_mode)) {
+      for (ar = cfg->archives; ar != NULL; ar = ar->next) {
+        if (strcmp(ar->path, vh->docroot) == 0) {
+          break;
+        }
+      }
+      if (ar == NULL) {
+        if ((ar = archive_open(vh->docroot)) == NULL) {
+          free(roots);
+          return -1;
+        }
+        ar->next      = cfg->archives;
+        cfg->archives = ar;
+      }
+      vh->archive = ar;
+      continue;
+    }
+    for (j = 0; j < num_roots; j++) {
+      if (strcmp(roots[j], vh->docroot) == 0) {
+        break;
+      }
+    }
+    if (j == num_roots) {
+      roots[num_roots++] = vh->docroot;
+    }
+  }
+  if (cache_enabled && num_roots > 0) {
+    cfg->files = file_cache_build(roots, num_roots, num_threads);
+  }
+  for (i = 0; i < cfg->num_vhosts; i++) {
+    cfg->vhosts[i].files = cfg->files;
+  }
+  free(roots);
+  return 0;
+}
+
+static void
+config_free(const struct config *cfg)
+{
+  struct site_archive *ar, *next;
+
+  for (ar = cfg->archives; ar != NULL; ar = next) {
+    next = ar->next;
+    archive_close(ar);
+  }
+  file_cache_free(cfg->files);
+  free((void *) cfg);
+}
+
+// Get the current configuration, and keep it from being freed until
+// config_release(). Each responder may hold one at a time.
+static const struct config *
+config_hold(int id)
+{
+  const struct config *cfg = atomic_load(&current_config), *again;
+
+  while (1) {
+    atomic_store(&config_hazards[id].config, cfg);
+    if ((again = atomic_load(&current_config)) == cfg) {
+      return cfg;
+    }
+    cfg = again;
+  }
+}
+
+static void
+config_release(int id)
+{
+  atomic_store_explicit(&config_hazards[id].config, NULL,
+                        memory_order_release);
+}
+
+// Reread the configuration file, and swap its vhosts in
+static void
+config_reload(const char *path)
+{
+  struct config        *cfg = config_load(path, NULL);
+  const struct config  *old;
+  int                   id;
+
+  if (cfg == NULL) {
+    printf("config: reload failed, keeping the current configuration\n");
+    return;
+  }
+  if (config_warm(cfg) == -1) {
+    printf("config: reload failed, keeping the current configuration\n");
+    config_free(cfg);
+    return;
+  }
+  old = atomic_exchange(&current_config, cfg);
+
+  // Wait for requests still using the old configuration
+  for (id = 0; id < num_threads; id++) {
+    while (atomic_load(&config_hazards[id].config) == old) {
+      if (shutdown_requested) {
+        return;
+      }
+      poll(NULL, 0, 1);
+    }
+  }
+  config_free(old);
+  printf("config: reloaded %s, %d vhosts\n", path, cfg->num_vhosts);
+}
+
+// Tracing and phase timing:
+//
+// Each request passes through the same phases: reading its headers,
+// parsing them, checking the Host header, opening the file or directory,
+// and sending the response. The boundaries between phases are static
+// tracepoints (USDT probes, built in when <sys/sdt.h> is available), each
+// a single nop until a tracer attaches; phases.bt and slow.bt turn them
+// into a breakdown with bpftrace.
+//
+// With -T the server also times the phases itself, into a log2 histogram
+// per phase and responder, printed on SIGUSR1 and at exit. A phase
+// boundary then costs a clock_gettime() from the vDSO; without -T it
+// costs a test of a global flag.
+//
+// The read phase starts when the first bytes of a request arrive, so time
+// that a keep-alive connection sits idle isn't counted. Phases a request
+// skips aren't recorded for it: a proxied request has no open phase, for
+// instance.
+
+#ifdef WITH_SDT
+#define TRACE1(name, a)     DTRACE_PROBE1(wserver, name, a)
+#define TRACE2(name, a, b)  DTRACE_PROBE2(wserver, name, a, b)
+#else
+#define TRACE1(name, a)     do { } while (0)
+#define TRACE2(name, a, b)  do { } while (0)
+#endif
+
+enum phase_mark {
+  MARK_START,     // First bytes of the request received
+  MARK_READ,      // Header block complete
+  MARK_PARSED,
+  MARK_HOST,      // Host header checked
+  MARK_OPENED,    // File or directory opened
+  MARK_SENT,      // Response sent
+  NUM_MARKS
+};
+
+#define NUM_PHASES    (NUM_MARKS - 1)
+#define HIST_BUCKETS  32    // Log2 of nanoseconds, so the last is 1 s and up
+
+static const char *phase_names[NUM_PHASES] = {
+  "read", "parse", "host", "open", "send"
+};
+
+// Each responder only updates its own histogram, so relaxed loads and
+// stores suffice, and the printer sees values at most one request stale.
+struct phase_hist {
+  _Atomic uint64_t  count[NUM_PHASES][HIST_BUCKETS];
+  _Atomic uint64_t  total_ns[NUM_PHASES];
+};
+
+static int                phase_timing = 0;
+static struct phase_hist *phase_hists;   // One per responder
+static __thread uint64_t  phase_marks[NUM_MARKS];
+
+static uint64_t
+phase_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+#define PHASE_MARK(mark)                  \
+  do {                                    \
+    if (phase_timing) {                   \
+      phase_marks[mark] = phase_now();    \
+    }                                     \
+  } while (0)
+
+static void
+hist_add(_Atomic uint64_t *counter, uint64_t n)
+{
+  atomic_store_explicit(counter,
+                        atomic_load_explicit(counter, memory_order_relaxed) + n,
+                        memory_order_relaxed);
+}
+
+// The response has gone: add the request's phases to the responder's
+// histograms, and start afresh for the next request.
+static void
+phase_done(int id)
+{
+  struct phase_hist  *h = &phase_hists[id];
+  int                 p;
+
+  if (!phase_timing) {
+    return;
+  }
+  phase_marks[MARK_SENT] = phase_now();
+  for (p = 0; p < NUM_PHASES; p++) {
+    if (phase_marks[p] != 0 && phase_marks[p + 1] >= phase_marks[p]) {
+      uint64_t  ns = phase_marks[p + 1] - phase_marks[p];
+      int       b  = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+
+      hist_add(&h->count[p][b < HIST_BUCKETS ? b : HIST_BUCKETS - 1], 1);
+      hist_add(&h->total_ns[p], ns);
+    }
+  }
+  memset(phase_marks, 0, sizeof(phase_marks));
+}
+
+static void
+format_ns(char *buf, size_t len, double ns)
+{
+  if (ns < 1e6) {
+    snprintf(buf, len, "%.1f us", ns / 1e3);
+  } else {
+    snprintf(buf, len, "%.1f ms", ns / 1e6);
+  }
+}
+
+// Print each phase's count, mean, and the bucket bounds of its median and
+// 99th percentile, summed over all responders.
+static void
+phase_print(void)
+{
+  int p, b, id;
+
+  printf("timing: phase   requests       mean       p50       p99\n");
+  for (p = 0; p < NUM_PHASES; p++) {
+    uint64_t  count[HIST_BUCKETS] = { 0 };
+    uint64_t  n = 0, total = 0, seen = 0;
+    double    p50 = 0, p99 = 0;
+    char      mean_s[16], p50_s[16], p99_s[16];
+
+    for (id = 0; id < num_threads; id++) {
+      for (b = 0; b < HIST_BUCKETS; b++) {
+        count[b] += atomic_load_explicit(&phase_hists[id].count[p][b],
+                                         memory_order_relaxed);
+      }
+      total += atomic_load_explicit(&phase_hists[id].total_ns[p],
+                                    memory_order_relaxed);
+    }
+    for (b = 0; b < HIST_BUCKETS; b++) {
+      n += count[b];
+    }
+    if (n == 0) {
+      printf("timing: %-6s %9d\n", phase_names[p], 0);
+      continue;
+    }
+    for (b = 0; b < HIST_BUCKETS; b++) {
+      seen += count[b];
+      if (p50 == 0 && seen * 2 >= n) {
+        p50 = (double) (1ULL << b);
+      }
+      if (p99 == 0 && seen * 100 >= n * 99) {
+        p99 = (double) (1ULL << b);
+      }
+    }
+    format_ns(mean_s, sizeof(mean_s), (double) total / (double) n);
+    format_ns(p50_s, sizeof(p50_s), p50);
+    format_ns(p99_s, sizeof(p99_s), p99);
+    printf("timing: %-6s %9llu %10s  <%8s  <%8s\n", phase_names[p],
+           (unsigned long long) n, mean_s, p50_s, p99_s);
+  }
+}
+
+// Request parsing:
+
+#define BODY_DISCARD_MAX  (1024 * 1024)
+
+struct request {
+  char       method[16];
+  char       target[1024];
+  char       host[256];
+  int        head;
+  int        http10;
+  int        close;
+  int        expect_continue;
+  int        chunked;            // Body uses chunked transfer coding
+  int        has_length;         // Body is framed by a Content-Length
+  long long  body_left;          // Body bytes still to read (or -1 = bad)
+  long long  chunk_left;         // Bytes left in the current chunk
+  int        chunk_crlf;         // CRLF after a chunk's data still to read
+  int        body_done;
+  int        upgrade_h2c;        // Client asks to switch to HTTP/2
+  char       http2_settings[128];
+  int        gzip;               // Client accepts gzip content coding
+
+  const struct vhost *vhost;     // NULL if no vhost serves this Host
+};
+
+static void
+conn_consume(struct connection *c, size_t n)
+{
+  memmove(c->in, c->in + n, c->in_len - n);
+  c->in_len -= n;
+}
+
+// Receive more data into the connection's input buffer. Returns the number
+// of bytes read, 0 if the client closed the connection or the buffer is
+// full, and -1 on error.
+static ssize_t
+conn_fill(struct connection *c)
+{
+  ssize_t rlen;
+
+  if (c->in_len == REQ_BUFLEN) {
+    return 0;
+  }
+  rlen = conn_recv(c, c->in + c->in_len, REQ_BUFLEN - c->in_len);
+  if (rlen > 0) {
+    c->in_len += (size_t) rlen;
+  }
+  return rlen;
+}
+
+// Wait for a complete header block in the input buffer. Returns its length
+// including the blank line, 0 if the connection closed, or -1 on error. A
+// header block larger than the buffer is reported as -2. A client's
+// request starts when its first bytes arrive; an upstream's response isn't
+// a request, and is read without marking one.
+static ssize_t
+read_headers(struct connection *c, int request)
+{
+  size_t   searched = 0;
+  char    *end;
+  ssize_t  rlen;
+
+  if (request && c->in_len > 0) {
+    // Pipelined behind the previous request
+    TRACE1(request__start, c->fd);
+    PHASE_MARK(MARK_START);
+  }
+  while (1) {
+    // Only search the newly arrived bytes, plus enough of the old ones to
+    // catch a terminator split across two reads.
+    c->in[c->in_len] = '\0';
+    if ((end = strstr(c->in + searched, "\r\n\r\n")) != NULL) {
+      return end + 4 - c->in;
+    }
+    searched = c->in_len > 3 ? c->in_len - 3 : 0;
+
+    if (c->in_len == REQ_BUFLEN) {
+      return -2;
+    }
+    rlen = conn_fill(c);
+    if (rlen ==  0) { 
+      // Connection closed by client
+      return 0;
+    } else if (rlen < 0)  {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("Cannot read HTTP headers");
+      }
+      return -1;
+    }
+    if (request && c->in_len == (size_t) rlen) {
+      TRACE1(request__start, c->fd);
+      PHASE_MARK(MARK_START);
+    }
+
+    if (shutdown_requested) {
+      printf("shutdown requested\n");
+      return -1;
+    }
+  }
+}
+
+// Copy the value of a header line into dst, with surrounding whitespace
+// removed.
+static void
+header_value(const char *line, const char *eol, char *dst, size_t dstlen)
+{
+  const char *colon = memchr(line, ':', (size_t) (eol - line));
+  size_t      len;
+
+  dst[0] = '\0';
+  if (colon == NULL) {
+    return;
+  }
+  for (line = colon + 1; line < eol && (*line == ' ' || *line == '\t'); line++)
+    ;
+  while (eol > line && (eol[-1] == ' ' || eol[-1] == '\t')) {
+    eol--;
+  }
+  len = (size_t) (eol - line);
+  if (len >= dstlen) {
+    len = dstlen - 1;
+  }
+  memcpy(dst, line, len);
+  dst[len] = '\0';
+}
+
+#define HEADER_IS(line, name) \
+  (strncasecmp((line), name ":", sizeof(name)) == 0)
+
+// Whether an Accept-Encoding header allows gzip. A q-value of zero
+// refuses it; "*" is not taken to include it.
+static int
+accepts_gzip(const char *value)
+{
+  const char *p = value;
+
+  while (*p != '\0') {
+    while (*p == ' ' || *p == ',') {
+      p++;
+    }
+    if (strncasecmp(p, "gzip", 4) == 0 &&
+        (p[4] == '\0' || p[4] == ',' || p[4] == ';' || p[4] == ' ')) {
+      p += 4;
+      while (*p == ' ' || *p == ';') {
+        p++;
+      }
+      return strncasecmp(p, "q=", 2) != 0 || strtod(p + 2, NULL) > 0;
+    }
+    while (*p != '\0' && *p != ',') {
+      p++;
+    }
+  }
+  return 0;
+}
+
+// Parse the request line and the headers we act on. Returns -1 if the
+// request is malformed.
+static int
+parse_request(char *headers, size_t len, struct request *req)
+{
+  char   version[16];
+  char   value[256];
+  char  *line, *eol;
+  char  *end = headers + len;
+
+  memset(req, 0, sizeof(*req));
+
+  // Parse the HTTP request, to determine the method and requested filename.
+  // Note that we specify a maximum field width, to avoid buffer overflow
+  // attacks when parsing long filenames.
+  if (sscanf(headers, "%15s %1023s %15s", req->method, req->target,
+             version) != 3) {
+    return -1;
+  }
+  // Only origin-form targets are served; everything below indexes the
+  // path as if it began with a slash
+  if (req->target[0] != '/') {
+    return -1;
+  }
+  if (strcmp(version, "HTTP/1.1") == 0) {
+    req->http10 = 0;
+  } else if (strcmp(version, "HTTP/1.0") == 0) {
+    req->http10 = 1;
+    req->close  = 1;
+  } else {
+    return -1;
+  }
+  req->head = (strcmp(req->method, "HEAD") == 0);
+
+  // Walk the header lines. Note that the header block ends with an empty
+  // line, which terminates the loop.
+  line = memchr(headers, '\n', len);
+  for (line = line + 1; line < end; line = eol + 1) {
+    if ((eol = memchr(line, '\n', (size_t) (end - line))) == NULL) {
+      break;
+    }
+    if (eol > line && eol[-1] == '\r') {
+      eol--;
+    }
+    if (eol == line) {
+      break;
+    }
+
+    if (HEADER_IS(line, "Host")) {
+      header_value(line, eol, req->host, sizeof(req->host));
+    } else if (HEADER_IS(line, "Content-Length")) {
+      char *num_end;
+
+      // A repeated length is refused outright: a proxy behind us could pick
+      // a different one, and see another request in the body
+      header_value(line, eol, value, sizeof(value));
+      req->body_left = strtoll(value, &num_end, 10);
+      if (num_end == value || *num_end != '\0' || req->body_left < 0 ||
+          req->has_length) {
+        return -1;
+      }
+      req->has_length = 1;
+    } else if (HEADER_IS(line, "Transfer-Encoding")) {
+      header_value(line, eol, value, sizeof(value));
+      if (strcasecmp(value, "chunked") != 0 || req->chunked) {
+        return -1;    // We can't find the end of any other coding
+      }
+      req->chunked = 1;
+    } else if (HEADER_IS(line, "Connection")) {
+      header_value(line, eol, value, sizeof(value));
+      if (strcasecmp(value, "close") == 0) {
+        req->close = 1;
+      }
+    } else if (HEADER_IS(line, "Expect")) {
+      header_value(line, eol, value, sizeof(value));
+      req->expect_continue = (strcasecmp(value, "100-continue") == 0);
+    } else if (HEADER_IS(line, "Upgrade")) {
+      header_value(line, eol, value, sizeof(value));
+      req->upgrade_h2c = (strcasecmp(value, "h2c") == 0);
+    } else if (HEADER_IS(line, "HTTP2-Settings")) {
+      header_value(line, eol, req->http2_settings,
+                   sizeof(req->http2_settings));
+    } else if (HEADER_IS(line, "Accept-Encoding")) {
+      header_value(line, eol, value, sizeof(value));
+      req->gzip = accepts_gzip(value);
+    }
+
+    if (*eol == '\r') {
+      eol++;
+    }
+  }
+
+  if (req->chunked && req->has_length) {
+    return -1;    // Framed two ways; the same goes for responses
+  }
+  req->body_done = !req->chunked && req->body_left == 0;
+  return 0;
+}
+
+// Read up to len bytes of the request body into buf, decoding chunked
+// transfer coding if necessary. The body is streamed through the
+// connection's bounded input buffer, however large it is. Returns the
+// number of bytes read, 0 at the end of the body, and -1 on error.
+static ssize_t
+read_body(struct connection *c, struct request *req, char *buf, size_t len)
+{
+  size_t  n;
+
+  while (!req->body_done) {
+    if (req->chunked && req->chunk_left == 0) {
+      char  *eol;
+      char  *num_end;
+
+      // Need the CRLF ending the previous chunk and the next chunk-size
+      // line (or, after the last chunk, the trailer lines) in the buffer.
+      c->in[c->in_len] = '\0';
+      if (req->chunk_crlf) {
+        if (c->in_len < 2) {
+          if (conn_fill(c) <= 0) {
+            return -1;
+          }
+          continue;
+        }
+        if (c->in[0] != '\r' || c->in[1] != '\n') {
+          return -1;
+        }
+        conn_consume(c, 2);
+        req->chunk_crlf = 0;
+        continue;
+      }
+      if ((eol = strstr(c->in, "\r\n")) == NULL) {
+        if (conn_fill(c) <= 0) {
+          return -1;
+        }
+        continue;
+      }
+      if (req->chunk_left == 0 && req->body_left == -1) {
+        // Reading trailers: an empty line ends the body
+        conn_consume(c, (size_t) (eol + 2 - c->in));
+        if (eol == c->in) {
+          req->body_done = 1;
+        }
+        continue;
+      }
+      req->chunk_left = strtoll(c->in, &num_end, 16);
+      if (num_end == c->in || req->chunk_left < 0) {
+        return -1;
+      }
+      conn_consume(c, (size_t) (eol + 2 - c->in));
+      if (req->chunk_left == 0) {
+        req->body_left = -1;  // Last chunk; trailers follow
+      }
+      continue;
+    }
+
+    if (c->in_len == 0 && conn_fill(c) <= 0) {
+      return -1;
+    }
+    n = c->in_len < len ? c->in_len : len;
+    if (req->chunked) {
+      if ((long long) n > req->chunk_left) {
+        n = (size_t) req->chunk_left;
+      }
+    } else if ((long long) n > req->body_left) {
+      n = (size_t) req->body_left;
+    }
+    memcpy(buf, c->in, n);
+    conn_consume(c, n);
+
+    if (req->chunked) {
+      req->chunk_left -= (long long) n;
+      req->chunk_crlf  = (req->chunk_left == 0);
+    } else {
+      req->body_left -= (long long) n;
+      req->body_done  = (req->body_left == 0);
+    }
+    return (ssize_t) n;
+  }
+  return 0;
+}
+
+// Read and throw away whatever is left of a request body, so that the next
+// request on the connection starts in the right place. Returns -1 if the
+// body is malformed or too large to be worth reading, in which case the
+// connection must be closed instead.
+static int
+discard_body(struct connection *c, struct request *req)
+{
+  char       buf[BUFLEN];
+  ssize_t    rlen;
+  long long  discarded = 0;
+
+  if (req->body_done) {
+    return 0;
+  }
+  if (!req->chunked && req->body_left > BODY_DISCARD_MAX) {
+    return -1;
+  }
+  while ((rlen = read_body(c, req, buf, sizeof(buf))) > 0) {
+    if ((discarded += rlen) > BODY_DISCARD_MAX) {
+      return -1;
+    }
+  }
+  return rlen == 0 ? 0 : -1;
+}
+
+// HEAD response cache:
+//
+// Health checkers and CDNs probe the same few URLs with HEAD requests over
+// and over. Each responder keeps the complete response to recent HEAD
+// requests for a second, so a flood of them costs one header write apiece
+// rather than a path lookup and header generation. Entries belong to a
+// vhost, so a reload, which gives every vhost a new id, empties the cache.
+// An archive may answer differently for clients that accept gzip, so
+// whether the client did is part of the key.
+
+#define HEAD_CACHE_SIZE  64
+#define HEAD_CACHE_TTL   1    // Seconds
+
+struct head_cache_entry {
+  char      target[256];
+  uint64_t  vhost_id;
+  int       gzip;
+  time_t    expires;
+  size_t    len;
+  char      response[HEAD_CACHE_RESP];
+};
+
+static __thread struct head_cache_entry head_cache[HEAD_CACHE_SIZE];
+
+static time_t
+coarse_now(void)
+{
+  return (time_t) (coarse_now_ms() / 1000);
+}
+
+static struct head_cache_entry *
+head_cache_slot(const struct request *req)
+{
+  // FNV-1a
+  unsigned int  h = 2166136261u ^ (unsigned int) req->vhost->id;
+  const char   *target;
+
+  h = (h ^ (unsigned int) req->gzip) * 16777619u;
+  for (target = req->target; *target != '\0'; target++) {
+    h = (h ^ (unsigned char) *target) * 16777619u;
+  }
+  return &head_cache[h % HEAD_CACHE_SIZE];
+}
+
+// Answer a HEAD request from the cache, if possible. Returns 1 if it was
+// answered (check *rc for the send result), 0 if not.
+static int
+head_cache_lookup(struct connection *c, const struct request *req, int *rc)
+{
+  struct head_cache_entry *e;
+
+  if (strlen(req->target) >= sizeof(e->target) || req->close) {
+    return 0;
+  }
+  e = head_cache_slot(req);
+  if (e->len == 0 || e->expires < coarse_now() ||
+      e->vhost_id != req->vhost->id || e->gzip != req->gzip ||
+      strcmp(e->target, req->target) != 0) {
+    return 0;
+  }
+  *rc = send_response(c, e->response, e->len);
+  return 1;
+}
+
+static void
+head_cache_begin(struct connection *c, const struct request *req,
+                 struct head_cache_entry **slot)
+{
+  *slot = NULL;
+  if (strlen(req->target) < sizeof((*slot)->target) && !req->close) {
+    *slot          = head_cache_slot(req);
+    (*slot)->len   = 0;
+    c->capture     = (*slot)->response;
+    c->capture_len = 0;
+  }
+}
+
+static void
+head_cache_end(struct connection *c, const struct request *req,
+               struct head_cache_entry *slot)
+{
+  // Only cache successful responses, and redirects
+  if (slot != NULL && c->capture != NULL &&
+      (strncmp(c->capture, "HTTP/1.1 200", 12) == 0 ||
+       strncmp(c->capture, "HTTP/1.1 307", 12) == 0)) {
+    strcpy(slot->target, req->target);
+    slot->vhost_id = req->vhost->id;
+    slot->gzip     = req->gzip;
+    slot->len      = c->capture_len;
+    slot->expires  = coarse_now() + HEAD_CACHE_TTL;
+  }
+  c->capture = NULL;
+}
+
+// Reverse proxy:
+//
+// Requests whose path starts with a configured prefix are forwarded to
+// upstream HTTP servers instead of being served from the website
+// directory. Each responder keeps its idle upstream connections in a small
+// thread-local pool, so that successive requests reuse a connection rather
+// than each paying for a new TCP handshake. Only the headers, which are
+// rewritten, and chunk framing pass through the proxy's own buffers: bodies
+// are moved between the two sockets with splice(), through a pipe owned by
+// the responder, so they are never copied into userspace.
+//
+// Each route balances its requests across its upstreams, either
+// round-robin or to whichever has the fewest requests in flight. An
+// upstream is marked down as soon as a connection to it fails, and is then
+// left alone until the health-check thread finds it answering again. The
+// health checker also probes upstreams that have had no traffic for a
+// while; for busy ones, their traffic already shows that they're up.
+
+#define MAX_ROUTES             16
+#define MAX_UPSTREAMS          32
+#define MAX_ROUTE_UPSTREAMS     8
+#define PROXY_HDRS_MAX         (REQ_BUFLEN + 512)
+#define POOL_SIZE               8       // Idle upstream connections per responder
+#define POOL_IDLE_MS         4000       // Below upstream idle timeouts
+#define PROXY_CONNECT_MS     1000
+#define PROXY_IO_MS         30000       // Give up on a silent upstream after this
+#define HEALTH_INTERVAL_MS   2000
+#define SPLICE_CHUNK        65536
+
+struct upstream {
+  char                     name[256];   // host:port, as configured
+  struct sockaddr_storage  addr;
+  socklen_t                addrlen;
+  atomic_int               up;
+  atomic_int               active;      // Requests in flight
+  atomic_llong             last_ok_ms;  // Last sign of life
+};
+
+struct proxy_route {
+  char              prefix[256];
+  size_t            prefix_len;
+  struct upstream  *upstreams[MAX_ROUTE_UPSTREAMS];
+  int               num_upstreams;
+  atomic_uint       next;               // Round-robin position
+};
+
+struct proxy_config {
+  struct proxy_route  routes[MAX_ROUTES];
+  int                 num_routes;
+  struct upstream     upstreams[MAX_UPSTREAMS];  // Shared between routes
+  int                 num_upstreams;
+  int                 least_conns;
+  const char         *check_path;
+};
+
+static struct proxy_config proxy;
+
+// Find or add the upstream named by the len bytes at spec, which are in the
+// form host:port, with an IPv6 address in brackets.
+static struct upstream *
+proxy_upstream(const char *spec, size_t len)
+{
+  struct addrinfo   hints, *ai;
+  struct upstream  *u;
+  char              name[sizeof(u->name)];
+  char             *host = name, *port;
+  int               i, err;
+
+  if (len == 0 || len >= sizeof(name)) {
+    return NULL;
+  }
+  memcpy(name, spec, len);
+  name[len] = '\0';
+  for (i = 0; i < proxy.num_upstreams; i++) {
+    if (strcmp(proxy.upstreams[i].name, name) == 0) {
+      return &proxy.upstreams[i];
+    }
+  }
+  if (proxy.num_upstreams == MAX_UPSTREAMS) {
+    return NULL;
+  }
+  u = &proxy.upstreams[proxy.num_upstreams];
+  strcpy(u->name, name);
+
+  if (*host == '[') {
+    host++;
+    if ((port = strchr(host, ']')) == NULL || port[1] != ':') {
+      return NULL;
+    }
+    *port = '\0';
+    port += 2;
+  } else {
+    if ((port = strrchr(host, ':')) == NULL) {
+      return NULL;
+    }
+    *port++ = '\0';
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family   = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags    = AI_NUMERICSERV;
+  if ((err = getaddrinfo(host, port, &hints, &ai)) != 0) {
+    printf("proxy: cannot resolve %s: %s\n", u->name, gai_strerror(err));
+    return NULL;
+  }
+  memcpy(&u->addr, ai->ai_addr, ai->ai_addrlen);
+  u->addrlen = ai->ai_addrlen;
+  freeaddrinfo(ai);
+
+  atomic_init(&u->up, 1);
+  atomic_init(&u->active, 0);
+  atomic_init(&u->last_ok_ms, 0);
+  proxy.num_upstreams++;
+  return u;
+}
+
+// Add a route given as prefix=host:port[,host:port]...
+static int
+proxy_add_route(const char *arg)
+{
+  const char          *eq = strchr(arg, '=');
+  const char          *p, *comma;
+  struct proxy_route  *r = &proxy.routes[proxy.num_routes];
+  struct upstream     *u;
+
+  if (proxy.num_routes == MAX_ROUTES || arg[0] != '/' || eq == NULL ||
+      (size_t) (eq - arg) >= sizeof(r->prefix)) {
+    printf("proxy: bad route %s\n", arg);
+    return -1;
+  }
+  r->prefix_len = (size_t) (eq - arg);
+  memcpy(r->prefix, arg, r->prefix_len);
+  r->prefix[r->prefix_len] = '\0';
+  r->num_upstreams = 0;
+  atomic_init(&r->next, 0);
+
+  for (p = eq + 1; ; p = comma + 1) {
+    size_t len = (comma = strchr(p, ',')) != NULL ? (size_t) (comma - p)
+                                                  : strlen(p);
+
+    if (r->num_upstreams == MAX_ROUTE_UPSTREAMS ||
+        (u = proxy_upstream(p, len)) == NULL) {
+      printf("proxy: bad upstream in route %s\n", arg);
+      return -1;
+    }
+    r->upstreams[r->num_upstreams++] = u;
+    if (comma == NULL) {
+      break;
+    }
+  }
+  proxy.num_routes++;
+  return 0;
+}
+
+// The route with the longest prefix matching the target, if any. A prefix
+// matches whole path segments: /api matches /api and /api/x, not /apix.
+static struct proxy_route *
+proxy_match(const char *target)
+{
+  struct proxy_route  *best = NULL;
+  int                  i;
+
+  for (i = 0; i < proxy.num_routes; i++) {
+    struct proxy_route *r   = &proxy.routes[i];
+    char                end = target[r->prefix_len];
+
+    if (strncmp(target, r->prefix, r->prefix_len) == 0 &&
+        (r->prefix[r->prefix_len - 1] == '/' || end == '\0' || end == '/' ||
+         end == '?') &&
+        (best == NULL || r->prefix_len > best->prefix_len)) {
+      best = r;
+    }
+  }
+  return best;
+}
+
+static struct upstream *
+proxy_choose(struct proxy_route *r)
+{
+  unsigned int      start = atomic_fetch_add(&r->next, 1);
+  struct upstream  *best  = NULL;
+  int               i;
+
+  // Starting from the round-robin position spreads ties between upstreams
+  // with equally few connections.
+  for (i = 0; i < r->num_upstreams; i++) {
+    struct upstream *u = r->upstreams[(start + (unsigned int) i) %
+                                      (unsigned int) r->num_upstreams];
+
+    if (!atomic_load(&u->up)) {
+      continue;
+    }
+    if (!proxy.least_conns) {
+      return u;
+    }
+    if (best == NULL || atomic_load(&u->active) < atomic_load(&best->active)) {
+      best = u;
+    }
+  }
+  return best;
+}
+
+static void
+upstream_down(struct upstream *u)
+{
+  if (atomic_exchange(&u->up, 0)) {
+    printf("proxy: upstream %s is down\n", u->name);
+  }
+}
+
+static void
+upstream_ok(struct upstream *u)
+{
+  atomic_store(&u->last_ok_ms, coarse_now_ms());
+  if (!atomic_exchange(&u->up, 1)) {
+    printf("proxy: upstream %s is up\n", u->name);
+  }
+}
+
+// Connect to an upstream, giving up after PROXY_CONNECT_MS. The socket is
+// returned in blocking mode, with I/O timeouts of timeout_ms so that a hung
+// upstream can't hold a responder forever.
+static int
+upstream_connect(const struct upstream *u, int timeout_ms)
+{
+  struct pollfd   pfd;
+  struct timeval  tv;
+  socklen_t       len = sizeof(int);
+  int             fd, flags, err = 0, opt = 1;
+
+  if ((fd = socket(u->addr.ss_family, SOCK_STREAM, 0)) == -1) {
+    return -1;
+  }
+  flags = fcntl(fd, F_GETFL);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  if (connect(fd, (const struct sockaddr *) &u->addr, u->addrlen) == -1) {
+    if (errno != EINPROGRESS) {
+      close(fd);
+      return -1;
+    }
+    pfd.fd     = fd;
+    pfd.events = POLLOUT;
+    if (poll(&pfd, 1, PROXY_CONNECT_MS) != 1 ||
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+      close(fd);
+      return -1;
+    }
+  }
+  fcntl(fd, F_SETFL, flags);
+
+  tv.tv_sec  = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  // Headers and bodies are written separately; send each at once
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+#ifdef __APPLE__
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
+#endif
+  return fd;
+}
+
+static int
+send_all(int fd, const char *data, size_t len)
+{
+#ifdef __APPLE__
+  int flags = 0;  // macOS doesn't support MSG_NOSIGNAL
+#else
+  int flags = MSG_NOSIGNAL;
+#endif
+
+  while (len > 0) {
+    ssize_t wrote = send(fd, data, len, flags);
+
+    if (wrote == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += wrote;
+    len  -= (size_t) wrote;
+  }
+  return 0;
+}
+
+// Per-responder pool of idle upstream connections
+struct pooled_conn {
+  struct upstream  *u;    // NULL = free slot
+  int               fd;
+  int64_t           since_ms;
+};
+
+static __thread struct pooled_conn upstream_pool[POOL_SIZE];
+
+static int
+pool_get(struct upstream *u)
+{
+  int64_t  now = coarse_now_ms();
+  int      i;
+
+  for (i = 0; i < POOL_SIZE; i++) {
+    struct pooled_conn *p = &upstream_pool[i];
+    char                b;
+    int                 fd = p->fd;
+
+    if (p->u != u) {
+      continue;
+    }
+    p->u = NULL;
+    // The upstream may have closed the connection while it sat idle. A
+    // live, idle connection has nothing to read.
+    if (now - p->since_ms < POOL_IDLE_MS &&
+        recv(fd, &b, 1, MSG_PEEK | MSG_DONTWAIT) == -1 &&
+        (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return fd;
+    }
+    close(fd);
+  }
+  return -1;
+}
+
+static void
+pool_put(struct upstream *u, int fd)
+{
+  struct pooled_conn  *p = &upstream_pool[0];
+  int                  i;
+
+  // Use a free slot, or else evict the connection idle longest
+  for (i = 0; i < POOL_SIZE; i++) {
+    if (upstream_pool[i].u == NULL) {
+      p = &upstream_pool[i];
+      break;
+    }
+    if (upstream_pool[i].since_ms < p->since_ms) {
+      p = &upstream_pool[i];
+    }
+  }
+  if (p->u != NULL) {
+    close(p->fd);
+  }
+  p->u        = u;
+  p->fd       = fd;
+  p->since_ms = coarse_now_ms();
+}
+
+static void
+pool_drain(void)
+{
+  int i;
+
+  for (i = 0; i < POOL_SIZE; i++) {
+    if (upstream_pool[i].u != NULL) {
+      close(upstream_pool[i].fd);
+      upstream_pool[i].u = NULL;
+    }
+  }
+}
+
+// Moving data between sockets. splice() needs a pipe at one end, so each
+// responder has a pipe through which bodies pass on their way from one
+// socket to the other. Data only ever sits in the pipe within a call.
+
+#ifdef __linux__
+static __thread int splice_pipe[2] = { -1, -1 };
+
+// Move len bytes from one socket to another, or everything up to end of
+// file if len is negative. Returns the number of bytes moved, which is
+// less than len if the source reached end of file first, or -1 on error.
+static long long
+splice_stream(int from, int to, long long len)
+{
+  long long  moved = 0;
+
+  if (splice_pipe[0] == -1 && pipe(splice_pipe) == -1) {
+    return -1;
+  }
+  while (len < 0 || moved < len) {
+    size_t   want = SPLICE_CHUNK;
+    ssize_t  in, out;
+
+    if (len >= 0 && (long long) want > len - moved) {
+      want = (size_t) (len - moved);
+    }
+    if ((in = splice(from, NULL, splice_pipe[1], NULL, want,
+                     SPLICE_F_MOVE)) == 0) {
+      break;
+    }
+    if (in == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    while (in > 0) {
+      // Tell the socket more is coming unless this is the end of the body
+      unsigned int more = (len < 0 || moved + in < len) ? SPLICE_F_MORE : 0;
+
+      if ((out = splice(splice_pipe[0], NULL, to, NULL, (size_t) in,
+                        SPLICE_F_MOVE | more)) <= 0) {
+        if (out == -1 && errno == EINTR) {
+          continue;
+        }
+        // Whatever is left in the pipe belongs to neither socket now
+        close(splice_pipe[0]);
+        close(splice_pipe[1]);
+        splice_pipe[0] = splice_pipe[1] = -1;
+        return -1;
+      }
+      in    -= out;
+      moved += out;
+    }
+  }
+  return moved;
+}
+
+static void
+splice_close(void)
+{
+  if (splice_pipe[0] != -1) {
+    close(splice_pipe[0]);
+    close(splice_pipe[1]);
+    splice_pipe[0] = splice_pipe[1] = -1;
+  }
+}
+#else
+static long long
+splice_stream(int from, int to, long long len)
+{
+  (void) from;
+  (void) to;
+  (void) len;
+  errno = ENOSYS;
+  return -1;
+}
+
+static void
+splice_close(void)
+{
+}
+#endif
+
+// Whether body data can be spliced straight to or from a connection's
+// socket, which isn't possible when TLS records are built in userspace.
+static int
+conn_splice_out(const struct connection *c)
+{
+#if defined(__linux__) && defined(WITH_TLS)
+  return c->ssl == NULL || c->ktls_send;
+#elif defined(__linux__)
+  (void) c;
+  return 1;
+#else
+  (void) c;
+  return 0;
+#endif
+}
+
+static int
+conn_splice_in(const struct connection *c)
+{
+#if defined(__linux__) && defined(WITH_TLS)
+  return c->ssl == NULL;
+#elif defined(__linux__)
+  (void) c;
+  return 1;
+#else
+  (void) c;
+  return 0;
+#endif
+}
+
+// Headers that describe a single connection, rather than the message, and
+// so are not forwarded
+static int
+is_hop_header(const char *line)
+{
+  return HEADER_IS(line, "Connection") || HEADER_IS(line, "Keep-Alive") ||
+         HEADER_IS(line, "Proxy-Connection") || HEADER_IS(line, "TE") ||
+         HEADER_IS(line, "Trailer") || HEADER_IS(line, "Upgrade");
+}
+
+static void
+peer_address(int fd, char *host, size_t hostlen)
+{
+  struct sockaddr_storage  sa;
+  socklen_t                len = sizeof(sa);
+
+  snprintf(host, hostlen, "unknown");
+  if (getpeername(fd, (struct sockaddr *) &sa, &len) == -1) {
+    return;
+  }
+  if (sa.ss_family == AF_INET6) {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) &sa;
+
+    if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+      inet_ntop(AF_INET, &sin6->sin6_addr.s6_addr[12], host, (socklen_t) hostlen);
+    } else {
+      inet_ntop(AF_INET6, &sin6->sin6_addr, host, (socklen_t) hostlen);
+    }
+  } else {
+    inet_ntop(AF_INET, &((struct sockaddr_in *) &sa)->sin_addr, host,
+              (socklen_t) hostlen);
+  }
+}
+
+// Rewrite a request's header block, still at the start of the connection's
+// input buffer, for an upstream. The request line is reissued as HTTP/1.1,
+// since upstream connections are kept alive; hop-by-hop headers are
+// dropped; and the client's address is added to X-Forwarded-For. The
+// client's framing headers are replaced by the one header that matches how
+// relay_request_body() sends the body. Returns the length of the new header
+// block, or -1 if it doesn't fit in out.
+static ssize_t
+proxy_request_headers(struct connection *c, const struct request *req,
+                      size_t hdr_len, char *out, size_t outlen)
+{
+  char    client[INET6_ADDRSTRLEN];
+  char    forwarded[256] = "";
+  char   *line, *eol;
+  char   *end = c->in + hdr_len;
+  size_t  len;
+  int     n;
+
+  n   = snprintf(out, outlen, "%s %s HTTP/1.1\r\n", req->method, req->target);
+  len = (size_t) n;
+
+  line = memchr(c->in, '\n', hdr_len);
+  for (line = line + 1; line < end; line = eol + 1) {
+    char *value_end;
+
+    if ((eol = memchr(line, '\n', (size_t) (end - line))) == NULL) {
+      break;
+    }
+    value_end = (eol > line && eol[-1] == '\r') ? eol - 1 : eol;
+    if (value_end == line) {
+      break;
+    }
+    if (is_hop_header(line) || HEADER_IS(line, "Expect")) {
+      continue;  // We answer Expect: 100-continue ourselves
+    }
+    if (HEADER_IS(line, "Content-Length") ||
+        HEADER_IS(line, "Transfer-Encoding")) {
+      continue;
+    }
+    if (HEADER_IS(line, "X-Forwarded-For")) {
+      header_value(line, value_end, forwarded, sizeof(forwarded));
+      continue;
+    }
+    if (len + (size_t) (eol + 1 - line) >= outlen) {
+      return -1;
+    }
+    memcpy(out + len, line, (size_t) (eol + 1 - line));
+    len += (size_t) (eol + 1 - line);
+  }
+
+  if (req->chunked) {
+    n = snprintf(out + len, outlen - len, "Transfer-Encoding: chunked\r\n");
+  } else if (req->has_length) {
+    n = snprintf(out + len, outlen - len, "Content-Length: %lld\r\n",
+                 req->body_left);
+  } else {
+    n = 0;
+  }
+  if (n < 0 || (size_t) n >= outlen - len) {
+    return -1;
+  }
+  len += (size_t) n;
+
+  peer_address(c->fd, client, sizeof(client));
+  n = snprintf(out + len, outlen - len, "X-Forwarded-For: %s%s%s\r\n\r\n",
+               forwarded, forwarded[0] != '\0' ? ", " : "", client);
+  if (n < 0 || (size_t) n >= outlen - len) {
+    return -1;
+  }
+  return (ssize_t) (len + (size_t) n);
+}
+
+// Send the rest of the request body to the upstream
+static int
+relay_request_body(struct connection *c, struct request *req, int fd)
+{
+  char     buf[BUFLEN + 24];
+  char    *data = buf + 20;   // Room in front for a chunk-size line
+  ssize_t  rlen;
+  size_t   n;
+
+  if (req->body_done) {
+    return 0;
+  }
+  if (!req->chunked && conn_splice_in(c)) {
+    // Whatever arrived with the headers goes first, then the rest is
+    // spliced from the client's socket.
+    n = c->in_len;
+    if ((long long) n > req->body_left) {
+      n = (size_t) req->body_left;
+    }
+    if (n > 0 && send_all(fd, c->in, n) == -1) {
+      return -1;
+    }
+    conn_consume(c, n);
+    req->body_left -= (long long) n;
+    if (req->body_left > 0 &&
+        splice_stream(c->fd, fd, req->body_left) != req->body_left) {
+      return -1;
+    }
+    req->body_left = 0;
+    req->body_done = 1;
+    return 0;
+  }
+
+  // A chunked body must be parsed to find its end, so it is decoded and
+  // sent on as fresh chunks. A body over userspace TLS has to come through
+  // here anyway, to be decrypted.
+  while ((rlen = read_body(c, req, data, BUFLEN)) > 0) {
+    char   *out = data;
+    size_t  len = (size_t) rlen;
+
+    if (req->chunked) {
+      char size[20];
+      int  k = sprintf(size, "%zx\r\n", len);
+
+      out -= k;
+      memcpy(out, size, (size_t) k);
+      memcpy(data + len, "\r\n", 2);
+      len += (size_t) k + 2;
+    }
+    if (send_all(fd, out, len) == -1) {
+      return -1;
+    }
+  }
+  if (rlen == -1) {
+    return -1;
+  }
+  return req->chunked ? send_all(fd, "0\r\n\r\n", 5) : 0;
+}
+
+// Forward len bytes of response body from the upstream to the client, or
+// everything up to end of file if len is negative. Bytes already read
+// along with the headers go first; the rest are spliced where possible.
+static int
+relay_response_body(struct connection *c, struct connection *up,
+                    long long len)
+{
+  char     buf[BUFLEN];
+  ssize_t  rlen;
+  size_t   n = up->in_len;
+
+  if (len >= 0 && (long long) n > len) {
+    n = (size_t) len;
+  }
+  if (n > 0) {
+    if (send_response(c, up->in, n) == -1) {
+      return -1;
+    }
+    conn_consume(up, n);
+    if (len > 0) {
+      len -= (long long) n;
+    }
+  }
+  if (len == 0) {
+    return 0;
+  }
+
+  if (conn_splice_out(c)) {
+    long long moved = splice_stream(up->fd, c->fd, len);
+
+    return (moved == -1 || (len > 0 && moved < len)) ? -1 : 0;
+  }
+  while (len != 0) {
+    n = sizeof(buf);
+    if (len > 0 && (long long) n > len) {
+      n = (size_t) len;
+    }
+    if ((rlen = recv(up->fd, buf, n, 0)) <= 0) {
+      return (rlen == 0 && len < 0) ? 0 : -1;
+    }
+    if (send_response(c, buf, (size_t) rlen) == -1) {
+      return -1;
+    }
+    if (len > 0) {
+      len -= rlen;
+    }
+  }
+  return 0;
+}
+
+// Find a CRLF-terminated line at the start of the upstream's buffer,
+// reading more if necessary. Returns the line's length without the CRLF.
+static ssize_t
+upstream_line(struct connection *up)
+{
+  char *eol;
+
+  while ((eol = memchr(up->in, '\n', up->in_len)) == NULL) {
+    if (conn_fill(up) <= 0) {
+      return -1;
+    }
+  }
+  if (eol == up->in || eol[-1] != '\r') {
+    return -1;
+  }
+  return eol - 1 - up->in;
+}
+
+// Forward a chunked response body. The chunk framing is parsed here, so
+// that the body's end can be found, and is regenerated for the client;
+// an HTTP/1.0 client gets the bare data. The chunk data is spliced.
+static int
+relay_chunked(struct connection *c, struct connection *up)
+{
+  char       frame[32];
+  char      *num_end;
+  ssize_t    len;
+  long long  size;
+  int        n, first = 1;
+
+  while (1) {
+    if ((len = upstream_line(up)) == -1) {
+      return -1;
+    }
+    size = strtoll(up->in, &num_end, 16);
+    if (num_end == up->in || size < 0) {
+      return -1;
+    }
+    conn_consume(up, (size_t) len + 2);
+
+    // Each chunk-size line goes out together with the CRLF that ended the
+    // previous chunk.
+    if (!c->http10) {
+      n = sprintf(frame, "%s%llx\r\n%s", first ? "" : "\r\n", size,
+                  size == 0 ? "\r\n" : "");
+      if (send_response(c, frame, (size_t) n) == -1) {
+        return -1;
+      }
+    }
+    first = 0;
+    if (size == 0) {
+      break;
+    }
+    if (relay_response_body(c, up, size) == -1 ||
+        upstream_line(up) != 0) {
+      return -1;
+    }
+    conn_consume(up, 2);
+  }
+
+  // Drop any trailers, up to the blank line that ends the body
+  while ((len = upstream_line(up)) > 0) {
+    conn_consume(up, (size_t) len + 2);
+  }
+  if (len == -1) {
+    return -1;
+  }
+  conn_consume(up, 2);
+  return 0;
+}
+
+struct proxy_response {
+  int        status;
+  int        chunked;
+  int        close;       // Upstream closes the connection afterwards
+  int        no_body;
+  long long  length;      // Content-Length, or -1 if not given
+};
+
+// Parse the upstream's response headers, and rewrite them for the client:
+// the status line is kept, hop-by-hop headers are dropped, and framing
+// headers are added to describe how the body will be relayed. Returns the
+// length of the new header block, or -1 if the response is malformed.
+static ssize_t
+proxy_response_headers(struct connection *c, const struct request *req,
+                       const char *hdrs, size_t hdr_len,
+                       struct proxy_response *resp, char *out, size_t outlen)
+{
+  char         value[256];
+  const char  *line, *eol;
+  const char  *end = hdrs + hdr_len;
+  size_t       len = 0;
+  int          minor, n;
+  int          has_length = 0;
+
+  memset(resp, 0, sizeof(*resp));
+  resp->length = -1;
+  if (sscanf(hdrs, "HTTP/1.%d %3d", &minor, &resp->status) != 2 ||
+      resp->status < 100 || resp->status == 101) {
+    return -1;
+  }
+  resp->close = (minor == 0);
+
+  for (line = hdrs; line < end; line = eol + 1) {
+    const char *value_end;
+    size_t      line_len;
+
+    if ((eol = memchr(line, '\n', (size_t) (end - line))) == NULL) {
+      break;
+    }
+    value_end = (eol > line && eol[-1] == '\r') ? eol - 1 : eol;
+    if (value_end == line) {
+      break;
+    }
+    line_len = (size_t) (eol + 1 - line);
+
+    if (line == hdrs) {
+      // Status line: we speak HTTP/1.1 to the client, whatever the upstream
+      line     += 8;
+      line_len -= 8;
+      memcpy(out, "HTTP/1.1", 8);
+      len = 8;
+    } else if (HEADER_IS(line, "Transfer-Encoding")) {
+      header_value(line, value_end, value, sizeof(value));
+      if (strcasecmp(value, "chunked") != 0) {
+        return -1;
+      }
+      resp->chunked = 1;
+      continue;
+    } else if (HEADER_IS(line, "Connection")) {
+      header_value(line, value_end, value, sizeof(value));
+      if (strcasecmp(value, "close") == 0) {
+        resp->close = 1;
+      } else if (strcasecmp(value, "keep-alive") == 0) {
+        resp->close = 0;
+      }
+      continue;
+    } else if (is_hop_header(line)) {
+      continue;
+    } else if (HEADER_IS(line, "Content-Length")) {
+      char *num_end;
+
+      header_value(line, value_end, value, sizeof(value));
+      resp->length = strtoll(value, &num_end, 10);
+      if (num_end == value || *num_end != '\0' || resp->length < 0) {
+        return -1;
+      }
+      has_length = 1;
+    }
+    if (len + line_len >= outlen) {
+      return -1;
+    }
+    memcpy(out + len, line, line_len);
+    len += line_len;
+  }
+
+  // A response with both is ambiguous, and a classic smuggling vector
+  if (resp->chunked && has_length) {
+    return -1;
+  }
+
+  resp->no_body = req->head || resp->status < 200 || resp->status == 204 ||
+                  resp->status == 304;
+  if (resp->no_body) {
+    resp->length = 0;
+  } else if (resp->chunked && c->http10) {
+    c->close = 1;   // Sent raw, ended by closing the connection
+  } else if (!resp->chunked && resp->length < 0) {
+    c->close = 1;   // Ends when the upstream closes, so must ours
+    resp->close = 1;
+  }
+
+  n = snprintf(out + len, outlen - len, "%s%s\r\n",
+               resp->chunked && !resp->no_body && !c->http10
+                 ? "Transfer-Encoding: chunked\r\n" : "",
+               c->close ? "Connection: close\r\n" : "");
+  if (n < 0 || (size_t) n >= outlen - len) {
+    return -1;
+  }
+  return (ssize_t) (len + (size_t) n);
+}
+
+// Exchange a request and its response with an upstream over the connection
+// up. Returns -1 if the client connection can't continue; *keep says
+// whether the upstream connection can be reused.
+static int
+proxy_exchange(struct connection *c, struct request *req, struct upstream *u,
+               struct connection *up, int reused, int *keep, int id)
+{
+  struct proxy_response  resp;
+  char                   out[PROXY_HDRS_MAX];
+  ssize_t                hdr_len, out_len;
+  int                    rc;
+  int                    blame = !reused;  // Does silence mean it's down?
+
+  *keep = 0;
+
+  if (req->expect_continue && !req->body_done &&
+      send_response(c, "HTTP/1.1 100 Continue\r\n\r\n", 25) == -1) {
+    return -1;
+  }
+  if (relay_request_body(c, req, up->fd) == -1) {
+    // The rest of the client's body is lost, but the upstream may have
+    // refused it with a response that explains why, so look for that.
+    c->close = 1;
+    blame    = 0;
+  }
+
+  // Skip any interim 1xx responses
+  while (1) {
+    if ((hdr_len = read_headers(up, 0)) <= 0) {
+      int timed_out = (hdr_len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK));
+
+      if (hdr_len != -2 && (blame || timed_out)) {
+        upstream_down(u);
+      }
+      return timed_out ? send_response_504(c, req->target, id)
+                       : send_response_502(c, req->target, id);
+    }
+    out_len = proxy_response_headers(c, req, up->in, (size_t) hdr_len, &resp,
+                                     out, sizeof(out));
+    conn_consume(up, (size_t) hdr_len);
+    if (out_len == -1) {
+      printf("proxy: bad response from %s\n", u->name);
+      return send_response_502(c, req->target, id);
+    }
+    if (resp.status >= 200) {
+      break;
+    }
+  }
+  upstream_ok(u);
+
+  conn_cork(c, 1);
+  rc = send_response(c, out, (size_t) out_len);
+  if (rc == 0 && !resp.no_body) {
+    rc = resp.chunked ? relay_chunked(c, up)
+                      : relay_response_body(c, up, resp.length);
+  }
+  conn_cork(c, 0);
+
+  if (rc == 0) {
+    printf("responder %d: %d %s via %s\n", id, resp.status, req->target,
+           u->name);
+    *keep = !resp.close && up->in_len == 0;
+  }
+  return rc;
+}
+
+// Forward a request, whose rewritten header block is in hdrs, to one of the
+// route's upstreams, and relay the response.
+static int
+proxy_request(struct connection *c, struct request *req,
+              struct proxy_route *r, const char *hdrs, size_t hdr_len,
+              int id)
+{
+  struct connection  up;
+  char               up_in[REQ_BUFLEN + 1];
+  struct upstream   *u;
+  int                tries, fd, reused, keep, rc;
+
+  // Pick an upstream and send it the headers, moving on to the next if it
+  // can't be reached. A pooled connection may turn out to have been closed
+  // by the upstream since, which says nothing about the upstream's health.
+  for (tries = 0; ; tries++) {
+    if (tries > r->num_upstreams || (u = proxy_choose(r)) == NULL) {
+      return send_response_502(c, req->target, id);
+    }
+    reused = 1;
+    if ((fd = pool_get(u)) == -1) {
+      reused = 0;
+      if ((fd = upstream_connect(u, PROXY_IO_MS)) == -1) {
+        upstream_down(u);
+        continue;
+      }
+    }
+    if (send_all(fd, hdrs, hdr_len) == 0) {
+      break;
+    }
+    close(fd);
+    if (!reused) {
+      upstream_down(u);
+    }
+  }
+
+  up.fd  = fd;
+  up.tls = 0;
+  conn_open(&up, up_in, id);
+  atomic_fetch_add(&u->active, 1);
+  rc = proxy_exchange(c, req, u, &up, reused, &keep, id);
+  atomic_fetch_sub(&u->active, 1);
+
+  if (keep) {
+    pool_put(u, fd);
+  } else {
+    close(fd);
+  }
+  return rc;
+}
+
+// Health checking: an upstream is up if it answers a HEAD request for the
+// check path with anything other than a server error, and down if it
+// refuses the connection or fails. One that accepts the connection but
+// doesn't answer in time is busy, which says nothing either way. Returns
+// 1 for up, 0 for down, and -1 if the check was inconclusive.
+static int
+health_check(struct upstream *u)
+{
+  char  buf[256];
+  int   fd, n, status = 0;
+
+  if ((fd = upstream_connect(u, PROXY_CONNECT_MS)) == -1) {
+    return 0;
+  }
+  n = snprintf(buf, sizeof(buf), "HEAD %s HTTP/1.1\r\n"
+                                 "Host: %s\r\n"
+                                 "Connection: close\r\n"
+                                 "\r\n", proxy.check_path, u->name);
+  if (send_all(fd, buf, (size_t) n) == 0) {
+    if ((n = (int) recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+      buf[n] = '\0';
+      if (sscanf(buf, "HTTP/1.%*d %3d", &status) != 1) {
+        status = 0;
+      }
+    } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      status = -1;
+    }
+  }
+  close(fd);
+  return status == -1 ? -1 : (status >= 100 && status < 500);
+}
+
+static void *
+health_thread(void *arg)
+{
+  struct work_queue  *wq = (struct work_queue *) arg;
+  int                 i, slept;
+
+  while (!wq_should_exit(wq)) {
+    for (i = 0; i < proxy.num_upstreams; i++) {
+      struct upstream *u = &proxy.upstreams[i];
+
+      if (atomic_load(&u->up) &&
+          coarse_now_ms() - atomic_load(&u->last_ok_ms) < HEALTH_INTERVAL_MS) {
+        continue;  // Recent traffic shows it's up
+      }
+      switch (health_check(u)) {
+        case 1:
+          upstream_ok(u);
+          break;
+        case 0:
+          upstream_down(u);
+          break;
+      }
+    }
+    for (slept = 0; slept < HEALTH_INTERVAL_MS && !wq_should_exit(wq);
+         slept += 100) {
+      struct timespec ts = { 0, 100 * 1000000 };
+
+      nanosleep(&ts, NULL);
+    }
+  }
+  return NULL;
+}
+
+// Request handling:
+
+static int
+is_known_method(const char *method)
+{
+  static const char *methods[] = {
+    "POST", "PUT", "DELETE", "PATCH", "OPTIONS", "CONNECT", "TRACE", NULL
+  };
+  int i;
+
+  for (i = 0; methods[i] != NULL; i++) {
+    if (strcmp(method, methods[i]) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Answer a GET or HEAD request from the static file cache, if possible.
+// Returns 1 if it was answered (check *rc for the send result), 0 if the
+// file must be served the slow way.
+static int
+send_cached(struct connection *c, struct file_cache *fc, char *filename,
+            int *rc, int id)
+{
+  static __thread char       *out;
+  const struct cache_entry   *e = file_cache_find(fc, filename);
+  size_t                      len;
+
+  if (e == NULL || (e->kind == CACHE_FILE && !c->head && !e->has_body)) {
+    return 0;  // Large files are sent with sendfile() as usual
+  }
+  TRACE2(file__opened, filename, 0);
+  PHASE_MARK(MARK_OPENED);
+  if (e->kind == CACHE_REDIRECT) {
+    *rc = send_response_307(c, CACHE_AT(fc, e->data), id);
+    return 1;
+  }
+
+  // The headers and body go out in one write
+  if (out == NULL &&
+      (out = malloc(CACHE_HEADERS_MAX + 32 + CACHE_BODY_MAX)) == NULL) {
+    *rc = send_response_500(c, filename, id);
+    return 1;
+  }
+  memcpy(out, CACHE_AT(fc, e->data), e->data_len);
+  len = e->data_len;
+  if (c->close) {
+    memcpy(out + len, "Connection: close\r\n", 19);
+    len += 19;
+  }
+  memcpy(out + len, "\r\n", 2);
+  len += 2;
+  if (!c->head) {
+    memcpy(out + len, CACHE_AT(fc, e->body), e->size);
+    len += e->size;
+  }
+  *rc = send_response(c, out, len);
+  if (*rc == 0) {
+    printf("responder %d: 200 %s (%lld bytes)\n", id, filename,
+           (long long) e->size);
+  }
+  return 1;
+}
+
+// Serve a request from the vhost's archive
+static int
+handle_archived(struct connection *c, struct request *req, char *path, int id)
+{
+  const struct site_archive  *ar = req->vhost->archive;
+  const struct wpack_entry   *e  = archive_find(ar, path);
+  char                        headers[WPACK_HEADERS_MAX + 32];
+  size_t                      len;
+  uint64_t                    body, size;
+  int                         gz;
+
+  TRACE2(file__opened, path, e != NULL ? ar->fd : -1);
+  PHASE_MARK(MARK_OPENED);
+  if (e == NULL) {
+    return send_response_404(c, path, id);
+  }
+  if (e->kind == WPACK_REDIRECT) {
+    return send_response_307(c, ARCHIVE_AT(ar, e->headers), id);
+  }
+
+  gz   = req->gzip && e->gz_size > 0;
+  len  = gz ? e->gz_headers_len : e->headers_len;
+  body = gz ? e->gz_body : e->body;
+  size = gz ? e->gz_size : e->size;
+  memcpy(headers, ARCHIVE_AT(ar, gz ? e->gz_headers : e->headers), len);
+  len += (size_t) sprintf(headers + len, "%s\r\n",
+                          c->close ? "Connection: close\r\n" : "");
+
+  conn_cork(c, 1);
+  if (send_response(c, headers, len) == -1 ||
+      (!c->head && send_file(c, ar->fd, (off_t) body, (off_t) size) == -1)) {
+    return -1;
+  }
+  conn_cork(c, 0);
+  printf("responder %d: 200 %s (%llu bytes%s)\n", id, path,
+         (unsigned long long) size, gz ? ", gzip" : "");
+  return 0;
+}
+
+static int
+handle_directory(struct connection *c, char *basename, char *filename,
+                 const char *query, int id)
+{
+  // Filename represents a directory
+  struct stat        fs;
+  struct dir_index  *ix;
+  char               tempFilename[DOCROOT_MAX+1024+32];
+  int                rc;
+
+  sprintf(tempFilename, "%s/index.html", filename);
+  if (stat(tempFilename, &fs) == 0) {
+    // Index.html exists
+    if (basename[strlen(basename) - 1] == '/') {
+      sprintf(tempFilename, "%sindex.html", basename);
+    } else {
+      sprintf(tempFilename, "%s/index.html", basename);
+    }
+    // Redirect to index.html
+    return send_response_307(c, tempFilename, id);
+  }
 
-      // Parse the HTTP request, to determine the requested filename.
-      // Note that we specify a maximum field width, to avoid buffer
-      // overflow attacks when parsing long filenames.
-      if (sscanf(headers, "GET %1023s HTTP/1.1", basename) != 1) {
-        printf("Cannot parse HTTP GET request\n");
-        send_response_500(fd, basename, id);
-        free(headers);
-        break;
+  // Index.html was not found in the directory
+  ix = dir_index_get(filename);
+  TRACE2(file__opened, filename, ix != NULL ? 0 : -1);
+  PHASE_MARK(MARK_OPENED);
+  if (ix == NULL) {
+    return send_response_404(c, filename, id);
+  }
+  if (basename[strlen(basename) - 1] == '/') {
+    basename[strlen(basename) - 1] = '\0';
+  }
+  // Print directory listings from the index
+  rc = send_response_200_listing(c, ix, basename, query, id);
+  dir_index_release(ix);
+  return rc;
+}
+
+static int
+handle_request(struct connection *c, struct request *req, int id)
+{
+  char         filename[DOCROOT_MAX+1024+8];
+  char         path[1024];
+  const char  *query;
+  struct stat  fs;
+  int          inf;
+  int          rc;
+
+  if (strcmp(req->method, "GET") != 0 && !req->head) {
+    if (is_known_method(req->method)) {
+      return send_response_405(c, req->method, id);
+    }
+    return send_response_501(c, req->method, id);
+  }
+
+  if (req->vhost == NULL) {
+    c->close = 1;
+    return send_response_404(c, req->target, id);
+  }
+  // A query string only matters to directory listings
+  if ((query = strchr(req->target, '?')) != NULL) {
+    memcpy(path, req->target, (size_t) (query - req->target));
+    path[query++ - req->target] = '\0';
+  } else {
+    strcpy(path, req->target);
+  }
+
+  if (req->vhost->archive != NULL) {
+    return handle_archived(c, req, path, id);
+  }
+
+  sprintf(filename, "%s%s", req->vhost->docroot, path);
+  if (send_cached(c, req->vhost->files, filename, &rc, id)) {
+    return rc;
+  }
+
+  if (req->head) {
+    // HEAD needs the file's metadata, not its contents
+    rc = stat(filename, &fs);
+    TRACE2(file__opened, filename, rc);
+    PHASE_MARK(MARK_OPENED);
+    if (rc == -1) {
+      return send_response_404(c, filename, id);
+    }
+    if (S_ISDIR(fs.st_mode)) {
+      return handle_directory(c, path, filename, query, id);
+    }
+    return send_response_200(c, filename, -1, &fs, id);
+  }
+
+  inf = open(filename, O_RDONLY, 0);
+  TRACE2(file__opened, filename, inf);
+  PHASE_MARK(MARK_OPENED);
+  if (inf == -1) {
+    if (errno == ENOENT || errno == ENOTDIR || errno == EACCES) {
+      return send_response_404(c, filename, id);
+    }
+    // Out of file descriptors, or similar
+    return send_response_500(c, filename, id);
+  }
+  fstat(inf, &fs);
+  if (S_ISDIR(fs.st_mode)) {
+    // EXTENSION
+    close(inf);
+    return handle_directory(c, path, filename, query, id);
+  }
+  rc = send_response_200(c, filename, inf, &fs, id);
+  close(inf);
+  return rc;
+}
+
+// HTTP/2:
+//
+// HTTP/2 connections are run by h2.c, which multiplexes the streams and
+// schedules their responses, with HPACK header compression in hpack.c.
+// What follows is the server's side: the connection I/O and the responses
+// that h2.h asks for, and handing a connection over to HTTP/2. Clients
+// reach it in one of three ways: by ALPN during the TLS handshake, by an
+// HTTP/1.1 "Upgrade: h2c" request, or by sending the HTTP/2 connection
+// preface straight away ("prior knowledge").
+//
+// Only the static file path is served this way. Requests for proxied
+// paths are answered 421, telling the client to retry them on a new
+// connection, and the h2c upgrade isn't offered for them.
+
+int
+h2_conn_send(struct connection *c, const void *data, size_t len)
+{
+  return send_response(c, data, len);
+}
+
+ssize_t
+h2_conn_recv(struct connection *c, void *buf, size_t len)
+{
+  return conn_recv(c, buf, len);
+}
+
+int
+h2_conn_readable(struct connection *c)
+{
+  struct pollfd pfd;
+
+#ifdef WITH_TLS
+  if (c->ssl != NULL && SSL_pending(c->ssl) > 0) {
+    return 1;
+  }
+#endif
+  pfd.fd     = c->fd;
+  pfd.events = POLLIN;
+  return poll(&pfd, 1, 0) == 1;
+}
+
+int
+h2_stopping(void)
+{
+  return shutdown_requested;
+}
+
+int
+h2_accepts_gzip(const char *value)
+{
+  return accepts_gzip(value);
+}
+
+// Work out the response to a request for one of vhost's files. Mirrors
+// handle_request() and handle_directory().
+static int
+h2_prepare_file(struct h2_stream *st, struct h2_request *req,
+                const struct vhost *vhost, const char **type,
+                int *extra_index, char *extra, size_t extra_len, int *coding)
+{
+  char                       filename[DOCROOT_MAX+1024+8];
+  char                       index[DOCROOT_MAX+1024+32];
+  char                       query[1024];
+  char                      *q;
+  const struct cache_entry  *e;
+  struct stat                fs;
+  struct dir_index          *ix;
+
+  *type        = "text/html";
+  *extra_index = 0;
+
+  if (req->bad || req->method[0] == '\0' || req->path[0] != '/') {
+    h2_error_body(st, "400 Bad Request", "Bad request");
+    return 400;
+  }
+  if (strcmp(req->method, "GET") != 0 && strcmp(req->method, "HEAD") != 0) {
+    if (is_known_method(req->method)) {
+      *extra_index = HPACK_STATIC_ALLOW;
+      snprintf(extra, extra_len, "GET, HEAD");
+      h2_printf(st, "<html>\r\n"
+                    "<head>\r\n"
+                    "<title> 405 Method Not Allowed </title>\r\n"
+                    "</head>\r\n"
+                    "<body>\r\n"
+                    "<p> Method not allowed </p>\r\n"
+                    "</body>\r\n"
+                    "</html>\r\n");
+      return 405;
+    }
+    h2_error_body(st, "501 Not Implemented", "Not implemented");
+    return 501;
+  }
+  if (proxy_match(req->path) != NULL) {
+    h2_error_body(st, "421 Misdirected Request",
+                  "Not served over HTTP/2");
+    return 421;
+  }
+  if (vhost == NULL) {
+    h2_error_body(st, "404 File Not Found", "File not found");
+    return 404;
+  }
+
+  // A query string only matters to directory listings
+  query[0] = '\0';
+  if ((q = strchr(req->path, '?')) != NULL) {
+    strcpy(query, q + 1);
+    *q = '\0';
+  }
+
+  if (vhost->archive != NULL) {
+    const struct site_archive  *ar = vhost->archive;
+    const struct wpack_entry   *ae = archive_find(ar, req->path);
+    int                         gz;
+
+    if (ae == NULL) {
+      h2_error_body(st, "404 File Not Found", "File not found");
+      return 404;
+    }
+    if (ae->kind == WPACK_REDIRECT) {
+      goto redirect;
+    }
+    // The stream outlives the hold on the configuration, and so perhaps
+    // the archive, so it gets a descriptor of its own
+    if ((st->fd = dup(ar->fd)) == -1) {
+      h2_error_body(st, "500 Internal Server Error", "Internal Error");
+      return 500;
+    }
+    gz         = req->gzip && ae->gz_size > 0;
+    *coding    = gz ? H2_CODING_GZIP : ae->gz_size > 0 ? H2_CODING_VARY : 0;
+    *type      = ARCHIVE_AT(ar, ae->type);
+    st->base   = (off_t) (gz ? ae->gz_body : ae->body);
+    st->length = (off_t) (gz ? ae->gz_size : ae->size);
+    return 200;
+  }
+
+  sprintf(filename, "%s%s", vhost->docroot, req->path);
+
+  // The stream outlives the hold on the configuration, so a cached body is
+  // copied
+  if ((e = file_cache_find(vhost->files, filename)) != NULL) {
+    if (e->kind == CACHE_REDIRECT) {
+      goto redirect;
+    }
+    if (e->has_body) {
+      if (strcmp(req->method, "HEAD") != 0 && e->size > 0) {
+        if ((st->body = malloc(e->size)) == NULL) {
+          h2_error_body(st, "500 Internal Server Error", "Internal Error");
+          return 500;
+        }
+        st->body_cap = e->size;
+        memcpy(st->body, CACHE_AT(vhost->files, e->body), e->size);
       }
+      *type      = content_type(filename);
+      st->length = (off_t) e->size;
+      return 200;
+    }
+  }
+
+  if ((st->fd = open(filename, O_RDONLY, 0)) == -1) {
+    if (errno == ENOENT || errno == ENOTDIR || errno == EACCES) {
+      h2_error_body(st, "404 File Not Found", "File not found");
+      return 404;
+    }
+    h2_error_body(st, "500 Internal Server Error", "Internal Error");
+    return 500;
+  }
+  fstat(st->fd, &fs);
+  if (!S_ISDIR(fs.st_mode)) {
+    *type      = content_type(filename);
+    st->length = fs.st_size;
+    return 200;
+  }
+  close(st->fd);
+  st->fd = -1;
+
+  // A directory: redirect to its index.html, or list it
+  sprintf(index, "%s/index.html", filename);
+  if (stat(index, &fs) == 0) {
+    size_t plen;
+
+redirect:
+    plen = strlen(req->path);
+
+    *extra_index = HPACK_STATIC_LOCATION;
+    snprintf(extra, extra_len, "%s%sindex.html", req->path,
+             req->path[plen - 1] == '/' ? "" : "/");
+    h2_printf(st, "<html>\r\n"
+                  "<head>\r\n"
+                  "<title>Redirected</title>\r\n"
+                  "</head>\r\n"
+                  "<body>\r\n"
+                  "<p>Redirecting ...</p>\r\n"
+                  "</body>\r\n"
+                  "</html>\r\n");
+    return 307;
+  }
+  if ((ix = dir_index_get(filename)) == NULL) {
+    h2_error_body(st, "404 File Not Found", "File not found");
+    return 404;
+  } else {
+    struct listing_page      lp;
+    const struct dir_entry  *de;
+    char                     when[32], nav[256];
+    size_t                   plen = strlen(req->path);
+    uint32_t                 i;
+
+    if (req->path[plen - 1] == '/') {
+      req->path[plen - 1] = '\0';
+    }
+    listing_parse_query(query, &lp);
+    listing_paginate(ix, &lp);
+    h2_printf(st, LISTING_HEAD);
+    for (i = lp.first; i < lp.first + lp.count; i++) {
+      de = listing_entry(ix, &lp, i);
+      listing_mtime(when, sizeof(when), (time_t) de->mtime);
+      h2_printf(st, LISTING_ENTRY, req->path, ix->names + de->name,
+                ix->names + de->name, (long long) de->size, when);
+    }
+    listing_nav(nav, sizeof(nav), &lp);
+    h2_printf(st, LISTING_END "%s" LISTING_TAIL, nav);
+    dir_index_release(ix);
+  }
+  return 200;
+}
+
+int
+h2_prepare_response(struct h2_stream *st, struct h2_request *req, int id,
+                    const char **type, int *extra_index, char *extra,
+                    size_t extra_len, int *coding)
+{
+  int status;
+
+  // The stream keeps what it needs, so the configuration is held only
+  // while the response is worked out
+  status = h2_prepare_file(st, req,
+                           vhost_lookup(config_hold(id), req->authority),
+                           type, extra_index, extra, extra_len, coding);
+  config_release(id);
+  return status;
+}
+
+// Serve the connection over HTTP/2 until it closes. For an h2c upgrade,
+// upgrade is the HTTP/1.1 request, whose response goes on stream 1. Any
+// bytes already in the connection's input buffer start the HTTP/2 input.
+static void
+handle_http2(struct connection *c, const struct request *upgrade, int id)
+{
+  struct h2_request  req;
+  size_t             in_len = c->in_len;
+
+  c->in_len = 0;
+  if (upgrade == NULL) {
+    h2_serve(c, c->in, in_len, NULL, NULL, id);
+    return;
+  }
+  memset(&req, 0, sizeof(req));
+  snprintf(req.method, sizeof(req.method), "%s", upgrade->method);
+  snprintf(req.path, sizeof(req.path), "%s", upgrade->target);
+  snprintf(req.authority, sizeof(req.authority), "%s", upgrade->host);
+  req.gzip = upgrade->gzip;
+  h2_serve(c, c->in, in_len, &req, upgrade->http2_settings, id);
+}
+
+struct response_params {
+  struct work_queue *wq;
+  int                id;
+  int                cpu;   // CPU to pin to, or -1
+};
+
+static void *
+response_thread(void *arg)
+{
+  struct response_params *params = (struct response_params *) arg;
+  struct work_queue      *wq = params->wq;
+  int                     id = params->id;
+  struct connection      *c;
+  char                   *in;
+  char                   *proxy_hdrs;
+
+#ifdef __linux__
+  // Pin before allocating, so the buffers are on this CPU's node
+  if (params->cpu != -1) {
+    pin_thread(&params->cpu, 1);
+  }
+#endif
+  in         = malloc(REQ_BUFLEN + 1);
+  proxy_hdrs = malloc(PROXY_HDRS_MAX);
+  free(params);
+
+  printf("responder %d: created\n", id);
+
+  while ((c = wq_get(wq)) != NULL) {
+    struct timeval idle   = { IDLE_TIMEOUT_MS / 1000, 0 };
+    int            parked = 0;
+
+    printf("responder %d: connection opened\n", id);
+    // Each connection ties up a responder, so one that sits idle between
+    // requests mustn't keep it forever.
+    setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    if (conn_open(c, in, id) == -1) {
+      conn_close(c);
+      conn_free(c);
+      atomic_fetch_sub(&admission.active, 1);
+      printf("responder %d: connection closed\n", id);
+      continue;
+    }
+    while (1) {
+      struct request            req;
+      struct head_cache_entry  *slot = NULL;
+      struct proxy_route       *route;
+      ssize_t                   hdr_len, proxy_len = 0;
+      int                       rc;
 
-      if (!hostname_matches(headers)) {
-        send_response_404(fd, basename, id);
-        free(headers);
+      if (c->h2) {
+        handle_http2(c, NULL, id);
         break;
       }
 
-      sprintf(filename, "website%s", basename);
-      
-      // EXTENSION
-      if ((dir = opendir(filename)) != NULL) {
-        // Filename represents a directory
-        char tempFilename[1024];
-        sprintf(tempFilename, "%s/index.html", filename);
-        if ((inf = open(tempFilename, O_RDONLY, 0)) != -1) {
-          // Index.html exists
-          if (basename[strlen(basename) - 1] == '/') {
-            sprintf(tempFilename, "%sindex.html", basename);
-          } else {
-            sprintf(tempFilename, "%s/index.html", basename);
-          }
-          // Redirect to index.html
-          if (send_response_307(fd, tempFilename, id) == -1) {
-            free(headers);
-            break;
-          }
-        } else {
-          // Index.html was not found in the directory
-          if (basename[strlen(basename) - 1] == '/') {
-            basename[strlen(basename) - 1] = '\0';
-          }
-          // Print directory listings dynamically
-          if (send_response_200_listing(fd, dir, basename, id) == -1) {
-            free(headers);
-            break;
-          }
+      // Retrieve the request
+      if ((hdr_len = read_headers(c, 1)) <= 0) {
+        if (hdr_len == -2) {
+          send_response_431(c, id);
         }
-        closedir(dir);
+        break;
       }
+      TRACE2(request__read, c->fd, hdr_len);
+      PHASE_MARK(MARK_READ);
 
-      if ((inf = open(filename, O_RDONLY, 0)) == -1) {
-        if (send_response_404(fd, filename, id) == -1) {
-          free(headers);
-          break;
+      // An HTTP/2 client with prior knowledge starts with the preface,
+      // whose first part looks like a request without headers.
+      if (hdr_len == 18 && memcmp(c->in, H2_PREFACE, 18) == 0) {
+        handle_http2(c, NULL, id);
+        break;
+      }
+
+      if (parse_request(c->in, (size_t) hdr_len, &req) == -1) {
+        printf("Cannot parse HTTP request\n");
+        send_response_400(c, id);
+        break;
+      }
+      TRACE2(request__parsed, req.method, req.target);
+      PHASE_MARK(MARK_PARSED);
+
+      // A proxied request's headers are forwarded, so they are rewritten
+      // for the upstream before they leave the input buffer.
+      if ((route = proxy_match(req.target)) != NULL &&
+          (proxy_len = proxy_request_headers(c, &req, (size_t) hdr_len,
+                                             proxy_hdrs,
+                                             PROXY_HDRS_MAX)) == -1) {
+        send_response_431(c, id);
+        break;
+      }
+      conn_consume(c, (size_t) hdr_len);
+
+      c->head   = req.head;
+      c->http10 = req.http10;
+      // If the client is waiting for permission to send its body, we won't
+      // be reading it, so the connection can't be reused. The proxy does
+      // read it, though.
+      c->close  = req.close ||
+                  (req.expect_continue && !req.body_done && route == NULL);
+
+      if (route != NULL) {
+        rc = proxy_request(c, &req, route, proxy_hdrs, (size_t) proxy_len,
+                           id);
+      } else if (req.upgrade_h2c && !req.http10 && req.body_done &&
+                 req.http2_settings[0] != '\0' && !conn_tls(c)) {
+        static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\n"
+                                        "Connection: Upgrade\r\n"
+                                        "Upgrade: h2c\r\n\r\n";
+
+        if (send_response(c, switching, sizeof(switching) - 1) == 0) {
+          handle_http2(c, &req, id);
         }
+        break;
       } else {
-        if (send_response_200(fd, filename, inf, id) == -1) {
-          free(headers);
-          break;
+        // The configuration is held until the response is sent, so a
+        // reload can't free the vhost in the meantime.
+        req.vhost = vhost_lookup(config_hold(id), req.host);
+        TRACE2(host__checked, req.host, req.vhost != NULL);
+        PHASE_MARK(MARK_HOST);
+
+        // A HEAD carrying a body goes the usual way, which discards the
+        // body after answering
+        if (req.head && req.body_done && !c->close && req.vhost != NULL &&
+            req.vhost->head_cache) {
+          if (head_cache_lookup(c, &req, &rc)) {
+            config_release(id);
+            TRACE2(request__done, c->fd, rc);
+            phase_done(id);
+            if (rc == -1) {
+              break;
+            }
+            continue;
+          }
+          head_cache_begin(c, &req, &slot);
         }
+
+        // Plain HTTP/1.x responses are written without blocking, queueing
+        // whatever the socket won't take yet
+        c->may_queue = !conn_tls(c);
+        rc = handle_request(c, &req, id);
+        c->may_queue = 0;
+      }
+      TRACE2(request__done, c->fd, rc);
+      phase_done(id);
+
+      if (slot != NULL) {
+        head_cache_end(c, &req, slot);
       }
-     
-      close(inf);
-      free(headers);
+      config_release(id);
 
+      // A slow reader's queue is drained without a responder, unless there
+      // is more input to deal with first
+      if (c->out != NULL && rc == 0 && c->in_len == 0 && req.body_done &&
+          out_park(c, wq) == 0) {
+        parked = 1;
+        break;
+      }
+      if (rc == -1) {
+        out_free(c);
+      } else if ((c->out != NULL || c->nonblock) && out_flush(c) == -1) {
+        rc = -1;
+      }
+      if (rc == -1 || c->close) {
+        break;
+      }
+      if (discard_body(c, &req) == -1) {
+        break;
+      }
     };
+    config_release(id);
 
     if (shutdown_requested) {
       printf("responder %d: shutdown requested\n", id);
       wq_shutdown(wq);
     }
 
-    close(fd);
+    // The connection is the drainer's now
+    if (parked) {
+      printf("responder %d: connection parked\n", id);
+      continue;
+    }
+    conn_close(c);
+    conn_free(c);
+    atomic_fetch_sub(&admission.active, 1);
     printf("responder %d: connection closed\n", id);
   };
 
+  pool_drain();
+  splice_close();
+  free(proxy_hdrs);
+  free(in);
   printf("responder %d: exit\n", id);
   return NULL;
 }
 
-static void 
-process_connections(struct work_queue *wq)
+static void *
+process_connections(void *arg)
 {
-  int                sfd;
-  int                cfd;
-  struct sockaddr_in caddr;
-  socklen_t          caddr_len = sizeof(caddr);
-
-  printf("listener: start\n");
+  struct listener         *l  = (struct listener *) arg;
+  struct work_queue       *wq = l->wq;
+  int                      cfd;
+  struct sockaddr_storage  caddr;
+  socklen_t                caddr_len;
 
-  if ((sfd = create_socket()) == -1) {
-    printf("listener: unable to bind socket, exit\n");
-    return;
+  if (placement.pin) {
+    placement_enter(&placement, &placement.nodes[l->node]);
+    printf("listener %s%s: start on node %d\n", l->name,
+           l->tls ? " (TLS)" : "", placement.nodes[l->node].id);
+  } else {
+    printf("listener %s%s: start\n", l->name, l->tls ? " (TLS)" : "");
   }
 
   while (!wq_should_exit(wq)) {
-    if ((cfd = accept(sfd, (struct sockaddr *) &caddr, &caddr_len)) == -1) {
-      perror("listener: unable to accept connection");
+    // The peer address is a sockaddr_storage, so the same loop serves
+    // IPv4 and IPv6 listeners.
+    caddr_len = sizeof(caddr);
+    if ((cfd = accept(l->fd, (struct sockaddr *) &caddr, &caddr_len)) == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (!wq_should_exit(wq)) {
+        perror("listener: unable to accept connection");
+      }
       break;
     } else {
 #ifdef __APPLE__ 
@@ -609,46 +6447,406 @@ process_connections(struct work_queue *wq)
       }
 #endif 
 
-      wq_add(wq, cfd);
+      admit_connection(wq, cfd, l->tls, &caddr);
     }
   }
 
-  close(sfd);
+  printf("listener %s: done\n", l->name);
+  return NULL;
+}
 
-  printf("listener: done\n");
+static void
+usage(const char *prog)
+{
+  printf("Usage: %s [-f config] [-l address]... [-p port] [-4 | -6] [-d]\n"
+         "          [-b backlog]\n"
+         "          [-s tls-port -c cert.pem -k key.pem]\n"
+         "          [-m max-conns] [-q max-queue] [-r rate [-B burst]] [-w min-rate]\n"
+         "          [-P prefix=host:port[,host:port]...]... [-a rr | lc] [-H path]\n"
+         "          [-R archive] [-S snapshot | -N] [-A] [-T]\n"
+         "  -f file     read vhosts and settings from file; reread on SIGHUP\n"
+         "  -l address  listen on this address (repeatable; default: all)\n"
+         "  -p port     listen on this port (default: 8080)\n"
+         "  -4          IPv4 only\n"
+         "  -6          IPv6 only\n"
+         "  -d          dual-stack: one [::] socket with IPV6_V6ONLY off\n"
+         "  -b backlog  listen backlog (default: SOMAXCONN)\n"
+         "  -s port     also listen for TLS connections on this port\n"
+         "  -c file     TLS certificate chain (PEM)\n"
+         "  -k file     TLS private key (PEM)\n"
+         "  -m n        refuse connections beyond n open (default: 4096)\n"
+         "  -q n        refuse connections while n are queued (default: 1024)\n"
+         "  -r n        limit each client to n new connections per second\n"
+         "  -B n        ... with bursts of up to n (default: rate)\n"
+         "  -w n        evict clients reading responses at under n bytes\n"
+         "              per second (default: 1024; 0: never)\n"
+         "  -P route    proxy requests under prefix to these upstream servers\n"
+         "  -a policy   balance upstreams round-robin (rr, default) or by\n"
+         "              least connections (lc)\n"
+         "  -H path     upstream health check path (default: /)\n"
+         "  -R file     serve the default vhost from this archive (see wpack)\n"
+         "  -N          don't pre-load the static file cache\n"
+         "  -S file     map the static file cache from this snapshot, or\n"
+         "              build it and save it there\n"
+         "  -A          pin threads to CPUs, with a queue and listening\n"
+         "              sockets per NUMA node\n"
+         "  -T          time each phase of each request, and print the\n"
+         "              histograms on SIGUSR1 and at exit\n", prog);
 }
 
 int 
-main(void)
+main(int argc, char *argv[])
 {
-  int                id;
-  struct work_queue *wq = wq_init();
-  pthread_t          threads[NUM_THREADS];
+  int                   id, i, opt;
+  int                   num_listeners;
+  int                   max_depth = 1024;
+  pthread_t            *threads;
+  pthread_t             health;
+#ifdef __linux__
+  pthread_t             drain;
+#endif
+  struct listener       listeners[MAX_LISTENERS * MAX_NODES];
+  struct listen_config  cfg;
+  sigset_t              sigint, oldmask;
+  const char           *cert_file = NULL;
+  const char           *key_file  = NULL;
+  const char           *config_path = NULL;
+  struct config        *config = NULL;
+  struct config_knobs   knobs;
+  uint64_t              started = phase_now();
+#ifdef __linux__
+  cpu_set_t             main_cpus;
+#endif
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.port    = "8080";
+  cfg.family  = AF_UNSPEC;
+  cfg.backlog = SOMAXCONN;
+
+  admission.max_conns = 4096;
+  proxy.check_path    = "/";
+
+  // The vhosts' names default to ours
+  gethostname(myhostname, sizeof(myhostname));
+  getdomainname(mydomainname, sizeof(mydomainname));
+
+  while ((opt = getopt(argc, argv, "f:l:p:46db:s:c:k:m:q:r:B:w:P:a:H:S:R:NAT")) != -1) {
+    switch (opt) {
+      case 'f':
+        // Applied here, so that later options override the file
+        memset(&knobs, 0, sizeof(knobs));
+        knobs.backlog = knobs.threads = knobs.buffer_size = -1;
+        knobs.max_conns = knobs.max_queue = knobs.rate = knobs.burst = -1;
+        knobs.min_rate = -1;
+        free(config);
+        config_path = optarg;
+        if ((config = config_load(config_path, &knobs)) == NULL) {
+          return 1;
+        }
+        for (i = 0; i < knobs.num_hosts && cfg.num_hosts < MAX_LISTENERS; i++) {
+          cfg.hosts[cfg.num_hosts++] = knobs.hosts[i];
+        }
+        cfg.port     = knobs.port     ? knobs.port     : cfg.port;
+        cfg.tls_port = knobs.tls_port ? knobs.tls_port : cfg.tls_port;
+        cert_file    = knobs.cert     ? knobs.cert     : cert_file;
+        key_file     = knobs.key      ? knobs.key      : key_file;
+        if (knobs.backlog != -1) {
+          cfg.backlog = knobs.backlog;
+        }
+        if (knobs.threads != -1) {
+          num_threads = knobs.threads;
+        }
+        if (knobs.buffer_size != -1) {
+          file_buflen = (size_t) knobs.buffer_size;
+        }
+        if (knobs.max_conns != -1) {
+          admission.max_conns = knobs.max_conns;
+        }
+        if (knobs.max_queue != -1) {
+          max_depth = knobs.max_queue;
+        }
+        if (knobs.rate != -1) {
+          admission.rate = knobs.rate;
+        }
+        if (knobs.burst != -1) {
+          admission.burst = knobs.burst;
+        }
+        if (knobs.min_rate != -1) {
+          min_rate = knobs.min_rate;
+        }
+        break;
+      case 'l':
+        if (cfg.num_hosts < MAX_LISTENERS) {
+          cfg.hosts[cfg.num_hosts++] = optarg;
+        }
+        break;
+      case 'p':
+        cfg.port = optarg;
+        break;
+      case '4':
+        cfg.family = AF_INET;
+        break;
+      case '6':
+        cfg.family = AF_INET6;
+        break;
+      case 'd':
+        cfg.dual_stack = 1;
+        break;
+      case 'b':
+        cfg.backlog = atoi(optarg);
+        break;
+      case 's':
+        cfg.tls_port = optarg;
+        break;
+      case 'c':
+        cert_file = optarg;
+        break;
+      case 'k':
+        key_file = optarg;
+        break;
+      case 'm':
+        admission.max_conns = atoi(optarg);
+        break;
+      case 'q':
+        max_depth = atoi(optarg);
+        break;
+      case 'r':
+        admission.rate = atoi(optarg);
+        break;
+      case 'B':
+        admission.burst = atoi(optarg);
+        break;
+      case 'w':
+        min_rate = atoi(optarg);
+        break;
+      case 'P':
+        if (proxy_add_route(optarg) == -1) {
+          return 1;
+        }
+        break;
+      case 'a':
+        if (strcmp(optarg, "lc") == 0) {
+          proxy.least_conns = 1;
+        } else if (strcmp(optarg, "rr") != 0) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'H':
+        proxy.check_path = optarg;
+        break;
+      case 'S':
+        cache_snapshot = optarg;
+        break;
+      case 'R':
+        default_root = optarg;
+        break;
+      case 'N':
+        cache_enabled = 0;
+        break;
+      case 'A':
+        placement.pin = 1;
+        break;
+      case 'T':
+        phase_timing = 1;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (num_threads < 1 || file_buflen < 512) {
+    printf("config: need at least 1 thread and a 512-byte buffer\n");
+    return 1;
+  }
+  admission_init(&admission);
+  placement_init(&placement);
+  cfg.num_nodes = placement.num_nodes;
+
+  if (cfg.tls_port != NULL) {
+#ifdef WITH_TLS
+    if (cert_file == NULL || key_file == NULL) {
+      printf("TLS requires a certificate (-c) and private key (-k)\n");
+      return 1;
+    }
+    if (tls_init(cert_file, key_file) == -1) {
+      printf("listener: unable to initialise TLS, exit\n");
+      return 1;
+    }
+#else
+    printf("TLS support not compiled in (build with WITH_TLS)\n");
+    return 1;
+#endif
+  }
+
+  num_listeners = create_listeners(&cfg, cfg.port, 0, listeners,
+                                   MAX_LISTENERS * MAX_NODES);
+  if (cfg.tls_port != NULL) {
+    num_listeners += create_listeners(&cfg, cfg.tls_port, 1,
+                                      listeners + num_listeners,
+                                      MAX_LISTENERS * MAX_NODES -
+                                      num_listeners);
+  }
+  if (num_listeners == 0) {
+    printf("listener: unable to bind socket, exit\n");
+    return 1;
+  }
+
+  if (config == NULL) {
+    config = config_default();
+  }
+  if (config_warm(config) == -1) {
+    return 1;
+  }
+  atomic_store(&current_config, config);
+  config_hazards = calloc((size_t) num_threads, sizeof(struct config_hazard));
+  phase_hists    = calloc((size_t) num_threads, sizeof(struct phase_hist));
+  threads        = malloc(sizeof(pthread_t) * (size_t) num_threads);
+  hpack_init();
+  dir_cache_init();
 
-  // Catch SIGINT (ctrl-c) and signal main loop to exit
+  // Catch SIGINT (ctrl-c) and SIGTERM and signal main loop to exit, SIGUSR1
+  // to print the phase timings, and SIGHUP to reread the configuration file.
+  // The signals are blocked while the worker threads are created, so they
+  // inherit a mask that leaves only the main thread to handle them.
   signal(SIGINT, signal_handler);
+  signal(SIGTERM, signal_handler);
+  if (phase_timing) {
+    signal(SIGUSR1, signal_handler);
+  }
+  if (config_path != NULL) {
+    signal(SIGHUP, signal_handler);
+  }
+  // Writes to a closed connection must fail with EPIPE rather than kill the
+  // server: sendfile() and OpenSSL's socket writes cannot pass MSG_NOSIGNAL.
+  signal(SIGPIPE, SIG_IGN);
+  sigemptyset(&sigint);
+  sigaddset(&sigint, SIGINT);
+  sigaddset(&sigint, SIGTERM);
+  sigaddset(&sigint, SIGUSR1);
+  sigaddset(&sigint, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &sigint, &oldmask);
+
+  placement_print(&placement);
+#ifdef __linux__
+  sched_getaffinity(0, sizeof(main_cpus), &main_cpus);
+#endif
+
+  // Each node's queue and responders are created from one of its CPUs, so
+  // that their memory is allocated on the node. The queue limit is shared
+  // between the nodes.
+  for (i = 0; i < placement.num_nodes; i++) {
+    struct numa_node *node = &placement.nodes[i];
+
+    placement_enter(&placement, node);
+    node->wq            = wq_init();
+    node->wq->max_depth = max_depth / placement.num_nodes;
+    if (max_depth > 0 && node->wq->max_depth == 0) {
+      node->wq->max_depth = 1;
+    }
 
-  for (id = 0; id < NUM_THREADS; id++) {
-    struct response_params *p = malloc(sizeof(struct response_params));
+    for (id = node->first_responder;
+         id < node->first_responder + node->num_responders; id++) {
+      struct response_params *p = malloc(sizeof(struct response_params));
+
+      p->wq  = node->wq;
+      p->id  = id;
+      p->cpu = placement_cpu(&placement, node, id);
+
+      pthread_create(&threads[id], NULL, response_thread, p);
+    }
+  }
+#ifdef __linux__
+  if (placement.pin) {
+    sched_setaffinity(0, sizeof(main_cpus), &main_cpus);
+  }
+#endif
+  if (proxy.num_routes > 0) {
+    pthread_create(&health, NULL, health_thread, placement.nodes[0].wq);
+  }
+#ifdef __linux__
+  if ((drainer.epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    perror("drainer: epoll_create1");
+  } else {
+    pthread_create(&drain, NULL, drainer_thread, NULL);
+  }
+#endif
 
-    p->wq = wq;
-    p->id = id;;
+  // Each listening socket gets its own accept loop, so IPv4 and IPv6
+  // clients are accepted independently of one another.
+  for (i = 0; i < num_listeners; i++) {
+    listeners[i].wq = placement.nodes[listeners[i].node].wq;
+    pthread_create(&listeners[i].thread, NULL, process_connections,
+                   &listeners[i]);
+  }
+  printf("listener: ready in %.1f ms\n",
+         (double) (phase_now() - started) / 1e6);
 
-    pthread_create(&threads[id], NULL, response_thread, p);
+  // The signals stay blocked between checking the flags and waiting, so
+  // one that arrives in between is taken by sigsuspend() rather than lost.
+  while (!shutdown_requested && !wq_should_exit(placement.nodes[0].wq)) {
+    sigsuspend(&oldmask);
+    if (timing_requested) {
+      timing_requested = 0;
+      phase_print();
+    }
+    if (reload_requested) {
+      reload_requested = 0;
+      config_reload(config_path);
+    }
   }
+  pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
 
-  process_connections(wq);
+  // Stop the accept loops. Shutting down a listening socket wakes any
+  // thread blocked in accept() on it.
+  for (i = 0; i < placement.num_nodes; i++) {
+    wq_shutdown(placement.nodes[i].wq);
+  }
+  for (i = 0; i < num_listeners; i++) {
+    shutdown(listeners[i].fd, SHUT_RDWR);
+    pthread_join(listeners[i].thread, NULL);
+    close(listeners[i].fd);
+  }
 
-  for (id = 0; id < NUM_THREADS; id++) {
+  for (id = 0; id < num_threads; id++) {
     printf("listener: waiting for responder %d to exit... ", id);
     fflush(stdout);
     pthread_join(threads[id], NULL);
     printf("done\n");
   }
+  if (proxy.num_routes > 0) {
+    pthread_join(health, NULL);
+  }
+#ifdef __linux__
+  if (drainer.epfd != -1) {
+    pthread_join(drain, NULL);
+    close(drainer.epfd);
+  }
+#endif
 
+  printf("listener: refused %lu over rate, %lu over capacity, "
+         "%lu shed from queue\n",
+         atomic_load(&admission.rejected_rate),
+         atomic_load(&admission.rejected_conns),
+         atomic_load(&admission.rejected_queue));
+  printf("listener: parked %lu slow readers, evicted %lu of them\n",
+         atomic_load(&drainer.num_parked), atomic_load(&drainer.num_evicted));
+  printf("listener: connection pool grew to %zu slabs, %d structs of %zu "
+         "bytes each\n", conn_pool.num_slabs,
+         (int) conn_pool.num_slabs * CONN_SLAB, sizeof(struct connection));
+  if (phase_timing) {
+    phase_print();
+  }
   printf("listener: exit\n");
 
-  free(wq);
+  for (i = 0; i < placement.num_nodes; i++) {
+    free(placement.nodes[i].wq);
+  }
+  config_free(atomic_load(&current_config));
+  free(config_hazards);
+  free(phase_hists);
+  free(threads);
 
   return 0;
 }
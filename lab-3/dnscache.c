@@ -0,0 +1,454 @@
+//
+// dnscache.c -- an in-process resolver cache, optionally kept on disk
+//
+// Entries live in an open-addressing hash table keyed on the name and
+// address family, so that a name with only IPv4 addresses can have a
+// negative IPv6 entry alongside its positive IPv4 one. Each entry expires
+// after its TTL; expiry times are wall-clock, so that they still mean
+// something when the cache is loaded again by a later run.
+//
+// The file format is one entry per line:
+//
+//   <expiry time> <4|6> <name> [address...]
+//
+// where an entry with no addresses is a negative answer.
+//
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dnscache.h"
+
+struct cache_entry {
+  char             *name;       // NULL if the slot is free
+  int               family;
+  time_t            expires;
+  int               naddrs;
+  struct dns_addr   addrs[DNS_CACHE_MAX_ADDRS];
+};
+
+struct dns_cache {
+  pthread_mutex_t      lock;
+  struct cache_entry  *slots;
+  size_t               cap;     // Always a power of two
+  size_t               used;
+  char                *path;
+  int                  dirty;
+  unsigned long        hits, misses;
+};
+
+static uint32_t
+hash_key(const char *name, int family)
+{
+  // FNV-1a over the lower-cased name, then the family
+  uint32_t h = 2166136261u;
+
+  for (; *name != '\0'; name++) {
+    h = (h ^ (unsigned char) tolower((unsigned char) *name)) * 16777619u;
+  }
+  return (h ^ (uint32_t) family) * 16777619u;
+}
+
+static struct cache_entry *
+find_slot(struct cache_entry *slots, size_t cap, const char *name, int family)
+{
+  size_t i = hash_key(name, family) & (cap - 1);
+
+  while (slots[i].name != NULL &&
+         (slots[i].family != family || strcasecmp(slots[i].name, name) != 0)) {
+    i = (i + 1) & (cap - 1);
+  }
+  return &slots[i];
+}
+
+static void
+grow(struct dns_cache *c)
+{
+  struct cache_entry  *old = c->slots;
+  size_t               oldcap = c->cap, i;
+
+  c->cap   = oldcap ? oldcap * 2 : 256;
+  c->slots = calloc(c->cap, sizeof(struct cache_entry));
+  for (i = 0; i < oldcap; i++) {
+    if (old[i].name != NULL) {
+      *find_slot(c->slots, c->cap, old[i].name, old[i].family) = old[i];
+    }
+  }
+  free(old);
+}
+
+static void
+put_locked(struct dns_cache *c, const char *name, int family,
+           const struct dns_addr *addrs, int n, time_t expires)
+{
+  struct cache_entry *e;
+
+  if ((c->used + 1) * 10 > c->cap * 7) {
+    grow(c);
+  }
+  e = find_slot(c->slots, c->cap, name, family);
+  if (e->name == NULL) {
+    e->name   = strdup(name);
+    e->family = family;
+    c->used++;
+  }
+  e->expires = expires;
+  e->naddrs  = n < DNS_CACHE_MAX_ADDRS ? n : DNS_CACHE_MAX_ADDRS;
+  if (e->naddrs > 0) {
+    memcpy(e->addrs, addrs, sizeof(struct dns_addr) * (size_t) e->naddrs);
+  }
+  c->dirty = 1;
+}
+
+static void
+load(struct dns_cache *c, FILE *f)
+{
+  char    line[8192];
+  time_t  t = time(NULL);
+
+  while (fgets(line, sizeof(line), f) != NULL) {
+    struct dns_addr   addrs[DNS_CACHE_MAX_ADDRS];
+    char             *field, *name, *save;
+    long long         expires;
+    int               family, n = 0;
+
+    if ((field = strtok_r(line, " \n", &save)) == NULL || field[0] == '#') {
+      continue;
+    }
+    expires = atoll(field);
+    if ((field = strtok_r(NULL, " \n", &save)) == NULL ||
+        (name = strtok_r(NULL, " \n", &save)) == NULL ||
+        expires <= (long long) t) {
+      continue;
+    }
+    family = atoi(field) == 6 ? AF_INET6 : AF_INET;
+    while ((field = strtok_r(NULL, " \n", &save)) != NULL &&
+           n < DNS_CACHE_MAX_ADDRS) {
+      if (inet_pton(family, field, addrs[n].addr) == 1) {
+        addrs[n].family = family;
+        addrs[n].ttl    = (uint32_t) (expires - t);
+        n++;
+      }
+    }
+    put_locked(c, name, family, addrs, n, (time_t) expires);
+  }
+}
+
+struct dns_cache *
+dns_cache_open(const char *path)
+{
+  struct dns_cache *c = calloc(1, sizeof(struct dns_cache));
+
+  if (c == NULL) {
+    return NULL;
+  }
+  pthread_mutex_init(&c->lock, NULL);
+  grow(c);
+  if (path != NULL) {
+    FILE *f;
+
+    c->path = strdup(path);
+    if ((f = fopen(path, "r")) != NULL) {
+      load(c, f);
+      fclose(f);
+    }
+  }
+  c->dirty = 0;
+  return c;
+}
+
+// Write the unexpired entries to a temporary file, and rename it over the
+// old one, so that a concurrent run never reads a half-written cache
+static void
+save(struct dns_cache *c)
+{
+  char    tmp[4096];
+  FILE   *f;
+  time_t  t = time(NULL);
+  size_t  i;
+
+  snprintf(tmp, sizeof(tmp), "%s.%d", c->path, (int) getpid());
+  if ((f = fopen(tmp, "w")) == NULL) {
+    perror(tmp);
+    return;
+  }
+  for (i = 0; i < c->cap; i++) {
+    struct cache_entry *e = &c->slots[i];
+    char                address[INET6_ADDRSTRLEN];
+    int                 j;
+
+    if (e->name == NULL || e->expires <= t) {
+      continue;
+    }
+    fprintf(f, "%lld %d %s", (long long) e->expires,
+            e->family == AF_INET6 ? 6 : 4, e->name);
+    for (j = 0; j < e->naddrs; j++) {
+      inet_ntop(e->family, e->addrs[j].addr, address, sizeof(address));
+      fprintf(f, " %s", address);
+    }
+    fputc('\n', f);
+  }
+  if (fclose(f) != 0 || rename(tmp, c->path) == -1) {
+    perror(c->path);
+    remove(tmp);
+  }
+}
+
+void
+dns_cache_close(struct dns_cache *c)
+{
+  size_t i;
+
+  if (c == NULL) {
+    return;
+  }
+  if (c->path != NULL && c->dirty) {
+    save(c);
+  }
+  for (i = 0; i < c->cap; i++) {
+    free(c->slots[i].name);
+  }
+  free(c->slots);
+  free(c->path);
+  pthread_mutex_destroy(&c->lock);
+  free(c);
+}
+
+static int
+get_locked(struct dns_cache *c, const char *name, int family,
+           struct dns_addr *addrs, int max)
+{
+  struct cache_entry  *e = find_slot(c->slots, c->cap, name, family);
+  time_t               t = time(NULL);
+  int                  i, n;
+
+  if (e->name == NULL || e->expires <= t) {
+    return -1;
+  }
+  n = e->naddrs < max ? e->naddrs : max;
+  for (i = 0; i < n; i++) {
+    addrs[i] = e->addrs[i];
+    addrs[i].ttl = (uint32_t) (e->expires - t);
+  }
+  return n;
+}
+
+int
+dns_cache_get(struct dns_cache *c, const char *name, int family,
+              struct dns_addr *addrs, int max)
+{
+  int n;
+
+  pthread_mutex_lock(&c->lock);
+  if ((n = get_locked(c, name, family, addrs, max)) == -1) {
+    c->misses++;
+  } else {
+    c->hits++;
+  }
+  pthread_mutex_unlock(&c->lock);
+  return n;
+}
+
+void
+dns_cache_put(struct dns_cache *c, const char *name, int family,
+              const struct dns_addr *addrs, int n, uint32_t ttl)
+{
+  if (ttl == 0) {
+    return;
+  }
+  pthread_mutex_lock(&c->lock);
+  put_locked(c, name, family, addrs, n, time(NULL) + ttl);
+  pthread_mutex_unlock(&c->lock);
+}
+
+void
+dns_cache_stats(const struct dns_cache *c, unsigned long *hits,
+                unsigned long *misses)
+{
+  *hits   = c->hits;
+  *misses = c->misses;
+}
+
+// One allocation holds both the addrinfo and the address it points to
+struct cached_ai {
+  struct addrinfo          ai;
+  struct sockaddr_storage  ss;
+};
+
+static struct addrinfo **
+append_ai(struct addrinfo **tail, const struct dns_addr *a, uint16_t port,
+          const struct addrinfo *hints)
+{
+  struct cached_ai *ca = calloc(1, sizeof(struct cached_ai));
+
+  if (ca == NULL) {
+    return tail;
+  }
+  ca->ai.ai_family   = a->family;
+  ca->ai.ai_socktype = hints != NULL ? hints->ai_socktype : 0;
+  ca->ai.ai_protocol = hints != NULL ? hints->ai_protocol : 0;
+  ca->ai.ai_addr     = (struct sockaddr *) &ca->ss;
+  if (a->family == AF_INET6) {
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &ca->ss;
+
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port   = htons(port);
+    memcpy(&sin6->sin6_addr, a->addr, 16);
+    ca->ai.ai_addrlen = sizeof(struct sockaddr_in6);
+  } else {
+    struct sockaddr_in *sin = (struct sockaddr_in *) &ca->ss;
+
+    sin->sin_family = AF_INET;
+    sin->sin_port   = htons(port);
+    memcpy(&sin->sin_addr, a->addr, 4);
+    ca->ai.ai_addrlen = sizeof(struct sockaddr_in);
+  }
+  *tail = &ca->ai;
+  return &ca->ai.ai_next;
+}
+
+void
+dns_cache_freeaddrinfo(struct addrinfo *ai)
+{
+  while (ai != NULL) {
+    struct addrinfo *next = ai->ai_next;
+    free(ai);
+    ai = next;
+  }
+}
+
+// Split a getaddrinfo() result by family, dropping duplicates
+static int
+collect(const struct addrinfo *res, int family, struct dns_addr *addrs)
+{
+  const struct addrinfo  *ai;
+  int                     n = 0, i;
+
+  for (ai = res; ai != NULL && n < DNS_CACHE_MAX_ADDRS; ai = ai->ai_next) {
+    struct dns_addr a;
+
+    if (ai->ai_family != family) {
+      continue;
+    }
+    memset(&a, 0, sizeof(a));
+    a.family = family;
+    a.ttl    = DNS_CACHE_TTL;
+    if (family == AF_INET6) {
+      memcpy(a.addr, &((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr, 16);
+    } else {
+      memcpy(a.addr, &((struct sockaddr_in *) ai->ai_addr)->sin_addr, 4);
+    }
+    for (i = 0; i < n && memcmp(addrs[i].addr, a.addr, 16) != 0; i++);
+    if (i == n) {
+      addrs[n++] = a;
+    }
+  }
+  return n;
+}
+
+int
+dns_cache_getaddrinfo(struct dns_cache *c, const char *name,
+                      const char *service, const struct addrinfo *hints,
+                      struct addrinfo **res)
+{
+  static const int      families[2] = { AF_INET6, AF_INET };
+  struct dns_addr       addrs[2][DNS_CACHE_MAX_ADDRS];
+  int                   n[2] = { -1, -1 };
+  int                   want = hints != NULL ? hints->ai_family : AF_UNSPEC;
+  struct addrinfo     **tail = res;
+  uint16_t              port = 0;
+  int                   f, i, miss = 0;
+
+  *res = NULL;
+  if (name == NULL) {
+    return EAI_NONAME;
+  }
+
+  if (service != NULL) {
+    char *end;
+
+    port = (uint16_t) strtoul(service, &end, 10);
+    if (*end != '\0') {
+      int              dgram = hints != NULL && hints->ai_socktype == SOCK_DGRAM;
+      struct servent  *se = getservbyname(service, dgram ? "udp" : "tcp");
+
+      if (se == NULL) {
+        return EAI_SERVICE;
+      }
+      port = ntohs((uint16_t) se->s_port);
+    }
+  }
+
+  // Numeric addresses need no lookup, and aren't worth caching
+  for (f = 0; f < 2; f++) {
+    memset(&addrs[f][0], 0, sizeof(struct dns_addr));
+    if ((want == AF_UNSPEC || want == families[f]) &&
+        inet_pton(families[f], name, addrs[f][0].addr) == 1) {
+      addrs[f][0].family = families[f];
+      append_ai(tail, &addrs[f][0], port, hints);
+      return *res != NULL ? 0 : EAI_MEMORY;
+    }
+  }
+
+  pthread_mutex_lock(&c->lock);
+  for (f = 0; f < 2; f++) {
+    if (want == AF_UNSPEC || want == families[f]) {
+      n[f] = get_locked(c, name, families[f], addrs[f], DNS_CACHE_MAX_ADDRS);
+      if (n[f] == -1) {
+        miss = 1;
+        c->misses++;
+      } else {
+        c->hits++;
+      }
+    }
+  }
+  pthread_mutex_unlock(&c->lock);
+
+  if (miss) {
+    struct addrinfo  h, *ai;
+    int              err;
+
+    memset(&h, 0, sizeof(h));
+    h.ai_family   = want;
+    h.ai_socktype = hints != NULL ? hints->ai_socktype : 0;
+    if ((err = getaddrinfo(name, NULL, &h, &ai)) != 0) {
+      if (err == EAI_NONAME
+#ifdef EAI_NODATA
+          || err == EAI_NODATA
+#endif
+         ) {
+        // The name doesn't exist: remember that for a while
+        for (f = 0; f < 2; f++) {
+          if (want == AF_UNSPEC || want == families[f]) {
+            dns_cache_put(c, name, families[f], NULL, 0, DNS_CACHE_NEG_TTL);
+          }
+        }
+      }
+      return err;
+    }
+    for (f = 0; f < 2; f++) {
+      if (want == AF_UNSPEC || want == families[f]) {
+        n[f] = collect(ai, families[f], addrs[f]);
+        dns_cache_put(c, name, families[f], addrs[f], n[f], DNS_CACHE_TTL);
+      }
+    }
+    freeaddrinfo(ai);
+  }
+
+  for (f = 0; f < 2; f++) {
+    for (i = 0; i < n[f]; i++) {
+      tail = append_ai(tail, &addrs[f][i], port, hints);
+    }
+  }
+  return *res != NULL ? 0 : EAI_NONAME;
+}
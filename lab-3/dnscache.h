@@ -0,0 +1,47 @@
+//
+// dnscache.h -- an in-process resolver cache, optionally kept on disk
+//
+
+#ifndef DNSCACHE_H
+#define DNSCACHE_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <stdint.h>
+
+#include "dnswire.h"
+
+#define DNS_CACHE_MAX_ADDRS   16
+#define DNS_CACHE_TTL         300   // getaddrinfo() doesn't tell us TTLs
+#define DNS_CACHE_NEG_TTL     60    // For failures with no SOA to go by
+
+struct dns_cache;
+
+// Create a cache. If path is non-NULL, entries that haven't expired are
+// loaded from it, and the cache is written back there by dns_cache_close().
+struct dns_cache *dns_cache_open(const char *path);
+void dns_cache_close(struct dns_cache *c);
+
+// Look up name's addresses of the given family. Returns how many were
+// copied to addrs, 0 for a cached negative answer, or -1 on a miss.
+int dns_cache_get(struct dns_cache *c, const char *name, int family,
+                  struct dns_addr *addrs, int max);
+
+// Remember name's addresses of the given family (none, for a negative
+// answer) for ttl seconds.
+void dns_cache_put(struct dns_cache *c, const char *name, int family,
+                   const struct dns_addr *addrs, int n, uint32_t ttl);
+
+// A caching getaddrinfo(). Results come back IPv6 first, and must be freed
+// with dns_cache_freeaddrinfo(). Numeric hosts bypass the cache.
+int dns_cache_getaddrinfo(struct dns_cache *c, const char *name,
+                          const char *service, const struct addrinfo *hints,
+                          struct addrinfo **res);
+void dns_cache_freeaddrinfo(struct addrinfo *ai);
+
+// Hits and misses so far, counting each family of each name separately
+void dns_cache_stats(const struct dns_cache *c, unsigned long *hits,
+                     unsigned long *misses);
+
+#endif
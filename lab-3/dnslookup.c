@@ -1,63 +1,474 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 #include <netdb.h>
 
-#define IPV4LEN 32
-#define IPV6LEN 128
+#include "dnscache.h"
+#include "dnsrec.h"
+#include "dnswire.h"
 
-int main(int argc, const char* argv[]) {
-  
-  int arg, i;
-  char *address;
-  struct addrinfo hints, *ai, *ai0;
+// Names are resolved by a pool of -j threads, so at most that many lookups
+// are in flight at once. Results are printed in command-line order as soon
+// as each one (and every name before it) is ready. A name that fails to
+// resolve is reported and skipped.
+//
+// With -s, the system resolver is bypassed: A and AAAA queries for all the
+// names are sent straight to the given DNS server, many at a time over one
+// UDP socket (see dnswire.c), and printed in order once all are answered.
+//
+// Either way, answers go through a cache (see dnscache.c), which -c keeps
+// in a file between runs, and a name given more than once is looked up
+// only once.
+//
+// Results are printed as "name IPvN address" lines, or with -b, written as
+// binary records (see dnsrec.h) that dnsread turns back into text.
 
-  if (argc < 2) {
+struct lookup {
+  const char *name;
+  int first;              // Index of the first lookup of the same name
+  struct addrinfo *ai;
+  int err;
+  double ms;
+  int done;
+};
+
+struct pool {
+  struct lookup *lookups;
+  int n;
+  int next;
+  const struct addrinfo *hints;
+  struct dns_cache *cache;
+  pthread_mutex_t lock;
+  pthread_cond_t done_cv;
+};
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void *resolver_thread(void *arg) {
+  struct pool *p = arg;
+
+  while (1) {
+    struct lookup *l;
+    double start;
+    int i;
+
+    pthread_mutex_lock(&p->lock);
+    i = p->next++;
+    pthread_mutex_unlock(&p->lock);
+    if (i >= p->n) {
+      break;
+    }
+
+    l = &p->lookups[i];
+    if (l->first == i) {
+      start = now_ms();
+      l->err = dns_cache_getaddrinfo(p->cache, l->name, "5000", p->hints, &l->ai);
+      l->ms = now_ms() - start;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    l->done = 1;
+    pthread_cond_broadcast(&p->done_cv);
+    pthread_mutex_unlock(&p->lock);
+  }
+  return NULL;
+}
+
+static FILE *bin_out;
+
+static void output_name(const char *name) {
+  if (bin_out != NULL) {
+    dnsrec_write_name(bin_out, name);
+  }
+}
+
+static void output_address(const char *name, int family, const void *addr, uint32_t ttl) {
+  char address[INET6_ADDRSTRLEN];
+
+  if (bin_out != NULL) {
+    dnsrec_write_addr(bin_out, family, addr, ttl);
+    return;
+  }
+  inet_ntop(family, addr, address, sizeof(address));
+  printf("%s %s %s\n", name, family == AF_INET ? "IPv4" : "IPv6", address);
+}
+
+static void output_failure(int rcode) {
+  if (bin_out != NULL) {
+    dnsrec_write_fail(bin_out, rcode);
+  }
+}
+
+static void print_addresses(const char *name, struct addrinfo *ai0) {
+  struct addrinfo *ai;
+
+  for (ai = ai0; ai != NULL; ai = ai->ai_next) {
+    switch(ai->ai_family) {
+      case AF_INET:
+        output_address(name, AF_INET, &((struct sockaddr_in *)ai->ai_addr)->sin_addr, 0);
+        break;
+      case AF_INET6:
+        output_address(name, AF_INET6, &((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr, 0);
+        break;
+      default:
+        printf("Cannot recognise address type.");
+    }
+  }
+}
+
+static char **sort_names;
+
+static int compare_names(const void *a, const void *b) {
+  int i = *(const int *) a, j = *(const int *) b;
+  int c = strcasecmp(sort_names[i], sort_names[j]);
+  return c != 0 ? c : i - j;
+}
+
+// Set first[i] to the index of the first name that is the same as names[i]
+static void find_duplicates(char **names, int n, int *first) {
+  int *order = malloc(n * sizeof(int));
+  int i;
+
+  for (i = 0; i < n; i++) {
+    order[i] = i;
+  }
+  sort_names = names;
+  qsort(order, n, sizeof(int), compare_names);
+  for (i = 0; i < n; i++) {
+    if (i > 0 && strcasecmp(names[order[i]], names[order[i - 1]]) == 0) {
+      first[order[i]] = first[order[i - 1]];
+    } else {
+      first[order[i]] = order[i];
+    }
+  }
+  free(order);
+}
+
+// Fill r from the cache, if both families of its name are there
+static int cache_lookup(struct dns_cache *cache, struct dns_result *r) {
+  int n6, n4;
+
+  if ((n6 = dns_cache_get(cache, r->name, AF_INET6, r->addrs, DNS_MAX_ADDRS)) == -1 ||
+      (n4 = dns_cache_get(cache, r->name, AF_INET, r->addrs + n6, DNS_MAX_ADDRS - n6)) == -1) {
+    return -1;
+  }
+  r->naddrs = n6 + n4;
+  r->rcode = r->naddrs > 0 ? DNS_RCODE_NOERROR : DNS_RCODE_NXDOMAIN;
+  return 0;
+}
+
+// Remember an answer from the server. Failures that say nothing about the
+// name, such as timeouts, aren't cached.
+static void cache_store(struct dns_cache *cache, const struct dns_result *r) {
+  static const int families[2] = { AF_INET6, AF_INET };
+  struct dns_addr addrs[DNS_MAX_ADDRS];
+  int f, i;
+
+  if (r->rcode != DNS_RCODE_NOERROR && r->rcode != DNS_RCODE_NXDOMAIN) {
+    return;
+  }
+  for (f = 0; f < 2; f++) {
+    uint32_t ttl = r->neg_ttl ? r->neg_ttl : DNS_CACHE_NEG_TTL;
+    int n = 0;
+
+    for (i = 0; i < r->naddrs; i++) {
+      if (r->addrs[i].family == families[f]) {
+        if (n == 0 || r->addrs[i].ttl < ttl) {
+          ttl = r->addrs[i].ttl;
+        }
+        addrs[n++] = r->addrs[i];
+      }
+    }
+    dns_cache_put(cache, r->name, families[f], addrs, n, ttl);
+  }
+}
+
+static const char *rcode_str(int rcode) {
+  switch (rcode) {
+    case DNS_RCODE_NOERROR:  return "No address associated with hostname";
+    case DNS_RCODE_SERVFAIL: return "Server failure";
+    case DNS_RCODE_NXDOMAIN: return "Name does not resolve";
+    case DNS_RCODE_TIMEOUT:  return "Timed out";
+    default:                 return "Query refused or malformed";
+  }
+}
+
+// Parse "host", "host:port" or "[v6-host]:port" into a server address
+static int parse_server(const char *spec, struct sockaddr_storage *ss, socklen_t *len) {
+  struct addrinfo hints, *ai;
+  char host[256];
+  const char *port = "53";
+  const char *colon = strrchr(spec, ':');
+
+  if (spec[0] == '[') {
+    const char *end = strchr(spec, ']');
+    if (end == NULL || end - spec - 1 >= (int) sizeof(host)) {
+      return -1;
+    }
+    snprintf(host, sizeof(host), "%.*s", (int) (end - spec - 1), spec + 1);
+    if (end[1] == ':') {
+      port = end + 2;
+    }
+  } else if (colon != NULL && strchr(spec, ':') == colon) {
+    snprintf(host, sizeof(host), "%.*s", (int) (colon - spec), spec);
+    port = colon + 1;
+  } else {
+    snprintf(host, sizeof(host), "%s", spec);
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = PF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (getaddrinfo(host, port, &hints, &ai) != 0) {
+    return -1;
+  }
+  memcpy(ss, ai->ai_addr, ai->ai_addrlen);
+  *len = ai->ai_addrlen;
+  freeaddrinfo(ai);
+  return 0;
+}
+
+static int lookup_direct(const char *server, char **names, int n, struct dns_cache *cache,
+                         const struct dns_options *opts, int timing) {
+  struct sockaddr_storage ss;
+  struct dns_result *results, *queries;
+  socklen_t sslen;
+  double start;
+  int *first, *from;
+  int i, j, nq = 0, failed = 0;
+
+  if (parse_server(server, &ss, &sslen) == -1) {
+    fprintf(stderr, "Unable to parse DNS server address %s\n", server);
+    return -1;
+  }
+  results = calloc(n, sizeof(struct dns_result));
+  queries = calloc(n, sizeof(struct dns_result));
+  first = malloc(n * sizeof(int));
+  from = malloc(n * sizeof(int));
+  find_duplicates(names, n, first);
+
+  // Only names that aren't cached, or repeated, go to the server
+  start = now_ms();
+  for (i = 0; i < n; i++) {
+    results[i].name = names[i];
+    if (first[i] != i) {
+      from[i] = from[first[i]];
+    } else if (cache_lookup(cache, &results[i]) == 0) {
+      from[i] = -1;
+    } else {
+      from[i] = nq;
+      queries[nq++].name = names[i];
+    }
+  }
+
+  if (nq > 0 && dns_resolve_batch((struct sockaddr *) &ss, sslen, queries, nq, opts) == -1) {
+    perror("Unable to query DNS server");
+    free(results);
+    free(queries);
+    free(first);
+    free(from);
+    return -1;
+  }
+  for (i = 0; i < nq; i++) {
+    cache_store(cache, &queries[i]);
+  }
+
+  for (i = 0; i < n; i++) {
+    struct dns_result *r = from[i] >= 0 ? &queries[from[i]] : &results[first[i]];
+
+    output_name(r->name);
+    if (r->naddrs == 0) {
+      fprintf(stderr, "Unable to look up IP address of %s: %s\n", r->name, rcode_str(r->rcode));
+      output_failure(r->rcode == DNS_RCODE_TIMEOUT ? DNSREC_TIMEOUT : r->rcode);
+      failed++;
+    }
+    for (j = 0; j < r->naddrs; j++) {
+      output_address(r->name, r->addrs[j].family, r->addrs[j].addr, r->addrs[j].ttl);
+    }
+    if (timing) {
+      fprintf(stderr, "%s: %.1f ms\n", r->name, r->ms);
+    }
+  }
+
+  fprintf(stderr, "%d names, %d failed, %d queried, in %.1f ms via %s\n",
+          n, failed, nq, now_ms() - start, server);
+  free(results);
+  free(queries);
+  free(first);
+  free(from);
+  return failed;
+}
+
+int main(int argc, char *argv[]) {
+
+  int i, opt;
+  int jobs = 16;
+  int timing = 0;
+  int failed = 0;
+  int nthreads;
+  double start;
+  const char *server = NULL;
+  const char *cache_file = NULL;
+  const char *bin_file = NULL;
+  struct dns_cache *cache;
+  unsigned long hits, misses;
+  int *first;
+  struct dns_options dopts;
+  struct addrinfo hints;
+  struct pool pool;
+  pthread_t *threads;
+
+  dopts.max_inflight = 256;
+  dopts.timeout_ms = 500;
+  dopts.retries = 3;
+  dopts.want_a = 1;
+  dopts.want_aaaa = 1;
+
+  while ((opt = getopt(argc, argv, "j:ts:i:w:r:c:b:")) != -1) {
+    switch (opt) {
+      case 'j':
+        jobs = atoi(optarg);
+        break;
+      case 't':
+        timing = 1;
+        break;
+      case 's':
+        server = optarg;
+        break;
+      case 'i':
+        dopts.max_inflight = atoi(optarg) > 0 ? atoi(optarg) : 1;
+        break;
+      case 'w':
+        dopts.timeout_ms = atoi(optarg) > 0 ? atoi(optarg) : 1;
+        break;
+      case 'r':
+        dopts.retries = atoi(optarg) >= 0 ? atoi(optarg) : 0;
+        break;
+      case 'c':
+        cache_file = optarg;
+        break;
+      case 'b':
+        bin_file = optarg;
+        break;
+      default:
+        printf("Usage: %s [-j jobs] [-t] [-c cache-file] [-b file|-] [-s server[:port] [-i inflight] [-w timeout-ms] [-r retries]] name...\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (optind >= argc) {
     printf("You must provide at least one domain name.");
     return 1;
   }
 
+  if (bin_file != NULL) {
+    bin_out = strcmp(bin_file, "-") == 0 ? stdout : fopen(bin_file, "wb");
+    if (bin_out == NULL) {
+      perror(bin_file);
+      return 1;
+    }
+    setvbuf(bin_out, NULL, _IOFBF, 1 << 20);
+    dnsrec_write_header(bin_out);
+  }
+
+  cache = dns_cache_open(cache_file);
+
+  if (server != NULL) {
+    failed = lookup_direct(server, argv + optind, argc - optind, cache, &dopts, timing);
+    dns_cache_stats(cache, &hits, &misses);
+    fprintf(stderr, "cache: %lu hits, %lu misses\n", hits, misses);
+    dns_cache_close(cache);
+    if (bin_out != NULL) {
+      fclose(bin_out);
+    }
+    if (failed == -1) {
+      return 1;
+    }
+    return failed > 0 ? 2 : 0;
+  }
+
   memset(&hints, 0, sizeof(hints));
   hints.ai_family = PF_UNSPEC;
   hints.ai_socktype = SOCK_STREAM;
 
-  for (arg = 1; arg < argc; arg++) {
-    if ((i = getaddrinfo(argv[arg], "5000", &hints, &ai0)) != 0) {
-      printf("Unable to look up IP address: %s", gai_strerror(i));
-      return 2;
-    }
-   
-    for (ai = ai0; ai != NULL; ai = ai->ai_next) {
-      switch(ai->ai_family) {
-        case AF_INET:
-          // IPv4
-          if ((address = malloc(IPV4LEN)) != NULL) {
-            inet_ntop(AF_INET, &((struct sockaddr_in *)ai->ai_addr)->sin_addr, address, IPV4LEN);
-            printf("%s IPv4 %s\n", argv[arg], address);
-          }
-          break;
-        case AF_INET6:
-          // IPv6
-          if ((address = malloc(IPV6LEN)) != NULL) {
-            inet_ntop(AF_INET6, &((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr, address, IPV6LEN);
-            printf("%s IPv6 %s\n", argv[arg], address);
-          }
-          break;
-        default:
-          printf("Cannot recognise address type.");
-      }
-      
-      if (address != NULL) {
-        free(address);
-      }
+  pool.n = argc - optind;
+  pool.next = 0;
+  pool.hints = &hints;
+  pool.cache = cache;
+  pool.lookups = calloc(pool.n, sizeof(struct lookup));
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.done_cv, NULL);
+  first = malloc(pool.n * sizeof(int));
+  find_duplicates(argv + optind, pool.n, first);
+  for (i = 0; i < pool.n; i++) {
+    pool.lookups[i].name = argv[optind + i];
+    pool.lookups[i].first = first[i];
+  }
+  free(first);
+
+  start = now_ms();
+  nthreads = jobs < 1 ? 1 : (jobs < pool.n ? jobs : pool.n);
+  threads = malloc(nthreads * sizeof(pthread_t));
+  for (i = 0; i < nthreads; i++) {
+    pthread_create(&threads[i], NULL, resolver_thread, &pool);
+  }
+
+  // Print the results in order, as they become available
+  for (i = 0; i < pool.n; i++) {
+    // A repeated name prints the first lookup's answer again
+    struct lookup *l = &pool.lookups[pool.lookups[i].first];
+
+    pthread_mutex_lock(&pool.lock);
+    while (!l->done) {
+      pthread_cond_wait(&pool.done_cv, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    output_name(l->name);
+    if (l->err != 0) {
+      fprintf(stderr, "Unable to look up IP address of %s: %s\n", l->name, gai_strerror(l->err));
+      output_failure(l->err == EAI_NONAME ? DNS_RCODE_NXDOMAIN :
+                     l->err == EAI_AGAIN ? DNSREC_TIMEOUT : DNS_RCODE_SERVFAIL);
+      failed++;
+    } else {
+      print_addresses(l->name, l->ai);
+    }
+    if (timing) {
+      fprintf(stderr, "%s: %.1f ms\n", l->name, l->ms);
     }
   }
 
-  freeaddrinfo(ai0);
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
 
-  return 0;
+  fprintf(stderr, "%d names, %d failed, in %.1f ms with %d threads\n",
+          pool.n, failed, now_ms() - start, nthreads);
+  dns_cache_stats(cache, &hits, &misses);
+  fprintf(stderr, "cache: %lu hits, %lu misses\n", hits, misses);
+
+  for (i = 0; i < pool.n; i++) {
+    if (pool.lookups[i].first == i && pool.lookups[i].err == 0) {
+      dns_cache_freeaddrinfo(pool.lookups[i].ai);
+    }
+  }
+  dns_cache_close(cache);
+  if (bin_out != NULL) {
+    fclose(bin_out);
+  }
+  free(threads);
+  free(pool.lookups);
+
+  return failed > 0 ? 2 : 0;
 }
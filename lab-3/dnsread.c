@@ -0,0 +1,84 @@
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dnsrec.h"
+
+// Read the binary results written by dnslookup -b, and print them as the
+// same "name IPvN address" lines that dnslookup would have printed, or
+// with -s, just count them.
+
+int main(int argc, char *argv[]) {
+  struct dnsrec r;
+  FILE *f = stdin;
+  char address[INET6_ADDRSTRLEN];
+  unsigned long names = 0, v4 = 0, v6 = 0, failed = 0;
+  int opt, type, summary = 0, ttls = 0;
+
+  while ((opt = getopt(argc, argv, "st")) != -1) {
+    switch (opt) {
+      case 's':
+        summary = 1;
+        break;
+      case 't':
+        ttls = 1;
+        break;
+      default:
+        printf("Usage: %s [-s] [-t] [file]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (optind < argc && (f = fopen(argv[optind], "rb")) == NULL) {
+    perror(argv[optind]);
+    return 1;
+  }
+  setvbuf(f, NULL, _IOFBF, 1 << 20);
+  if (dnsrec_read_header(f) == -1) {
+    fprintf(stderr, "Not a dnslookup results file\n");
+    return 1;
+  }
+
+  memset(&r, 0, sizeof(r));
+  while ((type = dnsrec_read(f, &r)) > 0) {
+    switch (type) {
+      case DNSREC_NAME:
+        names++;
+        break;
+      case DNSREC_ADDR:
+        if (r.family == AF_INET) {
+          v4++;
+        } else {
+          v6++;
+        }
+        if (summary) {
+          break;
+        }
+        inet_ntop(r.family, r.addr, address, sizeof(address));
+        if (ttls) {
+          printf("%s %s %s %u\n", r.name, r.family == AF_INET ? "IPv4" : "IPv6", address, r.ttl);
+        } else {
+          printf("%s %s %s\n", r.name, r.family == AF_INET ? "IPv4" : "IPv6", address);
+        }
+        break;
+      case DNSREC_FAIL:
+        failed++;
+        if (!summary) {
+          fprintf(stderr, "Unable to look up IP address of %s: %s\n", r.name,
+                  r.rcode == DNSREC_TIMEOUT ? "timed out" :
+                  r.rcode == 3 ? "name does not resolve" : "lookup failed");
+        }
+        break;
+    }
+  }
+  if (type == -1) {
+    fprintf(stderr, "Truncated or corrupt results file\n");
+  }
+  if (summary) {
+    printf("%lu names, %lu failed, %lu IPv4 and %lu IPv6 addresses\n", names, failed, v4, v6);
+  }
+  fclose(f);
+  return type == -1 ? 2 : 0;
+}
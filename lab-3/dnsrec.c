@@ -0,0 +1,102 @@
+//
+// dnsrec.c -- a compact binary format for lookup results
+//
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <string.h>
+
+#include "dnsrec.h"
+
+void
+dnsrec_write_header(FILE *f)
+{
+  uint16_t v[2] = { htons(DNSREC_VERSION), 0 };
+
+  fwrite(DNSREC_MAGIC, 4, 1, f);
+  fwrite(v, sizeof(v), 1, f);
+}
+
+void
+dnsrec_write_name(FILE *f, const char *name)
+{
+  size_t len = strlen(name);
+
+  if (len > 255) {
+    len = 255;
+  }
+  putc(DNSREC_NAME, f);
+  putc((int) len, f);
+  fwrite(name, 1, len, f);
+}
+
+void
+dnsrec_write_addr(FILE *f, int family, const void *addr, uint32_t ttl)
+{
+  struct dnsrec_addr rec;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.type   = DNSREC_ADDR;
+  rec.family = family == AF_INET6 ? 6 : 4;
+  rec.ttl    = htonl(ttl);
+  memcpy(rec.addr, addr, family == AF_INET6 ? 16 : 4);
+  fwrite(&rec, sizeof(rec), 1, f);
+}
+
+void
+dnsrec_write_fail(FILE *f, int rcode)
+{
+  putc(DNSREC_FAIL, f);
+  putc(rcode & 0xff, f);
+}
+
+int
+dnsrec_read_header(FILE *f)
+{
+  unsigned char h[8];
+
+  if (fread(h, sizeof(h), 1, f) != 1 || memcmp(h, DNSREC_MAGIC, 4) != 0 ||
+      h[4] != 0 || h[5] != DNSREC_VERSION) {
+    return -1;
+  }
+  return 0;
+}
+
+int
+dnsrec_read(FILE *f, struct dnsrec *r)
+{
+  struct dnsrec_addr  rec;
+  int                 type, len;
+
+  if ((type = getc(f)) == EOF) {
+    return 0;
+  }
+  r->type = type;
+  switch (type) {
+    case DNSREC_NAME:
+      if ((len = getc(f)) == EOF || fread(r->name, 1, (size_t) len, f) != (size_t) len) {
+        return -1;
+      }
+      r->name[len] = '\0';
+      break;
+
+    case DNSREC_ADDR:
+      if (fread((char *) &rec + 1, sizeof(rec) - 1, 1, f) != 1) {
+        return -1;
+      }
+      r->family = rec.family == 6 ? AF_INET6 : AF_INET;
+      r->ttl    = ntohl(rec.ttl);
+      memcpy(r->addr, rec.addr, 16);
+      break;
+
+    case DNSREC_FAIL:
+      if ((r->rcode = getc(f)) == EOF) {
+        return -1;
+      }
+      break;
+
+    default:
+      return -1;
+  }
+  return type;
+}
@@ -0,0 +1,56 @@
+//
+// dnsrec.h -- a compact binary format for lookup results
+//
+// A file starts with an 8-byte header (DNSREC_MAGIC and the version), then
+// holds a stream of records. Each name gets one DNSREC_NAME record, then
+// either one fixed-size DNSREC_ADDR record per address, or one DNSREC_FAIL
+// record. Multi-byte fields are in network byte order.
+//
+
+#ifndef DNSREC_H
+#define DNSREC_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define DNSREC_MAGIC    "DNSR"
+#define DNSREC_VERSION  1
+
+#define DNSREC_NAME     1     // u8 type, u8 length, then the name
+#define DNSREC_ADDR     2     // struct dnsrec_addr
+#define DNSREC_FAIL     3     // u8 type, u8 rcode
+
+#define DNSREC_TIMEOUT  255   // rcode of a lookup that got no answer
+
+struct dnsrec_addr {
+  uint8_t   type;
+  uint8_t   family;           // 4 or 6
+  uint16_t  reserved;
+  uint32_t  ttl;              // 0 if unknown
+  uint8_t   addr[16];         // IPv4 addresses use the first 4 bytes
+};
+
+// A decoded record
+struct dnsrec {
+  int       type;
+  char      name[256];        // The current name, for every type
+  int       family;           // AF_INET or AF_INET6
+  uint32_t  ttl;
+  uint8_t   addr[16];
+  int       rcode;
+};
+
+void dnsrec_write_header(FILE *f);
+void dnsrec_write_name(FILE *f, const char *name);
+void dnsrec_write_addr(FILE *f, int family, const void *addr, uint32_t ttl);
+void dnsrec_write_fail(FILE *f, int rcode);
+
+// Check the header. Returns 0, or -1 if f isn't a DNSREC_VERSION file.
+int dnsrec_read_header(FILE *f);
+
+// Read the next record into r, which should be reused from one call to the
+// next, to carry the current name. Returns its type, 0 at the end of the
+// file, or -1 if the file is malformed.
+int dnsrec_read(FILE *f, struct dnsrec *r);
+
+#endif
@@ -0,0 +1,459 @@
+//
+// dnsstub.c -- a tiny local DNS server, for testing dnslookup offline
+//
+// Answers A and AAAA queries over UDP and TCP, either from a hosts-format
+// file (-f) or by synthesising addresses for any name (-s). It can drop a
+// percentage of queries (-d) to exercise retransmission, and answers that
+// don't fit in the client's UDP payload size are truncated, so that the
+// client has to retry over TCP.
+//
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "dnswire.h"
+
+#define BATCH     64
+#define MAX_RESP  65535
+
+struct host_entry {
+  char           name[DNS_MAX_NAME + 1];
+  int            family;
+  unsigned char  addr[16];
+};
+
+struct stub {
+  struct host_entry  *hosts;
+  int                 nhosts;
+  int                 synthesise;
+  int                 per_name;     // Addresses per synthesised name
+  uint32_t            ttl;
+  int                 drop_percent;
+  unsigned long       queries, dropped, truncated;
+};
+
+static volatile sig_atomic_t stop = 0;
+
+static void
+signal_handler(int sig)
+{
+  (void) sig;
+  stop = 1;
+}
+
+static int
+compare_hosts(const void *a, const void *b)
+{
+  return strcasecmp(((const struct host_entry *) a)->name,
+                    ((const struct host_entry *) b)->name);
+}
+
+static int
+load_hosts(struct stub *s, const char *file)
+{
+  FILE  *f = fopen(file, "r");
+  char   line[1024];
+  int    cap = 0;
+
+  if (f == NULL) {
+    perror(file);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char           *addr, *name, *save;
+    unsigned char   buf[16];
+    int             family;
+
+    if ((addr = strtok_r(line, " \t\r\n", &save)) == NULL || addr[0] == '#') {
+      continue;
+    }
+    if (inet_pton(AF_INET, addr, buf) == 1) {
+      family = AF_INET;
+    } else if (inet_pton(AF_INET6, addr, buf) == 1) {
+      family = AF_INET6;
+    } else {
+      continue;
+    }
+    while ((name = strtok_r(NULL, " \t\r\n", &save)) != NULL && name[0] != '#') {
+      struct host_entry *h;
+
+      if (s->nhosts == cap) {
+        cap = cap ? cap * 2 : 256;
+        s->hosts = realloc(s->hosts, sizeof(struct host_entry) * (size_t) cap);
+      }
+      h = &s->hosts[s->nhosts++];
+      snprintf(h->name, sizeof(h->name), "%s", name);
+      h->family = family;
+      memcpy(h->addr, buf, 16);
+    }
+  }
+  fclose(f);
+  qsort(s->hosts, (size_t) s->nhosts, sizeof(struct host_entry), compare_hosts);
+  return 0;
+}
+
+static uint32_t
+hash_name(const char *name)
+{
+  // FNV-1a, case-insensitively
+  uint32_t h = 2166136261u;
+
+  for (; *name != '\0'; name++) {
+    h = (h ^ (unsigned char) tolower((unsigned char) *name)) * 16777619u;
+  }
+  return h;
+}
+
+static void
+put16(unsigned char *p, uint16_t v)
+{
+  p[0] = (unsigned char) (v >> 8);
+  p[1] = (unsigned char) v;
+}
+
+static void
+put32(unsigned char *p, uint32_t v)
+{
+  put16(p, (uint16_t) (v >> 16));
+  put16(p + 2, (uint16_t) v);
+}
+
+static size_t
+add_answer(unsigned char *resp, size_t off, uint16_t qtype, uint32_t ttl,
+           const unsigned char *addr)
+{
+  size_t rdlen = qtype == DNS_TYPE_A ? 4 : 16;
+
+  put16(resp + off, 0xc00c);        // Pointer to the question's name
+  put16(resp + off + 2, qtype);
+  put16(resp + off + 4, DNS_CLASS_IN);
+  put32(resp + off + 6, ttl);
+  put16(resp + off + 10, (uint16_t) rdlen);
+  memcpy(resp + off + 12, addr, rdlen);
+  return off + 12 + rdlen;
+}
+
+// Build the response to a query. Returns its length, or 0 to stay silent.
+// max_len is the most the client can accept; larger answers are truncated
+// to just the question, with the TC flag set.
+static size_t
+answer_query(struct stub *s, const unsigned char *q, size_t qlen,
+             unsigned char *resp, size_t max_len)
+{
+  char      name[DNS_MAX_NAME + 1];
+  size_t    off = 12, qend, len;
+  uint16_t  qtype, ancount = 0, flags;
+  int       found = 0, i;
+
+  if (qlen < 12 || (q[2] & 0x80) || q[4] != 0 || q[5] != 1 ||
+      dns_read_name(q, qlen, &off, name, sizeof(name)) == -1 ||
+      off + 4 > qlen) {
+    return 0;
+  }
+  qtype = (uint16_t) ((q[off] << 8) | q[off + 1]);
+  qend  = off + 4;
+  if (qend > MAX_RESP) {
+    return 0;
+  }
+
+  // The header and question are echoed back
+  memcpy(resp, q, qend);
+  len = qend;
+
+  if (s->synthesise) {
+    uint32_t h = hash_name(name);
+
+    found = 1;
+    for (i = 0; i < s->per_name && (qtype == DNS_TYPE_A || qtype == DNS_TYPE_AAAA); i++) {
+      unsigned char addr[16];
+
+      memset(addr, 0, sizeof(addr));
+      if (qtype == DNS_TYPE_A) {
+        addr[0] = 10;
+        addr[1] = (unsigned char) (h >> 16);
+        addr[2] = (unsigned char) (h >> 8);
+        addr[3] = (unsigned char) (h + (uint32_t) i);
+      } else {
+        addr[0] = 0xfd;
+        put32(addr + 8, h);
+        put32(addr + 12, (uint32_t) i + 1);
+      }
+      len = add_answer(resp, len, qtype, s->ttl, addr);
+      ancount++;
+    }
+  } else {
+    struct host_entry key, *h;
+
+    snprintf(key.name, sizeof(key.name), "%s", name);
+    h = bsearch(&key, s->hosts, (size_t) s->nhosts, sizeof(struct host_entry),
+                compare_hosts);
+    if (h != NULL) {
+      // Back up to the first entry with this name
+      while (h > s->hosts && strcasecmp(h[-1].name, name) == 0) {
+        h--;
+      }
+      for (; h < s->hosts + s->nhosts && strcasecmp(h->name, name) == 0; h++) {
+        found = 1;
+        if ((qtype == DNS_TYPE_A && h->family == AF_INET) ||
+            (qtype == DNS_TYPE_AAAA && h->family == AF_INET6)) {
+          if (len + 28 > MAX_RESP) {
+            break;
+          }
+          len = add_answer(resp, len, qtype, s->ttl, h->addr);
+          ancount++;
+        }
+      }
+    }
+  }
+
+  flags = 0x8000 | 0x0400 | 0x0080 | (q[2] & 0x01) << 8;   // QR AA RA, RD
+  if (!found) {
+    flags |= DNS_RCODE_NXDOMAIN;
+  }
+  if (ancount == 0) {
+    // Negative answer: an SOA record lets the client cache it (RFC 2308)
+    static const unsigned char soa_rdata[] = {
+      0, 0,                   // MNAME, RNAME: the root
+      0, 0, 0, 1,             // SERIAL
+      0, 0, 0x0e, 0x10,       // REFRESH
+      0, 0, 0x03, 0x84,       // RETRY
+      0, 0x09, 0x3a, 0x80,    // EXPIRE
+      0, 0, 0, 0              // MINIMUM, filled in below
+    };
+
+    put16(resp + len, 0xc00c);
+    put16(resp + len + 2, 6);
+    put16(resp + len + 4, DNS_CLASS_IN);
+    put32(resp + len + 6, s->ttl);
+    put16(resp + len + 10, sizeof(soa_rdata));
+    memcpy(resp + len + 12, soa_rdata, sizeof(soa_rdata));
+    put32(resp + len + 12 + sizeof(soa_rdata) - 4, s->ttl);
+    len += 12 + sizeof(soa_rdata);
+    put16(resp + 8, 1);     // NSCOUNT
+  } else {
+    put16(resp + 8, 0);
+  }
+
+  put16(resp + 2, flags);
+  put16(resp + 6, ancount);
+  put16(resp + 10, 0);      // ARCOUNT: we don't echo the OPT record
+
+  if (len > max_len) {
+    put16(resp + 2, flags | 0x0200);
+    put16(resp + 6, 0);
+    put16(resp + 8, 0);
+    len = qend;
+    s->truncated++;
+  }
+  return len;
+}
+
+// The largest UDP response the client will accept: 512 bytes, unless the
+// query carries an EDNS0 OPT record advertising more.
+static size_t
+udp_limit(const unsigned char *q, size_t qlen)
+{
+  char    name[DNS_MAX_NAME + 1];
+  size_t  off = 12;
+
+  if (qlen >= 12 && q[10] == 0 && q[11] == 1 &&
+      dns_read_name(q, qlen, &off, name, sizeof(name)) == 0 &&
+      off + 4 + 11 <= qlen && q[off + 4] == 0 &&
+      q[off + 5] == 0 && q[off + 6] == DNS_TYPE_OPT) {
+    size_t size = (size_t) ((q[off + 7] << 8) | q[off + 8]);
+    return size > 512 ? size : 512;
+  }
+  return 512;
+}
+
+static void
+serve_udp(struct stub *s, int fd)
+{
+  static unsigned char     in[BATCH][DNS_MAX_UDP];
+  static unsigned char     out[BATCH][MAX_RESP];
+  struct mmsghdr           rmsgs[BATCH], smsgs[BATCH];
+  struct iovec             riov[BATCH], siov[BATCH];
+  struct sockaddr_storage  from[BATCH];
+  int                      i, n, m = 0;
+
+  for (i = 0; i < BATCH; i++) {
+    riov[i].iov_base = in[i];
+    riov[i].iov_len  = DNS_MAX_UDP;
+    memset(&rmsgs[i].msg_hdr, 0, sizeof(rmsgs[i].msg_hdr));
+    rmsgs[i].msg_hdr.msg_name    = &from[i];
+    rmsgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+    rmsgs[i].msg_hdr.msg_iov     = &riov[i];
+    rmsgs[i].msg_hdr.msg_iovlen  = 1;
+  }
+  if ((n = recvmmsg(fd, rmsgs, BATCH, MSG_DONTWAIT, NULL)) <= 0) {
+    return;
+  }
+
+  for (i = 0; i < n; i++) {
+    size_t len;
+
+    s->queries++;
+    if (s->drop_percent > 0 && random() % 100 < s->drop_percent) {
+      s->dropped++;
+      continue;
+    }
+    len = answer_query(s, in[i], rmsgs[i].msg_len, out[m],
+                       udp_limit(in[i], rmsgs[i].msg_len));
+    if (len == 0) {
+      continue;
+    }
+    siov[m].iov_base = out[m];
+    siov[m].iov_len  = len;
+    memset(&smsgs[m].msg_hdr, 0, sizeof(smsgs[m].msg_hdr));
+    smsgs[m].msg_hdr.msg_name    = &from[i];
+    smsgs[m].msg_hdr.msg_namelen = rmsgs[i].msg_hdr.msg_namelen;
+    smsgs[m].msg_hdr.msg_iov     = &siov[m];
+    smsgs[m].msg_hdr.msg_iovlen  = 1;
+    m++;
+  }
+  if (m > 0) {
+    sendmmsg(fd, smsgs, (unsigned int) m, 0);
+  }
+}
+
+static int
+read_full(int fd, unsigned char *buf, size_t len)
+{
+  size_t off = 0;
+
+  while (off < len) {
+    ssize_t r = recv(fd, buf + off, len - off, 0);
+    if (r <= 0) {
+      return -1;
+    }
+    off += (size_t) r;
+  }
+  return 0;
+}
+
+// Serve one TCP client until it closes the connection. This blocks UDP
+// service meanwhile, which is fine for a test server.
+static void
+serve_tcp(struct stub *s, int lfd)
+{
+  static unsigned char  in[MAX_RESP], out[2 + MAX_RESP];
+  unsigned char         lenbuf[2];
+  int                   fd;
+
+  if ((fd = accept(lfd, NULL, NULL)) == -1) {
+    return;
+  }
+  while (read_full(fd, lenbuf, 2) == 0) {
+    size_t qlen = (size_t) ((lenbuf[0] << 8) | lenbuf[1]);
+    size_t len;
+
+    if (read_full(fd, in, qlen) == -1) {
+      break;
+    }
+    s->queries++;
+    if ((len = answer_query(s, in, qlen, out + 2, MAX_RESP)) == 0) {
+      continue;
+    }
+    put16(out, (uint16_t) len);
+    if (send(fd, out, len + 2, MSG_NOSIGNAL) == -1) {
+      break;
+    }
+  }
+  close(fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct stub          s;
+  struct sockaddr_in   addr;
+  struct pollfd        pfds[2];
+  const char          *hosts_file = NULL;
+  int                  port = 5353;
+  int                  opt, on = 1;
+
+  memset(&s, 0, sizeof(s));
+  s.per_name = 1;
+  s.ttl = 300;
+
+  while ((opt = getopt(argc, argv, "p:f:sn:t:d:")) != -1) {
+    switch (opt) {
+      case 'p': port = atoi(optarg); break;
+      case 'f': hosts_file = optarg; break;
+      case 's': s.synthesise = 1; break;
+      case 'n': s.per_name = atoi(optarg); break;
+      case 't': s.ttl = (uint32_t) atol(optarg); break;
+      case 'd': s.drop_percent = atoi(optarg); break;
+      default:
+        printf("Usage: %s [-p port] [-f hosts-file | -s [-n addrs]] [-t ttl] [-d drop%%]\n"
+               "  -p port     listen on 127.0.0.1:port, UDP and TCP (default: 5353)\n"
+               "  -f file     answer from a hosts-format file\n"
+               "  -s          synthesise addresses for every name\n"
+               "  -n count    addresses per synthesised name (default: 1)\n"
+               "  -t ttl      TTL of answers (default: 300)\n"
+               "  -d percent  drop this share of UDP queries\n", argv[0]);
+        return 1;
+    }
+  }
+  if (hosts_file != NULL && load_hosts(&s, hosts_file) == -1) {
+    return 1;
+  }
+  if (hosts_file == NULL && !s.synthesise) {
+    hosts_file = "/etc/hosts";
+    if (load_hosts(&s, hosts_file) == -1) {
+      return 1;
+    }
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  pfds[0].fd = socket(AF_INET, SOCK_DGRAM, 0);
+  pfds[1].fd = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(pfds[1].fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (bind(pfds[0].fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+      bind(pfds[1].fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+      listen(pfds[1].fd, 16) == -1) {
+    perror("Unable to bind to port");
+    return 1;
+  }
+  pfds[0].events = pfds[1].events = POLLIN;
+
+  signal(SIGINT, signal_handler);
+  signal(SIGTERM, signal_handler);
+  fprintf(stderr, "dnsstub: listening on 127.0.0.1:%d (%s)\n", port,
+          s.synthesise ? "synthesised" : hosts_file);
+
+  while (!stop) {
+    if (poll(pfds, 2, -1) == -1) {
+      continue;
+    }
+    if (pfds[0].revents & POLLIN) {
+      serve_udp(&s, pfds[0].fd);
+    }
+    if (pfds[1].revents & POLLIN) {
+      serve_tcp(&s, pfds[1].fd);
+    }
+  }
+
+  fprintf(stderr, "dnsstub: %lu queries, %lu dropped, %lu truncated\n",
+          s.queries, s.dropped, s.truncated);
+  close(pfds[0].fd);
+  close(pfds[1].fd);
+  free(s.hosts);
+  return 0;
+}
@@ -0,0 +1,613 @@
+//
+// dnswire.c -- a minimal DNS wire-protocol client, for bulk A/AAAA lookups
+//
+// dns_resolve_batch() keeps up to max_inflight queries outstanding over a
+// single non-blocking UDP socket. Queries go out in batches with one
+// sendmmsg() call, and answers are collected with recvmmsg(); each answer
+// is matched to its query by ID and question. Unanswered queries are
+// retransmitted with exponential backoff, and queries whose answers come
+// back truncated are repeated over TCP once the UDP phase is over.
+//
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dnswire.h"
+
+#define BATCH       64      // Datagrams per sendmmsg()/recvmmsg()
+#define QUERY_MAX   512
+
+#define FLAG_QR     0x8000
+#define FLAG_TC     0x0200
+#define FLAG_RD     0x0100
+
+enum { Q_NEW, Q_SENT, Q_TRUNCATED, Q_DONE };
+
+struct query {
+  int       result;         // Index into the results array
+  uint16_t  qtype;
+  uint16_t  id;
+  int       state;
+  int       attempts;
+  int       slot;           // Position in the in-flight list
+  double    deadline;
+};
+
+struct batch_ctx {
+  struct dns_result         *results;
+  struct query              *queries;
+  int                        nq;
+  int                        done;
+  int32_t                   *idmap;     // Query ID -> query index, or -1
+  uint16_t                   next_id;
+  int                       *inflight;  // Indexes of queries awaiting answers
+  int                        ninflight;
+  double                     start;
+  const struct dns_options  *opts;
+};
+
+static double
+now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void
+put16(unsigned char *p, uint16_t v)
+{
+  p[0] = (unsigned char) (v >> 8);
+  p[1] = (unsigned char) v;
+}
+
+static uint16_t
+get16(const unsigned char *p)
+{
+  return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static uint32_t
+get32(const unsigned char *p)
+{
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+         ((uint32_t) p[2] << 8) | p[3];
+}
+
+int
+dns_build_query(unsigned char *buf, size_t buflen, uint16_t id,
+                const char *name, uint16_t qtype)
+{
+  size_t       off = 12;
+  const char  *label = name;
+
+  if (buflen < 12 + DNS_MAX_NAME + 2 + 4 + 11) {
+    return -1;
+  }
+  memset(buf, 0, 12);
+  put16(buf, id);
+  put16(buf + 2, FLAG_RD);
+  put16(buf + 4, 1);          // QDCOUNT
+  put16(buf + 10, 1);         // ARCOUNT: the EDNS0 OPT record
+
+  // QNAME, as length-prefixed labels
+  while (*label != '\0') {
+    const char *dot = strchr(label, '.');
+    size_t      len = dot ? (size_t) (dot - label) : strlen(label);
+
+    if (len == 0 || len > 63 || off + len + 1 > 12 + DNS_MAX_NAME) {
+      return -1;
+    }
+    buf[off++] = (unsigned char) len;
+    memcpy(buf + off, label, len);
+    off += len;
+    label += len;
+    if (*label == '.') {
+      label++;
+    }
+  }
+  buf[off++] = 0;
+  put16(buf + off, qtype);
+  put16(buf + off + 2, DNS_CLASS_IN);
+  off += 4;
+
+  // OPT pseudo-record advertising our UDP payload size, so that servers
+  // don't truncate answers at 512 bytes
+  buf[off++] = 0;
+  put16(buf + off, DNS_TYPE_OPT);
+  put16(buf + off + 2, DNS_MAX_UDP);
+  memset(buf + off + 4, 0, 6);
+  off += 10;
+
+  return (int) off;
+}
+
+int
+dns_read_name(const unsigned char *msg, size_t len, size_t *off, char *out,
+              size_t outlen)
+{
+  size_t  pos = *off;
+  size_t  o = 0;
+  int     jumped = 0;
+  int     hops = 0;
+
+  while (1) {
+    unsigned int l;
+
+    if (pos >= len) {
+      return -1;
+    }
+    l = msg[pos];
+    if ((l & 0xc0) == 0xc0) {
+      // Compression pointer
+      if (pos + 1 >= len || ++hops > 32) {
+        return -1;
+      }
+      if (!jumped) {
+        *off = pos + 2;
+      }
+      jumped = 1;
+      pos = ((l & 0x3f) << 8) | msg[pos + 1];
+      continue;
+    }
+    if (l > 63) {
+      return -1;
+    }
+    pos++;
+    if (l == 0) {
+      break;
+    }
+    if (pos + l > len || o + l + 2 > outlen) {
+      return -1;
+    }
+    if (o > 0) {
+      out[o++] = '.';
+    }
+    memcpy(out + o, msg + pos, l);
+    o += l;
+    pos += l;
+  }
+  out[o] = '\0';
+  if (!jumped) {
+    *off = pos;
+  }
+  return 0;
+}
+
+static int
+names_equal(const char *wire, const char *name)
+{
+  size_t n = strlen(name);
+
+  if (n > 0 && name[n - 1] == '.') {
+    n--;
+  }
+  return strlen(wire) == n && strncasecmp(wire, name, n) == 0;
+}
+
+static void
+finish_query(struct batch_ctx *ctx, struct query *q, int rcode)
+{
+  struct dns_result *r = &ctx->results[q->result];
+
+  if (q->state == Q_SENT) {
+    // Remove from the in-flight list
+    int last = ctx->inflight[--ctx->ninflight];
+    ctx->inflight[q->slot] = last;
+    ctx->queries[last].slot = q->slot;
+    ctx->idmap[q->id] = -1;
+  }
+  q->state = Q_DONE;
+  ctx->done++;
+
+  if (rcode != DNS_RCODE_NOERROR && r->rcode == DNS_RCODE_NOERROR) {
+    r->rcode = rcode;
+  }
+  r->ms = now_ms() - ctx->start;
+}
+
+// Parse an answer to query q, adding any addresses to its result
+static void
+parse_answer(struct batch_ctx *ctx, struct query *q, const unsigned char *msg,
+             size_t len)
+{
+  struct dns_result  *r = &ctx->results[q->result];
+  int                 rcode = get16(msg + 2) & 0x0f;
+  int                 ancount = get16(msg + 6);
+  int                 nscount = get16(msg + 8);
+  size_t              off = 12;
+  char                name[DNS_MAX_NAME + 1];
+  int                 i;
+
+  // Skip the question, which has already been checked
+  if (dns_read_name(msg, len, &off, name, sizeof(name)) == -1) {
+    return;
+  }
+  off += 4;
+
+  for (i = 0; i < ancount + nscount; i++) {
+    uint16_t  type, class, rdlen;
+    uint32_t  ttl;
+
+    if (dns_read_name(msg, len, &off, name, sizeof(name)) == -1 ||
+        off + 10 > len) {
+      break;
+    }
+    type  = get16(msg + off);
+    class = get16(msg + off + 2);
+    ttl   = get32(msg + off + 4);
+    rdlen = get16(msg + off + 8);
+    off += 10;
+    if (off + rdlen > len) {
+      break;
+    }
+
+    // Any CNAME chain is followed by the server; the addresses it leads
+    // to are the A/AAAA records in the answer section.
+    if (i < ancount && class == DNS_CLASS_IN && type == q->qtype &&
+        r->naddrs < DNS_MAX_ADDRS) {
+      struct dns_addr *a = &r->addrs[r->naddrs];
+
+      if (type == DNS_TYPE_A && rdlen == 4) {
+        a->family = AF_INET;
+        memcpy(a->addr, msg + off, 4);
+        a->ttl = ttl;
+        r->naddrs++;
+      } else if (type == DNS_TYPE_AAAA && rdlen == 16) {
+        a->family = AF_INET6;
+        memcpy(a->addr, msg + off, 16);
+        a->ttl = ttl;
+        r->naddrs++;
+      }
+    } else if (i >= ancount && type == 6 && rdlen >= 22) {
+      // SOA in the authority section: its MINIMUM field bounds how long
+      // the negative answer may be cached (RFC 2308)
+      size_t    soa = off;
+      uint32_t  minimum;
+
+      if (dns_read_name(msg, len, &soa, name, sizeof(name)) == 0 &&
+          dns_read_name(msg, len, &soa, name, sizeof(name)) == 0 &&
+          soa + 20 <= len) {
+        minimum = get32(msg + soa + 16);
+        r->neg_ttl = minimum < ttl ? minimum : ttl;
+      }
+    }
+    off += rdlen;
+  }
+
+  finish_query(ctx, q, rcode);
+}
+
+// Match a response to its query. Returns the query, or NULL if the
+// response doesn't belong to anything we asked.
+static struct query *
+match_response(struct batch_ctx *ctx, const unsigned char *msg, size_t len)
+{
+  struct query  *q;
+  size_t         off = 12;
+  char           name[DNS_MAX_NAME + 1];
+  int32_t        qi;
+
+  if (len < 12 || !(get16(msg + 2) & FLAG_QR) || get16(msg + 4) != 1) {
+    return NULL;
+  }
+  if ((qi = ctx->idmap[get16(msg)]) < 0) {
+    return NULL;
+  }
+  q = &ctx->queries[qi];
+  if (dns_read_name(msg, len, &off, name, sizeof(name)) == -1 ||
+      off + 4 > len || get16(msg + off) != q->qtype ||
+      !names_equal(name, ctx->results[q->result].name)) {
+    return NULL;
+  }
+  return q;
+}
+
+static void
+receive_responses(struct batch_ctx *ctx, int fd)
+{
+  unsigned char         bufs[BATCH][DNS_MAX_UDP];
+  struct mmsghdr        msgs[BATCH];
+  struct iovec          iovs[BATCH];
+  int                   i, n;
+
+  do {
+    for (i = 0; i < BATCH; i++) {
+      iovs[i].iov_base = bufs[i];
+      iovs[i].iov_len  = DNS_MAX_UDP;
+      memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+      msgs[i].msg_hdr.msg_iov    = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    if ((n = recvmmsg(fd, msgs, BATCH, MSG_DONTWAIT, NULL)) <= 0) {
+      break;
+    }
+    for (i = 0; i < n; i++) {
+      size_t         len = msgs[i].msg_len;
+      struct query  *q = match_response(ctx, bufs[i], len);
+
+      if (q == NULL || q->state != Q_SENT) {
+        continue;
+      }
+      if (get16(bufs[i] + 2) & FLAG_TC) {
+        // Truncated: take it out of the UDP phase, and retry over TCP
+        int last = ctx->inflight[--ctx->ninflight];
+        ctx->inflight[q->slot] = last;
+        ctx->queries[last].slot = q->slot;
+        ctx->idmap[q->id] = -1;
+        q->state = Q_TRUNCATED;
+        continue;
+      }
+      parse_answer(ctx, q, bufs[i], len);
+    }
+  } while (n == BATCH);
+}
+
+static uint16_t
+assign_id(struct batch_ctx *ctx, int qi)
+{
+  while (ctx->idmap[ctx->next_id] != -1) {
+    ctx->next_id++;
+  }
+  ctx->idmap[ctx->next_id] = qi;
+  return ctx->next_id++;
+}
+
+// Send the queries listed in pending[] with a single sendmmsg()
+static void
+send_queries(struct batch_ctx *ctx, int fd, const int *pending, int n)
+{
+  unsigned char         bufs[BATCH][QUERY_MAX];
+  struct mmsghdr        msgs[BATCH];
+  struct iovec          iovs[BATCH];
+  double                t = now_ms();
+  int                   i, m = 0, sent;
+
+  for (i = 0; i < n; i++) {
+    struct query *q = &ctx->queries[pending[i]];
+    int           len;
+
+    len = dns_build_query(bufs[m], QUERY_MAX, q->id,
+                          ctx->results[q->result].name, q->qtype);
+    // Back off exponentially on each retransmission
+    q->deadline = t + (double) ctx->opts->timeout_ms * (1 << q->attempts);
+    q->attempts++;
+    if (len == -1) {
+      // A name that can't be encoded will never get an answer
+      finish_query(ctx, q, DNS_RCODE_NXDOMAIN);
+      continue;
+    }
+    iovs[m].iov_base = bufs[m];
+    iovs[m].iov_len  = (size_t) len;
+    memset(&msgs[m].msg_hdr, 0, sizeof(msgs[m].msg_hdr));
+    msgs[m].msg_hdr.msg_iov    = &iovs[m];
+    msgs[m].msg_hdr.msg_iovlen = 1;
+    m++;
+  }
+
+  // Anything the socket can't take now is simply retransmitted when its
+  // deadline passes.
+  for (i = 0; i < m; i += sent) {
+    if ((sent = sendmmsg(fd, msgs + i, (unsigned int) (m - i), 0)) <= 0) {
+      break;
+    }
+  }
+}
+
+static int
+read_full(int fd, unsigned char *buf, size_t len)
+{
+  size_t off = 0;
+
+  while (off < len) {
+    ssize_t r = recv(fd, buf + off, len - off, 0);
+    if (r <= 0) {
+      return -1;
+    }
+    off += (size_t) r;
+  }
+  return 0;
+}
+
+// Repeat truncated queries over a single TCP connection (RFC 7766)
+static void
+resolve_truncated(struct batch_ctx *ctx, const struct sockaddr *server,
+                  socklen_t server_len)
+{
+  unsigned char   query[2 + QUERY_MAX];
+  unsigned char  *answer = malloc(65535);
+  struct timeval  tv;
+  int             fd = -1;
+  int             i;
+
+  tv.tv_sec  = ctx->opts->timeout_ms * (ctx->opts->retries + 1) / 1000;
+  tv.tv_usec = (ctx->opts->timeout_ms * (ctx->opts->retries + 1) % 1000) * 1000;
+
+  for (i = 0; i < ctx->nq; i++) {
+    struct query  *q = &ctx->queries[i];
+    unsigned char  lenbuf[2];
+    int            len;
+
+    if (q->state != Q_TRUNCATED) {
+      continue;
+    }
+    if (fd == -1) {
+      fd = socket(server->sa_family, SOCK_STREAM, 0);
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+      if (connect(fd, server, server_len) == -1) {
+        close(fd);
+        fd = -1;
+        finish_query(ctx, q, DNS_RCODE_TIMEOUT);
+        continue;
+      }
+    }
+
+    len = dns_build_query(query + 2, QUERY_MAX, q->id,
+                          ctx->results[q->result].name, q->qtype);
+    put16(query, (uint16_t) len);
+    ctx->idmap[q->id] = i;
+
+    if (send(fd, query, (size_t) len + 2, MSG_NOSIGNAL) != len + 2 ||
+        read_full(fd, lenbuf, 2) == -1 ||
+        read_full(fd, answer, get16(lenbuf)) == -1) {
+      // Drop the connection; the next query opens a fresh one
+      close(fd);
+      fd = -1;
+      ctx->idmap[q->id] = -1;
+      finish_query(ctx, q, DNS_RCODE_TIMEOUT);
+      continue;
+    }
+    if (match_response(ctx, answer, get16(lenbuf)) == q) {
+      parse_answer(ctx, q, answer, get16(lenbuf));
+    } else {
+      finish_query(ctx, q, DNS_RCODE_SERVFAIL);
+    }
+    ctx->idmap[q->id] = -1;
+  }
+
+  if (fd != -1) {
+    close(fd);
+  }
+  free(answer);
+}
+
+int
+dns_resolve_batch(const struct sockaddr *server, socklen_t server_len,
+                  struct dns_result *results, int n,
+                  const struct dns_options *opts)
+{
+  struct batch_ctx  ctx;
+  int               next_new = 0;
+  int               fd, i, k, resolved = 0;
+  int               bufsize = 4 * 1024 * 1024;
+
+  if ((fd = socket(server->sa_family, SOCK_DGRAM, 0)) == -1) {
+    return -1;
+  }
+  // Connecting the socket means the kernel drops datagrams from anyone
+  // other than the server.
+  if (connect(fd, server, server_len) == -1) {
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.results   = results;
+  ctx.opts      = opts;
+  ctx.nq        = n * ((opts->want_a != 0) + (opts->want_aaaa != 0));
+  ctx.queries   = calloc((size_t) ctx.nq, sizeof(struct query));
+  ctx.inflight  = malloc(sizeof(int) * (size_t) opts->max_inflight);
+  ctx.idmap     = malloc(sizeof(int32_t) * 65536);
+  ctx.start     = now_ms();
+  srandom((unsigned int) (ctx.start * 1000) ^ (unsigned int) getpid());
+  ctx.next_id   = (uint16_t) random();
+  memset(ctx.idmap, 0xff, sizeof(int32_t) * 65536);
+
+  for (i = 0; i < n; i++) {
+    results[i].rcode   = DNS_RCODE_NOERROR;
+    results[i].naddrs  = 0;
+    results[i].neg_ttl = 0;
+  }
+  // AAAA queries first, so that addresses come out in the same order as
+  // getaddrinfo() usually gives them
+  for (i = 0, k = 0; i < n; i++) {
+    if (opts->want_aaaa) {
+      ctx.queries[k].result = i;
+      ctx.queries[k].qtype  = DNS_TYPE_AAAA;
+      ctx.queries[k++].state = Q_NEW;
+    }
+    if (opts->want_a) {
+      ctx.queries[k].result = i;
+      ctx.queries[k].qtype  = DNS_TYPE_A;
+      ctx.queries[k++].state = Q_NEW;
+    }
+  }
+
+  // Truncated queries aren't done until they have been tried over TCP, so
+  // the UDP phase ends when nothing is left to send or waiting for an answer
+  while (ctx.ninflight > 0 || next_new < ctx.nq) {
+    int     pending[BATCH];
+    int     npending = 0;
+    double  t = now_ms();
+    double  next_deadline = t + opts->timeout_ms;
+    int     timeout;
+
+    // Retransmit, or give up on, queries whose deadlines have passed
+    for (i = 0; i < ctx.ninflight && npending < BATCH; i++) {
+      struct query *q = &ctx.queries[ctx.inflight[i]];
+
+      if (t >= q->deadline) {
+        if (q->attempts > opts->retries) {
+          finish_query(&ctx, q, DNS_RCODE_TIMEOUT);
+          i--;    // Another query has moved into this slot
+          continue;
+        }
+        pending[npending++] = ctx.inflight[i];
+      } else if (q->deadline < next_deadline) {
+        next_deadline = q->deadline;
+      }
+    }
+
+    // Start new queries, up to the in-flight limit
+    while (npending < BATCH && ctx.ninflight < opts->max_inflight &&
+           next_new < ctx.nq) {
+      struct query *q = &ctx.queries[next_new];
+
+      q->id    = assign_id(&ctx, next_new);
+      q->state = Q_SENT;
+      q->slot  = ctx.ninflight;
+      ctx.inflight[ctx.ninflight++] = next_new;
+      pending[npending++] = next_new++;
+    }
+
+    if (npending > 0) {
+      send_queries(&ctx, fd, pending, npending);
+      if (npending == BATCH) {
+        // More to send; pick up any answers, then go round again
+        receive_responses(&ctx, fd);
+        continue;
+      }
+    }
+    if (ctx.ninflight == 0) {
+      continue;
+    }
+    timeout = (int) (next_deadline - now_ms());
+    if (timeout > 0) {
+      struct pollfd pfd;
+
+      pfd.fd     = fd;
+      pfd.events = POLLIN;
+      poll(&pfd, 1, timeout);
+    }
+    receive_responses(&ctx, fd);
+  }
+  close(fd);
+
+  resolve_truncated(&ctx, server, server_len);
+
+  for (i = 0; i < n; i++) {
+    if (results[i].naddrs > 0) {
+      resolved++;
+    }
+  }
+  free(ctx.queries);
+  free(ctx.inflight);
+  free(ctx.idmap);
+  return resolved;
+}
@@ -0,0 +1,68 @@
+//
+// dnswire.h -- a minimal DNS wire-protocol client, for bulk A/AAAA lookups
+//
+
+#ifndef DNSWIRE_H
+#define DNSWIRE_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DNS_PORT        53
+#define DNS_MAX_NAME    255
+#define DNS_MAX_ADDRS   32
+#define DNS_MAX_UDP     1232    // EDNS0 payload size that avoids fragmentation
+
+#define DNS_TYPE_A      1
+#define DNS_TYPE_CNAME  5
+#define DNS_TYPE_AAAA   28
+#define DNS_TYPE_OPT    41
+#define DNS_CLASS_IN    1
+
+#define DNS_RCODE_NOERROR   0
+#define DNS_RCODE_SERVFAIL  2
+#define DNS_RCODE_NXDOMAIN  3
+#define DNS_RCODE_TIMEOUT   -1  // No answer after all retries
+
+struct dns_addr {
+  int            family;        // AF_INET or AF_INET6
+  unsigned char  addr[16];
+  uint32_t       ttl;
+};
+
+struct dns_result {
+  const char      *name;        // Set by the caller
+  int              rcode;       // Worst RCODE of the A and AAAA queries
+  int              naddrs;
+  struct dns_addr  addrs[DNS_MAX_ADDRS];
+  uint32_t         neg_ttl;     // From the SOA, when there are no addresses
+  double           ms;          // Time until the last answer arrived
+};
+
+struct dns_options {
+  int  max_inflight;            // Queries outstanding at once
+  int  timeout_ms;              // First retransmission timeout; doubles
+  int  retries;
+  int  want_a;
+  int  want_aaaa;
+};
+
+// Build a query for name/qtype into buf, returning its length or -1.
+int dns_build_query(unsigned char *buf, size_t buflen, uint16_t id,
+                    const char *name, uint16_t qtype);
+
+// Decode the (possibly compressed) name at msg[*off] into out as a dotted
+// string, and advance *off past it. Returns -1 if the name is malformed.
+int dns_read_name(const unsigned char *msg, size_t len, size_t *off,
+                  char *out, size_t outlen);
+
+// Look up A and/or AAAA records for each results[i].name, with many
+// queries in flight over one UDP socket, falling back to TCP for truncated
+// answers. Returns the number of names that resolved to an address.
+int dns_resolve_batch(const struct sockaddr *server, socklen_t server_len,
+                      struct dns_result *results, int n,
+                      const struct dns_options *opts);
+
+#endif
@@ -0,0 +1,712 @@
+//
+// graph.c -- an undirected graph in compressed sparse row form, with
+// incremental edge insertion, for querying router topologies
+//
+// Each vertex's neighbours are a sorted row of one big adjacency array,
+// found through an array of row offsets (CSR), which keeps searches
+// sequential in memory. Rebuilding that for every new edge would be far
+// too slow, so edges added later go into a short unsorted overflow list
+// per vertex instead. Searches read both. Once the overflow lists hold an
+// eighth as many edges as the CSR arrays, the two are merged, so the cost
+// of rebuilding is spread thinly over many insertions.
+//
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "graph.h"
+#include "topology.h"
+
+#define BFS_CHUNK     256     // Frontier vertices claimed at a time
+#define BFS_LOCAL     1024    // Next-frontier vertices buffered per thread
+
+struct overflow {
+  uint32_t  *v;
+  uint32_t   n;
+  uint32_t   cap;
+};
+
+struct graph {
+  uint32_t          n;            // Vertices
+  uint32_t          csr_n;        // Vertices with CSR rows
+  size_t           *offsets;      // csr_n + 1 of them
+  uint32_t         *adj;          // Each edge appears in both rows
+  size_t            csr_edges;    // Undirected edges in the CSR arrays
+  struct overflow  *extra;        // extra_cap of them
+  uint32_t          extra_cap;
+  size_t            extra_edges;  // Undirected edges in overflow lists
+
+  // Scratch space for graph_shortest_path()
+  uint32_t          scratch_n;
+  uint32_t         *visit;        // Generation at which each was reached
+  uint32_t          generation;
+  uint8_t          *side;
+  uint32_t         *depth;
+  uint32_t         *pred;
+  uint32_t         *queue[2];
+};
+
+static void
+row(const struct graph *g, uint32_t v, const uint32_t **csr, size_t *ncsr,
+    const uint32_t **extra, uint32_t *nextra)
+{
+  if (v < g->csr_n) {
+    *csr  = g->adj + g->offsets[v];
+    *ncsr = g->offsets[v + 1] - g->offsets[v];
+  } else {
+    *csr  = NULL;
+    *ncsr = 0;
+  }
+  if (v < g->extra_cap) {
+    *extra  = g->extra[v].v;
+    *nextra = g->extra[v].n;
+  } else {
+    *extra  = NULL;
+    *nextra = 0;
+  }
+}
+
+static int
+compare_u32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+static void
+sort_row(uint32_t *v, size_t n)
+{
+  size_t i, j;
+
+  if (n > 16) {
+    qsort(v, n, sizeof(uint32_t), compare_u32);
+    return;
+  }
+  // Most routers have only a few links
+  for (i = 1; i < n; i++) {
+    uint32_t x = v[i];
+    for (j = i; j > 0 && v[j - 1] > x; j--) {
+      v[j] = v[j - 1];
+    }
+    v[j] = x;
+  }
+}
+
+// Sort each row and drop duplicates, squeezing the rows together
+static void
+finish_rows(struct graph *g)
+{
+  size_t    out = 0, start = 0;
+  uint32_t  v;
+
+  for (v = 0; v < g->csr_n; v++) {
+    size_t end = g->offsets[v + 1], i;
+
+    sort_row(g->adj + start, end - start);
+    g->offsets[v] = out;
+    for (i = start; i < end; i++) {
+      if (i == start || g->adj[i] != g->adj[i - 1]) {
+        g->adj[out++] = g->adj[i];
+      }
+    }
+    start = end;
+  }
+  g->offsets[g->csr_n] = out;
+  g->csr_edges = out / 2;
+}
+
+struct graph *
+graph_create(uint32_t nvertices, const uint32_t (*edges)[2], size_t nedges)
+{
+  struct graph  *g = calloc(1, sizeof(struct graph));
+  size_t        *fill;
+  size_t         i;
+  uint32_t       v;
+
+  if (g == NULL) {
+    return NULL;
+  }
+  g->n       = nvertices;
+  g->csr_n   = nvertices;
+  g->offsets = calloc((size_t) nvertices + 1, sizeof(size_t));
+  for (i = 0; i < nedges; i++) {
+    if (edges[i][0] != edges[i][1] && edges[i][0] < nvertices &&
+        edges[i][1] < nvertices) {
+      g->offsets[edges[i][0] + 1]++;
+      g->offsets[edges[i][1] + 1]++;
+    }
+  }
+  for (v = 0; v < nvertices; v++) {
+    g->offsets[v + 1] += g->offsets[v];
+  }
+
+  g->adj = malloc(sizeof(uint32_t) * (g->offsets[nvertices] + 1));
+  fill   = malloc(sizeof(size_t) * ((size_t) nvertices + 1));
+  memcpy(fill, g->offsets, sizeof(size_t) * ((size_t) nvertices + 1));
+  for (i = 0; i < nedges; i++) {
+    uint32_t a = edges[i][0], b = edges[i][1];
+
+    if (a != b && a < nvertices && b < nvertices) {
+      g->adj[fill[a]++] = b;
+      g->adj[fill[b]++] = a;
+    }
+  }
+  free(fill);
+  finish_rows(g);
+  return g;
+}
+
+void
+graph_free(struct graph *g)
+{
+  uint32_t v;
+
+  if (g == NULL) {
+    return;
+  }
+  for (v = 0; v < g->extra_cap; v++) {
+    free(g->extra[v].v);
+  }
+  free(g->extra);
+  free(g->offsets);
+  free(g->adj);
+  free(g->visit);
+  free(g->side);
+  free(g->depth);
+  free(g->pred);
+  free(g->queue[0]);
+  free(g->queue[1]);
+  free(g);
+}
+
+struct graph *
+graph_load_topo(const char *path)
+{
+  struct topo_header   h;
+  struct graph        *g = NULL;
+  uint32_t           (*edges)[2];
+  FILE                *f = fopen(path, "rb");
+  uint32_t             nnodes, nedges, i;
+
+  if (f == NULL) {
+    return NULL;
+  }
+  if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, TOPO_MAGIC, 4) != 0 ||
+      ntohl(h.version) != TOPO_VERSION) {
+    fclose(f);
+    return NULL;
+  }
+  nnodes = ntohl(h.nnodes);
+  nedges = ntohl(h.nedges);
+  edges  = malloc(sizeof(*edges) * ((size_t) nedges + 1));
+  if (fseek(f, (long) (sizeof(struct topo_node) * nnodes), SEEK_CUR) == 0 &&
+      fread(edges, sizeof(*edges), nedges, f) == nedges) {
+    for (i = 0; i < nedges; i++) {
+      edges[i][0] = ntohl(edges[i][0]);
+      edges[i][1] = ntohl(edges[i][1]);
+    }
+    g = graph_create(nnodes, (const uint32_t (*)[2]) edges, nedges);
+  }
+  free(edges);
+  fclose(f);
+  return g;
+}
+
+uint32_t
+graph_vertices(const struct graph *g)
+{
+  return g->n;
+}
+
+size_t
+graph_edges(const struct graph *g)
+{
+  return g->csr_edges + g->extra_edges;
+}
+
+uint32_t
+graph_degree(const struct graph *g, uint32_t v)
+{
+  const uint32_t  *csr, *extra;
+  size_t           ncsr;
+  uint32_t         nextra;
+
+  if (v >= g->n) {
+    return 0;
+  }
+  row(g, v, &csr, &ncsr, &extra, &nextra);
+  return (uint32_t) ncsr + nextra;
+}
+
+static int
+has_edge(const struct graph *g, uint32_t a, uint32_t b)
+{
+  const uint32_t  *csr, *extra;
+  size_t           ncsr, lo, hi;
+  uint32_t         nextra, i;
+
+  // Search the shorter row
+  if (graph_degree(g, a) > graph_degree(g, b)) {
+    uint32_t t = a;
+    a = b;
+    b = t;
+  }
+  row(g, a, &csr, &ncsr, &extra, &nextra);
+  for (lo = 0, hi = ncsr; lo < hi; ) {
+    size_t mid = (lo + hi) / 2;
+    if (csr[mid] < b) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo < ncsr && csr[lo] == b) {
+    return 1;
+  }
+  for (i = 0; i < nextra; i++) {
+    if (extra[i] == b) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void
+push_overflow(struct overflow *o, uint32_t v)
+{
+  if (o->n == o->cap) {
+    o->cap = o->cap ? o->cap * 2 : 4;
+    o->v   = realloc(o->v, sizeof(uint32_t) * o->cap);
+  }
+  o->v[o->n++] = v;
+}
+
+int
+graph_add_edge(struct graph *g, uint32_t a, uint32_t b)
+{
+  uint32_t need = (a > b ? a : b) + 1;
+
+  if (a == b || a == GRAPH_NONE || b == GRAPH_NONE) {
+    return 0;
+  }
+  if (need > g->n) {
+    g->n = need;
+  }
+  if (need > g->extra_cap) {
+    uint32_t cap = g->extra_cap ? g->extra_cap : 1024;
+
+    while (cap < need) {
+      cap *= 2;
+    }
+    g->extra = realloc(g->extra, sizeof(struct overflow) * cap);
+    memset(g->extra + g->extra_cap, 0,
+           sizeof(struct overflow) * (cap - g->extra_cap));
+    g->extra_cap = cap;
+  }
+  if (has_edge(g, a, b)) {
+    return 0;
+  }
+  push_overflow(&g->extra[a], b);
+  push_overflow(&g->extra[b], a);
+  g->extra_edges++;
+
+  if (g->extra_edges > 1024 && g->extra_edges * 8 > g->csr_edges) {
+    graph_compact(g);
+  }
+  return 1;
+}
+
+void
+graph_compact(struct graph *g)
+{
+  size_t    *offsets;
+  uint32_t  *adj;
+  size_t     out = 0;
+  uint32_t   v;
+
+  if (g->extra_edges == 0 && g->csr_n == g->n) {
+    return;
+  }
+  offsets = malloc(sizeof(size_t) * ((size_t) g->n + 1));
+  adj     = malloc(sizeof(uint32_t) * (2 * graph_edges(g) + 1));
+
+  // Merge each sorted CSR row with its sorted overflow list
+  for (v = 0; v < g->n; v++) {
+    const uint32_t  *csr, *extra;
+    size_t           ncsr, i = 0;
+    uint32_t         nextra, j = 0;
+
+    row(g, v, &csr, &ncsr, &extra, &nextra);
+    if (nextra > 0) {
+      sort_row(g->extra[v].v, nextra);
+    }
+    offsets[v] = out;
+    while (i < ncsr || j < nextra) {
+      if (j == nextra || (i < ncsr && csr[i] < extra[j])) {
+        adj[out++] = csr[i++];
+      } else {
+        adj[out++] = extra[j++];
+      }
+    }
+    if (v < g->extra_cap) {
+      free(g->extra[v].v);
+      memset(&g->extra[v], 0, sizeof(struct overflow));
+    }
+  }
+  offsets[g->n] = out;
+
+  free(g->offsets);
+  free(g->adj);
+  g->offsets     = offsets;
+  g->adj         = adj;
+  g->csr_n       = g->n;
+  g->csr_edges   = out / 2;
+  g->extra_edges = 0;
+}
+
+static uint32_t
+bfs_serial(const struct graph *g, uint32_t src, int32_t *dist,
+           uint32_t *parent)
+{
+  uint32_t  *queue = malloc(sizeof(uint32_t) * g->n);
+  uint32_t   head = 0, tail = 0;
+
+  queue[tail++] = src;
+  dist[src] = 0;
+  while (head < tail) {
+    uint32_t         u = queue[head++];
+    const uint32_t  *csr, *extra;
+    size_t           ncsr, i;
+    uint32_t         nextra;
+
+    row(g, u, &csr, &ncsr, &extra, &nextra);
+    for (i = 0; i < ncsr + nextra; i++) {
+      uint32_t w = i < ncsr ? csr[i] : extra[i - ncsr];
+
+      if (dist[w] == -1) {
+        dist[w] = dist[u] + 1;
+        if (parent != NULL) {
+          parent[w] = u;
+        }
+        queue[tail++] = w;
+      }
+    }
+  }
+  free(queue);
+  return tail;
+}
+
+// State shared by the threads of a parallel BFS. The search proceeds a
+// level at a time: the threads claim chunks of the current frontier, and
+// each vertex they discover is claimed by whichever thread first sets its
+// distance, with a compare-and-swap, and added to the next frontier.
+struct bfs_shared {
+  const struct graph  *g;
+  int32_t             *dist;
+  uint32_t            *parent;
+  uint32_t            *frontier;
+  uint32_t            *next;
+  uint32_t             nfrontier;
+  uint32_t             nnext;       // Updated atomically
+  uint32_t             cursor;      // Updated atomically
+  uint32_t             reached;
+  int32_t              level;
+  int                  done;
+  pthread_barrier_t    barrier;
+};
+
+static void
+bfs_flush(struct bfs_shared *s, const uint32_t *buf, uint32_t n)
+{
+  uint32_t pos = __atomic_fetch_add(&s->nnext, n, __ATOMIC_RELAXED);
+  memcpy(s->next + pos, buf, sizeof(uint32_t) * n);
+}
+
+// Expand this thread's share of the current level
+static void
+bfs_level(struct bfs_shared *s)
+{
+  uint32_t  buf[BFS_LOCAL];
+  uint32_t  start, nbuf = 0;
+  int32_t   level = s->level;
+
+  while ((start = __atomic_fetch_add(&s->cursor, BFS_CHUNK, __ATOMIC_RELAXED)) <
+         s->nfrontier) {
+    uint32_t end = start + BFS_CHUNK < s->nfrontier ? start + BFS_CHUNK : s->nfrontier;
+    uint32_t k;
+
+    for (k = start; k < end; k++) {
+      uint32_t         u = s->frontier[k];
+      const uint32_t  *csr, *extra;
+      size_t           ncsr, i;
+      uint32_t         nextra;
+
+      row(s->g, u, &csr, &ncsr, &extra, &nextra);
+      for (i = 0; i < ncsr + nextra; i++) {
+        uint32_t  w = i < ncsr ? csr[i] : extra[i - ncsr];
+        int32_t   unseen = -1;
+
+        if (__atomic_load_n(&s->dist[w], __ATOMIC_RELAXED) != -1 ||
+            !__atomic_compare_exchange_n(&s->dist[w], &unseen, level + 1, 0,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+          continue;
+        }
+        if (s->parent != NULL) {
+          s->parent[w] = u;
+        }
+        buf[nbuf++] = w;
+        if (nbuf == BFS_LOCAL) {
+          bfs_flush(s, buf, nbuf);
+          nbuf = 0;
+        }
+      }
+    }
+  }
+  if (nbuf > 0) {
+    bfs_flush(s, buf, nbuf);
+  }
+}
+
+static void *
+bfs_worker(void *arg)
+{
+  struct bfs_shared *s = arg;
+
+  while (1) {
+    pthread_barrier_wait(&s->barrier);
+    if (s->done) {
+      break;
+    }
+    bfs_level(s);
+    pthread_barrier_wait(&s->barrier);
+  }
+  return NULL;
+}
+
+uint32_t
+graph_bfs(const struct graph *g, uint32_t src, int32_t *dist,
+          uint32_t *parent, int nthreads)
+{
+  struct bfs_shared   s;
+  pthread_t          *threads;
+  int32_t            *own_dist = NULL;
+  uint32_t            v;
+  int                 i;
+
+  if (src >= g->n) {
+    return 0;
+  }
+  if (dist == NULL) {
+    dist = own_dist = malloc(sizeof(int32_t) * g->n);
+  }
+  for (v = 0; v < g->n; v++) {
+    dist[v] = -1;
+  }
+  if (parent != NULL) {
+    for (v = 0; v < g->n; v++) {
+      parent[v] = GRAPH_NONE;
+    }
+  }
+  if (nthreads <= 1) {
+    v = bfs_serial(g, src, dist, parent);
+    free(own_dist);
+    return v;
+  }
+
+  memset(&s, 0, sizeof(s));
+  s.g        = g;
+  s.dist     = dist;
+  s.parent   = parent;
+  s.frontier = malloc(sizeof(uint32_t) * g->n);
+  s.next     = malloc(sizeof(uint32_t) * g->n);
+  s.frontier[0] = src;
+  s.nfrontier   = 1;
+  s.reached     = 1;
+  dist[src]     = 0;
+  pthread_barrier_init(&s.barrier, NULL, (unsigned) nthreads);
+
+  // This thread is worker 0, and moves the search on between levels
+  threads = malloc(sizeof(pthread_t) * (size_t) nthreads);
+  for (i = 1; i < nthreads; i++) {
+    pthread_create(&threads[i], NULL, bfs_worker, &s);
+  }
+  while (1) {
+    uint32_t *t;
+
+    pthread_barrier_wait(&s.barrier);
+    if (s.done) {
+      break;
+    }
+    bfs_level(&s);
+    pthread_barrier_wait(&s.barrier);
+
+    // The other threads are waiting at the top of the loop: swap frontiers
+    t = s.frontier;
+    s.frontier  = s.next;
+    s.next      = t;
+    s.nfrontier = s.nnext;
+    s.reached  += s.nnext;
+    s.nnext     = 0;
+    s.cursor    = 0;
+    s.level++;
+    s.done      = s.nfrontier == 0;
+  }
+  for (i = 1; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  pthread_barrier_destroy(&s.barrier);
+  free(threads);
+  free(s.frontier);
+  free(s.next);
+  free(own_dist);
+  return s.reached;
+}
+
+static void
+ensure_scratch(struct graph *g)
+{
+  if (g->scratch_n >= g->n) {
+    return;
+  }
+  free(g->visit);
+  free(g->side);
+  free(g->depth);
+  free(g->pred);
+  free(g->queue[0]);
+  free(g->queue[1]);
+  g->scratch_n  = g->n;
+  g->visit      = calloc(g->n, sizeof(uint32_t));
+  g->side       = malloc(g->n);
+  g->depth      = malloc(sizeof(uint32_t) * g->n);
+  g->pred       = malloc(sizeof(uint32_t) * g->n);
+  g->queue[0]   = malloc(sizeof(uint32_t) * g->n);
+  g->queue[1]   = malloc(sizeof(uint32_t) * g->n);
+  g->generation = 0;
+}
+
+// Walk back from v to the end of the search it was reached by, storing the
+// vertices in path from position pos, in the direction given
+static void
+trace_back(const struct graph *g, uint32_t v, uint32_t *path, uint32_t maxlen,
+           uint32_t pos, int step)
+{
+  while (1) {
+    if (pos < maxlen) {
+      path[pos] = v;
+    }
+    if (g->pred[v] == GRAPH_NONE) {
+      break;
+    }
+    v = g->pred[v];
+    pos += (uint32_t) step;
+  }
+}
+
+uint32_t
+graph_shortest_path(struct graph *g, uint32_t a, uint32_t b, uint32_t *path,
+                    uint32_t maxlen)
+{
+  uint32_t  head[2] = { 0, 0 }, tail[2] = { 1, 1 };
+  uint32_t  level[2] = { 0, 0 };
+  uint32_t  best = UINT32_MAX, meet_u = 0, meet_w = 0;
+  uint32_t  gen, len;
+
+  if (a >= g->n || b >= g->n) {
+    return 0;
+  }
+  if (a == b) {
+    if (maxlen > 0) {
+      path[0] = a;
+    }
+    return 1;
+  }
+  ensure_scratch(g);
+  if (++g->generation == 0) {
+    // Wrapped: start the generations again
+    memset(g->visit, 0, sizeof(uint32_t) * g->scratch_n);
+    g->generation = 1;
+  }
+  gen = g->generation;
+
+  g->queue[0][0] = a;
+  g->queue[1][0] = b;
+  g->visit[a] = g->visit[b] = gen;
+  g->side[a]  = 0;
+  g->side[b]  = 1;
+  g->depth[a] = g->depth[b] = 0;
+  g->pred[a]  = g->pred[b] = GRAPH_NONE;
+
+  // Expand a whole level of the smaller frontier at a time, until the
+  // searches meet. Every meeting found in that level is considered, since
+  // they can be at different depths on the other side.
+  while (head[0] < tail[0] && head[1] < tail[1] && best == UINT32_MAX) {
+    int       s = tail[0] - head[0] <= tail[1] - head[1] ? 0 : 1;
+    uint32_t  end = tail[s];
+
+    while (head[s] < end) {
+      uint32_t         u = g->queue[s][head[s]++];
+      const uint32_t  *csr, *extra;
+      size_t           ncsr, i;
+      uint32_t         nextra;
+
+      row(g, u, &csr, &ncsr, &extra, &nextra);
+      for (i = 0; i < ncsr + nextra; i++) {
+        uint32_t w = i < ncsr ? csr[i] : extra[i - ncsr];
+
+        if (g->visit[w] != gen) {
+          g->visit[w] = gen;
+          g->side[w]  = (uint8_t) s;
+          g->depth[w] = level[s] + 1;
+          g->pred[w]  = u;
+          g->queue[s][tail[s]++] = w;
+        } else if (g->side[w] != s &&
+                   level[s] + 1 + g->depth[w] < best) {
+          best   = level[s] + 1 + g->depth[w];
+          meet_u = u;
+          meet_w = w;
+        }
+      }
+    }
+    level[s]++;
+  }
+  if (best == UINT32_MAX) {
+    return 0;
+  }
+
+  // meet_u was reached from one end and meet_w from the other
+  len = best + 1;
+  if (g->side[meet_u] == 0) {
+    trace_back(g, meet_u, path, maxlen, g->depth[meet_u], -1);
+    trace_back(g, meet_w, path, maxlen, g->depth[meet_u] + 1, 1);
+  } else {
+    trace_back(g, meet_w, path, maxlen, g->depth[meet_w], -1);
+    trace_back(g, meet_u, path, maxlen, g->depth[meet_w] + 1, 1);
+  }
+  return len;
+}
+
+uint32_t
+graph_common_ancestor(const int32_t *dist, const uint32_t *parent, uint32_t a,
+                      uint32_t b)
+{
+  if (dist[a] < 0 || dist[b] < 0) {
+    return GRAPH_NONE;
+  }
+  // Climb from the deeper vertex until both are at the same depth, then
+  // climb together until they meet
+  while (dist[a] > dist[b]) {
+    a = parent[a];
+  }
+  while (dist[b] > dist[a]) {
+    b = parent[b];
+  }
+  while (a != b) {
+    a = parent[a];
+    b = parent[b];
+  }
+  return a;
+}
@@ -0,0 +1,62 @@
+//
+// graph.h -- an undirected graph in compressed sparse row form, with
+// incremental edge insertion, for querying router topologies
+//
+
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define GRAPH_NONE  UINT32_MAX
+
+struct graph;
+
+// Build a graph of nvertices vertices from an edge list, in which each
+// undirected edge appears once. Duplicates and self-loops are dropped.
+struct graph *graph_create(uint32_t nvertices, const uint32_t (*edges)[2],
+                           size_t nedges);
+void graph_free(struct graph *g);
+
+// Load the binary adjacency file written by topology -f bin, whose router
+// IDs become vertex numbers.
+struct graph *graph_load_topo(const char *path);
+
+uint32_t graph_vertices(const struct graph *g);
+size_t graph_edges(const struct graph *g);
+
+// Add an edge, adding vertices as needed. Returns 1 if the edge is new, or
+// 0 if it was already there (or is a self-loop). New edges go into a small
+// per-vertex overflow list, which is merged into the CSR arrays once it
+// holds an eighth as many edges as they do.
+int graph_add_edge(struct graph *g, uint32_t a, uint32_t b);
+
+// Merge any overflow edges into the CSR arrays now
+void graph_compact(struct graph *g);
+
+uint32_t graph_degree(const struct graph *g, uint32_t v);
+
+// Breadth-first search from src, filling in each vertex's distance (or -1
+// if it's unreachable) and its parent in the BFS tree (GRAPH_NONE for src
+// and unreachable vertices); either may be NULL. With nthreads > 1, each
+// level of the search is shared between that many threads. Returns the
+// number of vertices reached.
+uint32_t graph_bfs(const struct graph *g, uint32_t src, int32_t *dist,
+                   uint32_t *parent, int nthreads);
+
+// Find a shortest path from a to b, searching from both ends at once.
+// Stores up to maxlen vertices of it, a first, in path, and returns the
+// number of vertices on the path, or 0 if there is none. Not thread-safe:
+// it uses scratch space in the graph.
+uint32_t graph_shortest_path(struct graph *g, uint32_t a, uint32_t b,
+                             uint32_t *path, uint32_t maxlen);
+
+// The deepest vertex that is an ancestor of both a and b in a BFS tree
+// from graph_bfs(): for traceroutes from one vantage point, the last router
+// that the paths to a and b have in common. GRAPH_NONE if a or b wasn't
+// reached.
+uint32_t graph_common_ancestor(const int32_t *dist, const uint32_t *parent,
+                               uint32_t a, uint32_t b);
+
+#endif
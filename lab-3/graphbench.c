@@ -0,0 +1,184 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "graph.h"
+
+// Benchmark the graph library on a synthetic Internet-like topology: a
+// preferential-attachment graph, in which each new router links to -m
+// existing ones, chosen in proportion to their degree. The defaults give
+// a million links. Nine tenths of them are loaded in one go, and the rest
+// are added one at a time, as if from later traceroute runs; the results
+// are checked against a graph built from all of them at once.
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng(void) {
+  // xorshift64
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t generate(uint32_t n, uint32_t m, uint32_t (**out)[2]) {
+  uint32_t (*edges)[2] = malloc(sizeof(*edges) * (size_t) n * m);
+  uint32_t *ends = malloc(sizeof(uint32_t) * (size_t) n * m * 2);
+  size_t nedges = 0, nends = 0;
+  uint32_t v, i, j;
+
+  // Start from a small clique
+  for (v = 1; v <= m && v < n; v++) {
+    for (j = 0; j < v; j++) {
+      edges[nedges][0] = v;
+      edges[nedges++][1] = j;
+      ends[nends++] = v;
+      ends[nends++] = j;
+    }
+  }
+  for (; v < n; v++) {
+    for (i = 0; i < m; i++) {
+      uint32_t u = ends[rng() % nends];
+
+      edges[nedges][0] = v;
+      edges[nedges++][1] = u;
+      ends[nends++] = v;
+      ends[nends++] = u;
+    }
+  }
+  free(ends);
+  *out = edges;
+  return nedges;
+}
+
+int main(int argc, char *argv[]) {
+  uint32_t n = 250000, m = 4, queries = 1000, v, i;
+  int threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t (*edges)[2];
+  struct graph *g, *full;
+  int32_t *dist, *dist2;
+  uint32_t *parent, *path;
+  size_t nedges, base, added = 0;
+  double t, total_len = 0;
+  uint64_t sum = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:m:t:q:s:")) != -1) {
+    switch (opt) {
+      case 'n': n = (uint32_t) atol(optarg); break;
+      case 'm': m = (uint32_t) atol(optarg); break;
+      case 't': threads = atoi(optarg); break;
+      case 'q': queries = (uint32_t) atol(optarg); break;
+      case 's': rng_state = strtoull(optarg, NULL, 0) | 1; break;
+      default:
+        printf("Usage: %s [-n routers] [-m links-per-router] [-t threads] [-q queries] [-s seed]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (threads < 2) {
+    threads = 2;
+  }
+  if (n < m + 2 || m < 1) {
+    fprintf(stderr, "Need more routers than links per router\n");
+    return 1;
+  }
+
+  t = now();
+  nedges = generate(n, m, &edges);
+  printf("generate:        %u routers, %zu links in %.3f s\n", n, nedges, now() - t);
+
+  // Load most of it at once...
+  base = nedges - nedges / 10;
+  t = now();
+  g = graph_create(n, (const uint32_t (*)[2]) edges, base);
+  printf("build CSR:       %zu links in %.3f s\n", base, now() - t);
+
+  // ...and the rest a link at a time. Later routers get new IDs, as they
+  // would from a new traceroute run.
+  t = now();
+  for (i = (uint32_t) base; i < nedges; i++) {
+    added += graph_add_edge(g, edges[i][0], edges[i][1]);
+  }
+  t = now() - t;
+  printf("insert:          %zu links in %.3f s, %.0f ns each\n", added, t, t * 1e9 / (nedges - base));
+
+  full = graph_create(n, (const uint32_t (*)[2]) edges, nedges);
+  if (graph_edges(g) != graph_edges(full)) {
+    printf("MISMATCH: %zu links after inserting, %zu built at once\n", graph_edges(g), graph_edges(full));
+    return 2;
+  }
+  for (v = 0; v < n; v++) {
+    if (graph_degree(g, v) != graph_degree(full, v)) {
+      printf("MISMATCH: degree of %u\n", v);
+      return 2;
+    }
+  }
+
+  // Degree queries
+  t = now();
+  for (i = 0; i < 10000000; i++) {
+    sum += graph_degree(g, (uint32_t) (rng() % n));
+  }
+  t = now() - t;
+  printf("degree:          %.1f ns per query (checksum %llu)\n", t * 1e2, (unsigned long long) sum % 1000);
+
+  // Breadth-first search, serially and in parallel
+  dist = malloc(sizeof(int32_t) * n);
+  dist2 = malloc(sizeof(int32_t) * n);
+  parent = malloc(sizeof(uint32_t) * n);
+  t = now();
+  v = graph_bfs(g, 0, dist, parent, 1);
+  printf("BFS, 1 thread:   %u reached in %.3f s\n", v, now() - t);
+  t = now();
+  v = graph_bfs(full, 0, dist2, NULL, threads);
+  printf("BFS, %d threads: %u reached in %.3f s\n", threads, v, now() - t);
+  if (memcmp(dist, dist2, sizeof(int32_t) * n) != 0) {
+    printf("MISMATCH: parallel BFS distances\n");
+    return 2;
+  }
+
+  // Shortest paths, checked against the BFS distances from router 0
+  path = malloc(sizeof(uint32_t) * n);
+  graph_compact(g);
+  t = now();
+  for (i = 0; i < queries; i++) {
+    uint32_t a = i % 2 ? 0 : (uint32_t) (rng() % n);
+    uint32_t b = (uint32_t) (rng() % n);
+    uint32_t len = graph_shortest_path(g, a, b, path, n);
+
+    if (a == 0 && (len == 0 || (int32_t) len - 1 != dist[b] || path[0] != a || path[len - 1] != b)) {
+      printf("MISMATCH: path from 0 to %u has %u routers, expected %d\n", b, len, dist[b] + 1);
+      return 2;
+    }
+    total_len += len;
+  }
+  t = now() - t;
+  printf("shortest path:   %.1f us per query, %.2f hops on average\n", t * 1e6 / queries, total_len / queries - 1);
+
+  // Common ancestors in the BFS tree from router 0
+  t = now();
+  sum = 0;
+  for (i = 0; i < 1000000; i++) {
+    sum += graph_common_ancestor(dist, parent, (uint32_t) (rng() % n), (uint32_t) (rng() % n));
+  }
+  t = now() - t;
+  printf("common ancestor: %.1f ns per query (checksum %llu)\n", t * 1e3, (unsigned long long) sum % 1000);
+
+  graph_free(g);
+  graph_free(full);
+  free(edges);
+  free(dist);
+  free(dist2);
+  free(parent);
+  free(path);
+  return 0;
+}
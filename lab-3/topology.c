@@ -0,0 +1,390 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <ctype.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "topology.h"
+
+// Build a router-level topology from traceroute output, such as IPv4.txt
+// and IPv6.txt. Each router address is interned into a dense integer ID,
+// and the links between consecutive responding hops of each trace are
+// kept in a hash set, so that every link is reported once however many
+// traces cross it. Input is read a line at a time, so the size of the
+// archive doesn't matter, only the number of distinct routers and links.
+//
+// Output is a DOT graph (as reformat.py used to produce), per-router RTT
+// statistics, or a binary adjacency file (see topology.h) for the graph
+// tools.
+//
+// As reformat.py did, hops that didn't respond are skipped over, linking
+// the routers either side of them; -G leaves such gaps unlinked instead.
+
+#define MAX_PER_HOP 16
+
+struct node {
+  uint8_t family;
+  uint8_t addr[16];
+  unsigned long probes;
+  double min, max, sum, sumsq;
+};
+
+struct topology {
+  struct node *nodes;
+  uint32_t nnodes, nodes_cap;
+  uint64_t *node_index;     // Hash table of (hash << 32 | ID + 1), or 0
+  uint32_t node_index_cap;
+
+  uint64_t *edges;          // In the order first seen, as (a << 32 | b)
+  uint32_t nedges, edges_cap;
+  uint64_t *edge_set;       // Hash set of (min << 32 | max) + 1, or 0
+  uint32_t edge_set_cap;
+};
+
+static uint32_t hash64(uint64_t k) {
+  // The finaliser from MurmurHash3
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return (uint32_t) k;
+}
+
+static uint32_t hash_addr(int family, const uint8_t *addr) {
+  uint64_t a, b;
+
+  memcpy(&a, addr, 8);
+  memcpy(&b, addr + 8, 8);
+  return hash64(a ^ hash64(b ^ (uint64_t) family));
+}
+
+// Find the slot for this address. The hash is kept alongside each ID, so
+// that most mismatches are rejected without touching the node array.
+static uint32_t node_slot(const struct topology *t, uint32_t h, int family, const uint8_t *addr) {
+  uint32_t mask = t->node_index_cap - 1;
+  uint32_t i = h & mask;
+
+  while (t->node_index[i] != 0) {
+    if (t->node_index[i] >> 32 == h) {
+      const struct node *n = &t->nodes[(uint32_t) t->node_index[i] - 1];
+      if (n->family == family && memcmp(n->addr, addr, 16) == 0) {
+        break;
+      }
+    }
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+static void grow_node_index(struct topology *t) {
+  uint32_t i;
+
+  free(t->node_index);
+  t->node_index_cap = t->node_index_cap ? t->node_index_cap * 2 : 1024;
+  t->node_index = calloc(t->node_index_cap, sizeof(uint64_t));
+  for (i = 0; i < t->nnodes; i++) {
+    uint32_t h = hash_addr(t->nodes[i].family, t->nodes[i].addr);
+    t->node_index[node_slot(t, h, t->nodes[i].family, t->nodes[i].addr)] = (uint64_t) h << 32 | (i + 1);
+  }
+}
+
+// Return the ID of the router with this address, adding it if it's new
+static uint32_t intern(struct topology *t, int family, const uint8_t *addr) {
+  uint32_t h = hash_addr(family, addr);
+  uint32_t slot;
+  struct node *n;
+
+  if ((uint64_t) (t->nnodes + 1) * 2 > t->node_index_cap) {
+    grow_node_index(t);
+  }
+  slot = node_slot(t, h, family, addr);
+  if (t->node_index[slot] != 0) {
+    return (uint32_t) t->node_index[slot] - 1;
+  }
+
+  if (t->nnodes == t->nodes_cap) {
+    t->nodes_cap = t->nodes_cap ? t->nodes_cap * 2 : 1024;
+    t->nodes = realloc(t->nodes, t->nodes_cap * sizeof(struct node));
+  }
+  n = &t->nodes[t->nnodes];
+  memset(n, 0, sizeof(*n));
+  n->family = family;
+  memcpy(n->addr, addr, 16);
+  t->node_index[slot] = (uint64_t) h << 32 | ++t->nnodes;
+  return t->nnodes - 1;
+}
+
+static uint32_t edge_slot(const struct topology *t, uint64_t key) {
+  uint32_t mask = t->edge_set_cap - 1;
+  uint32_t i = hash64(key) & mask;
+
+  while (t->edge_set[i] != 0 && t->edge_set[i] != key + 1) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+static void add_edge(struct topology *t, uint32_t a, uint32_t b) {
+  uint64_t key = a < b ? (uint64_t) a << 32 | b : (uint64_t) b << 32 | a;
+  uint32_t slot, i;
+
+  if (a == b) {
+    // A router that answers for two hops in a row isn't a link
+    return;
+  }
+  if ((uint64_t) (t->nedges + 1) * 2 > t->edge_set_cap) {
+    free(t->edge_set);
+    t->edge_set_cap = t->edge_set_cap ? t->edge_set_cap * 2 : 1024;
+    t->edge_set = calloc(t->edge_set_cap, sizeof(uint64_t));
+    for (i = 0; i < t->nedges; i++) {
+      uint32_t x = t->edges[i] >> 32, y = (uint32_t) t->edges[i];
+      uint64_t k = x < y ? (uint64_t) x << 32 | y : (uint64_t) y << 32 | x;
+      t->edge_set[edge_slot(t, k)] = k + 1;
+    }
+  }
+  slot = edge_slot(t, key);
+  if (t->edge_set[slot] != 0) {
+    return;
+  }
+  t->edge_set[slot] = key + 1;
+
+  if (t->nedges == t->edges_cap) {
+    t->edges_cap = t->edges_cap ? t->edges_cap * 2 : 1024;
+    t->edges = realloc(t->edges, t->edges_cap * sizeof(uint64_t));
+  }
+  t->edges[t->nedges++] = (uint64_t) a << 32 | b;
+}
+
+static int count_dots(const char *s) {
+  int n = 0;
+
+  for (; *s != '\0'; s++) {
+    n += *s == '.';
+  }
+  return n;
+}
+
+static void add_rtt(struct node *n, double ms) {
+  if (n->probes == 0 || ms < n->min) {
+    n->min = ms;
+  }
+  if (n->probes == 0 || ms > n->max) {
+    n->max = ms;
+  }
+  n->probes++;
+  n->sum += ms;
+  n->sumsq += ms * ms;
+}
+
+// Parse one hop line, such as
+//
+//    7  146.97.35.190  5.222 ms
+//    8  a.example (192.0.2.1)  1.1 ms  1.0 ms b.example (192.0.2.9)  1.3 ms
+//   12  *
+//
+// adding the ID of each router that answered to ids. Returns how many did.
+static int parse_hop(struct topology *t, char *line, uint32_t *ids) {
+  char *tok, *save, *prev = NULL;
+  int n = 0, have = 0, i;
+  uint32_t id = 0;
+
+  // The hop number
+  if ((tok = strtok_r(line, " \t\r\n", &save)) == NULL) {
+    return 0;
+  }
+  while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+    uint8_t addr[16];
+    size_t len = strlen(tok);
+    int family = 0;
+
+    if (strcmp(tok, "ms") == 0 && prev != NULL && have) {
+      // The RTT of a probe answered by the current router
+      add_rtt(&t->nodes[id], atof(prev));
+    } else if (tok[0] == '(' && tok[len - 1] == ')') {
+      // The address of the hostname that came before
+      tok[len - 1] = '\0';
+      tok++;
+    }
+    // Only bother inet_pton() with things that look like addresses, rather
+    // than RTTs and hostnames
+    if (strchr(tok, ':') != NULL) {
+      family = AF_INET6;
+    } else if (isdigit((unsigned char) tok[0]) && count_dots(tok) == 3) {
+      family = AF_INET;
+    }
+    if (family != 0 && inet_pton(family, tok, memset(addr, 0, sizeof(addr))) == 1) {
+      id = intern(t, family, addr);
+      have = 1;
+      for (i = 0; i < n && ids[i] != id; i++);
+      if (i == n && n < MAX_PER_HOP) {
+        ids[n++] = id;
+      }
+    }
+    prev = tok;
+  }
+  return n;
+}
+
+static void read_traces(struct topology *t, FILE *f, int link_gaps) {
+  uint32_t hop[2][MAX_PER_HOP];
+  int nprev = 0, cur = 0, n, i, j;
+  char *line = NULL;
+  size_t cap = 0;
+
+  while (getline(&line, &cap, f) != -1) {
+    if (strncmp(line, "traceroute", 10) == 0) {
+      // A new trace
+      nprev = 0;
+      continue;
+    }
+    n = parse_hop(t, line, hop[cur]);
+    if (n == 0) {
+      if (!link_gaps) {
+        nprev = 0;
+      }
+      continue;
+    }
+    for (i = 0; i < nprev; i++) {
+      for (j = 0; j < n; j++) {
+        add_edge(t, hop[1 - cur][i], hop[cur][j]);
+      }
+    }
+    nprev = n;
+    cur = 1 - cur;
+  }
+  free(line);
+}
+
+static const char *node_name(const struct node *n, char *buf, size_t len) {
+  return inet_ntop(n->family, n->addr, buf, len);
+}
+
+static void write_dot(const struct topology *t, FILE *f) {
+  char a[INET6_ADDRSTRLEN], b[INET6_ADDRSTRLEN];
+  uint32_t i;
+
+  fprintf(f, "graph routertopology {\n");
+  for (i = 0; i < t->nedges; i++) {
+    fprintf(f, "\"%s\" -- \"%s\"\n",
+            node_name(&t->nodes[t->edges[i] >> 32], a, sizeof(a)),
+            node_name(&t->nodes[(uint32_t) t->edges[i]], b, sizeof(b)));
+  }
+  fprintf(f, "}\n");
+}
+
+static void write_stats(const struct topology *t, FILE *f) {
+  char a[INET6_ADDRSTRLEN];
+  uint32_t i;
+
+  fprintf(f, "# router probes min avg max stddev (ms)\n");
+  for (i = 0; i < t->nnodes; i++) {
+    const struct node *n = &t->nodes[i];
+    double avg = n->probes ? n->sum / n->probes : 0;
+    double var = n->probes ? n->sumsq / n->probes - avg * avg : 0;
+
+    fprintf(f, "%s %lu %.3f %.3f %.3f %.3f\n", node_name(n, a, sizeof(a)),
+            n->probes, n->min, avg, n->max, var > 0 ? sqrt(var) : 0);
+  }
+}
+
+static void write_binary(const struct topology *t, FILE *f) {
+  struct topo_header h;
+  uint32_t i;
+
+  memcpy(h.magic, TOPO_MAGIC, 4);
+  h.version = htonl(TOPO_VERSION);
+  h.nnodes = htonl(t->nnodes);
+  h.nedges = htonl(t->nedges);
+  fwrite(&h, sizeof(h), 1, f);
+
+  for (i = 0; i < t->nnodes; i++) {
+    struct topo_node n;
+    const struct node *src = &t->nodes[i];
+
+    memset(&n, 0, sizeof(n));
+    n.family = src->family == AF_INET6 ? 6 : 4;
+    memcpy(n.addr, src->addr, 16);
+    n.probes = htonl(src->probes > UINT32_MAX ? UINT32_MAX : (uint32_t) src->probes);
+    n.min_us = htonl((uint32_t) (src->min * 1000));
+    n.avg_us = htonl(src->probes ? (uint32_t) (src->sum / src->probes * 1000) : 0);
+    n.max_us = htonl((uint32_t) (src->max * 1000));
+    fwrite(&n, sizeof(n), 1, f);
+  }
+  for (i = 0; i < t->nedges; i++) {
+    uint32_t e[2] = { htonl(t->edges[i] >> 32), htonl((uint32_t) t->edges[i]) };
+    fwrite(e, sizeof(e), 1, f);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  struct topology t;
+  const char *format = "dot";
+  const char *out_file = NULL;
+  FILE *out = stdout;
+  int opt, i, link_gaps = 1;
+
+  while ((opt = getopt(argc, argv, "f:o:G")) != -1) {
+    switch (opt) {
+      case 'f':
+        format = optarg;
+        break;
+      case 'o':
+        out_file = optarg;
+        break;
+      case 'G':
+        link_gaps = 0;
+        break;
+      default:
+        printf("Usage: %s [-f dot|stats|bin] [-o file] [-G] [traceroute-output...]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (strcmp(format, "dot") != 0 && strcmp(format, "stats") != 0 &&
+      strcmp(format, "bin") != 0) {
+    fprintf(stderr, "Unknown output format %s\n", format);
+    return 1;
+  }
+
+  memset(&t, 0, sizeof(t));
+  if (optind == argc) {
+    read_traces(&t, stdin, link_gaps);
+  }
+  for (i = optind; i < argc; i++) {
+    FILE *f = fopen(argv[i], "r");
+
+    if (f == NULL) {
+      perror(argv[i]);
+      return 1;
+    }
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+    read_traces(&t, f, link_gaps);
+    fclose(f);
+  }
+
+  if (out_file != NULL && (out = fopen(out_file, "wb")) == NULL) {
+    perror(out_file);
+    return 1;
+  }
+  setvbuf(out, NULL, _IOFBF, 1 << 20);
+  if (strcmp(format, "dot") == 0) {
+    write_dot(&t, out);
+  } else if (strcmp(format, "stats") == 0) {
+    write_stats(&t, out);
+  } else {
+    write_binary(&t, out);
+  }
+  fclose(out);
+
+  fprintf(stderr, "%u routers, %u links\n", t.nnodes, t.nedges);
+  free(t.nodes);
+  free(t.node_index);
+  free(t.edges);
+  free(t.edge_set);
+  return 0;
+}
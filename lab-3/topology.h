@@ -0,0 +1,35 @@
+//
+// topology.h -- the binary adjacency format written by topology -f bin
+//
+// A topo_header, then nnodes topo_node records, whose positions are the
+// router IDs, then nedges links, each a pair of 32-bit router IDs. Every
+// link appears once, in one direction. Multi-byte fields are in network
+// byte order.
+//
+
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <stdint.h>
+
+#define TOPO_MAGIC    "TOPO"
+#define TOPO_VERSION  1
+
+struct topo_header {
+  char      magic[4];
+  uint32_t  version;
+  uint32_t  nnodes;
+  uint32_t  nedges;
+};
+
+struct topo_node {
+  uint8_t   family;           // 4 or 6
+  uint8_t   reserved[3];
+  uint32_t  probes;           // Probes this router answered
+  uint8_t   addr[16];         // IPv4 addresses use the first 4 bytes
+  uint32_t  min_us;           // RTT statistics, in microseconds
+  uint32_t  avg_us;
+  uint32_t  max_us;
+};
+
+#endif
@@ -0,0 +1,587 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
+#include <linux/errqueue.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Trace the routes to many destinations at once, printing each trace in
+// the same format as the system traceroute (see IPv4.txt), ready for the
+// topology builder.
+//
+// Probes are UDP datagrams to unlikely ports, as in classic traceroute,
+// with the TTL (or hop limit) set per datagram. There's no need for raw
+// sockets or root: with IP_RECVERR, the kernel queues the ICMP errors the
+// probes provoke on the sending socket, together with the router that sent
+// them and the probe's original destination. Every destination shares one
+// socket per address family, and the destination port of each probe says
+// which destination slot and TTL it belongs to.
+//
+// Each destination has up to -N probes outstanding at once. Tracing stops
+// when the destination itself answers (with port unreachable), or after
+// -g consecutive hops that didn't answer at all, rather than waiting out
+// every hop up to -m.
+
+#define PAYLOAD 32          // For 60 (IPv4) or 80 (IPv6) byte packets
+#define PORT_SPACE 30000    // Destination ports available for probes
+
+enum { P_UNSENT, P_SENT, P_ANSWERED, P_TIMEOUT };
+
+struct probe {
+  int state;
+  double sent;
+  double sent_wall;         // For RTTs from the kernel's receive timestamps
+  double rtt;
+  struct sockaddr_storage from;
+};
+
+struct target {
+  const char *name;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  int slot;                 // Port block in use while active, or -1
+  struct probe *probes;     // maxhops * nqueries, in TTL order
+  int next_ttl;
+  int outstanding;
+  int reached;              // TTL at which the destination answered
+  int stopped;
+  int done;
+  char *output;
+};
+
+struct options {
+  int maxhops;
+  int nqueries;
+  int wait_ms;
+  int parallel;
+  int window;
+  int gap;
+  int base_port;
+};
+
+static struct options o;
+static struct target **slots;
+static int fds[2] = { -1, -1 };     // IPv4, IPv6
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static double wall_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int open_socket(int family) {
+  int on = 1;
+  int fd = socket(family, SOCK_DGRAM, 0);
+
+  if (fd == -1) {
+    return -1;
+  }
+  if (family == AF_INET) {
+    setsockopt(fd, SOL_IP, IP_RECVERR, &on, sizeof(on));
+  } else {
+    setsockopt(fd, SOL_IPV6, IPV6_RECVERR, &on, sizeof(on));
+  }
+  // Time each ICMP error by when it arrived, not when we got round to it
+  setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  return fd;
+}
+
+static struct probe *probe_at(struct target *t, int ttl, int q) {
+  return &t->probes[(ttl - 1) * o.nqueries + q];
+}
+
+// Send every query for the next TTL of t
+static void send_probes(struct target *t, double now) {
+  char payload[PAYLOAD];
+  int family = t->addr.ss_family;
+  int fd = fds[family == AF_INET6];
+  int ttl = t->next_ttl++;
+  int q;
+
+  memset(payload, 0, sizeof(payload));
+  for (q = 0; q < o.nqueries; q++) {
+    struct probe *p = probe_at(t, ttl, q);
+    struct sockaddr_storage dst = t->addr;
+    int port = o.base_port + t->slot * o.maxhops * o.nqueries + (ttl - 1) * o.nqueries + q;
+    union {
+      char buf[CMSG_SPACE(sizeof(int))];
+      struct cmsghdr align;
+    } control;
+    struct cmsghdr *cm;
+    struct msghdr msg;
+    struct iovec iov;
+
+    if (family == AF_INET) {
+      ((struct sockaddr_in *) &dst)->sin_port = htons(port);
+    } else {
+      ((struct sockaddr_in6 *) &dst)->sin6_port = htons(port);
+    }
+
+    // The TTL goes with each datagram, rather than being set on the socket
+    iov.iov_base = payload;
+    iov.iov_len = sizeof(payload);
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_name = &dst;
+    msg.msg_namelen = t->addrlen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = family == AF_INET ? SOL_IP : SOL_IPV6;
+    cm->cmsg_type = family == AF_INET ? IP_TTL : IPV6_HOPLIMIT;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &ttl, sizeof(int));
+
+    p->sent = now;
+    p->sent_wall = wall_ms();
+    // An ICMP error for an earlier probe can be reported by this send, as
+    // well as queued; if so, this one didn't go, so try again. A local
+    // error, such as no route, won't go away, so count the probe as lost.
+    if (sendmsg(fd, &msg, 0) == -1 && (errno == EAGAIN || sendmsg(fd, &msg, 0) == -1)) {
+      p->state = P_TIMEOUT;
+      continue;
+    }
+    p->state = P_SENT;
+    t->outstanding++;
+  }
+}
+
+// Decide whether t should stop: it has reached the destination, or the
+// last -g hops, with every hop before them settled, went unanswered
+static void check_stop(struct target *t) {
+  int ttl, q, silent = 0;
+
+  if (t->reached) {
+    t->stopped = 1;
+    return;
+  }
+  for (ttl = 1; ttl < t->next_ttl; ttl++) {
+    int answered = 0, settled = 1;
+
+    for (q = 0; q < o.nqueries; q++) {
+      int state = probe_at(t, ttl, q)->state;
+      answered |= state == P_ANSWERED;
+      settled &= state == P_ANSWERED || state == P_TIMEOUT;
+    }
+    if (!settled) {
+      break;
+    }
+    silent = answered ? 0 : silent + 1;
+    if (silent >= o.gap) {
+      t->stopped = 1;
+      return;
+    }
+  }
+  if (t->next_ttl > o.maxhops) {
+    t->stopped = 1;
+  }
+}
+
+static int last_hop(struct target *t);
+
+// Whether every probe that will be printed has been answered or timed out.
+// Probes beyond the destination don't matter.
+static int settled(struct target *t) {
+  int last = last_hop(t);
+  int i;
+
+  for (i = 0; i < last * o.nqueries; i++) {
+    if (t->probes[i].state == P_SENT) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int same_addr(const struct sockaddr_storage *a, const struct sockaddr_storage *b) {
+  if (a->ss_family != b->ss_family) {
+    return 0;
+  }
+  if (a->ss_family == AF_INET) {
+    return ((struct sockaddr_in *) a)->sin_addr.s_addr == ((struct sockaddr_in *) b)->sin_addr.s_addr;
+  }
+  return memcmp(&((struct sockaddr_in6 *) a)->sin6_addr, &((struct sockaddr_in6 *) b)->sin6_addr, 16) == 0;
+}
+
+// Collect the ICMP errors queued on fd, and match each to its probe
+static void receive_errors(int fd, double now) {
+  while (1) {
+    struct sockaddr_storage dst;
+    char control[512];
+    char payload[PAYLOAD];
+    struct sock_extended_err *ee = NULL;
+    double arrived = 0;
+    struct cmsghdr *cm;
+    struct msghdr msg;
+    struct iovec iov;
+    struct target *t;
+    struct probe *p;
+    int port, index, ttl;
+
+    iov.iov_base = payload;
+    iov.iov_len = sizeof(payload);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &dst;
+    msg.msg_namelen = sizeof(dst);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+      break;
+    }
+
+    for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+      if ((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+          (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+        ee = (struct sock_extended_err *) CMSG_DATA(cm);
+      } else if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+        struct timespec ts;
+        memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+        arrived = ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+      }
+    }
+    if (ee == NULL || (ee->ee_origin != SO_EE_ORIGIN_ICMP && ee->ee_origin != SO_EE_ORIGIN_ICMP6)) {
+      continue;
+    }
+
+    // Which probe was this?
+    port = ntohs(dst.ss_family == AF_INET ? ((struct sockaddr_in *) &dst)->sin_port
+                                          : ((struct sockaddr_in6 *) &dst)->sin6_port);
+    index = port - o.base_port;
+    if (index < 0 || index / (o.maxhops * o.nqueries) >= o.parallel ||
+        (t = slots[index / (o.maxhops * o.nqueries)]) == NULL || !same_addr(&t->addr, &dst)) {
+      continue;
+    }
+    index %= o.maxhops * o.nqueries;
+    ttl = index / o.nqueries + 1;
+    p = &t->probes[index];
+    if (p->state != P_SENT) {
+      continue;
+    }
+    p->state = P_ANSWERED;
+    p->rtt = arrived > 0 ? arrived - p->sent_wall : now - p->sent;
+    memset(&p->from, 0, sizeof(p->from));
+    memcpy(&p->from, SO_EE_OFFENDER(ee),
+           dst.ss_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6));
+    t->outstanding--;
+
+    // Port unreachable means the probe got to the destination itself, and
+    // any other kind of unreachable that it never will: stop either way
+    if ((ee->ee_origin == SO_EE_ORIGIN_ICMP && ee->ee_type == ICMP_DEST_UNREACH) ||
+        (ee->ee_origin == SO_EE_ORIGIN_ICMP6 && ee->ee_type == ICMP6_DST_UNREACH)) {
+      if (t->reached == 0 || ttl < t->reached) {
+        t->reached = ttl;
+      }
+    }
+    check_stop(t);
+  }
+}
+
+static void expire_probes(struct target *t, double now, double *next_deadline) {
+  int i;
+
+  for (i = 0; i < (t->next_ttl - 1) * o.nqueries; i++) {
+    struct probe *p = &t->probes[i];
+
+    if (p->state != P_SENT) {
+      continue;
+    }
+    if (now - p->sent >= o.wait_ms) {
+      p->state = P_TIMEOUT;
+      t->outstanding--;
+      check_stop(t);
+    } else if (p->sent + o.wait_ms < *next_deadline) {
+      *next_deadline = p->sent + o.wait_ms;
+    }
+  }
+}
+
+// The last hop worth printing: the destination, or the -g silent hops
+// after the last router that answered
+static int last_hop(struct target *t) {
+  int ttl, q, last = 0;
+
+  if (t->reached) {
+    return t->reached;
+  }
+  for (ttl = 1; ttl < t->next_ttl; ttl++) {
+    for (q = 0; q < o.nqueries; q++) {
+      if (probe_at(t, ttl, q)->state == P_ANSWERED) {
+        last = ttl;
+      }
+    }
+  }
+  return last + o.gap < t->next_ttl - 1 ? last + o.gap : t->next_ttl - 1;
+}
+
+// Render the finished trace as traceroute would have printed it
+static void format_trace(struct target *t) {
+  char addr[INET6_ADDRSTRLEN], prev[INET6_ADDRSTRLEN];
+  int last = last_hop(t);
+  size_t size = 256 + (size_t) last * o.nqueries * (INET6_ADDRSTRLEN + 24);
+  size_t len;
+  int ttl, q;
+
+  t->output = malloc(size);
+  inet_ntop(t->addr.ss_family, t->addr.ss_family == AF_INET
+            ? (void *) &((struct sockaddr_in *) &t->addr)->sin_addr
+            : (void *) &((struct sockaddr_in6 *) &t->addr)->sin6_addr, addr, sizeof(addr));
+  len = snprintf(t->output, size, "traceroute to %s (%s), %d hops max, %d byte packets\n",
+                 t->name, addr, o.maxhops, t->addr.ss_family == AF_INET ? 60 : 80);
+
+  for (ttl = 1; ttl <= last; ttl++) {
+    prev[0] = '\0';
+    len += snprintf(t->output + len, size - len, "%2d", ttl);
+    for (q = 0; q < o.nqueries; q++) {
+      struct probe *p = probe_at(t, ttl, q);
+
+      if (p->state != P_ANSWERED) {
+        len += snprintf(t->output + len, size - len, "  *");
+        continue;
+      }
+      inet_ntop(p->from.ss_family, p->from.ss_family == AF_INET
+                ? (void *) &((struct sockaddr_in *) &p->from)->sin_addr
+                : (void *) &((struct sockaddr_in6 *) &p->from)->sin6_addr, addr, sizeof(addr));
+      if (strcmp(addr, prev) != 0) {
+        len += snprintf(t->output + len, size - len, "  %s", addr);
+        strcpy(prev, addr);
+      }
+      len += snprintf(t->output + len, size - len, "  %.3f ms", p->rtt);
+    }
+    len += snprintf(t->output + len, size - len, "\n");
+  }
+}
+
+static int resolve_target(struct target *t, int family) {
+  struct addrinfo hints, *ai;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = family;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (getaddrinfo(t->name, NULL, &hints, &ai) != 0) {
+    return -1;
+  }
+  memcpy(&t->addr, ai->ai_addr, ai->ai_addrlen);
+  t->addrlen = ai->ai_addrlen;
+  freeaddrinfo(ai);
+  return 0;
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s [-4|-6] [-m hops] [-q queries] [-w ms] [-c parallel] [-N window] [-g gap]\n"
+         "          [-p port] [-f file] [host...]\n"
+         "  -4, -6       trace over IPv4 or IPv6 only\n"
+         "  -m hops      maximum TTL (default: 30)\n"
+         "  -q queries   probes per hop (default: 1)\n"
+         "  -w ms        wait this long for each answer (default: 1000)\n"
+         "  -c parallel  destinations traced at once (default: 64)\n"
+         "  -N window    probes outstanding per destination (default: 16)\n"
+         "  -g gap       stop after this many silent hops in a row (default: 5)\n"
+         "  -p port      first destination port (default: 33434)\n"
+         "  -f file      read destinations from a file, one per line\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+  struct target *targets;
+  const char *file = NULL;
+  char **names = NULL;
+  int ntargets = 0, next_target = 0, next_print = 0, active = 0;
+  int family = AF_UNSPEC;
+  int opt, i, failed = 0;
+  double start = now_ms();
+
+  o.maxhops = 30;
+  o.nqueries = 1;
+  o.wait_ms = 1000;
+  o.parallel = 64;
+  o.window = 16;
+  o.gap = 5;
+  o.base_port = 33434;
+
+  while ((opt = getopt(argc, argv, "46m:q:w:c:N:g:p:f:")) != -1) {
+    switch (opt) {
+      case '4': family = AF_INET; break;
+      case '6': family = AF_INET6; break;
+      case 'm': o.maxhops = atoi(optarg); break;
+      case 'q': o.nqueries = atoi(optarg); break;
+      case 'w': o.wait_ms = atoi(optarg); break;
+      case 'c': o.parallel = atoi(optarg); break;
+      case 'N': o.window = atoi(optarg); break;
+      case 'g': o.gap = atoi(optarg); break;
+      case 'p': o.base_port = atoi(optarg); break;
+      case 'f': file = optarg; break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (o.maxhops < 1 || o.maxhops > 255 || o.nqueries < 1 || o.nqueries > 10 ||
+      o.window < 1 || o.gap < 1 || o.parallel < 1 || o.base_port < 1024) {
+    usage(argv[0]);
+    return 1;
+  }
+  // Every active destination needs its own block of ports
+  if (o.parallel > PORT_SPACE / (o.maxhops * o.nqueries)) {
+    o.parallel = PORT_SPACE / (o.maxhops * o.nqueries);
+  }
+  if (o.base_port + PORT_SPACE > 65535) {
+    o.base_port = 65535 - PORT_SPACE;
+  }
+
+  // Gather the destinations
+  if (file != NULL) {
+    FILE *f = strcmp(file, "-") == 0 ? stdin : fopen(file, "r");
+    char line[1024];
+    int cap = 0;
+
+    if (f == NULL) {
+      perror(file);
+      return 1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+      char *name = strtok(line, " \t\r\n");
+      if (name == NULL || name[0] == '#') {
+        continue;
+      }
+      if (ntargets == cap) {
+        cap = cap ? cap * 2 : 256;
+        names = realloc(names, cap * sizeof(char *));
+      }
+      names[ntargets++] = strdup(name);
+    }
+    if (f != stdin) {
+      fclose(f);
+    }
+  } else {
+    names = argv + optind;
+    ntargets = argc - optind;
+  }
+  if (ntargets == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  targets = calloc(ntargets, sizeof(struct target));
+  slots = calloc(o.parallel, sizeof(struct target *));
+  for (i = 0; i < ntargets; i++) {
+    targets[i].name = names[i];
+    targets[i].slot = -1;
+  }
+
+  while (next_print < ntargets) {
+    struct pollfd pfds[2];
+    double now = now_ms();
+    double next_deadline = now + o.wait_ms;
+    int timeout;
+
+    // Start tracing more destinations, while there are free slots
+    while (active < o.parallel && next_target < ntargets) {
+      struct target *t = &targets[next_target++];
+      int s;
+
+      if (resolve_target(t, family) == -1) {
+        fprintf(stderr, "Unable to look up IP address of %s\n", t->name);
+        t->done = 1;
+        failed++;
+        continue;
+      }
+      if (fds[t->addr.ss_family == AF_INET6] == -1 &&
+          (fds[t->addr.ss_family == AF_INET6] = open_socket(t->addr.ss_family)) == -1) {
+        perror("Unable to create socket");
+        return 1;
+      }
+      for (s = 0; slots[s] != NULL; s++);
+      slots[s] = t;
+      t->slot = s;
+      t->probes = calloc(o.maxhops * o.nqueries, sizeof(struct probe));
+      t->next_ttl = 1;
+      active++;
+    }
+
+    // Keep each window full
+    for (i = 0; i < o.parallel; i++) {
+      struct target *t = slots[i];
+
+      while (t != NULL && !t->stopped && t->next_ttl <= o.maxhops &&
+             t->outstanding + o.nqueries <= o.window) {
+        send_probes(t, now);
+        check_stop(t);
+      }
+    }
+
+    // Wait for answers, or for the next probe to time out
+    for (i = 0; i < o.parallel; i++) {
+      if (slots[i] != NULL) {
+        expire_probes(slots[i], now, &next_deadline);
+      }
+    }
+    timeout = (int) (next_deadline - now) + 1;
+    for (i = 0; i < 2; i++) {
+      pfds[i].fd = fds[i];
+      pfds[i].events = 0;     // Queued errors are always reported
+    }
+    if (active > 0) {
+      poll(pfds, 2, timeout);
+    }
+    now = now_ms();
+    for (i = 0; i < 2; i++) {
+      if (fds[i] != -1 && (pfds[i].revents & POLLERR)) {
+        receive_errors(fds[i], now);
+      }
+    }
+
+    // Retire the traces that are finished
+    for (i = 0; i < o.parallel; i++) {
+      struct target *t = slots[i];
+
+      if (t == NULL) {
+        continue;
+      }
+      expire_probes(t, now, &next_deadline);
+      if (t->stopped && settled(t)) {
+        format_trace(t);
+        free(t->probes);
+        t->done = 1;
+        slots[i] = NULL;
+        active--;
+      }
+    }
+
+    // Print in the order given, as each trace (and every one before it)
+    // is finished
+    while (next_print < ntargets && targets[next_print].done) {
+      if (targets[next_print].output != NULL) {
+        fputs(targets[next_print].output, stdout);
+        free(targets[next_print].output);
+      }
+      next_print++;
+    }
+    fflush(stdout);
+  }
+
+  fprintf(stderr, "%d destinations, %d failed, in %.1f ms\n", ntargets, failed, now_ms() - start);
+  free(targets);
+  free(slots);
+  return failed > 0 ? 2 : 0;
+}